@@ -0,0 +1,40 @@
+# craneweb_embed_assets(<name> <directory> [PREFIX <uri prefix>] [GZIP])
+#
+# Packs the files below <directory> into a read-only CRW_Asset table
+# named <name>, for CRW_handler_new_assets: generates <name>.c and
+# <name>.h in the current binary directory, and sets <name>_SOURCES
+# to the generated source, to be added to a target.
+# PREFIX is prepended to the URI paths, GZIP adds precompressed copies.
+#
+# The table is generated again when a packed file changes; new files
+# need CMake to run again.
+
+include(CMakeParseArguments)
+find_package(PythonInterp REQUIRED)
+
+set(CRANEWEB_EMBED_TOOL ${CMAKE_CURRENT_LIST_DIR}/../../tools/craneweb_embed.py)
+
+function(craneweb_embed_assets NAME DIR)
+    cmake_parse_arguments(EMBED "GZIP" "PREFIX" "" ${ARGN})
+
+    set(EMBED_OPTIONS)
+    if(EMBED_PREFIX)
+        list(APPEND EMBED_OPTIONS --prefix ${EMBED_PREFIX})
+    endif(EMBED_PREFIX)
+    if(EMBED_GZIP)
+        list(APPEND EMBED_OPTIONS --gzip)
+    endif(EMBED_GZIP)
+
+    file(GLOB_RECURSE EMBED_FILES ${DIR}/*)
+    set(EMBED_C ${CMAKE_CURRENT_BINARY_DIR}/${NAME}.c)
+    set(EMBED_H ${CMAKE_CURRENT_BINARY_DIR}/${NAME}.h)
+
+    add_custom_command(OUTPUT ${EMBED_C} ${EMBED_H}
+                       COMMAND ${PYTHON_EXECUTABLE} ${CRANEWEB_EMBED_TOOL}
+                               ${EMBED_OPTIONS} ${NAME} ${DIR}
+                               ${EMBED_C} ${EMBED_H}
+                       DEPENDS ${EMBED_FILES} ${CRANEWEB_EMBED_TOOL}
+                       COMMENT "Embedding the assets in ${DIR}")
+
+    set(${NAME}_SOURCES ${EMBED_C} PARENT_SCOPE)
+endfunction(craneweb_embed_assets)
@@ -23,6 +23,9 @@
 #else
 #define _XOPEN_SOURCE 600 // For flockfile() on Linux
 #define _LARGEFILE_SOURCE // Enable 64-bit file offsets
+#if defined(__linux__)
+#define _GNU_SOURCE // For sched_setaffinity() and CPU_SET()
+#endif
 #define __STDC_FORMAT_MACROS // <inttypes.h> wants this for C++
 #endif
 
@@ -144,6 +147,7 @@ struct timespec {
 static int pthread_mutex_lock(pthread_mutex_t *);
 static int pthread_mutex_unlock(pthread_mutex_t *);
 static FILE *mg_fopen(const char *path, const char *mode);
+static int mg_open(const char *path, int flags);
 
 #if defined(HAVE_STDINT)
 #include <stdint.h>
@@ -169,8 +173,10 @@ typedef struct DIR {
 #else    // UNIX  specific
 #include <sys/wait.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/select.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <stdint.h>
@@ -184,6 +190,10 @@ typedef struct DIR {
 #include <dlfcn.h>
 #endif
 #include <pthread.h>
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/sendfile.h>
+#endif
 #if defined(__MACH__)
 #define SSL_LIB   "libssl.dylib"
 #define CRYPTO_LIB  "libcrypto.dylib"
@@ -202,6 +212,7 @@ typedef struct DIR {
 #endif // O_BINARY
 #define closesocket(a) close(a)
 #define mg_fopen(x, y) fopen(x, y)
+#define mg_open(x, y) open(x, y)
 #define mg_mkdir(x, y) mkdir(x, y)
 #define mg_remove(x) remove(x)
 #define mg_rename(x, y) rename(x, y)
@@ -400,6 +411,8 @@ enum {
   ENABLE_KEEP_ALIVE, ACCESS_CONTROL_LIST, MAX_REQUEST_SIZE,
   EXTRA_MIME_TYPES, LISTENING_PORTS,
   DOCUMENT_ROOT, SSL_CERTIFICATE, NUM_THREADS, RUN_AS_USER,
+  SOCKET_QUEUE_SIZE, CPU_AFFINITY, SOCKET_QUEUE, FD_CACHE_SIZE,
+  STATIC_CACHE_SIZE, STATIC_CACHE_FILE_SIZE, GZIP_STATIC,
   NUM_OPTIONS
 };
 
@@ -426,10 +439,66 @@ static const char *config_options[] = {
   "s", "ssl_certificate", NULL,
   "t", "num_threads", "10",
   "u", "run_as_user", NULL,
+  "q", "socket_queue_size", "20",
+  "A", "cpu_affinity", "no",
+  "Q", "socket_queue", "lockfree",
+  "f", "fd_cache_size", "64",
+  "Z", "static_cache_size", "0",
+  "z", "static_cache_file_size", "65536",
+  "y", "gzip_static", "no",
   NULL
 };
 #define ENTRIES_PER_CONFIG_OPTION 3
 
+#if defined(__GNUC__) && !defined(_WIN32) && !defined(NO_LOCKFREE_QUEUE)
+#define HAVE_LOCKFREE_QUEUE
+
+// A slot of the lock-free socket queue. Its sequence number tells if it
+// is free for the enqueue at position `seq', or if it holds the socket
+// for the dequeue at position `seq - 1'.
+struct sq_cell {
+  volatile unsigned seq;
+  struct socket sock;
+};
+#endif // HAVE_LOCKFREE_QUEUE
+
+// Idle workers spin that many times (adaptively) before going to sleep
+enum { SQ_SPIN_MIN = 16, SQ_SPIN_MAX = 4096 };
+
+// An open static file, shared by the workers sending it.
+struct fd_cache_entry {
+  char *path;
+  time_t mtime;         // Together with size, tells if the file changed
+  int64_t size;
+  int fd;
+  int refs;             // Workers sending it right now
+  int cached;           // In the cache; if not, the last user closes it
+  unsigned long used;   // Last hit, for LRU eviction
+};
+
+// A small static file kept in memory, with its response headers.
+// Immutable once built: a changed file gets a new entry.
+struct static_entry {
+  struct static_entry *next;            // Hash chain
+  struct static_entry *newer, *older;   // LRU list
+  unsigned hash;
+  char *path;
+  struct mgstat st;
+  time_t checked;       // When st was last compared with the file system
+  char *head;           // Headers but Connection:, with Date as of checked
+  int head_len;
+  char *body;           // st.size bytes
+  struct mgstat gz_st;  // The precompressed sibling, if gz_body != NULL
+  char *gz_head;
+  int gz_head_len;
+  char *gz_body;        // gz_st.size bytes
+  size_t alloc;         // Bytes charged to the cache
+  int refs;             // Workers sending it right now
+  int cached;           // In the cache; if not, the last user frees it
+};
+
+enum { SC_BUCKETS = 1024 };  // Power of two
+
 struct mg_context {
   volatile int stop_flag;       // Should we stop event loop
   SSL_CTX *ssl_ctx;             // SSL context
@@ -443,11 +512,42 @@ struct mg_context {
   pthread_mutex_t mutex;     // Protects (max|num)_threads
   pthread_cond_t  cond;      // Condvar for tracking workers terminations
 
-  struct socket queue[20];   // Accepted sockets
+  volatile int num_pinned;   // Workers already bound to a CPU
+  struct socket *queue;      // Accepted sockets
+  int sq_size;               // Capacity of the socket queue
   volatile int sq_head;      // Head of the socket queue
   volatile int sq_tail;      // Tail of the socket queue
   pthread_cond_t sq_full;    // Singaled when socket is produced
   pthread_cond_t sq_empty;   // Signaled when socket is consumed
+
+#if defined(HAVE_LOCKFREE_QUEUE)
+  // Lock-free socket queue, used unless socket_queue is "mutex".
+  // The mutex and the condvars above are used only to park.
+  int sq_lockfree;
+  int sq_spin_max;           // No point in spinning on a single CPU
+  struct sq_cell *sq_cells;  // sq_mask + 1 of them
+  unsigned sq_mask;
+  volatile int sq_sleepers;  // Workers parked on sq_full
+  volatile int sq_blocked;   // Master parked on sq_empty
+  char sq_pad0[64];          // Keep the positions on their own lines
+  volatile unsigned sq_enqueue_pos;
+  char sq_pad1[64];
+  volatile unsigned sq_dequeue_pos;
+  char sq_pad2[64];
+#endif // HAVE_LOCKFREE_QUEUE
+
+  struct fd_cache_entry **fd_cache;  // fd_cache_size slots, NULL if off
+  int fd_cache_size;
+  unsigned long fd_cache_clock;
+  pthread_mutex_t fd_cache_mutex;    // Protects fd_cache*
+
+  struct static_entry **sc_buckets;  // SC_BUCKETS chains, NULL if off
+  struct static_entry *sc_newest;
+  struct static_entry *sc_oldest;
+  int64_t sc_size;                   // Memory budget of the static cache
+  int64_t sc_used;
+  int64_t sc_file_size;              // Larger files are not cached
+  pthread_mutex_t sc_mutex;          // Protects sc_* and static_entry refs
 };
 
 struct mg_connection {
@@ -464,6 +564,7 @@ struct mg_connection {
   int buf_size;               // Buffer size
   int request_len;            // Size of the request + headers in a buffer
   int data_len;               // Total size of data in a buffer
+  int must_close;             // No keep-alive after this request
 };
 
 const char **mg_get_valid_option_names(void) {
@@ -1006,6 +1107,13 @@ static FILE *mg_fopen(const char *path, const char *mode) {
   return _wfopen(wbuf, wmode);
 }
 
+static int mg_open(const char *path, int flags) {
+  wchar_t wbuf[PATH_MAX];
+
+  to_unicode(path, wbuf, ARRAY_SIZE(wbuf));
+  return _wopen(wbuf, flags);
+}
+
 static int mg_stat(const char *path, struct mgstat *stp) {
   int ok = -1; // Error
   wchar_t wbuf[PATH_MAX];
@@ -1414,11 +1522,115 @@ int mg_read(struct mg_connection *conn, void *buf, size_t len) {
   return nread;
 }
 
+long long mg_sendfile(struct mg_connection *conn, int fd, long long offset,
+                      long long len) {
+  long long sent = 0;
+  char buf[BUFSIZ];
+  int n;
+
+#if defined(__linux__)
+  if (conn->ssl == NULL) {
+    off_t off = (off_t) offset;
+    ssize_t k;
+    while (sent < len) {
+      // sendfile() moves at most 2G at once anyway
+      size_t chunk = len - sent > INT_MAX ? INT_MAX : (size_t) (len - sent);
+      if ((k = sendfile(conn->client.sock, fd, &off, chunk)) < 0 &&
+          ERRNO == EINTR) {
+        continue;
+      }
+      if (k <= 0) {
+        break;
+      }
+      sent += k;
+    }
+    return sent;
+  }
+#endif // __linux__
+
+#if defined(_WIN32)
+  if (lseek(fd, (off_t) offset, SEEK_SET) == (off_t) -1) {
+    return 0;
+  }
+#endif // _WIN32
+  while (sent < len) {
+    n = (int) (len - sent > (long long) sizeof(buf) ?
+               (long long) sizeof(buf) : len - sent);
+#if defined(_WIN32)
+    n = read(fd, buf, (size_t) n);
+#else
+    // pread() leaves the file offset alone: the fd may be shared
+    n = (int) pread(fd, buf, (size_t) n, (off_t) (offset + sent));
+#endif // _WIN32
+    if (n <= 0 || mg_write(conn, buf, n) != n) {
+      break;
+    }
+    sent += n;
+  }
+  return sent;
+}
+
+void mg_must_close(struct mg_connection *conn) {
+  conn->must_close = 1;
+}
+
 int mg_write(struct mg_connection *conn, const void *buf, size_t len) {
   return (int) push(NULL, conn->client.sock, conn->ssl,
       (const char *) buf, (int64_t) len);
 }
 
+// Gather write: one writev() per call on plain sockets, unless it is
+// interrupted or the socket buffer is full.
+int mg_writev(struct mg_connection *conn, const struct mg_iovec *iov,
+              int iovcnt) {
+  int64_t sent = 0, total = 0;
+  int i;
+
+#if !defined(_WIN32)
+  struct iovec vec[MG_MAX_IOVEC];
+  int first = 0;
+  ssize_t n;
+
+  if (conn->ssl == NULL && iovcnt <= MG_MAX_IOVEC) {
+    for (i = 0; i < iovcnt; i++) {
+      vec[i].iov_base = (void *) iov[i].buf;
+      vec[i].iov_len = iov[i].len;
+      total += iov[i].len;
+    }
+    while (sent < total) {
+      if ((n = writev(conn->client.sock, vec + first, iovcnt - first)) < 0) {
+        if (ERRNO == EINTR) {
+          continue;
+        }
+        break;
+      }
+      sent += n;
+      // Skip what went out, maybe in the middle of a buffer
+      while (first < iovcnt && (size_t) n >= vec[first].iov_len) {
+        n -= vec[first].iov_len;
+        first++;
+      }
+      if (first < iovcnt) {
+        vec[first].iov_base = (char *) vec[first].iov_base + n;
+        vec[first].iov_len -= n;
+      }
+    }
+    return (int) sent;
+  }
+#endif // !_WIN32
+
+  for (i = 0; i < iovcnt; i++) {
+    int n = mg_write(conn, iov[i].buf, iov[i].len);
+    if (n > 0) {
+      sent += n;
+    }
+    if (n != (int) iov[i].len) {
+      break;
+    }
+  }
+  return (int) sent;
+}
+
 int mg_printf(struct mg_connection *conn, const char *fmt, ...) {
   char buf[BUFSIZ];
   int len;
@@ -2504,34 +2716,592 @@ static int parse_range_header(const char *header, int64_t *a, int64_t *b) {
   return sscanf(header, "bytes=%" INT64_FMT "-%" INT64_FMT, a, b);
 }
 
+static void fd_cache_free(struct fd_cache_entry *e) {
+  (void) close(e->fd);
+  free(e->path);
+  free(e);
+}
+
+// Take the entry out of the cache. If in use, the last user frees it.
+static void fd_cache_evict(struct mg_context *ctx, int i) {
+  struct fd_cache_entry *e = ctx->fd_cache[i];
+
+  ctx->fd_cache[i] = NULL;
+  e->cached = 0;
+  if (e->refs == 0) {
+    fd_cache_free(e);
+  }
+}
+
+// Look the file up; an older version of it is evicted on the way.
+// Called with fd_cache_mutex held.
+static struct fd_cache_entry *fd_cache_find(struct mg_context *ctx,
+                                            const char *path,
+                                            const struct mgstat *stp) {
+  struct fd_cache_entry *e;
+  int i;
+
+  for (i = 0; i < ctx->fd_cache_size; i++) {
+    if ((e = ctx->fd_cache[i]) == NULL || strcmp(e->path, path) != 0) {
+      continue;
+    } else if (e->mtime != stp->mtime || e->size != stp->size) {
+      fd_cache_evict(ctx, i);
+    } else {
+      e->refs++;
+      e->used = ++ctx->fd_cache_clock;
+      return e;
+    }
+  }
+  return NULL;
+}
+
+// Put the entry in a free slot, or in the least recently used one.
+// Called with fd_cache_mutex held.
+static void fd_cache_insert(struct mg_context *ctx, struct fd_cache_entry *e) {
+  int i, slot = 0;
+
+  for (i = 0; i < ctx->fd_cache_size; i++) {
+    if (ctx->fd_cache[i] == NULL) {
+      slot = i;
+      break;
+    } else if (ctx->fd_cache[i]->used < ctx->fd_cache[slot]->used) {
+      slot = i;
+    }
+  }
+  if (ctx->fd_cache[slot] != NULL) {
+    fd_cache_evict(ctx, slot);
+  }
+  ctx->fd_cache[slot] = e;
+  e->cached = 1;
+  e->used = ++ctx->fd_cache_clock;
+}
+
+// Get an open descriptor for the file, as of the given stat: the same
+// path with a different mtime or size is a different file.
+// The descriptor is shared, so only positional reads on it.
+// Return: NULL on error, the entry to give back with fd_cache_put().
+static struct fd_cache_entry *fd_cache_get(struct mg_context *ctx,
+                                           const char *path,
+                                           const struct mgstat *stp) {
+  struct fd_cache_entry *e, *found = NULL;
+
+  if (ctx->fd_cache != NULL) {
+    (void) pthread_mutex_lock(&ctx->fd_cache_mutex);
+    found = fd_cache_find(ctx, path, stp);
+    (void) pthread_mutex_unlock(&ctx->fd_cache_mutex);
+    if (found != NULL) {
+      return found;
+    }
+  }
+
+  // Miss. Do not open the file with the lock held
+  if ((e = (struct fd_cache_entry *) calloc(1, sizeof(*e))) == NULL) {
+    return NULL;
+  } else if ((e->fd = mg_open(path, O_RDONLY | O_BINARY)) < 0) {
+    free(e);
+    return NULL;
+  }
+  set_close_on_exec(e->fd);
+  e->path = mg_strdup(path);
+  e->mtime = stp->mtime;
+  e->size = stp->size;
+  e->refs = 1;
+
+  if (ctx->fd_cache != NULL) {
+    (void) pthread_mutex_lock(&ctx->fd_cache_mutex);
+    // Another worker may have been quicker
+    if ((found = fd_cache_find(ctx, path, stp)) == NULL) {
+      fd_cache_insert(ctx, e);
+    }
+    (void) pthread_mutex_unlock(&ctx->fd_cache_mutex);
+    if (found != NULL) {
+      fd_cache_free(e);
+      return found;
+    }
+  }
+  return e;
+}
+
+static void fd_cache_put(struct mg_context *ctx, struct fd_cache_entry *e) {
+  int done;
+
+  if (ctx->fd_cache != NULL) {
+    (void) pthread_mutex_lock(&ctx->fd_cache_mutex);
+  }
+  done = --e->refs == 0 && !e->cached;
+  if (ctx->fd_cache != NULL) {
+    (void) pthread_mutex_unlock(&ctx->fd_cache_mutex);
+  }
+  if (done) {
+    fd_cache_free(e);
+  }
+}
+
+// Allocate the cache of open static files, as configured by fd_cache_size
+static int init_fd_cache(struct mg_context *ctx) {
+  ctx->fd_cache_size = atoi(ctx->config[FD_CACHE_SIZE]);
+#if defined(_WIN32)
+  // No pread(): the readers of a shared descriptor would race on its offset
+  ctx->fd_cache_size = 0;
+#endif // _WIN32
+  if (ctx->fd_cache_size <= 0) {
+    ctx->fd_cache_size = 0;
+    return 1;
+  }
+  ctx->fd_cache = (struct fd_cache_entry **) calloc(ctx->fd_cache_size,
+                                                    sizeof(*ctx->fd_cache));
+  return ctx->fd_cache != NULL;
+}
+
+static void free_fd_cache(struct mg_context *ctx) {
+  int i;
+
+  for (i = 0; i < ctx->fd_cache_size && ctx->fd_cache != NULL; i++) {
+    if (ctx->fd_cache[i] != NULL) {
+      fd_cache_evict(ctx, i);
+    }
+  }
+  free(ctx->fd_cache);
+}
+
+static int gzip_static(const struct mg_context *ctx) {
+  return !mg_strcasecmp(ctx->config[GZIP_STATIC], "yes");
+}
+
+// Whether the client takes gzip: listed in Accept-Encoding, not with q=0
+static int accepts_gzip(const struct mg_connection *conn) {
+  const char *p = mg_get_header(conn, "Accept-Encoding");
+  size_t n;
+
+  while (p != NULL && *p != '\0') {
+    p += strspn(p, " \t,");
+    n = strcspn(p, " \t,;");
+    if (n == 4 && mg_strncasecmp(p, "gzip", 4) == 0) {
+      p += n + strspn(p + n, " \t");
+      n = strcspn(p, ",");
+      return *p != ';' || (p = memchr(p, '=', n)) == NULL ||
+        strtod(p + 1, NULL) > 0.0;
+    }
+    p += strcspn(p, ",");
+  }
+  return 0;
+}
+
+// The precompressed sibling of a file, path.gz, if gzip_static is on.
+// Stale (older) or useless (larger) ones are ignored.
+// Return: 1 if there is one, with gz_path and gz_stp filled.
+static int stat_gz_sibling(struct mg_connection *conn, const char *path,
+                           const struct mgstat *stp, char *gz_path,
+                           size_t gz_path_len, struct mgstat *gz_stp) {
+  return gzip_static(conn->ctx) &&
+    mg_snprintf(conn, gz_path, gz_path_len, "%s.gz", path) <
+      (int) gz_path_len - 1 &&
+    mg_stat(gz_path, gz_stp) == 0 && !gz_stp->is_directory &&
+    gz_stp->mtime >= stp->mtime && gz_stp->size < stp->size;
+}
+
+// Render the headers of a file response but Connection: and the final
+// CRLF, which depend on the request. The type comes from path; stp
+// is the file being sent, path.gz if gzipped.
+static int print_file_headers(struct mg_connection *conn, char *buf,
+                              size_t buflen, const char *path,
+                              const struct mgstat *stp, time_t curtime,
+                              int status, const char *msg, int64_t cl,
+                              const char *range, int gzipped) {
+  char date[64], lm[64], etag[64];
+  const char *fmt = "%a, %d %b %Y %H:%M:%S %Z";
+  struct vec mime_vec;
+
+  get_mime_type(conn->ctx, path, &mime_vec);
+
+  // Prepare Etag, Date, Last-Modified headers
+  (void) strftime(date, sizeof(date), fmt, localtime(&curtime));
+  (void) strftime(lm, sizeof(lm), fmt, localtime(&stp->mtime));
+  (void) mg_snprintf(conn, etag, sizeof(etag), "%lx.%lx",
+      (unsigned long) stp->mtime, (unsigned long) stp->size);
+
+  return mg_snprintf(conn, buf, buflen,
+      "HTTP/1.1 %d %s\r\n"
+      "Date: %s\r\n"
+      "Last-Modified: %s\r\n"
+      "Etag: \"%s\"\r\n"
+      "Content-Type: %.*s\r\n"
+      "%s%s"
+      "Content-Length: %" INT64_FMT "\r\n"
+      "Accept-Ranges: bytes\r\n"
+      "%s",
+      status, msg, date, lm, etag, mime_vec.len, mime_vec.ptr,
+      gzipped ? "Content-Encoding: gzip\r\n" : "",
+      gzip_static(conn->ctx) ? "Vary: Accept-Encoding\r\n" : "",
+      cl, range);
+}
+
+static unsigned static_cache_hash(const char *path) {
+  unsigned hash = 2166136261U;  // FNV-1a
+
+  while (*path != '\0') {
+    hash = (hash ^ (unsigned char) *path++) * 16777619U;
+  }
+  return hash;
+}
+
+// Take the entry out of the cache. If in use, the last user frees it.
+// Called with sc_mutex held.
+static void static_cache_unlink(struct mg_context *ctx,
+                                struct static_entry *e) {
+  struct static_entry **pp = &ctx->sc_buckets[e->hash & (SC_BUCKETS - 1)];
+
+  while (*pp != e) {
+    pp = &(*pp)->next;
+  }
+  *pp = e->next;
+  if (e->newer != NULL) {
+    e->newer->older = e->older;
+  } else {
+    ctx->sc_newest = e->older;
+  }
+  if (e->older != NULL) {
+    e->older->newer = e->newer;
+  } else {
+    ctx->sc_oldest = e->newer;
+  }
+  ctx->sc_used -= e->alloc;
+  e->cached = 0;
+  if (e->refs == 0) {
+    free(e);
+  }
+}
+
+// Make room for the entry, evicting the least recently used ones.
+// Called with sc_mutex held.
+static void static_cache_link(struct mg_context *ctx,
+                              struct static_entry *e) {
+  struct static_entry **bucket = &ctx->sc_buckets[e->hash & (SC_BUCKETS - 1)];
+
+  while (ctx->sc_oldest != NULL &&
+         ctx->sc_used + (int64_t) e->alloc > ctx->sc_size) {
+    static_cache_unlink(ctx, ctx->sc_oldest);
+  }
+  e->next = *bucket;
+  *bucket = e;
+  e->newer = NULL;
+  e->older = ctx->sc_newest;
+  if (ctx->sc_newest != NULL) {
+    ctx->sc_newest->newer = e;
+  } else {
+    ctx->sc_oldest = e;
+  }
+  ctx->sc_newest = e;
+  ctx->sc_used += e->alloc;
+  e->cached = 1;
+}
+
+// Called with sc_mutex held.
+static struct static_entry *static_cache_find(struct mg_context *ctx,
+                                              const char *path,
+                                              unsigned hash) {
+  struct static_entry *e = ctx->sc_buckets[hash & (SC_BUCKETS - 1)];
+
+  while (e != NULL && (e->hash != hash || strcmp(e->path, path) != 0)) {
+    e = e->next;
+  }
+  if (e != NULL) {
+    e->refs++;
+    if (e->newer != NULL) {
+      // Move it up front
+      e->newer->older = e->older;
+      if (e->older != NULL) {
+        e->older->newer = e->newer;
+      } else {
+        ctx->sc_oldest = e->newer;
+      }
+      e->newer = NULL;
+      e->older = ctx->sc_newest;
+      ctx->sc_newest->newer = e;
+      ctx->sc_newest = e;
+    }
+  }
+  return e;
+}
+
+// Read size bytes of the file from the start. Return: 1 on success.
+static int read_whole_file(int fd, char *buf, int64_t size) {
+  int64_t got = 0;
+  int n;
+
+#if defined(_WIN32)
+  // Private descriptor: there is no fd cache on Windows
+  (void) lseek(fd, 0, SEEK_SET);
+#endif // _WIN32
+  while (got < size) {
+#if defined(_WIN32)
+    n = read(fd, buf + got, (size_t) (size - got));
+#else
+    n = (int) pread(fd, buf + got, (size_t) (size - got), (off_t) got);
+#endif // _WIN32
+    if (n <= 0) {
+      return 0;  // The file shrunk under our feet
+    }
+    got += n;
+  }
+  return 1;
+}
+
+// Build an entry, one allocation for all: the body comes from buf,
+// or is read from fd if buf is NULL. With gz_stp, the same for the
+// precompressed sibling: from gz_buf, or read from path.gz.
+// Returned with one reference.
+static struct static_entry *static_cache_new(struct mg_connection *conn,
+                                             const char *path,
+                                             const struct mgstat *stp,
+                                             time_t curtime,
+                                             const char *buf, int fd,
+                                             const struct mgstat *gz_stp,
+                                             const char *gz_buf) {
+  struct static_entry *e;
+  char head[1024], gz_head[1024], gz_path[PATH_MAX];
+  size_t path_len = strlen(path) + 1;
+  int64_t gz_size = gz_stp != NULL ? gz_stp->size : 0;
+  int head_len, gz_head_len = 0, gz_fd, ok;
+
+  head_len = print_file_headers(conn, head, sizeof(head), path, stp, curtime,
+                                200, "OK", stp->size, "", 0);
+  if (gz_stp != NULL) {
+    gz_head_len = print_file_headers(conn, gz_head, sizeof(gz_head), path,
+                                     gz_stp, curtime, 200, "OK", gz_size,
+                                     "", 1);
+  }
+  e = (struct static_entry *) malloc(sizeof(*e) + path_len + head_len +
+                                     (size_t) stp->size + gz_head_len +
+                                     (size_t) gz_size);
+  if (e == NULL) {
+    return NULL;
+  }
+  e->path = (char *) (e + 1);
+  e->head = e->path + path_len;
+  e->body = e->head + head_len;
+  memcpy(e->path, path, path_len);
+  memcpy(e->head, head, head_len);
+  e->head_len = head_len;
+  if (buf != NULL) {
+    memcpy(e->body, buf, (size_t) stp->size);
+  } else if (!read_whole_file(fd, e->body, stp->size)) {
+    free(e);
+    return NULL;
+  }
+  e->gz_head = e->gz_body = NULL;
+  e->gz_head_len = 0;
+  if (gz_stp != NULL) {
+    e->gz_st = *gz_stp;
+    e->gz_head = e->body + stp->size;
+    e->gz_body = e->gz_head + gz_head_len;
+    memcpy(e->gz_head, gz_head, gz_head_len);
+    e->gz_head_len = gz_head_len;
+    if (gz_buf != NULL) {
+      memcpy(e->gz_body, gz_buf, (size_t) gz_size);
+    } else {
+      (void) mg_snprintf(conn, gz_path, sizeof(gz_path), "%s.gz", path);
+      ok = (gz_fd = mg_open(gz_path, O_RDONLY | O_BINARY)) != -1 &&
+        read_whole_file(gz_fd, e->gz_body, gz_size);
+      if (gz_fd != -1) {
+        (void) close(gz_fd);
+      }
+      if (!ok) {
+        free(e);
+        return NULL;
+      }
+    }
+  }
+  e->hash = static_cache_hash(path);
+  e->st = *stp;
+  e->checked = curtime;
+  e->alloc = sizeof(*e) + path_len + head_len + (size_t) stp->size +
+    gz_head_len + (size_t) gz_size;
+  e->refs = 1;
+  e->cached = 0;
+  return e;
+}
+
+static void static_cache_put(struct mg_context *ctx, struct static_entry *e) {
+  int done;
+
+  (void) pthread_mutex_lock(&ctx->sc_mutex);
+  done = --e->refs == 0 && !e->cached;
+  (void) pthread_mutex_unlock(&ctx->sc_mutex);
+  if (done) {
+    free(e);
+  }
+}
+
+// Cache the file just opened for a full response, if small enough.
+// Return: the entry to send, to give back with static_cache_put(),
+// NULL if not cached.
+static struct static_entry *static_cache_add(struct mg_connection *conn,
+                                             const char *path,
+                                             const struct mgstat *stp,
+                                             int fd,
+                                             const struct mgstat *gz_stp) {
+  struct mg_context *ctx = conn->ctx;
+  struct static_entry *e;
+
+  if (ctx->sc_buckets == NULL || stp->size > ctx->sc_file_size ||
+      (e = static_cache_new(conn, path, stp, time(NULL), NULL, fd,
+                            gz_stp, NULL)) == NULL) {
+    return NULL;
+  }
+  (void) pthread_mutex_lock(&ctx->sc_mutex);
+  if (e->alloc <= (size_t) ctx->sc_size) {
+    // Another worker may have been quicker: newer wins
+    struct static_entry *old = static_cache_find(ctx, path, e->hash);
+    if (old != NULL) {
+      old->refs--;
+      static_cache_unlink(ctx, old);
+    }
+    static_cache_link(ctx, e);
+  }
+  (void) pthread_mutex_unlock(&ctx->sc_mutex);
+  return e;
+}
+
+// Look the file up. Once a second, the entry is checked against the file
+// system, and its headers rendered again for the new Date.
+// Return: the entry, to give back with static_cache_put(), NULL if none.
+static struct static_entry *static_cache_get(struct mg_connection *conn,
+                                             const char *path) {
+  struct mg_context *ctx = conn->ctx;
+  struct static_entry *e, *fresh = NULL;
+  struct mgstat st, gz_st;
+  char gz_path[PATH_MAX];
+  time_t curtime;
+  int has_gz, same_gz;
+
+  if (ctx->sc_buckets == NULL) {
+    return NULL;
+  }
+  (void) pthread_mutex_lock(&ctx->sc_mutex);
+  e = static_cache_find(ctx, path, static_cache_hash(path));
+  (void) pthread_mutex_unlock(&ctx->sc_mutex);
+  if (e == NULL || e->checked == (curtime = time(NULL))) {
+    return e;
+  }
+
+  if (mg_stat(path, &st) == 0 && !st.is_directory &&
+      st.mtime == e->st.mtime && st.size == e->st.size) {
+    // The sibling may have come, gone or changed meanwhile
+    has_gz = stat_gz_sibling(conn, path, &st, gz_path, sizeof(gz_path),
+                             &gz_st);
+    same_gz = has_gz && e->gz_body != NULL &&
+      gz_st.mtime == e->gz_st.mtime && gz_st.size == e->gz_st.size;
+    fresh = static_cache_new(conn, path, &st, curtime, e->body, -1,
+                             has_gz ? &gz_st : NULL,
+                             same_gz ? e->gz_body : NULL);
+    if (fresh == NULL) {
+      return e;  // Out of memory, but still good
+    }
+  }
+  (void) pthread_mutex_lock(&ctx->sc_mutex);
+  if (e->cached) {
+    static_cache_unlink(ctx, e);
+    if (fresh != NULL) {
+      static_cache_link(ctx, fresh);
+    }
+  }
+  (void) pthread_mutex_unlock(&ctx->sc_mutex);
+  static_cache_put(ctx, e);
+  return fresh;
+}
+
+// Allocate the static file cache, as configured by static_cache_size
+static int init_static_cache(struct mg_context *ctx) {
+  ctx->sc_size = strtoll(ctx->config[STATIC_CACHE_SIZE], NULL, 10);
+  ctx->sc_file_size = strtoll(ctx->config[STATIC_CACHE_FILE_SIZE], NULL, 10);
+  if (ctx->sc_size <= 0 || ctx->sc_file_size <= 0) {
+    return 1;
+  }
+  ctx->sc_buckets = (struct static_entry **) calloc(SC_BUCKETS,
+                                                    sizeof(*ctx->sc_buckets));
+  return ctx->sc_buckets != NULL;
+}
+
+static void free_static_cache(struct mg_context *ctx) {
+  while (ctx->sc_oldest != NULL) {
+    static_cache_unlink(ctx, ctx->sc_oldest);
+  }
+  free(ctx->sc_buckets);
+}
+
+// Send a cached file with a single write
+static void send_cached_file(struct mg_connection *conn,
+                             const struct static_entry *e, int gzipped) {
+  struct mg_iovec iov[3];
+  char tail[64];
+
+  iov[0].buf = gzipped ? e->gz_head : e->head;
+  iov[0].len = gzipped ? e->gz_head_len : e->head_len;
+  iov[1].buf = tail;
+  iov[1].len = mg_snprintf(conn, tail, sizeof(tail), "Connection: %s\r\n\r\n",
+                           suggest_connection_header(conn));
+  iov[2].buf = gzipped ? e->gz_body : e->body;
+  iov[2].len = (size_t) (gzipped ? e->gz_st.size : e->st.size);
+  conn->request_info.status_code = 200;
+  if (strcmp(conn->request_info.request_method, "HEAD") == 0) {
+    (void) mg_writev(conn, iov, 2);
+  } else if (mg_writev(conn, iov, 3) ==
+             (int) (iov[0].len + iov[1].len + iov[2].len)) {
+    conn->num_bytes_sent += iov[2].len;
+  }
+}
+
+// Hold the headers back until the file follows them, so that the small
+// write of the headers does not stall the body (Nagle vs delayed ACK).
+static void cork(struct mg_connection *conn, int on) {
+#if defined(TCP_CORK)
+  if (conn->ssl == NULL) {
+    (void) setsockopt(conn->client.sock, IPPROTO_TCP, TCP_CORK,
+                      (void *) &on, sizeof(on));
+  }
+#endif // TCP_CORK
+}
+
 static void handle_file_request(struct mg_connection *conn, const char *path,
                                 struct mgstat *stp) {
-  char date[64], lm[64], etag[64], range[64];
-  const char *fmt = "%a, %d %b %Y %H:%M:%S %Z", *msg = "OK", *hdr;
-  time_t curtime = time(NULL);
+  char head[1024], range[64], gz_path[PATH_MAX];
+  const char *msg = "OK", *hdr;
   int64_t cl, r1, r2;
-  struct vec mime_vec;
-  FILE *fp;
-  int n;
+  struct fd_cache_entry *file, *gz_file;
+  struct static_entry *cached;
+  struct mgstat gz_st;
+  int n, has_gz, gzipped;
 
-  get_mime_type(conn->ctx, path, &mime_vec);
   cl = stp->size;
   conn->request_info.status_code = 200;
   range[0] = '\0';
 
-  if ((fp = mg_fopen(path, "rb")) == NULL) {
-    send_http_error(conn, 500, http_500_error,
-        "fopen(%s): %s", path, strerror(ERRNO));
-    return;
-  }
-  set_close_on_exec(fileno(fp));
-
-  // If Range: header specified, act accordingly
+  // The precompressed sibling goes for whole files only
   r1 = r2 = 0;
   hdr = mg_get_header(conn, "Range");
+  has_gz = stat_gz_sibling(conn, path, stp, gz_path, sizeof(gz_path), &gz_st);
+  gzipped = has_gz && hdr == NULL && accepts_gzip(conn);
+
+  // If Range: header specified, act accordingly
   if (hdr != NULL && (n = parse_range_header(hdr, &r1, &r2)) > 0) {
+    if (n == 1 && hdr[6] == '-') {
+      // Suffix range: bytes=-N are the last N bytes, bytes=-0 none at all
+      r1 = r1 == 0 ? stp->size : stp->size + r1 < 0 ? 0 : stp->size + r1;
+    } else if (n == 2 && r2 >= stp->size) {
+      r2 = stp->size - 1;
+    }
+    if (r1 >= stp->size || (n == 2 && r2 < r1)) {
+      (void) mg_printf(conn,
+          "HTTP/1.1 416 Requested Range Not Satisfiable\r\n"
+          "Content-Range: bytes */%" INT64_FMT "\r\n"
+          "Content-Length: 0\r\n"
+          "Connection: %s\r\n\r\n",
+          stp->size, suggest_connection_header(conn));
+      conn->request_info.status_code = 416;
+      return;
+    }
     conn->request_info.status_code = 206;
-    (void) fseeko(fp, (off_t) r1, SEEK_SET);
     cl = n == 2 ? r2 - r1 + 1: cl - r1;
     (void) mg_snprintf(conn, range, sizeof(range),
         "Content-Range: bytes "
@@ -2541,29 +3311,45 @@ static void handle_file_request(struct mg_connection *conn, const char *path,
     msg = "Partial Content";
   }
 
-  // Prepare Etag, Date, Last-Modified headers
-  (void) strftime(date, sizeof(date), fmt, localtime(&curtime));
-  (void) strftime(lm, sizeof(lm), fmt, localtime(&stp->mtime));
-  (void) mg_snprintf(conn, etag, sizeof(etag), "%lx.%lx",
-      (unsigned long) stp->mtime, (unsigned long) stp->size);
+  if ((file = fd_cache_get(conn->ctx, path, stp)) == NULL) {
+    send_http_error(conn, 500, http_500_error,
+        "open(%s): %s", path, strerror(ERRNO));
+    return;
+  }
 
-  (void) mg_printf(conn,
-      "HTTP/1.1 %d %s\r\n"
-      "Date: %s\r\n"
-      "Last-Modified: %s\r\n"
-      "Etag: \"%s\"\r\n"
-      "Content-Type: %.*s\r\n"
-      "Content-Length: %" INT64_FMT "\r\n"
-      "Connection: %s\r\n"
-      "Accept-Ranges: bytes\r\n"
-      "%s\r\n",
-      conn->request_info.status_code, msg, date, lm, etag,
-      mime_vec.len, mime_vec.ptr, cl, suggest_connection_header(conn), range);
+  // Small enough for memory? Then next time it comes from there
+  if (conn->request_info.status_code == 200 &&
+      (cached = static_cache_add(conn, path, stp, file->fd,
+                                 has_gz ? &gz_st : NULL)) != NULL) {
+    fd_cache_put(conn->ctx, file);
+    send_cached_file(conn, cached, gzipped);
+    static_cache_put(conn->ctx, cached);
+    return;
+  }
+
+  if (gzipped) {
+    if ((gz_file = fd_cache_get(conn->ctx, gz_path, &gz_st)) != NULL) {
+      fd_cache_put(conn->ctx, file);
+      file = gz_file;
+      stp = &gz_st;
+      cl = gz_st.size;
+    } else {
+      gzipped = 0;  // Gone meanwhile: the file itself will do
+    }
+  }
+
+  (void) print_file_headers(conn, head, sizeof(head), path, stp, time(NULL),
+                            conn->request_info.status_code, msg, cl, range,
+                            gzipped);
+  cork(conn, 1);
+  (void) mg_printf(conn, "%sConnection: %s\r\n\r\n",
+                   head, suggest_connection_header(conn));
 
   if (strcmp(conn->request_info.request_method, "HEAD") != 0) {
-    send_file_data(conn, fp, cl);
+    conn->num_bytes_sent += mg_sendfile(conn, file->fd, r1, cl);
   }
-  (void) fclose(fp);
+  cork(conn, 0);
+  fd_cache_put(conn->ctx, file);
 }
 
 // Parse HTTP headers from the given buffer, advance buffer to the point
@@ -3216,6 +4002,18 @@ static void handle_ssi_file_request(struct mg_connection *conn,
   }
 }
 
+// Serve a file from the static cache: no file system access but once
+// a second. The entry is given back once sent.
+static void handle_cached_file_request(struct mg_connection *conn,
+                                       struct static_entry *e) {
+  if (is_not_modified(conn, &e->st)) {
+    send_http_error(conn, 304, "Not Modified", "");
+  } else {
+    send_cached_file(conn, e, e->gz_body != NULL && accepts_gzip(conn));
+  }
+  static_cache_put(conn->ctx, e);
+}
+
 // This is the heart of the Mongoose's logic.
 // This function is called when the request is read, parsed and validated,
 // and Mongoose must decide what action to take: serve a file, or
@@ -3225,6 +4023,7 @@ static void handle_request(struct mg_connection *conn) {
   char path[PATH_MAX];
   int uri_len;
   struct mgstat st;
+  struct static_entry *cached;
 
   if ((conn->request_info.query_string = strchr(ri->uri, '?')) != NULL) {
     * conn->request_info.query_string++ = '\0';
@@ -3258,6 +4057,9 @@ static void handle_request(struct mg_connection *conn) {
       send_http_error(conn, 500, http_500_error, "remove(%s): %s", path,
                       strerror(ERRNO));
     }
+  } else if (mg_get_header(conn, "Range") == NULL &&
+             (cached = static_cache_get(conn, path)) != NULL) {
+    handle_cached_file_request(conn, cached);
   } else if (mg_stat(path, &st) != 0) {
     send_http_error(conn, 404, "Not Found", "%s", "File not found");
   } else if (st.is_directory && ri->uri[uri_len - 1] != '/') {
@@ -3354,7 +4156,7 @@ static int set_ports_option(struct mg_context *ctx) {
                           sizeof(reuseaddr)) != 0 ||
 #endif // !_WIN32
                bind(sock, &so.lsa.u.sa, so.lsa.len) != 0 ||
-               listen(sock, 20) != 0) {
+               listen(sock, SOMAXCONN) != 0) {
       closesocket(sock);
       cry(fc(ctx), "%s: cannot bind to %.*s: %s", __func__,
           vec.len, vec.ptr, strerror(ERRNO));
@@ -3656,7 +4458,9 @@ static void reset_per_request_attributes(struct mg_connection *conn) {
 
   conn->num_bytes_sent = conn->consumed_content = 0;
   conn->content_len = -1;
-  conn->request_len = conn->data_len = 0;
+  conn->must_close = 0;
+  // Keep data_len: the buffer may already hold the next, pipelined request
+  conn->request_len = 0;
 }
 
 static void close_socket_gracefully(SOCKET sock) {
@@ -3691,6 +4495,14 @@ static void close_connection(struct mg_connection *conn) {
   }
 }
 
+// Whatever the handler did not read of the body and is not buffered yet
+// is still on the socket: it cannot be told apart from the next request.
+static int is_body_pending(const struct mg_connection *conn) {
+  return conn->content_len > 0 &&
+      conn->consumed_content < conn->content_len &&
+      (int64_t) (conn->data_len - conn->request_len) < conn->content_len;
+}
+
 static void discard_current_request_from_buffer(struct mg_connection *conn) {
   int buffered_len, body_len;
 /*char *buffered;
@@ -3787,13 +4599,15 @@ static int is_valid_uri(const char *uri) {
 
 static void process_new_connection(struct mg_connection *conn) {
   struct mg_request_info *ri = &conn->request_info;
-  int keep_alive_enabled;
+  int keep_alive_enabled, keep_alive;
   const char *cl;
 
   keep_alive_enabled = !strcmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes");
+  conn->data_len = 0;
 
   do {
     reset_per_request_attributes(conn);
+    keep_alive = 0;
 
     // If next request is not pipelined, read it in
     if ((conn->request_len = get_request_len(conn->buf, conn->data_len)) == 0) {
@@ -3830,15 +4644,18 @@ static void process_new_connection(struct mg_connection *conn) {
       } else {
         handle_request(conn);
       }
+      // Before the discard: the headers point into the buffer
+      keep_alive = should_keep_alive(conn) && !is_body_pending(conn) &&
+          !conn->must_close;
       log_access(conn);
       discard_current_request_from_buffer(conn);
     }
     // conn->peer is not NULL only for SSL-ed proxy connections
-  } while (conn->peer || (keep_alive_enabled && should_keep_alive(conn)));
+  } while (conn->peer || (keep_alive_enabled && keep_alive));
 }
 
 // Worker threads take accepted socket from the queue
-static int consume_socket(struct mg_context *ctx, struct socket *sp) {
+static int consume_socket_locked(struct mg_context *ctx, struct socket *sp) {
   (void) pthread_mutex_lock(&ctx->mutex);
   DEBUG_TRACE(("going idle"));
 
@@ -3855,14 +4672,14 @@ static int consume_socket(struct mg_context *ctx, struct socket *sp) {
   assert(ctx->sq_head > ctx->sq_tail);
 
   // Copy socket from the queue and increment tail
-  *sp = ctx->queue[ctx->sq_tail % ARRAY_SIZE(ctx->queue)];
+  *sp = ctx->queue[ctx->sq_tail % ctx->sq_size];
   ctx->sq_tail++;
   DEBUG_TRACE(("grabbed socket %d, going busy", sp->sock));
 
   // Wrap pointers if needed
-  while (ctx->sq_tail > (int) ARRAY_SIZE(ctx->queue)) {
-    ctx->sq_tail -= ARRAY_SIZE(ctx->queue);
-    ctx->sq_head -= ARRAY_SIZE(ctx->queue);
+  while (ctx->sq_tail > (int) ctx->sq_size) {
+    ctx->sq_tail -= ctx->sq_size;
+    ctx->sq_head -= ctx->sq_size;
   }
 
   (void) pthread_cond_signal(&ctx->sq_empty);
@@ -3871,16 +4688,254 @@ static int consume_socket(struct mg_context *ctx, struct socket *sp) {
   return 1;
 }
 
+// Master thread adds accepted socket to a queue
+static void produce_socket_locked(struct mg_context *ctx,
+                                  const struct socket *sp) {
+  (void) pthread_mutex_lock(&ctx->mutex);
+
+  // If the queue is full, wait
+  while (ctx->sq_head - ctx->sq_tail >= (int) ctx->sq_size) {
+    (void) pthread_cond_wait(&ctx->sq_empty, &ctx->mutex);
+  }
+  assert(ctx->sq_head - ctx->sq_tail < (int) ctx->sq_size);
+
+  // Copy socket to the queue and increment head
+  ctx->queue[ctx->sq_head % ctx->sq_size] = *sp;
+  ctx->sq_head++;
+  DEBUG_TRACE(("queued socket %d", sp->sock));
+
+  (void) pthread_cond_signal(&ctx->sq_full);
+  (void) pthread_mutex_unlock(&ctx->mutex);
+}
+
+#if defined(HAVE_LOCKFREE_QUEUE)
+static void sq_relax(void) {
+#if defined(__i386__) || defined(__x86_64__)
+  __asm__ __volatile__("pause");
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+// Vyukov's bounded MPMC queue: claim a position with a CAS, then the
+// slot sequence number publishes the socket. 0 if the queue is full.
+static int sq_push(struct mg_context *ctx, const struct socket *sp) {
+  struct sq_cell *cell;
+  unsigned pos = __atomic_load_n(&ctx->sq_enqueue_pos, __ATOMIC_RELAXED);
+  int diff;
+
+  for (;;) {
+    cell = &ctx->sq_cells[pos & ctx->sq_mask];
+    diff = (int) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ctx->sq_enqueue_pos, &pos, pos + 1,
+                                      1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&ctx->sq_enqueue_pos, __ATOMIC_RELAXED);
+    }
+  }
+  cell->sock = *sp;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+// 0 if the queue is empty
+static int sq_pop(struct mg_context *ctx, struct socket *sp) {
+  struct sq_cell *cell;
+  unsigned pos = __atomic_load_n(&ctx->sq_dequeue_pos, __ATOMIC_RELAXED);
+  int diff;
+
+  for (;;) {
+    cell = &ctx->sq_cells[pos & ctx->sq_mask];
+    diff = (int) (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ctx->sq_dequeue_pos, &pos, pos + 1,
+                                      1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    } else if (diff < 0) {
+      return 0;
+    } else {
+      pos = __atomic_load_n(&ctx->sq_dequeue_pos, __ATOMIC_RELAXED);
+    }
+  }
+  *sp = cell->sock;
+  __atomic_store_n(&cell->seq, pos + ctx->sq_mask + 1, __ATOMIC_RELEASE);
+  return 1;
+}
+
+// Parking protocol: the sleeper raises its flag, then looks at the queue
+// once more; the waker changes the queue, then looks at the flag. With a
+// full barrier on both sides, at least one of them sees the other.
+static void sq_wake(struct mg_context *ctx, volatile int *waiters,
+                    pthread_cond_t *cond) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(waiters, __ATOMIC_RELAXED) > 0) {
+    (void) pthread_mutex_lock(&ctx->mutex);
+    (void) pthread_cond_signal(cond);
+    (void) pthread_mutex_unlock(&ctx->mutex);
+  }
+}
+
+// Spin first: under load a socket shows up soon. The spin budget adapts:
+// it doubles when spinning paid off, it halves when we had to sleep.
+static int consume_socket_lockfree(struct mg_context *ctx, struct socket *sp,
+                                   int *spin) {
+  int i, got = 0;
+
+  for (i = 0; !got && i < *spin && i < ctx->sq_spin_max &&
+       ctx->stop_flag == 0; i++) {
+    if ((got = sq_pop(ctx, sp)) == 0) {
+      sq_relax();
+    }
+  }
+  if (got) {
+    if (*spin < SQ_SPIN_MAX) {
+      *spin *= 2;
+    }
+  } else {
+    if (*spin > SQ_SPIN_MIN) {
+      *spin /= 2;
+    }
+    DEBUG_TRACE(("going idle"));
+    (void) pthread_mutex_lock(&ctx->mutex);
+    __atomic_add_fetch(&ctx->sq_sleepers, 1, __ATOMIC_SEQ_CST);
+    while (ctx->stop_flag == 0 && (got = sq_pop(ctx, sp)) == 0) {
+      (void) pthread_cond_wait(&ctx->sq_full, &ctx->mutex);
+    }
+    __atomic_sub_fetch(&ctx->sq_sleepers, 1, __ATOMIC_SEQ_CST);
+    (void) pthread_mutex_unlock(&ctx->mutex);
+  }
+  if (got) {
+    DEBUG_TRACE(("grabbed socket %d, going busy", sp->sock));
+    sq_wake(ctx, &ctx->sq_blocked, &ctx->sq_empty);
+  }
+  return got;
+}
+
+static void produce_socket_lockfree(struct mg_context *ctx,
+                                    const struct socket *sp) {
+  int i, pushed = 0;
+
+  for (i = 0; !pushed && i < ctx->sq_spin_max; i++) {
+    if ((pushed = sq_push(ctx, sp)) == 0) {
+      sq_relax();
+    }
+  }
+  if (!pushed) {
+    // Still full: wait for a worker to make room
+    (void) pthread_mutex_lock(&ctx->mutex);
+    __atomic_store_n(&ctx->sq_blocked, 1, __ATOMIC_SEQ_CST);
+    while (ctx->stop_flag == 0 && (pushed = sq_push(ctx, sp)) == 0) {
+      (void) pthread_cond_wait(&ctx->sq_empty, &ctx->mutex);
+    }
+    __atomic_store_n(&ctx->sq_blocked, 0, __ATOMIC_SEQ_CST);
+    (void) pthread_mutex_unlock(&ctx->mutex);
+  }
+  if (pushed) {
+    DEBUG_TRACE(("queued socket %d", sp->sock));
+    sq_wake(ctx, &ctx->sq_sleepers, &ctx->sq_full);
+  } else {
+    // Stopping, and the workers are gone already
+    (void) closesocket(sp->sock);
+  }
+}
+#endif // HAVE_LOCKFREE_QUEUE
+
+static int consume_socket(struct mg_context *ctx, struct socket *sp,
+                          int *spin) {
+#if defined(HAVE_LOCKFREE_QUEUE)
+  if (ctx->sq_lockfree) {
+    return consume_socket_lockfree(ctx, sp, spin);
+  }
+#endif // HAVE_LOCKFREE_QUEUE
+  (void) spin;
+  return consume_socket_locked(ctx, sp);
+}
+
+static void produce_socket(struct mg_context *ctx, const struct socket *sp) {
+#if defined(HAVE_LOCKFREE_QUEUE)
+  if (ctx->sq_lockfree) {
+    produce_socket_lockfree(ctx, sp);
+    return;
+  }
+#endif // HAVE_LOCKFREE_QUEUE
+  produce_socket_locked(ctx, sp);
+}
+
+// Allocate the socket queue, as configured by socket_queue(_size)
+static int init_socket_queue(struct mg_context *ctx) {
+  ctx->sq_size = atoi(ctx->config[SOCKET_QUEUE_SIZE]);
+  if (ctx->sq_size <= 0) {
+    return 0;
+  }
+#if defined(HAVE_LOCKFREE_QUEUE)
+  if (strcmp(ctx->config[SOCKET_QUEUE], "mutex") != 0) {
+    unsigned i, size = 2;
+
+    // The ring needs a power of two: round up
+    while (size < (unsigned) ctx->sq_size) {
+      size <<= 1;
+    }
+    ctx->sq_cells = (struct sq_cell *) calloc(size, sizeof(*ctx->sq_cells));
+    if (ctx->sq_cells == NULL) {
+      return 0;
+    }
+    for (i = 0; i < size; i++) {
+      ctx->sq_cells[i].seq = i;
+    }
+    ctx->sq_mask = size - 1;
+    ctx->sq_spin_max = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? SQ_SPIN_MAX : 1;
+    ctx->sq_lockfree = 1;
+    return 1;
+  }
+#endif // HAVE_LOCKFREE_QUEUE
+  ctx->queue = (struct socket *) calloc(ctx->sq_size, sizeof(*ctx->queue));
+  return ctx->queue != NULL;
+}
+
+// Bind the calling worker to a CPU, round robin over the online ones.
+static void pin_worker_thread(struct mg_context *ctx) {
+#if defined(__linux__)
+  cpu_set_t set;
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int idx;
+
+  (void) pthread_mutex_lock(&ctx->mutex);
+  idx = ctx->num_pinned++;
+  (void) pthread_mutex_unlock(&ctx->mutex);
+
+  if (num_cpus > 0) {
+    CPU_ZERO(&set);
+    CPU_SET(idx % num_cpus, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+      cry(fc(ctx), "Cannot pin worker %d: %s", idx, strerror(ERRNO));
+    }
+  }
+#else
+  (void) ctx;
+#endif // __linux__
+}
+
 static void worker_thread(struct mg_context *ctx) {
   struct mg_connection *conn;
   int buf_size = atoi(ctx->config[MAX_REQUEST_SIZE]);
+  int spin = SQ_SPIN_MIN;
+
+  if (!strcmp(ctx->config[CPU_AFFINITY], "yes")) {
+    pin_worker_thread(ctx);
+  }
 
   conn = (struct mg_connection *) calloc(1, sizeof(*conn) + buf_size);
   conn->buf_size = buf_size;
   conn->buf = (char *) (conn + 1);
   assert(conn != NULL);
 
-  while (ctx->stop_flag == 0 && consume_socket(ctx, &conn->client)) {
+  while (ctx->stop_flag == 0 && consume_socket(ctx, &conn->client, &spin)) {
     conn->birth_time = time(NULL);
     conn->ctx = ctx;
 
@@ -3912,25 +4967,6 @@ static void worker_thread(struct mg_context *ctx) {
   DEBUG_TRACE(("exiting"));
 }
 
-// Master thread adds accepted socket to a queue
-static void produce_socket(struct mg_context *ctx, const struct socket *sp) {
-  (void) pthread_mutex_lock(&ctx->mutex);
-
-  // If the queue is full, wait
-  while (ctx->sq_head - ctx->sq_tail >= (int) ARRAY_SIZE(ctx->queue)) {
-    (void) pthread_cond_wait(&ctx->sq_empty, &ctx->mutex);
-  }
-  assert(ctx->sq_head - ctx->sq_tail < (int) ARRAY_SIZE(ctx->queue));
-
-  // Copy socket to the queue and increment head
-  ctx->queue[ctx->sq_head % ARRAY_SIZE(ctx->queue)] = *sp;
-  ctx->sq_head++;
-  DEBUG_TRACE(("queued socket %d", sp->sock));
-
-  (void) pthread_cond_signal(&ctx->sq_full);
-  (void) pthread_mutex_unlock(&ctx->mutex);
-}
-
 static void accept_new_connection(const struct socket *listener,
                                   struct mg_context *ctx) {
   struct socket accepted;
@@ -3994,7 +5030,10 @@ static void master_thread(struct mg_context *ctx) {
   close_all_listening_sockets(ctx);
 
   // Wakeup workers that are waiting for connections to handle.
+  // Under the mutex, or a worker about to park could miss it.
+  (void) pthread_mutex_lock(&ctx->mutex);
   pthread_cond_broadcast(&ctx->sq_full);
+  (void) pthread_mutex_unlock(&ctx->mutex);
 
   // Wait until all threads finish
   (void) pthread_mutex_lock(&ctx->mutex);
@@ -4005,6 +5044,8 @@ static void master_thread(struct mg_context *ctx) {
 
   // All threads exited, no sync is needed. Destroy mutex and condvars
   (void) pthread_mutex_destroy(&ctx->mutex);
+  (void) pthread_mutex_destroy(&ctx->fd_cache_mutex);
+  (void) pthread_mutex_destroy(&ctx->sc_mutex);
   (void) pthread_cond_destroy(&ctx->cond);
   (void) pthread_cond_destroy(&ctx->sq_empty);
   (void) pthread_cond_destroy(&ctx->sq_full);
@@ -4024,6 +5065,13 @@ static void free_context(struct mg_context *ctx) {
       free(ctx->config[i]);
   }
 
+  free(ctx->queue);
+  free_fd_cache(ctx);
+  free_static_cache(ctx);
+#if defined(HAVE_LOCKFREE_QUEUE)
+  free(ctx->sq_cells);
+#endif // HAVE_LOCKFREE_QUEUE
+
   // Deallocate SSL context
   if (ctx->ssl_ctx != NULL) {
     SSL_CTX_free(ctx->ssl_ctx);
@@ -4094,6 +5142,24 @@ struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
     }
   }
 
+  if (!init_socket_queue(ctx)) {
+    cry(fc(ctx), "Cannot allocate socket queue of %d", ctx->sq_size);
+    free_context(ctx);
+    return NULL;
+  }
+
+  if (!init_fd_cache(ctx)) {
+    cry(fc(ctx), "Cannot allocate file cache of %d", ctx->fd_cache_size);
+    free_context(ctx);
+    return NULL;
+  }
+
+  if (!init_static_cache(ctx)) {
+    cry(fc(ctx), "Cannot allocate static cache");
+    free_context(ctx);
+    return NULL;
+  }
+
   // NOTE(lsm): order is important here. SSL certificates must
   // be initialized before listening ports. UID must be set last.
   if (!set_gpass_option(ctx) ||
@@ -4116,6 +5182,8 @@ struct mg_context *mg_start(mg_callback_t user_callback, void *user_data,
 #endif // !_WIN32
 
   (void) pthread_mutex_init(&ctx->mutex, NULL);
+  (void) pthread_mutex_init(&ctx->fd_cache_mutex, NULL);
+  (void) pthread_mutex_init(&ctx->sc_mutex, NULL);
   (void) pthread_cond_init(&ctx->cond, NULL);
   (void) pthread_cond_init(&ctx->sq_empty, NULL);
   (void) pthread_cond_init(&ctx->sq_full, NULL);
@@ -147,6 +147,38 @@ int mg_modify_passwords_file(const char *passwords_file_name,
 int mg_write(struct mg_connection *, const void *buf, size_t len);
 
 
+// Send len bytes of the open file fd, starting at offset, to the client.
+//
+// Without SSL (on Linux), the data goes with sendfile(2): it never passes
+// through user space. The file offset is left untouched (but on Windows),
+// so the descriptor can be shared.
+// Return: number of bytes written, less than len on error.
+long long mg_sendfile(struct mg_connection *, int fd, long long offset,
+                      long long len);
+
+
+// Close the connection once the current request is done, even if it could
+// be kept alive (e.g. the reply was cut short).
+void mg_must_close(struct mg_connection *);
+
+
+// A buffer for mg_writev().
+struct mg_iovec {
+  const void *buf;
+  size_t len;
+};
+
+// Max number of buffers sent by mg_writev() in a single system call.
+#define MG_MAX_IOVEC 16
+
+// Send data to the client, gathered from iovcnt buffers.
+//
+// Without SSL, the buffers go out with a single writev() system call,
+// unless there are more than MG_MAX_IOVEC of them.
+// Return: number of bytes written, less than the total on error.
+int mg_writev(struct mg_connection *, const struct mg_iovec *iov, int iovcnt);
+
+
 // Send data to the browser using printf() semantics.
 //
 // Works exactly like mg_write(), but allows to do message formatting.
@@ -0,0 +1,24 @@
+/*
+ * assets.c -- serving files embedded in the program.
+ * ZLIB licensed.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "craneweb.h"
+#include "ui_assets.h" /* generated from www/ at build time */
+
+int main(int argc, char *argv[])
+{
+    CRW_Config cfg;
+    CRW_Instance *inst = CRW_instance_new(CRW_SERVER_ADAPTER_DEFAULT);
+    CRW_Handler *handler = CRW_handler_new_assets(inst, "/ui/.*", ui_assets);
+
+    CRW_instance_add_handler(inst, handler);
+
+    CRW_config_init(&cfg);
+
+    return CRW_run(inst, &cfg);
+}
@@ -35,9 +35,7 @@ int main(int argc, char *argv[])
 
     CRW_instance_add_handler(inst, handler);
     
-    cfg.host = "127.0.0.1";
-    cfg.port = 8080;
-    cfg.document_root = "."; /* YMMV? default? */
+    CRW_config_init(&cfg);
 
     return CRW_run(inst, &cfg);
 }
@@ -4,26 +4,60 @@
  * ZLIB licensed.
  */
 
+#include "config.h"
+
+#if (defined(ENABLE_EPOLL_SERVER) || defined(ENABLE_IO_URING_SERVER)) \
+ && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE /* syscall(), pthread_setaffinity_np() */
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <strings.h>
 #include <stdint.h>
+#include <ctype.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
 /* FIXME (portability) */
 #include <unistd.h>
+#include <pthread.h>
 /* FIXME (portability) */
 
-#include "config.h"
-
 #include "list.h"
-#include "stringbuilder.h"
 #ifdef ENABLE_BUILTIN_REGEX
 #include "regex.h"
 #endif
 #ifdef ENABLE_BUILTIN_MONGOOSE
 #include "mongoose.h"
 #endif
+#if defined(ENABLE_EPOLL_SERVER) || defined(ENABLE_IO_URING_SERVER)
+#define CRW_NATIVE_SERVER 1
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#endif
+#ifdef CRW_NATIVE_SERVER
+#include <sys/sendfile.h>
+#endif
+#ifdef ENABLE_EPOLL_SERVER
+#include <sys/epoll.h>
+#endif
+#ifdef ENABLE_IO_URING_SERVER
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#ifdef ENABLE_GZIP
+#include <zlib.h>
+#endif
 
 #include "craneweb.h"
 
@@ -37,13 +71,16 @@ static void CRW_dispatcher_del(CRW_Dispatcher *disp);
 static int CRW_dispatcher_init(CRW_Dispatcher *disp, CRW_Instance *inst);
 static int CRW_dispatcher_fini(CRW_Dispatcher *disp);
 
-static CRW_Response *CRW_dispatcher_handle(CRW_Dispatcher *disp,
-                                           CRW_Request *request);
+CRW_PRIVATE CRW_Response *CRW_dispatcher_handle(CRW_Dispatcher *disp,
+                                                CRW_Request *request);
 
 static CRW_Response *CRW_handler_call(CRW_Handler *handler,
                                       const CRW_RouteArgs *args,
                                       const CRW_Request *req);
 
+static int CRW_http_etag_match(const char *if_none_match,
+                               const char *etag, size_t etag_len);
+
 typedef struct crwserveradapter_ CRW_ServerAdapter;
 
 static CRW_ServerAdapter *CRW_server_adapter_new(CRW_Instance *inst,
@@ -93,6 +130,7 @@ struct crwinstance_ {
     CRW_Dispatcher *disp;
     CRW_LogHandler log;
     void *log_data;
+    size_t compress_min_size;   /* 0: no compression */
 };
 
 /*** logger **************************************************************/
@@ -202,20 +240,217 @@ static const char *CRW_kvpair_get_by_key(const CRW_KVPair *pairs, int num,
     return value;
 }
 
-static const char *CRW_kvpair_get_by_ikey(const CRW_KVPair *pairs, int num,
-                                          const char *tag)
+
+/*** arena ***************************************************************/
+
+/* A bump-pointer allocator for everything a request (and its response)
+   needs: it is dropped at once when both are done. The idle arenas are
+   kept, blocks included, and reused by the next requests served by the
+   same thread, so the steady state needs no malloc() at all. */
+
+#ifdef __GNUC__
+#define CRW_THREAD_LOCAL __thread
+#if !defined(CRW_NO_THREAD_CACHE)
+#define CRW_HAVE_THREAD_CACHE 1
+#endif
+#endif
+
+enum {
+    CRW_ARENA_BLOCK_SIZE = 8192,
+    CRW_ARENA_ALIGN = 16,
+    CRW_ARENA_CACHE_MAX = 64,   /* idle arenas kept by each thread */
+    CRW_POOL_MAX = 64           /* idle requests/responses, likewise */
+};
+
+#define CRW_ARENA_ROUND(SIZE) \
+    (((SIZE) + CRW_ARENA_ALIGN - 1) & ~((size_t)CRW_ARENA_ALIGN - 1))
+
+typedef struct crwarenablock_ CRW_ArenaBlock;
+struct crwarenablock_ {
+    CRW_ArenaBlock *next;
+    size_t size;
+    size_t used;
+    /* the data follows, aligned */
+};
+
+typedef struct crwarena_ CRW_Arena;
+struct crwarena_ {
+    CRW_ArenaBlock *head;
+    CRW_ArenaBlock *cur;
+    int users;          /* the request and the response(s) on it */
+    CRW_Arena *next;    /* in the thread cache */
+};
+
+#ifdef CRW_HAVE_THREAD_CACHE
+static CRW_THREAD_LOCAL CRW_Arena *CRW_ArenaCache = NULL;
+static CRW_THREAD_LOCAL int CRW_ArenaCached = 0;
+
+static void CRW_thread_cache_arm(void);
+#endif
+#ifdef CRW_THREAD_LOCAL
+/* the arena of the request whose handler is running */
+static CRW_THREAD_LOCAL CRW_Arena *CRW_ArenaCurrent = NULL;
+#endif
+
+static char *CRW_arena_block_data(CRW_ArenaBlock *block)
 {
-    const char *value = NULL;
-    if (pairs && num > 0 && tag) {
-        int j = 0, found  = 0;
-        for (j = 0; !found && j < num; j++) {
-            if (!strcasecmp(tag, pairs[j].key)) {
-                value = pairs[j].value;
-                found = 1;
-            }
+    return (char *)block + CRW_ARENA_ROUND(sizeof(CRW_ArenaBlock));
+}
+
+static CRW_ArenaBlock *CRW_arena_block_new(size_t size)
+{
+    CRW_ArenaBlock *block = malloc(CRW_ARENA_ROUND(sizeof(CRW_ArenaBlock))
+                                   + size);
+    if (block) {
+        block->next = NULL;
+        block->size = size;
+        block->used = 0;
+    }
+    return block;
+}
+
+static void *CRW_arena_alloc(CRW_Arena *A, size_t size)
+{
+    CRW_ArenaBlock *block = A->cur;
+    char *ptr = NULL;
+    size = CRW_ARENA_ROUND((size) ?size :1);
+    /* after a reset, the next blocks are there to be reused */
+    while (block && block->used + size > block->size) {
+        block = block->next;
+    }
+    if (!block) {
+        block = CRW_arena_block_new((size > CRW_ARENA_BLOCK_SIZE)
+                                    ?size :CRW_ARENA_BLOCK_SIZE);
+        if (!block) {
+            return NULL;
+        }
+        if (A->cur) {
+            block->next = A->cur->next;
+            A->cur->next = block;
+        } else {
+            A->head = block;
         }
     }
-    return value;
+    ptr = CRW_arena_block_data(block) + block->used;
+    block->used += size;
+    A->cur = block;
+    return ptr;
+}
+
+static char *CRW_arena_strdup(CRW_Arena *A, const char *str)
+{
+    size_t len = strlen(str);
+    char *dup = CRW_arena_alloc(A, len + 1);
+    if (dup) {
+        memcpy(dup, str, len + 1);
+    }
+    return dup;
+}
+
+/* the oversized blocks go away, to keep the idle footprint bounded */
+static void CRW_arena_reset(CRW_Arena *A)
+{
+    CRW_ArenaBlock **link = &A->head;
+    while (*link) {
+        CRW_ArenaBlock *block = *link;
+        if (block->size > CRW_ARENA_BLOCK_SIZE) {
+            *link = block->next;
+            free(block);
+        } else {
+            block->used = 0;
+            link = &block->next;
+        }
+    }
+    A->cur = A->head;
+    return;
+}
+
+static void CRW_arena_destroy(CRW_Arena *A)
+{
+    if (A) {
+        CRW_ArenaBlock *block = A->head;
+        while (block) {
+            CRW_ArenaBlock *next = block->next;
+            free(block);
+            block = next;
+        }
+        free(A);
+    }
+}
+
+static CRW_Arena *CRW_arena_get(void)
+{
+    CRW_Arena *A = NULL;
+#ifdef CRW_HAVE_THREAD_CACHE
+    if (CRW_ArenaCache) {
+        A = CRW_ArenaCache;
+        CRW_ArenaCache = A->next;
+        CRW_ArenaCached--;
+        A->next = NULL;
+    }
+#endif
+    if (!A) {
+#ifdef CRW_HAVE_THREAD_CACHE
+        CRW_thread_cache_arm(); /* the cache is empty the first time */
+#endif
+        A = calloc(1, sizeof(CRW_Arena));
+    }
+    if (A) {
+        A->users = 1;
+    }
+    return A;
+}
+
+static void CRW_arena_put(CRW_Arena *A)
+{
+    if (A && --A->users == 0) {
+        CRW_arena_reset(A);
+#ifdef CRW_HAVE_THREAD_CACHE
+        if (CRW_ArenaCached < CRW_ARENA_CACHE_MAX) {
+            A->next = CRW_ArenaCache;
+            CRW_ArenaCache = A;
+            CRW_ArenaCached++;
+            A = NULL;
+        }
+#endif
+        CRW_arena_destroy(A);
+    }
+}
+
+static void CRW_arena_cache_flush(void)
+{
+#ifdef CRW_HAVE_THREAD_CACHE
+    while (CRW_ArenaCache) {
+        CRW_Arena *A = CRW_ArenaCache;
+        CRW_ArenaCache = A->next;
+        CRW_arena_destroy(A);
+    }
+    CRW_ArenaCached = 0;
+#endif
+}
+
+/* the arena a new response should share: the one of the request
+   being handled, if any. Returns the previous one. */
+static CRW_Arena *CRW_arena_set_current(CRW_Arena *A)
+{
+    CRW_Arena *prev = NULL;
+#ifdef CRW_THREAD_LOCAL
+    prev = CRW_ArenaCurrent;
+    CRW_ArenaCurrent = A;
+#endif
+    return prev;
+}
+
+static CRW_Arena *CRW_arena_get_current(void)
+{
+    CRW_Arena *A = NULL;
+#ifdef CRW_THREAD_LOCAL
+    A = CRW_ArenaCurrent;
+    if (A) {
+        A->users++;
+    }
+#endif
+    return (A) ?A :CRW_arena_get();
 }
 
 
@@ -240,22 +475,143 @@ void CRW_instance_del(CRW_Instance *inst)
 }
 
 /*** request *************************************************************/
+
+/* the route args (see below) live in the request being served,
+   so the dispatcher can stay read-only while serving. */
+struct crwrouteargs_ {
+    CRW_KVPair pairs[CRW_MAX_ROUTE_ARGS];
+    int num;
+    char *data; /* values storage */
+    CRW_Arena *arena; /* of the request, if any: owns the storage */
+};
+
+static void CRW_route_args_cleanup(CRW_RouteArgs *args)
+{
+    if (args) {
+        CRW_Arena *arena = args->arena;
+        if (!arena) {
+            free(args->data);
+        }
+        memset(args, 0, sizeof(*args));
+        args->arena = arena;
+    }
+}
+
+/* the headers are indexed as they are added: by case-folded name hash
+   (open addressing) and, for the well-known ones, directly by id.
+   Both store the header index + 1, so 0 means empty. */
+enum {
+    CRW_REQUEST_HEADER_SLOTS = 2 * CRW_MAX_REQUEST_HEADERS, /* pow2 */
+    CRW_REQUEST_QUERY_SLOTS = 2 * CRW_MAX_QUERY_PARAMS,     /* pow2 */
+    CRW_REQUEST_BODY_CHUNK = 16384,
+    CRW_REQUEST_BODY_DRAIN_MAX = 65536 /* unread body worth reading away */
+};
+
+/* where the body comes from: either it is already in memory
+   (native servers) or it is read from the connection (mongoose). */
+typedef int (*CRW_BodyRead)(void *source, char *buf, size_t len);
+
+typedef struct crwrequestbody_ CRW_RequestBody;
+struct crwrequestbody_ {
+    long length;            /* Content-Length */
+    long consumed;          /* by the handler so far */
+    const char *data;
+    CRW_BodyRead read;
+    void *source;
+};
+
+/* the temporary files made on the behalf of the request */
+typedef struct crwspillfile_ CRW_SpillFile;
+struct crwspillfile_ {
+    CRW_SpillFile *next;
+    const char *path;
+};
+
+/* a view into the query string, still encoded */
+typedef struct crwqueryparam_ CRW_QueryParam;
+struct crwqueryparam_ {
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+    unsigned hash;          /* of the decoded name */
+    const char *decoded;    /* the value, once asked for */
+};
+
 struct crwrequest_ {
+    CRW_Arena *arena;   /* what the request needs lives there */
+    CRW_Request *next;  /* in the thread pool */
     CRW_RequestMethod method;
     const char *URI;
     const char *query_string;
     CRW_KVPair headers[CRW_MAX_REQUEST_HEADERS];
+    unsigned header_hashes[CRW_MAX_REQUEST_HEADERS];
     int num_headers;
+    unsigned char header_slots[CRW_REQUEST_HEADER_SLOTS];
+    unsigned char known_headers[CRW_HDR_COUNT];
+    /* parsed on first access only */
+    CRW_QueryParam query_params[CRW_MAX_QUERY_PARAMS];
+    int num_query_params;   /* <0: not parsed yet */
+    unsigned char query_slots[CRW_REQUEST_QUERY_SLOTS];
+    CRW_RequestBody body;
+    CRW_SpillFile *spills;  /* removed with the request */
+    CRW_RouteArgs args;
     /* shortcut & goodies */
     int is_xhr;
+    int no_wait;            /* served by an event loop: must not block */
 };
 
+#ifdef CRW_HAVE_THREAD_CACHE
+static CRW_THREAD_LOCAL CRW_Request *CRW_RequestPool = NULL;
+static CRW_THREAD_LOCAL int CRW_RequestPooled = 0;
+#endif
+
+/* the headers and the args tables are not cleared:
+   the counts tell what is valid in there. */
+static void CRW_request_init(CRW_Request *req, CRW_Arena *arena)
+{
+    req->arena = arena;
+    req->next = NULL;
+    req->method = CRW_REQUEST_METHOD_UNKNOWN;
+    req->URI = NULL;
+    req->query_string = NULL;
+    req->num_headers = 0;
+    memset(req->header_slots, 0, sizeof(req->header_slots));
+    memset(req->known_headers, 0, sizeof(req->known_headers));
+    req->num_query_params = -1;
+    memset(&req->body, 0, sizeof(req->body));
+    req->spills = NULL;
+    req->args.num = 0;
+    req->args.data = NULL;
+    req->args.arena = arena;
+    req->is_xhr = 0;
+    req->no_wait = 0;
+    return;
+}
+
 CRW_PRIVATE
 CRW_Request *CRW_request_new(CRW_Instance *inst)
 {
     CRW_Request *req = NULL;
     if (inst) {
-        req = calloc(1, sizeof(CRW_Request));
+        CRW_Arena *arena = CRW_arena_get();
+        if (arena) {
+#ifdef CRW_HAVE_THREAD_CACHE
+            if (CRW_RequestPool) {
+                req = CRW_RequestPool;
+                CRW_RequestPool = req->next;
+                CRW_RequestPooled--;
+            }
+#endif
+            if (!req) {
+                req = malloc(sizeof(CRW_Request));
+            }
+            if (req) {
+                CRW_request_init(req, arena);
+            } else {
+                CRW_arena_put(arena);
+            }
+        }
     }
     return req;
 }
@@ -263,7 +619,65 @@ CRW_Request *CRW_request_new(CRW_Instance *inst)
 CRW_PRIVATE
 void CRW_request_del(CRW_Request *req)
 {
-    free(req);
+    if (req) {
+        CRW_SpillFile *spill = NULL;
+        for (spill = req->spills; spill; spill = spill->next) {
+            unlink(spill->path); /* unless the handler moved it */
+        }
+        CRW_route_args_cleanup(&req->args);
+        CRW_arena_put(req->arena);
+#ifdef CRW_HAVE_THREAD_CACHE
+        if (CRW_RequestPooled < CRW_POOL_MAX) {
+            req->next = CRW_RequestPool;
+            CRW_RequestPool = req;
+            CRW_RequestPooled++;
+            req = NULL;
+        }
+#endif
+        free(req);
+    }
+}
+
+static void CRW_request_pool_flush(void)
+{
+#ifdef CRW_HAVE_THREAD_CACHE
+    while (CRW_RequestPool) {
+        CRW_Request *req = CRW_RequestPool;
+        CRW_RequestPool = req->next;
+        free(req);
+    }
+    CRW_RequestPooled = 0;
+#endif
+}
+
+void *CRW_request_alloc(const CRW_Request *req, size_t size)
+{
+    void *ptr = NULL;
+    if (req) {
+        ptr = CRW_arena_alloc(req->arena, size);
+    }
+    return ptr;
+}
+
+CRW_PRIVATE
+CRW_RequestMethod CRW_request_method_from_str(const char *method)
+{
+    CRW_RequestMethod meth = CRW_REQUEST_METHOD_UNKNOWN;
+    /* FIXME what about a LUT? */
+    if (!method) {
+        meth = CRW_REQUEST_METHOD_UNKNOWN;
+    } else if (!strcmp(method, "GET")) {
+        meth = CRW_REQUEST_METHOD_GET;
+    } else if (!strcmp(method, "HEAD")) {
+        meth = CRW_REQUEST_METHOD_HEAD;
+    } else if (!strcmp(method, "POST")) {
+        meth = CRW_REQUEST_METHOD_POST;
+    } else if (!strcmp(method, "PUT")) {
+        meth = CRW_REQUEST_METHOD_PUT;
+    } else if (!strcmp(method, "DELETE")) {
+        meth = CRW_REQUEST_METHOD_DELETE;
+    }
+    return meth;
 }
 
 CRW_RequestMethod CRW_request_get_method(const CRW_Request *req)
@@ -285,11 +699,124 @@ int CRW_request_is_xhr(const CRW_Request *req)
 }
 
 
+static const struct {
+    const char *name;
+    size_t len;
+} CRW_KnownHeaderNames[CRW_HDR_COUNT] = {
+    { "Host",                4 },
+    { "Connection",         10 },
+    { "Content-Length",     14 },
+    { "Content-Type",       12 },
+    { "Transfer-Encoding",  17 },
+    { "Accept",              6 },
+    { "Accept-Encoding",    15 },
+    { "Cookie",              6 },
+    { "If-None-Match",      13 },
+    { "If-Modified-Since",  17 },
+    { "User-Agent",         10 },
+    { "Authorization",      13 },
+    { "Range",               5 },
+    { "X-Requested-With",   16 }
+};
+
+/* FNV-1a on the case-folded name */
+static unsigned CRW_header_hash(const char *name, size_t *len)
+{
+    unsigned hash = 2166136261U;
+    const char *pc = name;
+    for (pc = name; *pc; pc++) {
+        unsigned char c = *pc;
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        hash = (hash ^ c) * 16777619U;
+    }
+    *len = pc - name;
+    return hash;
+}
+
+static CRW_KnownHeader CRW_header_known_id(const char *name, size_t len)
+{
+    int j = 0;
+    for (j = 0; j < CRW_HDR_COUNT; j++) {
+        if (CRW_KnownHeaderNames[j].len == len
+         && !strcasecmp(CRW_KnownHeaderNames[j].name, name)) {
+            return (CRW_KnownHeader)j;
+        }
+    }
+    return CRW_HDR_UNKNOWN;
+}
+
+/* the index of the first header with that name, or -1 */
+static int CRW_request_find_header(const CRW_Request *req,
+                                   const char *name, unsigned hash)
+{
+    unsigned slot = hash & (CRW_REQUEST_HEADER_SLOTS - 1);
+    while (req->header_slots[slot]) {
+        int idx = req->header_slots[slot] - 1;
+        if (req->header_hashes[idx] == hash
+         && !strcasecmp(req->headers[idx].key, name)) {
+            return idx;
+        }
+        slot = (slot + 1) & (CRW_REQUEST_HEADER_SLOTS - 1);
+    }
+    return -1;
+}
+
+/* for the adapters: the strings must outlive the request.
+   Like mongoose, the exceeding headers are silently dropped.
+   Returns the id of the header, known or not. */
+static CRW_KnownHeader CRW_request_add_header(CRW_Request *req,
+                                              const char *name,
+                                              const char *value)
+{
+    size_t len = 0;
+    unsigned hash = CRW_header_hash(name, &len);
+    CRW_KnownHeader id = CRW_header_known_id(name, len);
+    if (req->num_headers < CRW_MAX_REQUEST_HEADERS) {
+        int idx = req->num_headers++;
+        req->headers[idx].key = name;
+        req->headers[idx].value = value;
+        req->header_hashes[idx] = hash;
+        if (CRW_request_find_header(req, name, hash) < 0) {
+            /* the first one wins: no need to insert the others */
+            unsigned slot = hash & (CRW_REQUEST_HEADER_SLOTS - 1);
+            while (req->header_slots[slot]) {
+                slot = (slot + 1) & (CRW_REQUEST_HEADER_SLOTS - 1);
+            }
+            req->header_slots[slot] = idx + 1;
+        }
+        if (id != CRW_HDR_UNKNOWN && !req->known_headers[id]) {
+            req->known_headers[id] = idx + 1;
+        }
+    }
+    if (id == CRW_HDR_X_REQUESTED_WITH) {
+        req->is_xhr = 1;
+    }
+    return id;
+}
+
 const char *CRW_request_get_header_value(const CRW_Request *req, const char *header)
 {
     const char *value = NULL;
     if (req && header) {
-        value = CRW_kvpair_get_by_ikey(req->headers, req->num_headers, header);
+        size_t len = 0;
+        int idx = CRW_request_find_header(req, header,
+                                          CRW_header_hash(header, &len));
+        if (idx >= 0) {
+            value = req->headers[idx].value;
+        }
+    }
+    return value;
+}
+
+const char *CRW_request_get_known_header(const CRW_Request *req,
+                                         CRW_KnownHeader header)
+{
+    const char *value = NULL;
+    if (req && header >= 0 && header < CRW_HDR_COUNT
+     && req->known_headers[header]) {
+        value = req->headers[req->known_headers[header] - 1].value;
     }
     return value;
 }
@@ -319,948 +846,6859 @@ int CRW_request_get_header_by_idx(const CRW_Request *req, int idx,
     return err;
 }
 
+const char *CRW_request_get_query_string(const CRW_Request *req)
+{
+    const char *query = NULL;
+    if (req) {
+        query = req->query_string;
+    }
+    return query;
+}
 
-/*** response ************************************************************/
+static int CRW_http_hexval(int c)
+{
+    int val = -1;
+    if (c >= '0' && c <= '9') {
+        val = c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+        val = c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+        val = c - 'A' + 10;
+    }
+    return val;
+}
 
-enum {
-    CRW_RESPONSE_DEFAULT_BODY_LEN = 1024
-};
+/* one decoded char of an urlencoded string, advancing *pos */
+static int CRW_query_next_char(const char *src, size_t len, size_t *pos)
+{
+    int c = (unsigned char)src[*pos], hi = -1, lo = -1;
+    if (c == '+') {
+        c = ' ';
+    } else if (c == '%' && *pos + 2 < len
+            && (hi = CRW_http_hexval(src[*pos + 1])) >= 0
+            && (lo = CRW_http_hexval(src[*pos + 2])) >= 0) {
+        c = (hi << 4) | lo;
+        *pos += 2;
+    }
+    *pos += 1;
+    return c;
+}
 
-struct crwresponse_ {
-    int status_code;
-    list headers;
-    stringbuilder *body;
-};
+static unsigned CRW_query_hash(const char *src, size_t len, int encoded)
+{
+    unsigned hash = 2166136261U;
+    size_t pos = 0;
+    while (pos < len) {
+        int c = (encoded) ?CRW_query_next_char(src, len, &pos)
+                          :(unsigned char)src[pos++];
+        hash = (hash ^ c) * 16777619U;
+    }
+    return hash;
+}
 
-CRW_Response *CRW_response_new(CRW_Instance *inst)
+/* the encoded src against the plain name */
+static int CRW_query_name_equals(const char *src, size_t len,
+                                 const char *name)
 {
-    CRW_Response *res = NULL;
-    res = calloc(1, sizeof(CRW_Response));
-    if (res) {
-        res->status_code = 200; /* FIXME */
-        list_init(&res->headers, free);
-        res->body = sb_new_with_size(CRW_RESPONSE_DEFAULT_BODY_LEN);
-        if (!res->body) {
-            free(res);
-            res = NULL;
+    size_t pos = 0;
+    while (pos < len && *name) {
+        if (CRW_query_next_char(src, len, &pos) != (unsigned char)*name++) {
+            return 0;
         }
     }
-    return res;
+    return (pos == len && !*name);
 }
 
-void CRW_response_del(CRW_Response *res)
+/* returns the decoded length: dst must hold len + 1 bytes */
+static size_t CRW_query_decode(char *dst, const char *src, size_t len)
 {
-    if (res) {
-        list_destroy(&res->headers);
-        sb_destroy(res->body, 1);
+    size_t pos = 0, out = 0;
+    while (pos < len) {
+        dst[out++] = (char)CRW_query_next_char(src, len, &pos);
     }
-    free(res);
+    dst[out] = '\0';
+    return out;
 }
 
-int CRW_response_add_header(CRW_Response *res,
-                            const char *name, const char *value)
+/* one pass, no decoding, no copies: just the views and the index.
+   Like the headers, the exceeding parameters are silently dropped. */
+static void CRW_request_parse_query(CRW_Request *req)
 {
-    int err = -1;
-    if (res && name) {
-        char hdrbuf[CRW_RESPONSE_DEFAULT_BODY_LEN] = { '\0' };
-        char *pc = NULL;
-        snprintf(hdrbuf, sizeof(hdrbuf), "%s%s%s\r\n",
-                 name, (value) ?":" :"", value);
-        pc = strdup(hdrbuf);
-        if (pc) {
-            list_element *tail = list_tail(&(res->headers));
-            err = list_insert_next(&res->headers, tail, pc);
-        } else {
-            err = 1;
+    const char *pc = req->query_string;
+    req->num_query_params = 0;
+    memset(req->query_slots, 0, sizeof(req->query_slots));
+    while (pc && *pc && req->num_query_params < CRW_MAX_QUERY_PARAMS) {
+        size_t len = strcspn(pc, "&;");
+        const char *eq = memchr(pc, '=', len);
+        if (len > 0) {
+            int idx = req->num_query_params++;
+            CRW_QueryParam *QP = &req->query_params[idx];
+            unsigned slot = 0;
+            QP->name = pc;
+            QP->name_len = (eq) ?(size_t)(eq - pc) :len;
+            QP->value = (eq) ?eq + 1 :pc + len;
+            QP->value_len = (eq) ?len - QP->name_len - 1 :0;
+            QP->hash = CRW_query_hash(QP->name, QP->name_len, 1);
+            QP->decoded = NULL;
+            /* a repeated name comes later in the probe sequence:
+               the first one wins, as with the headers */
+            slot = QP->hash & (CRW_REQUEST_QUERY_SLOTS - 1);
+            while (req->query_slots[slot]) {
+                slot = (slot + 1) & (CRW_REQUEST_QUERY_SLOTS - 1);
+            }
+            req->query_slots[slot] = idx + 1;
+        }
+        pc += len;
+        if (*pc) {
+            pc++;
         }
     }
-    return err;
+    return;
 }
 
-int CRW_response_add_body(CRW_Response *res, const char *chunk)
+/* the accessors are const for the caller, not for the cache */
+static CRW_Request *CRW_request_query(const CRW_Request *req)
 {
-    int err = -1;
-    if (res && chunk) {
-        sb_append_str(res->body, chunk);
-        err = 0;
+    CRW_Request *mreq = (CRW_Request *)req;
+    if (mreq->num_query_params < 0) {
+        CRW_request_parse_query(mreq);
     }
-    return err;
+    return mreq;
 }
 
+/* for the adapters: the body is in memory, and outlives the request */
+CRW_PRIVATE
+void CRW_request_set_body_buffer(CRW_Request *req,
+                                 const char *data, long length)
+{
+    req->body.length = length;
+    req->body.consumed = 0;
+    req->body.data = data;
+    req->body.read = NULL;
+    req->body.source = NULL;
+}
 
-/*** route ***************************************************************/
-
-struct crwrouteargs_ {
-    CRW_KVPair pairs[CRW_MAX_ROUTE_ARGS];
-    int num;
-};
+/* for the event loop adapters */
+CRW_PRIVATE
+void CRW_request_set_no_wait(CRW_Request *req)
+{
+    req->no_wait = 1;
+}
 
-int CRW_route_args_count(const CRW_RouteArgs *args)
+/* for the adapters: the body is still on the connection */
+static void CRW_request_set_body_source(CRW_Request *req, long length,
+                                        CRW_BodyRead read, void *source)
 {
-    int num = -1;
-    if (args) {
-        num = args->num;
-    }
-    return num;
+    req->body.length = length;
+    req->body.consumed = 0;
+    req->body.data = NULL;
+    req->body.read = read;
+    req->body.source = source;
 }
 
-const char *CRW_route_args_get_by_idx(const CRW_RouteArgs *args, int idx)
+static const char *CRW_request_keep_str(CRW_Request *req, const char *str,
+                                        int *err)
 {
-    const char *value = NULL;
-    if (args) {
-        return CRW_kvpair_get_by_idx(args->pairs, args->num, idx);
+    const char *dup = NULL;
+    if (str && !*err) {
+        dup = CRW_arena_strdup(req->arena, str);
+        *err = (dup) ?0 :-1;
     }
-    return value;
+    return dup;
 }
 
-const char *CRW_route_args_get_by_tag(const CRW_RouteArgs *args,
-                                      const char *tag)
+/* for the deferred responses: the request outlives the buffer of the
+   connection, or the connection for the body still on it. What points
+   there is copied to the arena (the native servers parse a copy of
+   the head already, but mongoose does not). */
+static int CRW_request_detach(CRW_Request *req)
 {
-    const char *value = NULL;
-    if (args) {
-        return CRW_kvpair_get_by_key(args->pairs, args->num, tag);
+    CRW_RequestBody *body = &req->body;
+    long consumed = body->consumed;
+    int j = 0, err = 0;
+    req->URI = CRW_request_keep_str(req, req->URI, &err);
+    req->query_string = CRW_request_keep_str(req, req->query_string, &err);
+    req->num_query_params = -1; /* the views point to the old one */
+    for (j = 0; j < req->num_headers; j++) {
+        CRW_KVPair *header = &req->headers[j];
+        header->key = CRW_request_keep_str(req, header->key, &err);
+        header->value = CRW_request_keep_str(req, header->value, &err);
     }
-    return value;
+    if (!err && body->length > consumed) {
+        /* at the same offsets: the cursor stays where it is */
+        char *data = CRW_arena_alloc(req->arena, body->length);
+        if (!data) {
+            err = -1;
+        } else if (body->data) {
+            memcpy(data + consumed, body->data + consumed,
+                   body->length - consumed);
+        } else {
+            while (!err && body->consumed < body->length) {
+                if (CRW_request_read_body(req, data + body->consumed,
+                                          body->length - body->consumed)
+                                                                    <= 0) {
+                    err = -1; /* the client went away */
+                }
+            }
+        }
+        if (!err) {
+            CRW_request_set_body_buffer(req, data, body->length);
+            body->consumed = consumed;
+        }
+    }
+    return err;
 }
 
-#define SUBEXPR_STR "([[:print:]]*)"
-#define SUBEXPR_LEN 14
-
-typedef struct crwroute_ CRW_Route;
-struct crwroute_ {
-    regex_t RE;
-    int compiled;
-    const char *regex_user;
-    char *regex_crane;
-    char *regex_tags;
-    const char *tags[CRW_MAX_ROUTE_ARGS];
-    int tag_processed;
-    int tag_found;
-    int tag_malformed;
-    regmatch_t matches[CRW_MAX_ROUTE_ARGS];
-    int match_num;
-    char *data;
-};
-
+long CRW_request_get_content_length(const CRW_Request *req)
+{
+    long length = -1;
+    if (req) {
+        length = req->body.length;
+    }
+    return length;
+}
 
-#ifdef CRW_DEBUG
+int CRW_request_read_body(const CRW_Request *req, void *buf, size_t len)
+{
+    int ret = -1;
+    if (req && buf) {
+        /* the accessors are const for the caller, not for the cursor */
+        CRW_RequestBody *body = (CRW_RequestBody *)&req->body;
+        long left = body->length - body->consumed;
+        if (len > (size_t)left) {
+            len = left;
+        }
+        if (len > INT_MAX) {
+            len = INT_MAX;
+        }
+        if (len == 0) {
+            ret = 0;
+        } else if (body->data) {
+            memcpy(buf, body->data + body->consumed, len);
+            ret = (int)len;
+        } else if (body->read) {
+            ret = body->read(body->source, buf, len);
+        }
+        if (ret > 0) {
+            body->consumed += ret;
+        }
+    }
+    return ret;
+}
 
-CRW_PRIVATE
-CRW_Route *CRW_route_new(void)
+long CRW_request_stream_body(const CRW_Request *req,
+                             CRW_BodyChunkHandler handler, void *userdata)
 {
-    return calloc(1, sizeof(CRW_Route));
+    long total = -1;
+    if (req && handler) {
+        CRW_RequestBody *body = (CRW_RequestBody *)&req->body;
+        int stop = 0;
+        total = 0;
+        if (body->data) {
+            /* straight from where it is */
+            while (!stop && body->consumed < body->length) {
+                long len = body->length - body->consumed;
+                if (len > CRW_REQUEST_BODY_CHUNK) {
+                    len = CRW_REQUEST_BODY_CHUNK;
+                }
+                body->consumed += len;
+                total += len;
+                stop = handler(userdata, body->data + body->consumed - len,
+                               len);
+            }
+        } else {
+            char chunk[CRW_REQUEST_BODY_CHUNK];
+            while (!stop && total >= 0) {
+                int len = CRW_request_read_body(req, chunk, sizeof(chunk));
+                if (len > 0) {
+                    total += len;
+                    stop = handler(userdata, chunk, len);
+                } else if (len < 0 || body->consumed < body->length) {
+                    total = -1; /* the client went away */
+                } else {
+                    stop = 1;
+                }
+            }
+        }
+    }
+    return total;
 }
 
-CRW_PRIVATE
-void CRW_route_del(CRW_Route *route)
+int CRW_request_count_query_params(const CRW_Request *req)
 {
-    free(route);
+    int num = -1;
+    if (req) {
+        num = CRW_request_query(req)->num_query_params;
+    }
+    return num;
 }
 
-CRW_PRIVATE
-int CRW_route_tag_count(CRW_Route *route)
+int CRW_request_get_query_param_by_idx(const CRW_Request *req, int idx,
+                                       const char **name, size_t *name_len,
+                                       const char **value, size_t *value_len)
 {
-    return route->tag_processed;
+    int err = -1;
+    if (req && name && name_len && value && value_len) {
+        CRW_Request *mreq = CRW_request_query(req);
+        if (idx < 0 || idx >= mreq->num_query_params) {
+            err = 1;
+        } else {
+            const CRW_QueryParam *QP = &mreq->query_params[idx];
+            *name = QP->name;
+            *name_len = QP->name_len;
+            *value = QP->value;
+            *value_len = QP->value_len;
+            err = 0;
+        }
+    }
+    return err;
 }
 
-CRW_PRIVATE
-int CRW_route_tag_found(CRW_Route *route)
+const char *CRW_request_get_query_param(const CRW_Request *req,
+                                        const char *name)
 {
-    return route->tag_found;
+    const char *value = NULL;
+    if (req && name) {
+        CRW_Request *mreq = CRW_request_query(req);
+        unsigned hash = CRW_query_hash(name, strlen(name), 0);
+        unsigned slot = hash & (CRW_REQUEST_QUERY_SLOTS - 1);
+        while (!value && mreq->query_slots[slot]) {
+            CRW_QueryParam *QP = &mreq->query_params[mreq->query_slots[slot] - 1];
+            if (QP->hash == hash
+             && CRW_query_name_equals(QP->name, QP->name_len, name)) {
+                if (!QP->decoded) {
+                    char *buf = CRW_arena_alloc(mreq->arena,
+                                                QP->value_len + 1);
+                    if (buf) {
+                        CRW_query_decode(buf, QP->value, QP->value_len);
+                    }
+                    QP->decoded = buf;
+                }
+                value = QP->decoded;
+                break;
+            }
+            slot = (slot + 1) & (CRW_REQUEST_QUERY_SLOTS - 1);
+        }
+    }
+    return value;
 }
 
-CRW_PRIVATE
-int CRW_route_tag_malformed(CRW_Route *route)
+
+/*** multipart ***********************************************************/
+
+/* a streaming multipart/form-data parser (RFC 2046, RFC 7578): the body
+   is scanned for the delimiter as it comes, chunk by chunk, so nothing
+   but the part headers is ever buffered on the parser side. */
+
+enum {
+    CRW_MULTIPART_MAX_BOUNDARY = 70,  /* RFC 2046 */
+    CRW_MULTIPART_HEADERS_MAX = 4096, /* of each part */
+    CRW_MULTIPART_MIN_BUFFER = 1024
+};
+
+typedef enum {
+    CRW_MULTIPART_STATE_PREAMBLE = 0,
+    CRW_MULTIPART_STATE_BOUNDARY,     /* after a delimiter */
+    CRW_MULTIPART_STATE_BOUNDARY_LF,
+    CRW_MULTIPART_STATE_FINAL_DASH,
+    CRW_MULTIPART_STATE_HEADERS,
+    CRW_MULTIPART_STATE_DATA,
+    CRW_MULTIPART_STATE_EPILOGUE,
+    CRW_MULTIPART_STATE_ERROR
+} CRW_MultipartState;
+
+typedef struct crwmultipart_ CRW_Multipart;
+struct crwmultipart_ {
+    CRW_Request *req;
+    CRW_MultipartHandler handler;
+    void *userdata;
+    long spill_size;
+    CRW_MultipartState state;
+    int stop;
+    /* "\r\n--" boundary */
+    char delim[4 + CRW_MULTIPART_MAX_BOUNDARY];
+    size_t delim_len;
+    size_t match;           /* delimiter bytes held back so far */
+    char head[CRW_MULTIPART_HEADERS_MAX + 1];
+    size_t head_len;
+    CRW_MultipartPart part;
+    /* the part being collected */
+    char *buf;
+    size_t buf_size;
+    int fd;
+};
+
+/* the value of the `param' parameter of an header value
+   (e.g. the boundary of a Content-Type), unquoted, into the arena */
+static char *CRW_multipart_get_param(CRW_Arena *arena, const char *value,
+                                     const char *param)
 {
-    return route->tag_malformed;
+    size_t plen = strlen(param);
+    const char *pc = strchr(value, ';');
+    while (pc) {
+        pc++;
+        while (*pc == ' ' || *pc == '\t') {
+            pc++;
+        }
+        if (!strncasecmp(pc, param, plen) && pc[plen] == '=') {
+            char *res = NULL, *out = NULL;
+            pc += plen + 1;
+            res = CRW_arena_alloc(arena, strlen(pc) + 1);
+            if (res) {
+                out = res;
+                if (*pc == '"') {
+                    for (pc++; *pc && *pc != '"'; pc++) {
+                        if (*pc == '\\' && pc[1]) {
+                            pc++;
+                        }
+                        *out++ = *pc;
+                    }
+                } else {
+                    while (*pc && *pc != ';' && *pc != ' ' && *pc != '\t') {
+                        *out++ = *pc++;
+                    }
+                }
+                *out = '\0';
+            }
+            return res;
+        }
+        pc = strchr(pc, ';');
+    }
+    return NULL;
 }
 
-CRW_PRIVATE
-const char *CRW_route_regex_user(CRW_Route *route)
+static int CRW_multipart_setup(CRW_Multipart *MP, CRW_Request *req)
 {
-    return route->regex_user;
+    int err = -1;
+    const char *ctype = CRW_request_get_known_header(req,
+                                                     CRW_HDR_CONTENT_TYPE);
+    if (ctype && !strncasecmp(ctype, "multipart/", 10)) {
+        const char *boundary = CRW_multipart_get_param(req->arena, ctype,
+                                                       "boundary");
+        size_t len = (boundary) ?strlen(boundary) :0;
+        /* no CR in there: a partial match can't restart inside it */
+        if (len > 0 && len <= CRW_MULTIPART_MAX_BOUNDARY
+         && !strpbrk(boundary, "\r\n")) {
+            memcpy(MP->delim, "\r\n--", 4);
+            memcpy(MP->delim + 4, boundary, len);
+            MP->delim_len = 4 + len;
+            /* the first delimiter may come without the leading CRLF */
+            MP->match = 2;
+            MP->req = req;
+            MP->fd = -1;
+            MP->part.index = -1;
+            err = 0;
+        }
+    }
+    return err;
 }
 
-CRW_PRIVATE
-const char *CRW_route_regex_crane(CRW_Route *route)
+static int CRW_multipart_spill(CRW_Multipart *MP)
 {
-    return route->regex_crane;
+    int err = -1;
+    const char *tmpdir = getenv("TMPDIR");
+    size_t len = 0;
+    char *path = NULL;
+    if (!tmpdir || !*tmpdir) {
+        tmpdir = "/tmp";
+    }
+    len = strlen(tmpdir) + sizeof("/craneweb-XXXXXX");
+    path = CRW_arena_alloc(MP->req->arena, len);
+    if (path) {
+        snprintf(path, len, "%s/craneweb-XXXXXX", tmpdir);
+        MP->fd = mkstemp(path);
+    }
+    if (MP->fd >= 0) {
+        CRW_SpillFile *spill = CRW_arena_alloc(MP->req->arena,
+                                               sizeof(CRW_SpillFile));
+        if (spill) {
+            spill->path = path;
+            spill->next = MP->req->spills;
+            MP->req->spills = spill;
+            MP->part.path = path;
+            err = 0;
+        } else {
+            close(MP->fd);
+            MP->fd = -1;
+            unlink(path);
+        }
+    }
+    return err;
 }
 
-CRW_PRIVATE
-int CRW_route_regex_dump(CRW_Route *route, const char *msg)
+static int CRW_multipart_write(int fd, const char *data, size_t len)
 {
-    if (!msg) {
-        msg = "dump";
+    while (len > 0) {
+        ssize_t ret = write(fd, data, len);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        data += ret;
+        len -= ret;
     }
-    fprintf(stderr, "%s  user = [%s]\n", msg, CRW_route_regex_user(route));
-    fprintf(stderr, "%s crane = [%s]\n", msg, CRW_route_regex_crane(route));
     return 0;
 }
 
-
-CRW_PRIVATE
-const char *CRW_route_tag_get_by_idx(CRW_Route *route, int idx)
+/* keep a data piece of the current part, in memory up to spill_size */
+static int CRW_multipart_collect(CRW_Multipart *MP,
+                                 const char *data, size_t len)
 {
-    return route->tags[idx];
+    int err = 0;
+    size_t used = MP->part.size - len; /* already counted */
+    if (MP->fd < 0 && MP->part.size <= MP->spill_size) {
+        if ((size_t)MP->part.size + 1 > MP->buf_size) {
+            /* the old buffer goes away with the arena */
+            size_t size = (MP->buf_size) ?MP->buf_size :CRW_MULTIPART_MIN_BUFFER;
+            char *buf = NULL;
+            while (size < (size_t)MP->part.size + 1) {
+                size *= 2;
+            }
+            if (size > (size_t)MP->spill_size + 1) {
+                size = MP->spill_size + 1;
+            }
+            buf = CRW_arena_alloc(MP->req->arena, size);
+            if (buf && used) {
+                memcpy(buf, MP->buf, used);
+            }
+            MP->buf = buf;
+            MP->buf_size = size;
+        }
+        if (MP->buf) {
+            memcpy(MP->buf + used, data, len);
+        } else {
+            err = -1;
+        }
+    } else {
+        if (MP->fd < 0) {
+            err = CRW_multipart_spill(MP);
+            if (!err && used) {
+                err = CRW_multipart_write(MP->fd, MP->buf, used);
+            }
+        }
+        if (!err) {
+            err = CRW_multipart_write(MP->fd, data, len);
+        }
+    }
+    return err;
 }
 
-CRW_PRIVATE
-int CRW_route_tag_dump(CRW_Route *route, const char *msg)
+static void CRW_multipart_emit(CRW_Multipart *MP, CRW_MultipartEvent event,
+                               const char *data, size_t len)
 {
-    int j;
-    if (!msg) {
-        msg = "dump";
+    if (MP->stop) {
+        return;
     }
-    for (j= 0; j < route->tag_processed; j++) {
-        fprintf(stderr, "%s tag[%i]= [%s]\n",
-                msg, j, route->tags[j]);
+    if (event == CRW_MULTIPART_PART_DATA) {
+        if (len == 0 || MP->state != CRW_MULTIPART_STATE_DATA) {
+            return; /* the preamble is not worth a look */
+        }
+        MP->part.size += len;
+        if (MP->spill_size >= 0) {
+            if (CRW_multipart_collect(MP, data, len)) {
+                MP->state = CRW_MULTIPART_STATE_ERROR;
+            }
+            return;
+        }
+    } else if (event == CRW_MULTIPART_PART_END && MP->spill_size >= 0) {
+        if (MP->fd >= 0) {
+            if (close(MP->fd)) {
+                MP->state = CRW_MULTIPART_STATE_ERROR;
+                return;
+            }
+            MP->fd = -1;
+        } else {
+            if (!MP->buf) {
+                MP->buf = CRW_arena_alloc(MP->req->arena, 1);
+                if (!MP->buf) {
+                    MP->state = CRW_MULTIPART_STATE_ERROR;
+                    return;
+                }
+            }
+            MP->buf[MP->part.size] = '\0';
+            MP->part.data = MP->buf;
+        }
     }
-    return 0;
+    MP->stop = MP->handler(MP->userdata, event, &MP->part, data, len);
 }
 
-CRW_PRIVATE
-int CRW_route_all_empty_tags(CRW_Route *route)
+static void CRW_multipart_begin_part(CRW_Multipart *MP)
 {
-    int j;
-    for (j= 0; j < CRW_MAX_ROUTE_ARGS; j++) {
-        if (route->tags[j]) {
-            fprintf(stderr, "UNEXPECTED tag[%i]= [%s]\n",
-                    j, route->tags[j]);
-            return 0;
+    CRW_Arena *arena = MP->req->arena;
+    char *line = MP->head;
+    int index = MP->part.index + 1;
+
+    memset(&MP->part, 0, sizeof(MP->part));
+    MP->part.index = index;
+    MP->buf = NULL;
+    MP->buf_size = 0;
+
+    MP->head[MP->head_len] = '\0';
+    while (line && *line) {
+        char *end = strstr(line, "\r\n");
+        char *value = strchr(line, ':');
+        if (end) {
+            *end = '\0';
+        }
+        if (value) {
+            *value++ = '\0';
+            while (*value == ' ' || *value == '\t') {
+                value++;
+            }
+            if (!strcasecmp(line, "Content-Disposition")) {
+                MP->part.name = CRW_multipart_get_param(arena, value, "name");
+                MP->part.filename = CRW_multipart_get_param(arena, value,
+                                                            "filename");
+            } else if (!strcasecmp(line, "Content-Type")) {
+                MP->part.content_type = CRW_arena_strdup(arena, value);
+            }
         }
+        line = (end) ?end + 2 :NULL;
     }
-    return 1;
+    MP->state = CRW_MULTIPART_STATE_DATA;
+    CRW_multipart_emit(MP, CRW_MULTIPART_PART_BEGIN, NULL, 0);
 }
 
-CRW_PRIVATE
-int CRW_route_set_tags(CRW_Route *route, const char *tags[], int num)
+/* scans for the delimiter, hands over what comes before it.
+   The bytes which may be the start of the delimiter are held back
+   and, on a mismatch, handed over from the delimiter itself. */
+static size_t CRW_multipart_scan_data(CRW_Multipart *MP,
+                                      const char *data, size_t len)
 {
-    int j;
-    for (j = 0; j < num; j++) {
-        route->tags[j] = tags[j];
-        route->tag_processed++;
-        route->tag_found++;
+    size_t pos = 0, run = 0;
+    while (pos < len) {
+        if (data[pos] == MP->delim[MP->match]) {
+            if (MP->match == 0) {
+                CRW_multipart_emit(MP, CRW_MULTIPART_PART_DATA,
+                                   data + run, pos - run);
+            }
+            MP->match++;
+            pos++;
+            run = pos;
+            if (MP->match == MP->delim_len) {
+                MP->match = 0;
+                if (MP->state == CRW_MULTIPART_STATE_DATA) {
+                    CRW_multipart_emit(MP, CRW_MULTIPART_PART_END, NULL, 0);
+                }
+                if (MP->state != CRW_MULTIPART_STATE_ERROR) {
+                    MP->state = CRW_MULTIPART_STATE_BOUNDARY;
+                }
+                return pos;
+            }
+        } else if (MP->match > 0) {
+            /* false alarm, check this byte again */
+            CRW_multipart_emit(MP, CRW_MULTIPART_PART_DATA,
+                               MP->delim, MP->match);
+            MP->match = 0;
+        } else {
+            const char *cr = memchr(data + pos, MP->delim[0], len - pos);
+            pos = (cr) ?(size_t)(cr - data) :len;
+        }
     }
-    return 0;
+    CRW_multipart_emit(MP, CRW_MULTIPART_PART_DATA, data + run, pos - run);
+    return pos;
 }
 
-#endif /* CRW_DEBUG */
-
+static size_t CRW_multipart_scan_headers(CRW_Multipart *MP,
+                                         const char *data, size_t len)
+{
+    size_t pos = 0;
+    while (pos < len) {
+        if (MP->head_len == CRW_MULTIPART_HEADERS_MAX) {
+            MP->state = CRW_MULTIPART_STATE_ERROR;
+            break;
+        }
+        MP->head[MP->head_len++] = data[pos++];
+        if ((MP->head_len == 2 && !memcmp(MP->head, "\r\n", 2))
+         || (MP->head_len >= 4
+          && !memcmp(MP->head + MP->head_len - 4, "\r\n\r\n", 4))) {
+            CRW_multipart_begin_part(MP);
+            break;
+        }
+    }
+    return pos;
+}
 
-CRW_PRIVATE
-int CRW_route_cleanup(CRW_Route *route)
+static int CRW_multipart_scan(void *userdata, const char *data, size_t len)
 {
-    int err = -1;
-    if (route) {
-        free((char *)route->regex_user); /* XXX */
-        free(route->regex_tags);
-        free(route->regex_crane);
-        if (route->compiled) {
-            regfree(&route->RE);
+    CRW_Multipart *MP = userdata;
+    size_t pos = 0;
+    while (pos < len && !MP->stop) {
+        char c = data[pos];
+        switch (MP->state) {
+        case CRW_MULTIPART_STATE_PREAMBLE:
+        case CRW_MULTIPART_STATE_DATA:
+            pos += CRW_multipart_scan_data(MP, data + pos, len - pos);
+            break;
+        case CRW_MULTIPART_STATE_HEADERS:
+            pos += CRW_multipart_scan_headers(MP, data + pos, len - pos);
+            break;
+        case CRW_MULTIPART_STATE_BOUNDARY:
+            pos++;
+            if (c == '-') {
+                MP->state = CRW_MULTIPART_STATE_FINAL_DASH;
+            } else if (c == '\r') {
+                MP->state = CRW_MULTIPART_STATE_BOUNDARY_LF;
+            } else if (c != ' ' && c != '\t') { /* transport padding */
+                MP->state = CRW_MULTIPART_STATE_ERROR;
+            }
+            break;
+        case CRW_MULTIPART_STATE_BOUNDARY_LF:
+            pos++;
+            MP->head_len = 0;
+            MP->state = (c == '\n') ?CRW_MULTIPART_STATE_HEADERS
+                                    :CRW_MULTIPART_STATE_ERROR;
+            break;
+        case CRW_MULTIPART_STATE_FINAL_DASH:
+            pos++;
+            MP->state = (c == '-') ?CRW_MULTIPART_STATE_EPILOGUE
+                                   :CRW_MULTIPART_STATE_ERROR;
+            break;
+        case CRW_MULTIPART_STATE_EPILOGUE:
+            pos = len;
+            break;
+        case CRW_MULTIPART_STATE_ERROR:
+        default:
+            return 1;
         }
-        free(route);
     }
-    return err;
+    return (MP->stop || MP->state == CRW_MULTIPART_STATE_ERROR);
 }
 
-CRW_PRIVATE
-int CRW_route_sum_tag_len(CRW_Route *route)
+int CRW_request_read_multipart(const CRW_Request *req, long spill_size,
+                               CRW_MultipartHandler handler, void *userdata)
 {
-    int len = -1;
-    if (route) {
-        int j;
-        len = 0;
-        for (j = 0; j < route->tag_processed; j++) {
-            len += strlen(route->tags[j]) + 1;
-            /* the leading ':' */
+    int parts = -1;
+    if (req && handler) {
+        CRW_Multipart MP;
+        memset(&MP, 0, sizeof(MP));
+        MP.handler = handler;
+        MP.userdata = userdata;
+        MP.spill_size = spill_size;
+        if (CRW_multipart_setup(&MP, (CRW_Request *)req) == 0) {
+            long ret = CRW_request_stream_body(req, CRW_multipart_scan, &MP);
+            if (MP.fd >= 0) {
+                close(MP.fd); /* stopped or failed halfway */
+            }
+            if (ret >= 0 && (MP.stop
+                          || MP.state == CRW_MULTIPART_STATE_EPILOGUE)) {
+                parts = MP.part.index + 1;
+            }
         }
     }
-    return len;
+    return parts;
 }
 
 
-typedef struct crwroutescanner_ CRW_RouteScanner;
-struct crwroutescanner_ {
-    int tag_found;
-    int tag_processed;
-    int tag_malformed;
+/*** response ************************************************************/
 
-    const char *route_string;
+enum {
+    CRW_RESPONSE_DEFAULT_BODY_LEN = 1024,
+    CRW_RESPONSE_POOLED_BODY_LEN = 65536, /* larger ones are not kept */
+    CRW_RESPONSE_MIN_REFS = 4
+};
 
-    void *userdata;
+/* The body is made of the bytes copied in the body buffer, with
+   the attached (by reference) buffers spliced in at given positions.
+   The buffers are released together with the response. */
+typedef struct crwbodyref_ CRW_BodyRef;
+struct crwbodyref_ {
+    size_t at;              /* splice point in the copied bytes */
+    const char *data;
+    size_t len;
+    CRW_BodyRelease release;
+    void *release_data;
+};
 
-    int (*on_tag)(CRW_RouteScanner *RS,
-                  int idx, const char *tag, size_t len);
-    int (*on_char)(CRW_RouteScanner *RS,
-                   int idx, char c);
+/* already formatted, as it goes on the wire */
+typedef struct crwresponseheader_ CRW_ResponseHeader;
+struct crwresponseheader_ {
+    CRW_ResponseHeader *next;
+    size_t len;
+    char line[1];
 };
 
-CRW_PRIVATE
-int CRW_route_scan_string(CRW_RouteScanner *RS)
+/* the body buffer and the refs table stay with the (pooled)
+   response, the rest lives in the arena. */
+struct crwresponse_ {
+    CRW_Arena *arena;
+    CRW_Response *next;     /* in the thread pool */
+    int status_code;
+    CRW_ResponseHeader *headers;
+    CRW_ResponseHeader *last_header;
+    size_t headers_len;
+    char *body;             /* the copied bytes */
+    size_t body_pos;
+    size_t body_size;
+    CRW_BodyRef *refs;      /* sorted by splice point */
+    int num_refs;
+    int max_refs;
+    size_t body_len;        /* copied + referenced + file */
+    int file_fd;            /* the file at the end of the body, if any */
+    off_t file_off;
+    size_t file_len;
+    /* streaming: the body comes from there, after the head is sent */
+    CRW_ResponseProducer producer;
+    CRW_StreamRelease stream_release;
+    void *stream_data;
+    size_t compress_min_size;   /* from the instance, 0: never */
+    const char *cache_tag;      /* in the arena, NULL if none */
+    CRW_Pending *pending;       /* a placeholder: the response is deferred */
+};
+
+/* a contiguous piece of a response, as it goes on the wire */
+typedef struct crwbodypiece_ CRW_BodyPiece;
+struct crwbodypiece_ {
+    const char *data;
+    size_t len;
+};
+
+static void CRW_response_release_refs(CRW_Response *res)
 {
-    /* no nested tags are allowed, so this is quite straightforward */
-    int err = 0;
-    int outside_tag = 1;
-    const char *tag_begin = NULL;
-    const char *rt = RS->route_string;
-    size_t j = 0, len = strlen(rt);
-    for (j = 0; !err && j < len + 1; j++) {
-        char c = rt[j];
-        if (tag_begin && (c == '\0' || c == '/' || c == ':')) {
-            /* now we are at the tag end boundary, so we can process
-               the tag we just found */
-            size_t tag_len = (&rt[j] - tag_begin);
-            if (tag_len >= 1) {
-                err = RS->on_tag(RS, j, tag_begin, tag_len);
-                RS->tag_processed++;
-            } else {
-                RS->tag_malformed++;
-            }
-            tag_begin = NULL;
-            outside_tag = 1;
-        }
-        if (c == ':') {
-            /* found a new tag preamble. Record the beginning. */
-            if (RS->tag_processed < CRW_MAX_ROUTE_ARGS) {
-                tag_begin = &rt[j + 1];
-            }
-            RS->tag_found++;
-            outside_tag = 0;
-        }
-        if (outside_tag) {
-            /* anything else outside a tag. */
-            err = RS->on_char(RS, j, c);
+    int j = 0;
+    for (j = 0; j < res->num_refs; j++) {
+        CRW_BodyRef *ref = &res->refs[j];
+        if (ref->release) {
+            ref->release(ref->data, ref->release_data);
         }
     }
-    return err;
+    res->num_refs = 0;
+    return;
 }
 
-CRW_PRIVATE
-int CRW_route_scan_on_char_null(CRW_RouteScanner *RS,
-                                int idx, char c)
+static void CRW_response_release_file(CRW_Response *res)
 {
-    return 0;
+    if (res->file_fd >= 0) {
+        close(res->file_fd);
+        res->body_len -= res->file_len;
+        res->file_fd = -1;
+        res->file_len = 0;
+    }
+    return;
 }
 
-CRW_PRIVATE
-int CRW_scan_regex_on_tag(CRW_RouteScanner *RS,
-                          int idx, const char *tag, size_t len)
+#ifdef CRW_HAVE_THREAD_CACHE
+static CRW_THREAD_LOCAL CRW_Response *CRW_ResponsePool = NULL;
+static CRW_THREAD_LOCAL int CRW_ResponsePooled = 0;
+#endif
+
+/* the body buffer and the refs table are kept as they are */
+static void CRW_response_init(CRW_Response *res, CRW_Arena *arena)
 {
-    CRW_Route *route = RS->userdata;
-    route->tags[RS->tag_processed] = tag;
-    route->regex_tags[idx] = '\0';
-    return 0;
+    res->arena = arena;
+    res->next = NULL;
+    res->status_code = 200; /* FIXME */
+    res->headers = NULL;
+    res->last_header = NULL;
+    res->headers_len = 0;
+    res->body_pos = 0;
+    res->num_refs = 0;
+    res->body_len = 0;
+    res->file_fd = -1;
+    res->file_len = 0;
+    res->producer = NULL;
+    res->stream_release = NULL;
+    res->stream_data = NULL;
+    res->cache_tag = NULL;
+    res->pending = NULL;
+    return;
 }
 
-CRW_PRIVATE
-int CRW_route_scan_regex(CRW_Route *route)
+static void CRW_response_free(CRW_Response *res)
 {
-    int err = -1;
-    if (route) {
-        CRW_RouteScanner RS = {
-            0, 0, 0,
-            route->regex_tags,
-            route,
-            CRW_scan_regex_on_tag,
-            CRW_route_scan_on_char_null
-        };
-        err = CRW_route_scan_string(&RS);
-        if (!err) {
-            route->tag_processed = RS.tag_processed;
-            route->tag_malformed = RS.tag_malformed;
-            route->tag_found     = RS.tag_found;
+    free(res->body);
+    free(res->refs);
+    free(res);
+}
+
+CRW_Response *CRW_response_new(CRW_Instance *inst)
+{
+    CRW_Response *res = NULL;
+    CRW_Arena *arena = CRW_arena_get_current();
+    if (arena) {
+#ifdef CRW_HAVE_THREAD_CACHE
+        if (CRW_ResponsePool) {
+            res = CRW_ResponsePool;
+            CRW_ResponsePool = res->next;
+            CRW_ResponsePooled--;
+        }
+#endif
+        if (!res) {
+            res = calloc(1, sizeof(CRW_Response));
+        }
+        if (res) {
+            CRW_response_init(res, arena);
+            res->compress_min_size = (inst) ?inst->compress_min_size :0;
+        } else {
+            CRW_arena_put(arena);
         }
     }
-    return err;
+    return res;
 }
 
-typedef struct crwregexbuilder_ CRW_RegexBuilder;
-struct crwregexbuilder_ {
-    char *ptr;
-    int idx;
-};
+void CRW_response_del(CRW_Response *res)
+{
+    if (res) {
+        CRW_response_release_refs(res);
+        CRW_response_release_file(res);
+        if (res->producer && res->stream_release) {
+            res->stream_release(res->stream_data);
+        }
+        CRW_arena_put(res->arena);
+        res->arena = NULL;
+#ifdef CRW_HAVE_THREAD_CACHE
+        if (CRW_ResponsePooled < CRW_POOL_MAX) {
+            if (res->body_size > CRW_RESPONSE_POOLED_BODY_LEN) {
+                free(res->body);
+                res->body = NULL;
+                res->body_size = 0;
+            }
+            res->next = CRW_ResponsePool;
+            CRW_ResponsePool = res;
+            CRW_ResponsePooled++;
+            res = NULL;
+        }
+#endif
+        if (res) {
+            CRW_response_free(res);
+        }
+    }
+}
 
-CRW_PRIVATE
-int CRW_build_regex_on_char(CRW_RouteScanner *RS,
-                            int idx, char c)
+static void CRW_response_pool_flush(void)
 {
-    CRW_RegexBuilder *RB = RS->userdata;
-    RB->ptr[RB->idx] = c;
-    RB->idx++;
-    return 0;
+#ifdef CRW_HAVE_THREAD_CACHE
+    while (CRW_ResponsePool) {
+        CRW_Response *res = CRW_ResponsePool;
+        CRW_ResponsePool = res->next;
+        CRW_response_free(res);
+    }
+    CRW_ResponsePooled = 0;
+#endif
 }
 
-CRW_PRIVATE
-int CRW_build_regex_on_tag(CRW_RouteScanner *RS,
-                           int idx, const char *tag, size_t len)
+/* what the thread has cached: for the threads going away */
+static void CRW_thread_cache_flush(void)
 {
-    CRW_RegexBuilder *RB = RS->userdata;
-    strcat(&RB->ptr[RB->idx], SUBEXPR_STR);
-    RB->idx += SUBEXPR_LEN;
-    return 0;
+    CRW_arena_cache_flush();
+    CRW_request_pool_flush();
+    CRW_response_pool_flush();
 }
 
+#ifdef CRW_HAVE_THREAD_CACHE
+/* the threads we do not own (the mongoose ones) flush when they exit */
+static pthread_key_t CRW_ThreadCacheKey;
+static pthread_once_t CRW_ThreadCacheOnce = PTHREAD_ONCE_INIT;
+static int CRW_ThreadCacheKeyErr = 0;
+static CRW_THREAD_LOCAL int CRW_ThreadCacheArmed = 0;
 
-CRW_PRIVATE
-int CRW_route_build_crane_regex(CRW_Route *route)
+static void CRW_thread_cache_exit(void *unused)
 {
-    int err = -1;
-    if (route) {
-        int tags_len = CRW_route_sum_tag_len(route);
-        int subx_len = route->tag_processed * SUBEXPR_LEN;
-        size_t regx_len = strlen(route->regex_user);
-        size_t overhead = 1; /* the ending '\0' */
+    CRW_thread_cache_flush();
+}
 
-        if (subx_len > tags_len) {
-            overhead += subx_len - tags_len;
+static void CRW_thread_cache_key_new(void)
+{
+    CRW_ThreadCacheKeyErr = pthread_key_create(&CRW_ThreadCacheKey,
+                                               CRW_thread_cache_exit);
+}
+
+/* the destructor runs only for the threads with a value on the key */
+static void CRW_thread_cache_arm(void)
+{
+    if (!CRW_ThreadCacheArmed) {
+        pthread_once(&CRW_ThreadCacheOnce, CRW_thread_cache_key_new);
+        if (!CRW_ThreadCacheKeyErr) {
+            pthread_setspecific(CRW_ThreadCacheKey, &CRW_ThreadCacheArmed);
         }
-        route->regex_crane = calloc(1, regx_len + overhead);
-        if (route->regex_crane) {
-            CRW_RegexBuilder RB = {
-                route->regex_crane,
-                0
-            };
-            CRW_RouteScanner RS = {
-                0, 0, 0,
-                route->regex_user,
-                &RB,
-                CRW_build_regex_on_tag,
-                CRW_build_regex_on_char
-            };
-            err = CRW_route_scan_string(&RS);
+        CRW_ThreadCacheArmed = 1;
+    }
+}
+#endif
+
+int CRW_response_add_header(CRW_Response *res,
+                            const char *name, const char *value)
+{
+    int err = -1;
+    /* they go on the wire as they are: no line breaks smuggled in */
+    if (res && name && *name && !name[strcspn(name, ":\r\n")]
+     && (!value || !value[strcspn(value, "\r\n")])) {
+        size_t namelen = strlen(name);
+        size_t valuelen = (value) ?strlen(value) + 2 :0; /* ": " */
+        size_t len = namelen + valuelen + 2; /* CRLF */
+        CRW_ResponseHeader *hdr = CRW_arena_alloc(res->arena,
+                                                  sizeof(CRW_ResponseHeader)
+                                                  + len);
+        if (hdr) {
+            memcpy(hdr->line, name, namelen);
+            if (value) {
+                memcpy(hdr->line + namelen, ": ", 2);
+                memcpy(hdr->line + namelen + 2, value, valuelen - 2);
+            }
+            memcpy(hdr->line + len - 2, "\r\n", 3);
+            hdr->len = len;
+            hdr->next = NULL;
+            if (res->last_header) {
+                res->last_header->next = hdr;
+            } else {
+                res->headers = hdr;
+            }
+            res->last_header = hdr;
+            res->headers_len += len;
+            err = 0;
+        } else {
+            err = 1;
         }
     }
     return err;
 }
 
-CRW_PRIVATE
-int CRW_route_init_regex(CRW_Route *route)
+/* a whole header line, CRLF included, as it is */
+static int CRW_response_add_header_line(CRW_Response *res,
+                                        const char *line, size_t len)
 {
-    int err = 0;
-    err = CRW_route_scan_regex(route);
-    if (err) {
-        CRW_panic("rtr", "error=[%i] while scanning regex for tags", err);
-        return err;
+    CRW_ResponseHeader *hdr = CRW_arena_alloc(res->arena,
+                                              sizeof(CRW_ResponseHeader)
+                                              + len + 1);
+    if (!hdr) {
+        return -1;
     }
-    err = CRW_route_build_crane_regex(route);
-    if (err) {
-        CRW_panic("rtr", "error=[%i] while building the internal regex", err);
-        return err;
+    memcpy(hdr->line, line, len);
+    hdr->line[len] = '\0';
+    hdr->len = len;
+    hdr->next = NULL;
+    if (res->last_header) {
+        res->last_header->next = hdr;
+    } else {
+        res->headers = hdr;
     }
-    err = regcomp(&route->RE, route->regex_crane, REG_EXTENDED);
-    if (err) {
-        CRW_panic("rtr", "error=[%i] while compiling the internal regex", err);
-        return err;
+    res->last_header = hdr;
+    res->headers_len += len;
+    return 0;
+}
+
+int CRW_response_add_body(CRW_Response *res, const char *chunk)
+{
+    int err = -1;
+    if (res && chunk) {
+        err = CRW_response_add_body_len(res, chunk, strlen(chunk));
     }
-    route->compiled = 1;
     return err;
 }
 
-CRW_PRIVATE
-int CRW_route_setup(CRW_Route *route, const char *regex)
+int CRW_response_add_body_len(CRW_Response *res,
+                              const void *data, size_t len)
 {
     int err = -1;
-    memset(route, 0, sizeof(CRW_Route));
-    route->compiled = 0;
-    route->regex_user = strdup(regex);
-    route->regex_tags = strdup(regex);
-    if (route->regex_user && route->regex_tags) {
+    if (res && (data || !len) && res->file_fd < 0) {
+        if (res->body_pos + len + 1 > res->body_size) {
+            size_t size = (res->body_size) ?res->body_size
+                                           :CRW_RESPONSE_DEFAULT_BODY_LEN;
+            char *body = NULL;
+            while (size < res->body_pos + len + 1) {
+                size *= 2;
+            }
+            body = realloc(res->body, size);
+            if (!body) {
+                return -1;
+            }
+            res->body = body;
+            res->body_size = size;
+        }
+        memcpy(res->body + res->body_pos, data, len);
+        res->body_pos += len;
+        res->body[res->body_pos] = '\0';
+        res->body_len += len;
         err = 0;
     }
     return err;
 }
 
-CRW_PRIVATE
-int CRW_route_init(CRW_Route *route, const char *regex)
+int CRW_response_add_body_ref(CRW_Response *res,
+                              const void *data, size_t len,
+                              CRW_BodyRelease release, void *release_data)
 {
     int err = -1;
-    if (route && regex) {
-        err = CRW_route_setup(route, regex);
-        if (!err) {
-            err = CRW_route_init_regex(route);
-        } else {
-            CRW_panic("rtr", "no memory for route data on [%s]", regex);
-            err = 1;
+    if (res && (data || !len) && res->file_fd < 0) {
+        if (res->num_refs == res->max_refs) {
+            int max = (res->max_refs) ?res->max_refs * 2
+                                      :CRW_RESPONSE_MIN_REFS;
+            CRW_BodyRef *refs = realloc(res->refs, max * sizeof(CRW_BodyRef));
+            if (refs) {
+                res->refs = refs;
+                res->max_refs = max;
+            }
         }
-        if (err) {
-            CRW_route_cleanup(route);
-            err = -1;
+        if (res->num_refs < res->max_refs) {
+            CRW_BodyRef *ref = &res->refs[res->num_refs++];
+            ref->at = res->body_pos;
+            ref->data = data;
+            ref->len = len;
+            ref->release = release;
+            ref->release_data = release_data;
+            res->body_len += len;
+            err = 0;
         }
     }
+    if (err && release) {
+        /* the caller gave it to us anyway */
+        release(data, release_data);
+    }
     return err;
 }
 
-CRW_PRIVATE
-int CRW_route_match(CRW_Route *route, const char *URI)
+int CRW_response_set_stream(CRW_Response *res,
+                            CRW_ResponseProducer producer,
+                            CRW_StreamRelease release, void *userdata)
 {
-    int match = 0;
-    if (route && URI) {
-        int err = regexec(&route->RE, URI,
-                          CRW_MAX_ROUTE_ARGS, route->matches,
-                          0);
-        if (!err) {
-            if (route->matches[0].rm_so != -1
-             && route->matches[0].rm_eo != -1) {
-                match = 1;
+    int err = -1;
+    if (res && producer && !res->producer) {
+        res->producer = producer;
+        res->stream_release = release;
+        res->stream_data = userdata;
+        err = 0;
+    } else if (release) {
+        release(userdata);
+    }
+    return err;
+}
+
+/* the value of a header set by the handler (with the line end),
+   NULL if not there */
+static const char *CRW_response_find_header(const CRW_Response *res,
+                                            const char *name)
+{
+    const CRW_ResponseHeader *hdr = NULL;
+    size_t len = strlen(name);
+    for (hdr = res->headers; hdr; hdr = hdr->next) {
+        if (hdr->len > len && hdr->line[len] == ':'
+         && !strncasecmp(hdr->line, name, len)) {
+            const char *value = hdr->line + len + 1;
+            while (*value == ' ' || *value == '\t') {
+                value++;
             }
-        } else {
-            /* FIXME */
-            CRW_panic("rte", "regexec() failed on URI=[%s] error=(%i)",
-                      URI, err);
+            return value;
         }
     }
-    return match;
+    return NULL;
 }
 
-CRW_PRIVATE
-int CRW_route_fetch(CRW_Route *route, const char *URI,
-                    CRW_RouteArgs *args)
+int CRW_response_set_cache_tag(CRW_Response *res, const char *tag)
 {
     int err = -1;
-    if (URI && args && route) {
-        free(route->data);
-        route->data = strdup(URI);
-        memset(args, 0, sizeof(*args));
-        if (route->data) {
-            int j = 0;
-            for (j = 0; route->matches[j+1].rm_so != -1
-                     && route->matches[j+1].rm_eo != -1; j++) {
-                args->pairs[j].key = route->tags[j];
-                args->pairs[j].value = &route->data[route->matches[j+1].rm_so];
-                route->data[route->matches[j+1].rm_eo] = '\0';
-                /* watch out for the bug lurking here */
-                args->num++;
-                /* FIXME */
-            }
+    if (res && tag) {
+        size_t len = strlen(tag) + 1;
+        char *copy = CRW_arena_alloc(res->arena, len);
+        if (copy) {
+            memcpy(copy, tag, len);
+            res->cache_tag = copy;
             err = 0;
         }
     }
     return err;
 }
 
-/*** dispatcher **********************************************************/
-
-typedef struct crwhandlerbinding_ CRW_HandlerBinding;
-struct crwhandlerbinding_ {
-    CRW_Route route;
-    CRW_Handler *handler;
-};
-
-struct crwdispatcher_ {
-    CRW_Instance *inst;
-    list handlers;
-};
-
-static CRW_Dispatcher *CRW_dispatcher_new(CRW_Instance *inst)
+/* for HEAD (the Content-Length is computed already), and for 304 */
+static void CRW_response_drop_body(CRW_Response *res)
 {
-    CRW_Dispatcher *disp = NULL;
-    if (inst) {
-        disp = calloc(1, sizeof(CRW_Dispatcher));
-        if (disp) {
-            CRW_dispatcher_init(disp, inst);
-        }
-    }
-    return disp;
+    CRW_response_release_refs(res);
+    CRW_response_release_file(res);
+    res->body_pos = 0;
+    res->body_len = 0;
+    return;
 }
 
-static void CRW_dispatcher_del(CRW_Dispatcher *disp)
+/* the client already has it: 304, without the body */
+static int CRW_response_not_modified(CRW_Response *res,
+                                     const CRW_Request *req)
 {
-    CRW_dispatcher_fini(disp);
-    free(disp);
+    const char *etag = NULL;
+    if (res->status_code != 200 || res->producer
+     || (req->method != CRW_REQUEST_METHOD_GET
+      && req->method != CRW_REQUEST_METHOD_HEAD)) {
+        return 0;
+    }
+    etag = CRW_response_find_header(res, "ETag");
+    if (!etag
+     || !CRW_http_etag_match(CRW_request_get_known_header(req,
+                                                CRW_HDR_IF_NONE_MATCH),
+                             etag, strcspn(etag, "\r"))) {
+        return 0;
+    }
+    res->status_code = 304;
+    CRW_response_drop_body(res);
+    return 1;
 }
 
-static void free_binding(void *data)
+int CRW_response_set_etag(CRW_Response *res, const CRW_Request *req,
+                          const char *etag)
 {
-    CRW_HandlerBinding *HB = data;
-    CRW_route_cleanup(&HB->route);
-    free(HB);
+    int ret = -1;
+    if (res && req && etag && *etag) {
+        size_t len = strlen(etag);
+        char *value = CRW_arena_alloc(res->arena, len + 3);
+        if (value && (etag[0] == '"' || !strncmp(etag, "W/\"", 3))) {
+            memcpy(value, etag, len + 1);
+        } else if (value) {
+            value[0] = '"';
+            memcpy(value + 1, etag, len);
+            memcpy(value + 1 + len, "\"", 2);
+        }
+        if (value && CRW_response_add_header(res, "ETag", value) == 0) {
+            ret = CRW_response_not_modified(res, req);
+        }
+    }
+    return ret;
 }
 
-static int CRW_dispatcher_init(CRW_Dispatcher *disp, CRW_Instance *inst)
+int CRW_response_send_fd(CRW_Response *res, int fd, off_t offset, off_t len)
 {
     int err = -1;
-    if (disp) {
-        disp->inst = inst;
-        list_init(&disp->handlers, free_binding);
+    struct stat st;
+    if (res && fd >= 0 && res->file_fd < 0 && !res->producer
+     && offset >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+     && offset <= st.st_size) {
+        if (len < 0 || len > st.st_size - offset) {
+            len = st.st_size - offset;
+        }
+        res->file_fd = fd;
+        res->file_off = offset;
+        res->file_len = (size_t)len;
+        res->body_len += res->file_len;
+        err = 0;
+    } else if (fd >= 0) {
+        close(fd); /* the caller gave it to us anyway */
     }
     return err;
 }
 
-static int CRW_dispatcher_fini(CRW_Dispatcher *disp)
+int CRW_response_send_file(CRW_Response *res, const char *path,
+                           off_t offset, off_t len)
 {
     int err = -1;
-    if (disp) {
-        list_destroy(&disp->handlers);
+    if (res && path) {
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+            err = CRW_response_send_fd(res, fd, offset, len);
+        }
+    }
+    return err;
+}
+
+static size_t CRW_response_body_len(const CRW_Response *res)
+{
+    return res->body_len;
+}
+
+/* where the file is for the body from the offset on, if there.
+   Returns the bytes to send from the file, 0 if not in the file. */
+static size_t CRW_response_body_file(const CRW_Response *res, size_t off,
+                                     int *fd, off_t *file_off)
+{
+    size_t mem_len = res->body_len - res->file_len;
+    if (res->file_fd < 0 || off < mem_len || off >= res->body_len) {
+        return 0;
+    }
+    *fd = res->file_fd;
+    *file_off = res->file_off + (off_t)(off - mem_len);
+    return res->body_len - off;
+}
+
+static int CRW_body_piece_add(CRW_BodyPiece *pieces, int num, int max,
+                              const char *data, size_t len, size_t *off)
+{
+    if (*off >= len) {
+        *off -= len;
+    } else if (num < max) {
+        pieces[num].data = data + *off;
+        pieces[num].len = len - *off;
+        *off = 0;
+        num++;
+    }
+    return num;
+}
+
+/* the body from the offset on, as at most max pieces: the copied
+   bytes, split where the referenced buffers go. Returns the pieces. */
+static int CRW_response_body_pieces(const CRW_Response *res, size_t off,
+                                    CRW_BodyPiece *pieces, int max)
+{
+    const char *copied = res->body;
+    size_t at = 0;
+    int num = 0, j = 0;
+    for (j = 0; j < res->num_refs && num < max; j++) {
+        const CRW_BodyRef *ref = &res->refs[j];
+        num = CRW_body_piece_add(pieces, num, max,
+                                 copied + at, ref->at - at, &off);
+        num = CRW_body_piece_add(pieces, num, max,
+                                 ref->data, ref->len, &off);
+        at = ref->at;
+    }
+    if (num < max) {
+        num = CRW_body_piece_add(pieces, num, max,
+                                 copied + at, res->body_pos - at, &off);
+    }
+    return num;
+}
+
+/* the body in memory, in buf (large enough). Returns its length. */
+static size_t CRW_response_copy_body(const CRW_Response *res, char *buf)
+{
+    size_t len = 0;
+    int num = 0;
+    do {
+        CRW_BodyPiece piece;
+        num = CRW_response_body_pieces(res, len, &piece, 1);
+        if (num) {
+            memcpy(buf + len, piece.data, piece.len);
+            len += piece.len;
+        }
+    } while (num);
+    return len;
+}
+
+/* weak: the same body may go out compressed, or not.
+   Only for the bodies all in memory. */
+static int CRW_response_auto_etag(CRW_Response *res)
+{
+    unsigned long long hash = 14695981039346656037ULL; /* FNV-1a */
+    char etag[48];
+    size_t len = 0, j = 0;
+    int num = 0;
+    if (res->status_code != 200 || res->producer || res->file_fd >= 0
+     || res->pending || CRW_response_find_header(res, "ETag")) {
+        return 0;
+    }
+    do {
+        CRW_BodyPiece piece;
+        num = CRW_response_body_pieces(res, len, &piece, 1);
+        if (num) {
+            for (j = 0; j < piece.len; j++) {
+                hash = (hash ^ (unsigned char)piece.data[j])
+                     * 1099511628211ULL;
+            }
+            len += piece.len;
+        }
+    } while (num);
+    snprintf(etag, sizeof(etag), "W/\"%lx-%016llx\"",
+             (unsigned long)len, hash);
+    return CRW_response_add_header(res, "ETag", etag);
+}
+
+#ifdef CRW_DEBUG
+
+/* the body as it goes on the wire, a few bytes at a time */
+CRW_PRIVATE
+size_t CRW_response_get_body(const CRW_Response *res, char *buf, size_t size)
+{
+    size_t len = 0;
+    int num = 0;
+    do {
+        CRW_BodyPiece piece;
+        num = CRW_response_body_pieces(res, len, &piece, 1);
+        if (num && len + piece.len <= size) {
+            memcpy(buf + len, piece.data, piece.len);
+            len += piece.len;
+        } else {
+            num = 0;
+        }
+    } while (num);
+    return len;
+}
+
+#endif /* CRW_DEBUG */
+
+
+/*** route ***************************************************************/
+
+
+int CRW_route_args_count(const CRW_RouteArgs *args)
+{
+    int num = -1;
+    if (args) {
+        num = args->num;
+    }
+    return num;
+}
+
+const char *CRW_route_args_get_by_idx(const CRW_RouteArgs *args, int idx)
+{
+    const char *value = NULL;
+    if (args) {
+        return CRW_kvpair_get_by_idx(args->pairs, args->num, idx);
+    }
+    return value;
+}
+
+const char *CRW_route_args_get_by_tag(const CRW_RouteArgs *args,
+                                      const char *tag)
+{
+    const char *value = NULL;
+    if (args) {
+        return CRW_kvpair_get_by_key(args->pairs, args->num, tag);
+    }
+    return value;
+}
+
+#define SUBEXPR_STR "([[:print:]]*)"
+#define SUBEXPR_LEN 14
+
+typedef struct crwroute_ CRW_Route;
+struct crwroute_ {
+    regex_t RE;
+    int compiled;
+    const char *regex_user;
+    char *regex_crane;
+    char *regex_tags;
+    const char *tags[CRW_MAX_ROUTE_ARGS];
+    int tag_processed;
+    int tag_found;
+    int tag_malformed;
+};
+
+
+#ifdef CRW_DEBUG
+
+CRW_PRIVATE
+CRW_Route *CRW_route_new(void)
+{
+    return calloc(1, sizeof(CRW_Route));
+}
+
+CRW_PRIVATE
+void CRW_route_del(CRW_Route *route)
+{
+    free(route);
+}
+
+CRW_PRIVATE
+int CRW_route_tag_count(CRW_Route *route)
+{
+    return route->tag_processed;
+}
+
+CRW_PRIVATE
+int CRW_route_tag_found(CRW_Route *route)
+{
+    return route->tag_found;
+}
+
+CRW_PRIVATE
+int CRW_route_tag_malformed(CRW_Route *route)
+{
+    return route->tag_malformed;
+}
+
+CRW_PRIVATE
+const char *CRW_route_regex_user(CRW_Route *route)
+{
+    return route->regex_user;
+}
+
+CRW_PRIVATE
+const char *CRW_route_regex_crane(CRW_Route *route)
+{
+    return route->regex_crane;
+}
+
+CRW_PRIVATE
+int CRW_route_regex_dump(CRW_Route *route, const char *msg)
+{
+    if (!msg) {
+        msg = "dump";
+    }
+    fprintf(stderr, "%s  user = [%s]\n", msg, CRW_route_regex_user(route));
+    fprintf(stderr, "%s crane = [%s]\n", msg, CRW_route_regex_crane(route));
+    return 0;
+}
+
+
+CRW_PRIVATE
+const char *CRW_route_tag_get_by_idx(CRW_Route *route, int idx)
+{
+    return route->tags[idx];
+}
+
+CRW_PRIVATE
+int CRW_route_tag_dump(CRW_Route *route, const char *msg)
+{
+    int j;
+    if (!msg) {
+        msg = "dump";
+    }
+    for (j= 0; j < route->tag_processed; j++) {
+        fprintf(stderr, "%s tag[%i]= [%s]\n",
+                msg, j, route->tags[j]);
+    }
+    return 0;
+}
+
+CRW_PRIVATE
+int CRW_route_all_empty_tags(CRW_Route *route)
+{
+    int j;
+    for (j= 0; j < CRW_MAX_ROUTE_ARGS; j++) {
+        if (route->tags[j]) {
+            fprintf(stderr, "UNEXPECTED tag[%i]= [%s]\n",
+                    j, route->tags[j]);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+CRW_PRIVATE
+int CRW_route_set_tags(CRW_Route *route, const char *tags[], int num)
+{
+    int j;
+    for (j = 0; j < num; j++) {
+        route->tags[j] = tags[j];
+        route->tag_processed++;
+        route->tag_found++;
+    }
+    return 0;
+}
+
+#endif /* CRW_DEBUG */
+
+
+CRW_PRIVATE
+int CRW_route_cleanup(CRW_Route *route)
+{
+    int err = -1;
+    if (route) {
+        free((char *)route->regex_user); /* XXX */
+        free(route->regex_tags);
+        free(route->regex_crane);
+        if (route->compiled) {
+            regfree(&route->RE);
+        }
+        free(route);
+    }
+    return err;
+}
+
+CRW_PRIVATE
+int CRW_route_sum_tag_len(CRW_Route *route)
+{
+    int len = -1;
+    if (route) {
+        int j;
+        len = 0;
+        for (j = 0; j < route->tag_processed; j++) {
+            len += strlen(route->tags[j]) + 1;
+            /* the leading ':' */
+        }
+    }
+    return len;
+}
+
+
+typedef struct crwroutescanner_ CRW_RouteScanner;
+struct crwroutescanner_ {
+    int tag_found;
+    int tag_processed;
+    int tag_malformed;
+
+    const char *route_string;
+
+    void *userdata;
+
+    int (*on_tag)(CRW_RouteScanner *RS,
+                  int idx, const char *tag, size_t len);
+    int (*on_char)(CRW_RouteScanner *RS,
+                   int idx, char c);
+};
+
+CRW_PRIVATE
+int CRW_route_scan_string(CRW_RouteScanner *RS)
+{
+    /* no nested tags are allowed, so this is quite straightforward */
+    int err = 0;
+    int outside_tag = 1;
+    const char *tag_begin = NULL;
+    const char *rt = RS->route_string;
+    size_t j = 0, len = strlen(rt);
+    for (j = 0; !err && j < len + 1; j++) {
+        char c = rt[j];
+        if (tag_begin && (c == '\0' || c == '/' || c == ':')) {
+            /* now we are at the tag end boundary, so we can process
+               the tag we just found */
+            size_t tag_len = (&rt[j] - tag_begin);
+            if (tag_len >= 1) {
+                err = RS->on_tag(RS, j, tag_begin, tag_len);
+                RS->tag_processed++;
+            } else {
+                RS->tag_malformed++;
+            }
+            tag_begin = NULL;
+            outside_tag = 1;
+        }
+        if (c == ':') {
+            /* found a new tag preamble. Record the beginning. */
+            if (RS->tag_processed < CRW_MAX_ROUTE_ARGS) {
+                tag_begin = &rt[j + 1];
+            }
+            RS->tag_found++;
+            outside_tag = 0;
+        }
+        if (outside_tag) {
+            /* anything else outside a tag. */
+            err = RS->on_char(RS, j, c);
+        }
+    }
+    return err;
+}
+
+CRW_PRIVATE
+int CRW_route_scan_on_char_null(CRW_RouteScanner *RS,
+                                int idx, char c)
+{
+    return 0;
+}
+
+CRW_PRIVATE
+int CRW_scan_regex_on_tag(CRW_RouteScanner *RS,
+                          int idx, const char *tag, size_t len)
+{
+    CRW_Route *route = RS->userdata;
+    route->tags[RS->tag_processed] = tag;
+    route->regex_tags[idx] = '\0';
+    return 0;
+}
+
+CRW_PRIVATE
+int CRW_route_scan_regex(CRW_Route *route)
+{
+    int err = -1;
+    if (route) {
+        CRW_RouteScanner RS = {
+            0, 0, 0,
+            route->regex_tags,
+            route,
+            CRW_scan_regex_on_tag,
+            CRW_route_scan_on_char_null
+        };
+        err = CRW_route_scan_string(&RS);
+        if (!err) {
+            route->tag_processed = RS.tag_processed;
+            route->tag_malformed = RS.tag_malformed;
+            route->tag_found     = RS.tag_found;
+        }
+    }
+    return err;
+}
+
+typedef struct crwregexbuilder_ CRW_RegexBuilder;
+struct crwregexbuilder_ {
+    char *ptr;
+    int idx;
+};
+
+CRW_PRIVATE
+int CRW_build_regex_on_char(CRW_RouteScanner *RS,
+                            int idx, char c)
+{
+    CRW_RegexBuilder *RB = RS->userdata;
+    RB->ptr[RB->idx] = c;
+    RB->idx++;
+    return 0;
+}
+
+CRW_PRIVATE
+int CRW_build_regex_on_tag(CRW_RouteScanner *RS,
+                           int idx, const char *tag, size_t len)
+{
+    CRW_RegexBuilder *RB = RS->userdata;
+    strcat(&RB->ptr[RB->idx], SUBEXPR_STR);
+    RB->idx += SUBEXPR_LEN;
+    return 0;
+}
+
+
+CRW_PRIVATE
+int CRW_route_build_crane_regex(CRW_Route *route)
+{
+    int err = -1;
+    if (route) {
+        int tags_len = CRW_route_sum_tag_len(route);
+        int subx_len = route->tag_processed * SUBEXPR_LEN;
+        size_t regx_len = strlen(route->regex_user);
+        size_t overhead = 1; /* the ending '\0' */
+
+        if (subx_len > tags_len) {
+            overhead += subx_len - tags_len;
+        }
+        route->regex_crane = calloc(1, regx_len + overhead);
+        if (route->regex_crane) {
+            CRW_RegexBuilder RB = {
+                route->regex_crane,
+                0
+            };
+            CRW_RouteScanner RS = {
+                0, 0, 0,
+                route->regex_user,
+                &RB,
+                CRW_build_regex_on_tag,
+                CRW_build_regex_on_char
+            };
+            err = CRW_route_scan_string(&RS);
+        }
+    }
+    return err;
+}
+
+CRW_PRIVATE
+int CRW_route_init_regex(CRW_Route *route)
+{
+    int err = 0;
+    err = CRW_route_scan_regex(route);
+    if (err) {
+        CRW_panic("rtr", "error=[%i] while scanning regex for tags", err);
+        return err;
+    }
+    err = CRW_route_build_crane_regex(route);
+    if (err) {
+        CRW_panic("rtr", "error=[%i] while building the internal regex", err);
+        return err;
+    }
+    err = regcomp(&route->RE, route->regex_crane, REG_EXTENDED);
+    if (err) {
+        CRW_panic("rtr", "error=[%i] while compiling the internal regex", err);
+        return err;
+    }
+    route->compiled = 1;
+    return err;
+}
+
+CRW_PRIVATE
+int CRW_route_setup(CRW_Route *route, const char *regex)
+{
+    int err = -1;
+    memset(route, 0, sizeof(CRW_Route));
+    route->compiled = 0;
+    route->regex_user = strdup(regex);
+    route->regex_tags = strdup(regex);
+    if (route->regex_user && route->regex_tags) {
+        err = 0;
+    }
+    return err;
+}
+
+CRW_PRIVATE
+int CRW_route_init(CRW_Route *route, const char *regex)
+{
+    int err = -1;
+    if (route && regex) {
+        err = CRW_route_setup(route, regex);
+        if (!err) {
+            err = CRW_route_init_regex(route);
+        } else {
+            CRW_panic("rtr", "no memory for route data on [%s]", regex);
+            err = 1;
+        }
+        if (err) {
+            CRW_route_cleanup(route);
+            err = -1;
+        }
+    }
+    return err;
+}
+
+/* the route is read-only here: the match offsets go in `matches' */
+CRW_PRIVATE
+int CRW_route_match(const CRW_Route *route, const char *URI,
+                    regmatch_t matches[CRW_MAX_ROUTE_ARGS])
+{
+    int match = 0;
+    if (route && URI && matches) {
+        int err = regexec(&route->RE, URI,
+                          CRW_MAX_ROUTE_ARGS, matches,
+                          0);
+        if (!err) {
+            if (matches[0].rm_so != -1
+             && matches[0].rm_eo != -1) {
+                match = 1;
+            }
+        } else if (err != REG_NOMATCH) {
+            /* FIXME */
+            CRW_panic("rte", "regexec() failed on URI=[%s] error=(%i)",
+                      URI, err);
+        }
+    }
+    return match;
+}
+
+/* the values are copied in the args storage, the route is untouched */
+CRW_PRIVATE
+int CRW_route_fetch(const CRW_Route *route, const char *URI,
+                    const regmatch_t matches[CRW_MAX_ROUTE_ARGS],
+                    CRW_RouteArgs *args)
+{
+    int err = -1;
+    if (URI && matches && args && route) {
+        CRW_route_args_cleanup(args);
+        args->data = (args->arena) ?CRW_arena_strdup(args->arena, URI)
+                                   :strdup(URI);
+        if (args->data) {
+            int j = 0;
+            for (j = 0; j + 1 < CRW_MAX_ROUTE_ARGS
+                     && matches[j+1].rm_so != -1
+                     && matches[j+1].rm_eo != -1; j++) {
+                args->pairs[j].key = route->tags[j];
+                args->pairs[j].value = &args->data[matches[j+1].rm_so];
+                args->data[matches[j+1].rm_eo] = '\0';
+                /* watch out for the bug lurking here */
+                args->num++;
+                /* FIXME */
+            }
+            err = 0;
+        }
+    }
+    return err;
+}
+
+/*** route tree **********************************************************/
+
+/* The route tree is the compiled form of the dispatcher bindings.
+   Routes made only of static segments and whole-segment :tags are
+   split on '/' and merged into a segment trie: static segments become
+   literal edges (kept sorted, so they can be bsearch()ed) and :tags
+   become the (single) parameter edge of a node.
+   A lookup walks the URI one segment at a time, so its cost depends
+   on the URI length and not on the number of routes.
+   It matches what the route regexes would. They are not anchored:
+   a route can begin at any '/' of the URI, and one ending with a
+   literal matches any segment beginning with it. A :tag is
+   ([[:print:]]*), so it takes one or more whole segments, '/'
+   included. Hence the walk is run as an NFA: the nodes matched so far
+   are the states, and a tag node stays a state while the tag goes on.
+   The args are then split as the regex engine does (see
+   CRW_route_tree_fetch).
+   Anything else (regex syntax, tags embedded into a segment...) stays
+   on the linear regex scan.
+*/
+
+typedef struct crwhandlerbinding_ CRW_HandlerBinding;
+struct crwhandlerbinding_ {
+    CRW_Route route;
+    CRW_Handler *handler;
+    int seq;                /* registration order: later wins */
+};
+
+typedef struct crwroutenode_ CRW_RouteNode;
+struct crwroutenode_ {
+    char *segment;                  /* literal edge label (NULL on params) */
+    size_t seglen;
+    CRW_RouteNode **children;       /* literal edges, sorted by label */
+    int num_children;
+    int max_children;
+    CRW_RouteNode *param;           /* the :tag edge, if any */
+    CRW_HandlerBinding *binding;    /* a route ends here */
+    int tag;                        /* this is a :tag edge */
+    int max_seq;                    /* most recent binding in the subtree */
+    int ends;                       /* literal edges with a binding */
+};
+
+enum {
+    CRW_ROUTE_MAX_STATES = 64
+};
+
+typedef struct crwroutestates_ CRW_RouteStates;
+struct crwroutestates_ {
+    const CRW_RouteNode *nodes[CRW_ROUTE_MAX_STATES];
+    int num;
+};
+
+typedef struct crwroutelookup_ CRW_RouteLookup;
+struct crwroutelookup_ {
+    CRW_RouteStates states[2];      /* before and after a segment */
+    CRW_HandlerBinding *binding;    /* the most recent match so far */
+    int overflow;                   /* too many states: ask the regexes */
+};
+
+/* '.' is here too: in the regex it matches any character */
+#define ROUTE_REGEX_CHARS ".[]()*+?{}|^$\\"
+
+/* can this route go into the tree? */
+CRW_PRIVATE
+int CRW_route_is_plain(const CRW_Route *route)
+{
+    int plain = 0;
+    if (route && route->regex_user && route->regex_user[0] == '/'
+     && route->tag_found == route->tag_processed
+     && route->tag_processed < CRW_MAX_ROUTE_ARGS
+     && !route->tag_malformed) {
+        const char *pc = NULL;
+        int seg_begin = 1, in_tag = 0;
+        plain = 1;
+        for (pc = route->regex_user + 1; plain && *pc; pc++) {
+            if (*pc == '/') {
+                seg_begin = 1;
+                in_tag = 0;
+                continue;
+            }
+            if (*pc == ':') {
+                /* tags must span a whole segment */
+                plain = seg_begin;
+                in_tag = 1;
+            } else if (!in_tag && (strchr(ROUTE_REGEX_CHARS, *pc)
+                                || !isprint((unsigned char)*pc))) {
+                plain = 0;
+            }
+            seg_begin = 0;
+        }
+    }
+    return plain;
+}
+
+static CRW_RouteNode *CRW_route_node_new(const char *segment, size_t seglen)
+{
+    CRW_RouteNode *node = calloc(1, sizeof(CRW_RouteNode));
+    if (node) {
+        node->max_seq = -1;
+    }
+    if (node && segment) {
+        node->segment = malloc(seglen + 1);
+        if (node->segment) {
+            memcpy(node->segment, segment, seglen);
+            node->segment[seglen] = '\0';
+            node->seglen = seglen;
+        } else {
+            free(node);
+            node = NULL;
+        }
+    }
+    return node;
+}
+
+static void CRW_route_node_del(CRW_RouteNode *node)
+{
+    if (node) {
+        int j = 0;
+        for (j = 0; j < node->num_children; j++) {
+            CRW_route_node_del(node->children[j]);
+        }
+        CRW_route_node_del(node->param);
+        free(node->children);
+        free(node->segment);
+        free(node);
+    }
+}
+
+/* the bindings are shared: they are owned by the dispatcher */
+static CRW_RouteNode *CRW_route_node_clone(const CRW_RouteNode *node)
+{
+    CRW_RouteNode *copy = NULL;
+    if (node) {
+        int j = 0, err = 0;
+        copy = CRW_route_node_new(node->segment, node->seglen);
+        if (!copy) {
+            return NULL;
+        }
+        copy->binding = node->binding;
+        copy->tag = node->tag;
+        copy->max_seq = node->max_seq;
+        copy->ends = node->ends;
+        if (node->num_children) {
+            copy->children = calloc(node->num_children,
+                                    sizeof(CRW_RouteNode *));
+            copy->max_children = node->num_children;
+            err = (copy->children) ?0 :-1;
+        }
+        for (j = 0; !err && j < node->num_children; j++) {
+            copy->children[j] = CRW_route_node_clone(node->children[j]);
+            if (copy->children[j]) {
+                copy->num_children++;
+            } else {
+                err = -1;
+            }
+        }
+        if (!err && node->param) {
+            copy->param = CRW_route_node_clone(node->param);
+            err = (copy->param) ?0 :-1;
+        }
+        if (err) {
+            CRW_route_node_del(copy);
+            copy = NULL;
+        }
+    }
+    return copy;
+}
+
+static int CRW_route_segment_cmp(const char *seg, size_t len,
+                                 const CRW_RouteNode *node)
+{
+    size_t n = (len < node->seglen) ?len :node->seglen;
+    int cmp = memcmp(seg, node->segment, n);
+    if (!cmp && len != node->seglen) {
+        cmp = (len < node->seglen) ?-1 :1;
+    }
+    return cmp;
+}
+
+/* returns the position of the child, or where it should be inserted */
+static int CRW_route_node_find(const CRW_RouteNode *node,
+                               const char *seg, size_t len, int *found)
+{
+    int lo = 0, hi = node->num_children;
+    *found = 0;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int cmp = CRW_route_segment_cmp(seg, len, node->children[mid]);
+        if (!cmp) {
+            *found = 1;
+            return mid;
+        }
+        if (cmp < 0) {
+            hi = mid;
+        } else {
+            lo = mid + 1;
+        }
+    }
+    return lo;
+}
+
+static CRW_RouteNode *CRW_route_node_add_child(CRW_RouteNode *node,
+                                               const char *seg, size_t len)
+{
+    int found = 0;
+    int pos = CRW_route_node_find(node, seg, len, &found);
+    CRW_RouteNode *child = NULL;
+    if (found) {
+        return node->children[pos];
+    }
+    if (node->num_children == node->max_children) {
+        int max = (node->max_children) ?node->max_children * 2 :4;
+        CRW_RouteNode **children = realloc(node->children,
+                                           max * sizeof(CRW_RouteNode *));
+        if (!children) {
+            return NULL;
+        }
+        node->children = children;
+        node->max_children = max;
+    }
+    child = CRW_route_node_new(seg, len);
+    if (child) {
+        memmove(&node->children[pos + 1], &node->children[pos],
+                (node->num_children - pos) * sizeof(CRW_RouteNode *));
+        node->children[pos] = child;
+        node->num_children++;
+    }
+    return child;
+}
+
+/* the leading '/' was already checked by CRW_route_is_plain */
+static int CRW_route_tree_insert(CRW_RouteNode *root, CRW_HandlerBinding *HB)
+{
+    CRW_RouteNode *node = root, *parent = NULL;
+    const char *seg = HB->route.regex_user + 1;
+    while (node) {
+        const char *end = strchr(seg, '/');
+        size_t len = (end) ?(size_t)(end - seg) :strlen(seg);
+        if (node->max_seq < HB->seq) {
+            node->max_seq = HB->seq;
+        }
+        parent = node;
+        if (len > 0 && seg[0] == ':') {
+            if (!node->param) {
+                node->param = CRW_route_node_new(NULL, 0);
+                if (node->param) {
+                    node->param->tag = 1;
+                }
+            }
+            node = node->param;
+        } else {
+            node = CRW_route_node_add_child(node, seg, len);
+        }
+        if (!end) {
+            break;
+        }
+        seg = end + 1;
+    }
+    if (!node) {
+        return -1;
+    }
+    if (node->max_seq < HB->seq) {
+        node->max_seq = HB->seq;
+    }
+    if (!node->binding && node != parent->param) {
+        parent->ends++;
+    }
+    /* same shape, same URIs: the most recent binding shadows the others */
+    if (!node->binding || node->binding->seq < HB->seq) {
+        node->binding = HB;
+    }
+    return 0;
+}
+
+static int CRW_route_is_printable(const char *str, size_t len)
+{
+    size_t j = 0;
+    for (j = 0; j < len; j++) {
+        if (!isprint((unsigned char)str[j])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* can this subtree still give a more recent match? */
+static int CRW_route_tree_worth(const CRW_RouteNode *node,
+                                const CRW_RouteLookup *RL)
+{
+    return (node
+         && (!RL->binding || RL->binding->seq < node->max_seq));
+}
+
+static void CRW_route_tree_found(const CRW_RouteNode *node,
+                                 CRW_RouteLookup *RL)
+{
+    if (node->binding
+     && (!RL->binding || RL->binding->seq < node->binding->seq)) {
+        RL->binding = node->binding;
+    }
+}
+
+static void CRW_route_states_add(CRW_RouteStates *states,
+                                 const CRW_RouteNode *node,
+                                 CRW_RouteLookup *RL)
+{
+    int j = 0;
+    if (!CRW_route_tree_worth(node, RL)) {
+        return;
+    }
+    for (j = 0; j < states->num; j++) {
+        if (states->nodes[j] == node) {
+            return;
+        }
+    }
+    if (states->num < CRW_ROUTE_MAX_STATES) {
+        states->nodes[states->num++] = node;
+    } else {
+        RL->overflow = 1;
+    }
+}
+
+/* `node' matched up to a '/', `seg' is the segment after it; `more'
+   if another '/' follows. */
+static void CRW_route_tree_step(const CRW_RouteNode *node,
+                                const char *seg, size_t len, int more,
+                                CRW_RouteStates *next, CRW_RouteLookup *RL)
+{
+    int found = 0, pos = 0;
+    size_t j = 0;
+
+    /* the routes ending here match any segment beginning with them */
+    for (j = 0; node->ends && j <= len; j++) {
+        pos = CRW_route_node_find(node, seg, j, &found);
+        if (found) {
+            CRW_route_tree_found(node->children[pos], RL);
+        }
+    }
+    if (node->param) {
+        /* a trailing tag matches even the empty string */
+        CRW_route_tree_found(node->param, RL);
+    }
+    if (!more) {
+        return;
+    }
+    pos = CRW_route_node_find(node, seg, len, &found);
+    if (found) {
+        CRW_route_states_add(next, node->children[pos], RL);
+    }
+    if (CRW_route_is_printable(seg, len)) {
+        /* a tag begins with this segment, or goes on with it */
+        CRW_route_states_add(next, node->param, RL);
+        if (node->tag) {
+            CRW_route_states_add(next, node, RL);
+        }
+    }
+}
+
+static void CRW_route_tree_lookup(const CRW_RouteNode *root,
+                                  const char *URI, CRW_RouteLookup *RL)
+{
+    CRW_RouteStates *now = &RL->states[0], *next = &RL->states[1];
+    const char *slash = strchr(URI, '/');
+    RL->binding = NULL;
+    RL->overflow = 0;
+    now->num = 0;
+    while (slash && !RL->overflow) {
+        CRW_RouteStates *swap = now;
+        const char *seg = slash + 1;
+        const char *end = strchr(seg, '/');
+        size_t len = (end) ?(size_t)(end - seg) :strlen(seg);
+        int j = 0;
+        /* not anchored: any '/' can be the first one of a route */
+        CRW_route_states_add(now, root, RL);
+        next->num = 0;
+        for (j = 0; j < now->num; j++) {
+            CRW_route_tree_step(now->nodes[j], seg, len, end != NULL,
+                                next, RL);
+        }
+        now = next;
+        next = swap;
+        slash = end;
+    }
+}
+
+/* the literal parts of a route: before, between and after the tags */
+typedef struct crwroutechunk_ CRW_RouteChunk;
+struct crwroutechunk_ {
+    const char *str;
+    size_t len;
+};
+
+/* CRW_route_is_plain already checked the route */
+static int CRW_route_split(const CRW_Route *route,
+                           CRW_RouteChunk chunks[CRW_MAX_ROUTE_ARGS])
+{
+    const char *pc = route->regex_user;
+    int num = 0;
+    chunks[0].str = pc;
+    while (*pc) {
+        if (*pc == ':') {
+            chunks[num].len = pc - chunks[num].str;
+            pc += strcspn(pc, "/");
+            chunks[++num].str = pc;
+        } else {
+            pc++;
+        }
+    }
+    chunks[num].len = pc - chunks[num].str;
+    return num + 1;
+}
+
+/* the chunks are short and (but the last one) begin with '/' */
+static int CRW_route_chunk_at(const char *URI, size_t pos, size_t end,
+                              const CRW_RouteChunk *chunk)
+{
+    return (pos + chunk->len <= end
+         && (!chunk->len || URI[pos] == chunk->str[0])
+         && !memcmp(URI + pos, chunk->str, chunk->len));
+}
+
+/* the first place of the chunk in [from, end); -1 if none */
+static long CRW_route_chunk_first(const char *URI, size_t from, size_t end,
+                                  const CRW_RouteChunk *chunk)
+{
+    size_t pos = 0;
+    for (pos = from; pos + chunk->len <= end; pos++) {
+        if (CRW_route_chunk_at(URI, pos, end, chunk)) {
+            return pos;
+        }
+    }
+    return -1;
+}
+
+/* the last place of the chunk in [from, end); -1 if none */
+static long CRW_route_chunk_last(const char *URI, size_t from, size_t end,
+                                 const CRW_RouteChunk *chunk)
+{
+    size_t pos = end;
+    while (pos >= from + chunk->len) {
+        pos--;
+        if (CRW_route_chunk_at(URI, pos + 1 - chunk->len, end, chunk)) {
+            return pos + 1 - chunk->len;
+        }
+    }
+    return -1;
+}
+
+/* The same offsets regexec() gives with the route regex, without
+   running it: the match begins as early as it can, then it is made
+   as long as it can, then every tag, from the left, takes as much as
+   it can with the rest still reaching that end.
+   A tag is ([[:print:]]*) and the chunks are printable too, so a
+   match lies within a printable run and, in a run, an earlier chunk
+   can do whatever a later one does. That makes every step a scan. */
+CRW_PRIVATE
+int CRW_route_tree_fetch(const CRW_Route *route, const char *URI,
+                         regmatch_t matches[CRW_MAX_ROUTE_ARGS])
+{
+    CRW_RouteChunk chunks[CRW_MAX_ROUTE_ARGS];
+    int num = CRW_route_split(route, chunks), j = 0;
+    size_t size = strlen(URI), from = 0, run = 0;
+    long begin = -1, end = 0, pos = 0;
+
+    /* the earliest begin, where the earliest chunks fit */
+    for (from = 0; begin < 0 && from < size; from = run + 1) {
+        for (run = from; run < size && isprint((unsigned char)URI[run]);
+             run++) {
+            ;
+        }
+        begin = CRW_route_chunk_first(URI, from, run, &chunks[0]);
+        end = begin + chunks[0].len;
+        for (j = 1; begin >= 0 && j < num; j++) {
+            pos = CRW_route_chunk_first(URI, end, run, &chunks[j]);
+            if (pos < 0) {
+                begin = -1;
+            } else if (j + 1 < num) {
+                end = pos + chunks[j].len;
+            }
+        }
+    }
+    if (begin < 0) {
+        return -1;
+    }
+    /* the longest end: the last chunk as late as it can be */
+    pos = CRW_route_chunk_last(URI, end, run, &chunks[num - 1]);
+    end = (chunks[num - 1].len) ?pos + chunks[num - 1].len :run;
+    matches[0].rm_so = begin;
+    matches[0].rm_eo = end;
+    /* the tags, right to left, each chunk as late as it can be */
+    pos = end - chunks[num - 1].len;
+    for (j = num - 1; j > 0; j--) {
+        matches[j].rm_eo = pos;
+        if (j > 1) {
+            pos = CRW_route_chunk_last(URI, begin + chunks[0].len, pos,
+                                       &chunks[j - 1]);
+        } else {
+            pos = begin;
+        }
+        matches[j].rm_so = pos + chunks[j - 1].len;
+    }
+    if (num < CRW_MAX_ROUTE_ARGS) {
+        matches[num].rm_so = -1;
+        matches[num].rm_eo = -1;
+    }
+    return 0;
+}
+
+/*** dispatcher **********************************************************/
+
+struct crwdispatcher_ {
+    CRW_Instance *inst;
+    list handlers;          /* most recent binding first */
+    int num_bindings;
+    /* compiled at CRW_run time */
+    CRW_RouteNode *tree;
+    CRW_HandlerBinding **fallback; /* !plain routes, most recent first */
+    int num_fallback;
+};
+
+static CRW_Dispatcher *CRW_dispatcher_new(CRW_Instance *inst)
+{
+    CRW_Dispatcher *disp = NULL;
+    if (inst) {
+        disp = calloc(1, sizeof(CRW_Dispatcher));
+        if (disp) {
+            CRW_dispatcher_init(disp, inst);
+        }
+    }
+    return disp;
+}
+
+static void CRW_dispatcher_del(CRW_Dispatcher *disp)
+{
+    CRW_dispatcher_fini(disp);
+    free(disp);
+}
+
+static void free_binding(void *data)
+{
+    CRW_HandlerBinding *HB = data;
+    CRW_route_cleanup(&HB->route);
+    free(HB);
+}
+
+static int CRW_dispatcher_init(CRW_Dispatcher *disp, CRW_Instance *inst)
+{
+    int err = -1;
+    if (disp) {
+        disp->inst = inst;
+        list_init(&disp->handlers, free_binding);
+    }
+    return err;
+}
+
+static int CRW_dispatcher_fini(CRW_Dispatcher *disp)
+{
+    int err = -1;
+    if (disp) {
+        CRW_route_node_del(disp->tree);
+        free(disp->fallback);
+        list_destroy(&disp->handlers);
+    }
+    return err;
+}
+
+/* FIXME: found a way to unclutter */
+CRW_PRIVATE
+int CRW_dispatcher_register(CRW_Dispatcher *disp, const char *route,
+                            CRW_Handler *handler)
+{
+    int err = -1;
+    if (disp && disp->tree) {
+        CRW_log(disp->inst, "dsp", CRW_LOG_ERROR,
+                "cannot bind route [%s]: the dispatcher is already running",
+                route);
+    } else if (disp && route && handler) {
+        CRW_HandlerBinding *HB = calloc(1, sizeof(CRW_HandlerBinding));
+        if (HB) {
+            HB->handler = handler;
+            err = CRW_route_init(&HB->route, route);
+            if (!err) {
+                err = list_insert_next(&disp->handlers, NULL, HB);
+                if (!err) {
+                    HB->seq = disp->num_bindings++;
+                    CRW_log(disp->inst, "dsp", CRW_LOG_DEBUG,
+                            "bound handler %p for route [%s]",
+                            handler, route);
+                } else {
+                    CRW_log(disp->inst, "dsp", CRW_LOG_ERROR,
+                            "failed to bind handler %p for route [%s] error=(%i)",
+                            handler, route, err);
+                }
+            } else {
+                CRW_log(disp->inst, "dsp", CRW_LOG_ERROR,
+                        "failed intialization for route [%s]",
+                        route);
+            }
+        } else {
+            CRW_log(disp->inst, "dsp", CRW_LOG_ERROR,
+                    "cannot allocate an handler binding");
+        }
+    } else {
+        CRW_panic("dsp",
+                  "invalid parameters for CRW_dispatcher_register");
+    }
+    return err;
+}
+
+CRW_PRIVATE
+int CRW_dispatcher_compile(CRW_Dispatcher *disp)
+{
+    int err = -1;
+    if (disp && disp->tree) {
+        err = 0; /* nothing to do */
+    } else if (disp) {
+        list_element *elem = NULL;
+        int num_tree = 0;
+        disp->tree = CRW_route_node_new(NULL, 0);
+        disp->fallback = calloc(list_size(&disp->handlers) + 1,
+                                sizeof(CRW_HandlerBinding *));
+        err = (disp->tree && disp->fallback) ?0 :-1;
+        for (elem = list_head(&disp->handlers);
+             !err && elem;
+             elem = list_next(elem)) {
+            CRW_HandlerBinding *HB = list_data(elem);
+            if (CRW_route_is_plain(&HB->route)) {
+                err = CRW_route_tree_insert(disp->tree, HB);
+                num_tree++;
+            } else {
+                disp->fallback[disp->num_fallback++] = HB;
+            }
+        }
+        if (!err) {
+            CRW_log(disp->inst, "dsp", CRW_LOG_INFO,
+                    "compiled routes: %i in the tree, %i on the regex scan",
+                    num_tree, disp->num_fallback);
+        } else {
+            CRW_log(disp->inst, "dsp", CRW_LOG_ERROR,
+                    "cannot compile the route tree");
+            CRW_route_node_del(disp->tree);
+            free(disp->fallback);
+            disp->tree = NULL;
+            disp->fallback = NULL;
+            disp->num_fallback = 0;
+        }
+    }
+    return err;
+}
+
+/* A private copy of a compiled dispatcher, for an event loop which
+   wants to share nothing with the others: the tree and the fallback
+   table are duplicated, the bindings (and their compiled regexes) are
+   borrowed from the original, which must outlive the copy. */
+CRW_PRIVATE
+CRW_Dispatcher *CRW_dispatcher_clone(const CRW_Dispatcher *disp)
+{
+    CRW_Dispatcher *copy = NULL;
+    if (disp && disp->tree) {
+        copy = calloc(1, sizeof(CRW_Dispatcher));
+        if (copy) {
+            size_t size = (disp->num_fallback + 1)
+                            * sizeof(CRW_HandlerBinding *);
+            /* no bindings in the list, so nothing will be freed twice */
+            list_init(&copy->handlers, free_binding);
+            copy->inst = disp->inst;
+            copy->num_bindings = disp->num_bindings;
+            copy->tree = CRW_route_node_clone(disp->tree);
+            copy->fallback = malloc(size);
+            if (copy->tree && copy->fallback) {
+                memcpy(copy->fallback, disp->fallback, size);
+                copy->num_fallback = disp->num_fallback;
+            } else {
+                CRW_log(disp->inst, "dsp", CRW_LOG_ERROR,
+                        "no memory to copy the route tree");
+                CRW_dispatcher_del(copy);
+                copy = NULL;
+            }
+        }
+    } else if (disp) {
+        CRW_log(disp->inst, "dsp", CRW_LOG_ERROR,
+                "cannot copy a dispatcher not yet compiled");
+    }
+    return copy;
+}
+
+/* the bindings are scanned most recent first, so the first match
+   is also the best one. */
+static CRW_HandlerBinding *CRW_dispatcher_scan(const CRW_Dispatcher *disp,
+                                               const char *URI,
+                                               regmatch_t *matches)
+{
+    CRW_HandlerBinding *found = NULL;
+    list_element *elem = NULL;
+    for (elem = list_head(&disp->handlers);
+         !found && elem;
+         elem = list_next(elem)) {
+        CRW_HandlerBinding *HB = list_data(elem);
+        if (CRW_route_match(&HB->route, URI, matches)) {
+            found = HB;
+        }
+    }
+    return found;
+}
+
+/* read-only on the dispatcher: safe to call from any worker */
+static CRW_HandlerBinding *CRW_dispatcher_lookup(const CRW_Dispatcher *disp,
+                                                 const char *URI,
+                                                 regmatch_t *matches)
+{
+    CRW_HandlerBinding *found = NULL;
+    regmatch_t scratch[CRW_MAX_ROUTE_ARGS];
+    CRW_RouteLookup RL;
+    int j = 0;
+
+    if (!disp->tree) {
+        return CRW_dispatcher_scan(disp, URI, matches);
+    }
+
+    CRW_route_tree_lookup(disp->tree, URI, &RL);
+    if (RL.overflow) {
+        CRW_log(disp->inst, "dsp", CRW_LOG_DEBUG,
+                "too many partial matches for URI=[%s], scanning", URI);
+        return CRW_dispatcher_scan(disp, URI, matches);
+    }
+    /* a regex route registered later than the tree hit still wins */
+    for (j = 0; !found && j < disp->num_fallback; j++) {
+        CRW_HandlerBinding *HB = disp->fallback[j];
+        if (RL.binding && HB->seq < RL.binding->seq) {
+            break;
+        }
+        if (CRW_route_match(&HB->route, URI, scratch)) {
+            memcpy(matches, scratch, sizeof(scratch));
+            found = HB;
+        }
+    }
+    if (!found && RL.binding
+     && !CRW_route_tree_fetch(&RL.binding->route, URI, matches)) {
+        found = RL.binding;
+    }
+    return found;
+}
+
+CRW_PRIVATE
+CRW_Handler *CRW_dispatcher_route(const CRW_Dispatcher *disp, const char *URI,
+                                  CRW_RouteArgs *args)
+{
+    CRW_Handler *handler = NULL;
+    if (disp && URI && args) {
+        regmatch_t matches[CRW_MAX_ROUTE_ARGS];
+        CRW_HandlerBinding *HB = CRW_dispatcher_lookup(disp, URI, matches);
+        if (HB) {
+            int err = 0;
+            CRW_log(disp->inst, "dsp", CRW_LOG_DEBUG,
+                    "handler %p found for URI=[%s] route=[%s]",
+                    HB->handler, URI, HB->route.regex_user);
+            err = CRW_route_fetch(&HB->route, URI, matches, args);
+            if (!err) {
+                handler = HB->handler;
+            } else {
+                CRW_log(disp->inst, "dsp", CRW_LOG_ERROR,
+                        "route args fetch for URI=[%s] failed error=(%i)",
+                        URI, err);
+            }
+        }
+    }
+    return handler;
+}
+
+CRW_PRIVATE
+CRW_Response *CRW_dispatcher_handle(CRW_Dispatcher *disp,
+                                    CRW_Request *request)
+{
+    CRW_Response *res = NULL;
+    if (disp && request) {
+        CRW_Handler *handler = NULL;
+        CRW_log(disp->inst, "dsp", CRW_LOG_DEBUG,
+                "searching handler for URI=[%s]",
+                request->URI);
+        handler = CRW_dispatcher_route(disp, request->URI, &request->args);
+        if (handler) {
+            /* the response shares the arena of the request */
+            CRW_Arena *prev = CRW_arena_set_current(request->arena);
+            res = CRW_handler_call(handler, &request->args, request);
+            CRW_arena_set_current(prev);
+        }
+    } else {
+        CRW_panic("dsp",
+                  "invalid parameters for CRW_dispatcher_handle");
+    }
+    return res;
+}
+
+#ifdef CRW_DEBUG
+
+CRW_PRIVATE
+CRW_Dispatcher *CRW_instance_get_dispatcher(CRW_Instance *inst)
+{
+    return inst->disp;
+}
+
+CRW_PRIVATE
+void CRW_dispatcher_destroy(CRW_Dispatcher *disp)
+{
+    CRW_dispatcher_del(disp);
+}
+
+CRW_PRIVATE
+CRW_RouteArgs *CRW_route_args_new(void)
+{
+    return calloc(1, sizeof(CRW_RouteArgs));
+}
+
+CRW_PRIVATE
+void CRW_route_args_del(CRW_RouteArgs *args)
+{
+    CRW_route_args_cleanup(args);
+    free(args);
+}
+
+#endif /* CRW_DEBUG */
+
+
+
+/*** response cache ******************************************************/
+
+enum {
+    CRW_CACHE_BUCKETS = 256,    /* power of two */
+    CRW_CACHE_MAX_VARY = 8      /* request headers in the key */
+};
+
+typedef struct crwresponsecache_ CRW_ResponseCache;
+typedef struct crwcacheentry_ CRW_CacheEntry;
+
+/* a response as the handler made it. Immutable once built:
+   a refreshed response gets a new entry. The request coalescing
+   shares its responses in entries never cached. */
+struct crwcacheentry_ {
+    CRW_CacheEntry *next;           /* hash chain */
+    CRW_CacheEntry *newer, *older;  /* LRU list */
+    pthread_mutex_t *mutex;         /* of the owner, for the refs */
+    unsigned hash;
+    char *key;                      /* URI, query and varying headers */
+    size_t key_len;
+    size_t uri_len;                 /* URI and query, at the key start */
+    char *tag;                      /* NULL if none */
+    int status_code;
+    char *headers;                  /* as they go on the wire */
+    size_t headers_len;
+    char *body;
+    size_t body_len;
+    long long expires;              /* milliseconds, see CRW_clock_ms */
+    size_t alloc;                   /* bytes charged to the cache */
+    int refs;                       /* responses sending it right now */
+    int cached;                     /* if not, the last user frees it */
+    int refreshing;                 /* a request is making it again */
+};
+
+struct crwresponsecache_ {
+    pthread_mutex_t mutex;          /* for all of the entries too */
+    CRW_CacheEntry *buckets[CRW_CACHE_BUCKETS];
+    CRW_CacheEntry *newest, *oldest;
+    size_t size;
+    size_t used;
+    long long ttl;
+    long long stale;
+    char *vary[CRW_CACHE_MAX_VARY];
+    int num_vary;
+};
+
+static long long CRW_clock_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static unsigned CRW_cache_hash(const char *key, size_t len)
+{
+    unsigned hash = 2166136261U; /* FNV-1a */
+    size_t j = 0;
+    for (j = 0; j < len; j++) {
+        hash = (hash ^ (unsigned char)key[j]) * 16777619U;
+    }
+    return hash;
+}
+
+static CRW_ResponseCache *CRW_cache_new(int ttl, int stale, size_t size)
+{
+    CRW_ResponseCache *cache = calloc(1, sizeof(CRW_ResponseCache));
+    if (cache) {
+        pthread_mutex_init(&cache->mutex, NULL);
+        cache->ttl = ttl;
+        cache->stale = stale;
+        cache->size = size;
+    }
+    return cache;
+}
+
+/* out of the cache. If in use, the last user frees it.
+   Called with the mutex held. */
+static void CRW_cache_unlink(CRW_ResponseCache *cache, CRW_CacheEntry *e)
+{
+    CRW_CacheEntry **pp = &cache->buckets[e->hash & (CRW_CACHE_BUCKETS - 1)];
+    while (*pp != e) {
+        pp = &(*pp)->next;
+    }
+    *pp = e->next;
+    if (e->newer) {
+        e->newer->older = e->older;
+    } else {
+        cache->newest = e->older;
+    }
+    if (e->older) {
+        e->older->newer = e->newer;
+    } else {
+        cache->oldest = e->newer;
+    }
+    cache->used -= e->alloc;
+    e->cached = 0;
+    if (e->refs == 0) {
+        free(e);
+    }
+    return;
+}
+
+/* room is made evicting the least recently used entries.
+   Called with the mutex held. */
+static void CRW_cache_link(CRW_ResponseCache *cache, CRW_CacheEntry *e)
+{
+    CRW_CacheEntry **bucket = &cache->buckets[e->hash
+                                              & (CRW_CACHE_BUCKETS - 1)];
+    while (cache->oldest && cache->used + e->alloc > cache->size) {
+        CRW_cache_unlink(cache, cache->oldest);
+    }
+    e->next = *bucket;
+    *bucket = e;
+    e->newer = NULL;
+    e->older = cache->newest;
+    if (cache->newest) {
+        cache->newest->newer = e;
+    } else {
+        cache->oldest = e;
+    }
+    cache->newest = e;
+    cache->used += e->alloc;
+    e->cached = 1;
+    return;
+}
+
+/* Called with the mutex held. */
+static CRW_CacheEntry *CRW_cache_find(CRW_ResponseCache *cache,
+                                      const char *key, size_t len,
+                                      unsigned hash)
+{
+    CRW_CacheEntry *e = cache->buckets[hash & (CRW_CACHE_BUCKETS - 1)];
+    while (e && (e->hash != hash || e->key_len != len
+              || memcmp(e->key, key, len) != 0)) {
+        e = e->next;
+    }
+    if (e && e->newer) {
+        /* up front */
+        e->newer->older = e->older;
+        if (e->older) {
+            e->older->newer = e->newer;
+        } else {
+            cache->oldest = e->newer;
+        }
+        e->newer = NULL;
+        e->older = cache->newest;
+        cache->newest->newer = e;
+        cache->newest = e;
+    }
+    return e;
+}
+
+static void CRW_cache_put(CRW_CacheEntry *e)
+{
+    int done = 0;
+    pthread_mutex_lock(e->mutex);
+    done = (--e->refs == 0 && !e->cached);
+    pthread_mutex_unlock(e->mutex);
+    if (done) {
+        free(e);
+    }
+    return;
+}
+
+/* as CRW_BodyRelease: the body of a served entry went out */
+static void CRW_cache_release(const void *data, void *release_data)
+{
+    CRW_cache_put(release_data);
+}
+
+static void CRW_cache_del(CRW_ResponseCache *cache)
+{
+    int j = 0;
+    if (cache) {
+        while (cache->oldest) {
+            CRW_cache_unlink(cache, cache->oldest);
+        }
+        for (j = 0; j < cache->num_vary; j++) {
+            free(cache->vary[j]);
+        }
+        pthread_mutex_destroy(&cache->mutex);
+        free(cache);
+    }
+    return;
+}
+
+/* URI, query string and the values of the varying headers (if there is
+   a cache), joined by newlines (which cannot be in any of them).
+   In the request arena. The method is not there: the key is the one
+   of the GET, and a HEAD is answered with the same response (minus the
+   body). The other methods get none. */
+static char *CRW_cache_key(const CRW_ResponseCache *cache,
+                           const CRW_Request *req,
+                           size_t *key_len, size_t *uri_len)
+{
+    const char *values[CRW_CACHE_MAX_VARY];
+    const char *query = req->query_string;
+    size_t len = strlen(req->URI), pos = 0;
+    char *key = NULL;
+    int j = 0;
+    if (req->method != CRW_REQUEST_METHOD_GET
+     && req->method != CRW_REQUEST_METHOD_HEAD) {
+        return NULL;
+    }
+    if (query && *query) {
+        len += 1 + strlen(query);
+    }
+    *uri_len = len;
+    for (j = 0; cache && j < cache->num_vary; j++) {
+        values[j] = CRW_request_get_header_value(req, cache->vary[j]);
+        len += 1 + ((values[j]) ?strlen(values[j]) :0);
+    }
+    key = CRW_request_alloc(req, len + 1);
+    if (key) {
+        pos += sprintf(key + pos, "%s", req->URI);
+        if (query && *query) {
+            pos += sprintf(key + pos, "?%s", query);
+        }
+        for (j = 0; cache && j < cache->num_vary; j++) {
+            pos += sprintf(key + pos, "\n%s", (values[j]) ?values[j] :"");
+        }
+        *key_len = pos;
+    }
+    return key;
+}
+
+/* A fresh entry, or a stale one while somebody else refreshes it:
+   returned with a reference. NULL otherwise; if the caller has to
+   refresh a stale entry, it gets it in refresh, with a reference. */
+static CRW_CacheEntry *CRW_cache_lookup(CRW_ResponseCache *cache,
+                                        const char *key, size_t len,
+                                        CRW_CacheEntry **refresh)
+{
+    long long now = CRW_clock_ms();
+    CRW_CacheEntry *e = NULL;
+    pthread_mutex_lock(&cache->mutex);
+    e = CRW_cache_find(cache, key, len, CRW_cache_hash(key, len));
+    if (e && now >= e->expires) {
+        if (now >= e->expires + cache->stale) {
+            CRW_cache_unlink(cache, e); /* too old to be of any use */
+            e = NULL;
+        } else if (!e->refreshing) {
+            e->refreshing = 1;
+            e->refs++;
+            *refresh = e;
+            e = NULL;
+        }
+    }
+    if (e) {
+        e->refs++;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return e;
+}
+
+/* the entry as a new response; its body is not copied */
+static CRW_Response *CRW_cache_respond(CRW_Instance *inst, CRW_CacheEntry *e)
+{
+    CRW_Response *res = CRW_response_new(inst);
+    const char *line = e->headers;
+    int err = (res) ?0 :-1;
+    while (!err && line < e->headers + e->headers_len) {
+        size_t len = strstr(line, "\r\n") + 2 - line;
+        err = CRW_response_add_header_line(res, line, len);
+        line += len;
+    }
+    if (!err) {
+        res->status_code = e->status_code;
+        err = CRW_response_add_body_ref(res, e->body, e->body_len,
+                                        CRW_cache_release, e);
+        e = NULL; /* released anyway */
+    }
+    if (err) {
+        CRW_response_del(res);
+        res = NULL;
+    }
+    if (e) {
+        CRW_cache_put(e);
+    }
+    return res;
+}
+
+/* the responses to give to others: fine for anybody, all in memory */
+static int CRW_cache_shareable(const CRW_Response *res)
+{
+    const char *cc = CRW_response_find_header(res, "Cache-Control");
+    if (res->status_code == 304 || res->producer || res->file_fd >= 0
+     || res->pending || CRW_response_find_header(res, "Set-Cookie")) {
+        return 0;
+    }
+    while (cc && *cc && *cc != '\r') {
+        if (!strncasecmp(cc, "private", 7)) {
+            return 0;
+        }
+        cc++;
+    }
+    return 1;
+}
+
+/* the responses to keep, for the next ones to come */
+static int CRW_cache_storable(const CRW_Response *res)
+{
+    const char *cc = CRW_response_find_header(res, "Cache-Control");
+    if (res->status_code != 200 || !CRW_cache_shareable(res)) {
+        return 0;
+    }
+    while (cc && *cc && *cc != '\r') {
+        if (!strncasecmp(cc, "no-store", 8)) {
+            return 0;
+        }
+        cc++;
+    }
+    return 1;
+}
+
+/* one allocation for all, up to max_alloc bytes */
+static CRW_CacheEntry *CRW_cache_entry_new(pthread_mutex_t *mutex,
+                                           size_t max_alloc,
+                                           const char *key, size_t key_len,
+                                           size_t uri_len,
+                                           const CRW_Response *res)
+{
+    const CRW_ResponseHeader *hdr = NULL;
+    size_t tag_len = (res->cache_tag) ?strlen(res->cache_tag) + 1 :0;
+    size_t alloc = sizeof(CRW_CacheEntry) + key_len + tag_len
+                 + res->headers_len + res->body_len;
+    CRW_CacheEntry *e = NULL;
+    char *p = NULL;
+    if (alloc > max_alloc || !(e = malloc(alloc))) {
+        return NULL;
+    }
+    p = (char *)(e + 1);
+    e->mutex = mutex;
+    e->hash = CRW_cache_hash(key, key_len);
+    e->key = p;
+    e->key_len = key_len;
+    e->uri_len = uri_len;
+    memcpy(e->key, key, key_len);
+    p += key_len;
+    e->tag = NULL;
+    if (tag_len) {
+        e->tag = p;
+        memcpy(e->tag, res->cache_tag, tag_len);
+        p += tag_len;
+    }
+    e->status_code = res->status_code;
+    e->headers = p;
+    e->headers_len = res->headers_len;
+    for (hdr = res->headers; hdr; hdr = hdr->next) {
+        memcpy(p, hdr->line, hdr->len);
+        p += hdr->len;
+    }
+    e->body = p;
+    e->body_len = CRW_response_copy_body(res, e->body);
+    e->expires = 0;
+    e->alloc = alloc;
+    e->refs = 0;
+    e->cached = 0;
+    e->refreshing = 0;
+    return e;
+}
+
+/* the response the handler just made, for the next ones to come. If it
+   cannot be kept, the stale entry it should have replaced can be
+   refreshed by somebody else. */
+static void CRW_cache_store(CRW_ResponseCache *cache,
+                            const char *key, size_t key_len, size_t uri_len,
+                            const CRW_Response *res, CRW_CacheEntry *refresh)
+{
+    CRW_CacheEntry *e = NULL, *old = NULL;
+    if (res && CRW_cache_storable(res)) {
+        e = CRW_cache_entry_new(&cache->mutex, cache->size,
+                                key, key_len, uri_len, res);
+    }
+    if (e) {
+        e->expires = CRW_clock_ms() + cache->ttl;
+    }
+    pthread_mutex_lock(&cache->mutex);
+    if (e) {
+        old = CRW_cache_find(cache, key, key_len, e->hash);
+        if (old) {
+            CRW_cache_unlink(cache, old); /* newer wins */
+        }
+        CRW_cache_link(cache, e);
+    } else if (refresh) {
+        refresh->refreshing = 0;
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    if (refresh) {
+        CRW_cache_put(refresh);
+    }
+    return;
+}
+
+/* the entry is for the URI; a bare path takes all its query strings */
+static int CRW_cache_purge_match(const CRW_CacheEntry *e,
+                                 const char *uri, size_t len, int bare)
+{
+    return e->uri_len >= len && !memcmp(e->key, uri, len)
+        && (e->uri_len == len || (bare && e->key[len] == '?'));
+}
+
+/* by URI (with the query string, if any) or by tag */
+static int CRW_cache_purge(CRW_ResponseCache *cache,
+                           const char *uri, const char *tag)
+{
+    CRW_CacheEntry *e = NULL, *newer = NULL;
+    size_t len = (uri) ?strlen(uri) :0;
+    int bare = (uri && !strchr(uri, '?'));
+    int num = 0;
+    pthread_mutex_lock(&cache->mutex);
+    for (e = cache->oldest; e; e = newer) {
+        newer = e->newer;
+        if ((uri && CRW_cache_purge_match(e, uri, len, bare))
+         || (tag && e->tag && !strcmp(e->tag, tag))) {
+            CRW_cache_unlink(cache, e);
+            num++;
+        }
+    }
+    pthread_mutex_unlock(&cache->mutex);
+    return num;
+}
+
+
+
+/*** request coalescing **************************************************/
+
+/* Identical requests arriving while the handler is still working on
+   the first one wait for it, and get its response, instead of calling
+   the handler again. */
+
+typedef struct crwflight_ CRW_Flight;
+typedef struct crwcoalescer_ CRW_Coalescer;
+
+/* the handler call the identical requests are waiting for */
+struct crwflight_ {
+    CRW_Flight *next;
+    unsigned hash;
+    const char *key;                /* in the arena of the leader */
+    size_t key_len;
+    pthread_t leader;
+    int waiters;
+    int landed;
+    CRW_CacheEntry *shared;         /* a reference for each waiter */
+};
+
+struct crwcoalescer_ {
+    pthread_mutex_t mutex;          /* for the shared entries too */
+    pthread_cond_t landed;
+    CRW_Flight *flights;            /* few: one per busy worker at most */
+};
+
+static CRW_Coalescer *CRW_coalescer_new(void)
+{
+    CRW_Coalescer *coal = calloc(1, sizeof(CRW_Coalescer));
+    if (coal) {
+        pthread_mutex_init(&coal->mutex, NULL);
+        pthread_cond_init(&coal->landed, NULL);
+    }
+    return coal;
+}
+
+static void CRW_coalescer_del(CRW_Coalescer *coal)
+{
+    if (coal) {
+        pthread_cond_destroy(&coal->landed);
+        pthread_mutex_destroy(&coal->mutex);
+        free(coal);
+    }
+    return;
+}
+
+/* Called with the mutex held. */
+static CRW_Flight *CRW_coalescer_find(CRW_Coalescer *coal,
+                                      const char *key, size_t len,
+                                      unsigned hash)
+{
+    CRW_Flight *F = coal->flights;
+    while (F && (F->hash != hash || F->key_len != len
+              || memcmp(F->key, key, len) != 0)) {
+        F = F->next;
+    }
+    return F;
+}
+
+/* Called with the mutex held. */
+static void CRW_coalescer_unlink(CRW_Coalescer *coal, CRW_Flight *F)
+{
+    CRW_Flight **pp = &coal->flights;
+    while (*pp != F) {
+        pp = &(*pp)->next;
+    }
+    *pp = F->next;
+    return;
+}
+
+/* The response of the identical request in flight, with a reference,
+   once it lands. NULL if there is none, or it could not be shared:
+   then the caller is the leader, if it got lead. */
+static CRW_CacheEntry *CRW_coalescer_join(CRW_Coalescer *coal,
+                                          const char *key, size_t len,
+                                          CRW_Flight **lead)
+{
+    unsigned hash = CRW_cache_hash(key, len);
+    CRW_CacheEntry *e = NULL;
+    CRW_Flight *F = NULL;
+    int last = 0;
+    pthread_mutex_lock(&coal->mutex);
+    F = CRW_coalescer_find(coal, key, len, hash);
+    if (!F) {
+        F = malloc(sizeof(CRW_Flight));
+        if (F) {
+            F->hash = hash;
+            F->key = key;
+            F->key_len = len;
+            F->leader = pthread_self();
+            F->waiters = 0;
+            F->landed = 0;
+            F->shared = NULL;
+            F->next = coal->flights;
+            coal->flights = F;
+            *lead = F;
+        }
+        F = NULL;
+    } else if (pthread_equal(F->leader, pthread_self())) {
+        F = NULL; /* from within the handler itself: would never land */
+    } else {
+        F->waiters++;
+        while (!F->landed) {
+            pthread_cond_wait(&coal->landed, &coal->mutex);
+        }
+        e = F->shared;
+        last = (--F->waiters == 0);
+    }
+    pthread_mutex_unlock(&coal->mutex);
+    if (last) {
+        free(F);
+    }
+    return e;
+}
+
+/* the waiters get their copies of the response, if they can */
+static void CRW_coalescer_land(CRW_Coalescer *coal, CRW_Flight *F,
+                               const CRW_Response *res)
+{
+    CRW_CacheEntry *e = NULL;
+    int waiters = 0;
+    pthread_mutex_lock(&coal->mutex);
+    CRW_coalescer_unlink(coal, F); /* nobody else joins from now on */
+    waiters = F->waiters;
+    pthread_mutex_unlock(&coal->mutex);
+    if (waiters && res && CRW_cache_shareable(res)) {
+        e = CRW_cache_entry_new(&coal->mutex, (size_t)-1,
+                                F->key, F->key_len, F->key_len, res);
+    }
+    pthread_mutex_lock(&coal->mutex);
+    if (e) {
+        e->refs = waiters;
+    }
+    F->shared = e;
+    F->landed = 1;
+    pthread_cond_broadcast(&coal->landed);
+    pthread_mutex_unlock(&coal->mutex);
+    if (!waiters) {
+        free(F);
+    }
+    return;
+}
+
+
+
+/*** handler *************************************************************/
+
+struct crwhandler_ {
+    CRW_Instance *inst;
+    const char *route;
+    CRW_HandlerCallback callback;
+    void *userdata;
+    const CRW_Asset *assets;    /* for the asset handlers, sorted by path */
+    size_t num_assets;
+    CRW_ResponseCache *cache;   /* NULL if not cached */
+    CRW_Coalescer *coalescer;   /* NULL if not coalescing */
+    int etag;                   /* automatic ETags */
+};
+
+CRW_Handler *CRW_handler_new(CRW_Instance *inst,
+                             const char *route,
+                             CRW_HandlerCallback callback,
+                             void *userdata)
+{
+    CRW_Handler *handler = NULL;
+    if (inst && inst->disp && route && callback) {
+        handler = calloc(1, sizeof(CRW_Handler));
+        if (handler) {
+            handler->inst = inst;
+            handler->route = route;
+            handler->callback = callback;
+            handler->userdata = userdata;
+        }
+    }
+    return handler;
+}
+
+void CRW_handler_del(CRW_Handler *handler)
+{
+    if (handler) {
+        CRW_cache_del(handler->cache);
+        CRW_coalescer_del(handler->coalescer);
+    }
+    free(handler);
+}
+
+static CRW_Response *CRW_handler_invoke(CRW_Handler *handler,
+                                        const CRW_RouteArgs *args,
+                                        const CRW_Request *req)
+{
+    CRW_Response *res = handler->callback(handler->inst,
+                                          args, req, handler->userdata);
+    if (res && handler->etag) {
+        CRW_response_auto_etag(res);
+    }
+    return res;
+}
+
+/* the GETs only: the others may do something each time. Not on the
+   event loops either: waiting would stall all their connections.
+   joined tells if the response is the one of another request. */
+static CRW_Response *CRW_handler_call_coalesced(CRW_Handler *handler,
+                                                const CRW_RouteArgs *args,
+                                                const CRW_Request *req,
+                                                const char *key, size_t len,
+                                                int *joined)
+{
+    CRW_Flight *lead = NULL;
+    CRW_CacheEntry *e = NULL;
+    CRW_Response *res = NULL;
+    if (key && req->method == CRW_REQUEST_METHOD_GET && !req->no_wait) {
+        e = CRW_coalescer_join(handler->coalescer, key, len, &lead);
+    }
+    if (e) {
+        res = CRW_cache_respond(handler->inst, e);
+        *joined = (res != NULL);
+    }
+    if (!res) {
+        res = CRW_handler_invoke(handler, args, req);
+    }
+    if (lead) {
+        CRW_coalescer_land(handler->coalescer, lead, res);
+    }
+    return res;
+}
+
+/* GET and HEAD go through the cache; HEAD does not fill it, the
+   handler may leave the body out */
+static CRW_Response *CRW_handler_call_cached(CRW_Handler *handler,
+                                             const CRW_RouteArgs *args,
+                                             const CRW_Request *req)
+{
+    CRW_ResponseCache *cache = handler->cache;
+    CRW_CacheEntry *e = NULL, *refresh = NULL;
+    CRW_Response *res = NULL;
+    size_t key_len = 0, uri_len = 0;
+    char *key = CRW_cache_key(cache, req, &key_len, &uri_len);
+    if (key) {
+        e = CRW_cache_lookup(cache, key, key_len, &refresh);
+    }
+    if (e) {
+        res = CRW_cache_respond(handler->inst, e);
+    }
+    if (!res) {
+        int joined = 0;
+        if (handler->coalescer) {
+            res = CRW_handler_call_coalesced(handler, args, req,
+                                             key, key_len, &joined);
+        } else {
+            res = CRW_handler_invoke(handler, args, req);
+        }
+        if (key && req->method == CRW_REQUEST_METHOD_GET && !joined) {
+            CRW_cache_store(cache, key, key_len, uri_len, res, refresh);
+        } else if (refresh) {
+            CRW_cache_store(cache, key, key_len, uri_len, NULL, refresh);
+        }
+    }
+    return res;
+}
+
+static CRW_Response *CRW_handler_call(CRW_Handler *handler,
+                                      const CRW_RouteArgs *args,
+                                      const CRW_Request *req)
+{
+    CRW_Response *res = NULL;
+    if (handler && args && req) {
+        if (handler->cache
+         && (req->method == CRW_REQUEST_METHOD_GET
+          || req->method == CRW_REQUEST_METHOD_HEAD)) {
+            res = CRW_handler_call_cached(handler, args, req);
+        } else if (handler->coalescer) {
+            int joined = 0;
+            size_t key_len = 0, uri_len = 0;
+            char *key = CRW_cache_key(NULL, req, &key_len, &uri_len);
+            res = CRW_handler_call_coalesced(handler, args, req,
+                                             key, key_len, &joined);
+        } else {
+            res = CRW_handler_invoke(handler, args, req);
+        }
+        if (res && (handler->etag || handler->cache || handler->coalescer)) {
+            /* the responses shared, or cached, are made 304 only
+               for the requests which can have it */
+            CRW_response_not_modified(res, req);
+        }
+    }
+    return res;
+}
+
+int CRW_handler_set_cache(CRW_Handler *handler,
+                          int ttl, int stale, size_t max_size)
+{
+    int err = -1;
+    if (handler && ttl > 0 && stale >= 0 && max_size > 0) {
+        CRW_ResponseCache *cache = CRW_cache_new(ttl, stale, max_size);
+        if (cache) {
+            CRW_cache_del(handler->cache);
+            handler->cache = cache;
+            err = 0;
+        }
+    }
+    return err;
+}
+
+int CRW_handler_cache_vary(CRW_Handler *handler, const char *header)
+{
+    int err = -1;
+    if (handler && handler->cache && header
+     && handler->cache->num_vary < CRW_CACHE_MAX_VARY) {
+        CRW_ResponseCache *cache = handler->cache;
+        cache->vary[cache->num_vary] = strdup(header);
+        if (cache->vary[cache->num_vary]) {
+            cache->num_vary++;
+            err = 0;
+        }
+    }
+    return err;
+}
+
+int CRW_handler_cache_purge(CRW_Handler *handler, const char *uri)
+{
+    int num = -1;
+    if (handler && handler->cache && uri) {
+        num = CRW_cache_purge(handler->cache, uri, NULL);
+    }
+    return num;
+}
+
+int CRW_handler_cache_purge_tag(CRW_Handler *handler, const char *tag)
+{
+    int num = -1;
+    if (handler && handler->cache && tag) {
+        num = CRW_cache_purge(handler->cache, NULL, tag);
+    }
+    return num;
+}
+
+int CRW_handler_set_coalescing(CRW_Handler *handler, int enabled)
+{
+    int err = -1;
+    if (handler && enabled && !handler->coalescer) {
+        handler->coalescer = CRW_coalescer_new();
+        err = (handler->coalescer) ?0 :-1;
+    } else if (handler) {
+        if (!enabled) {
+            CRW_coalescer_del(handler->coalescer);
+            handler->coalescer = NULL;
+        }
+        err = 0;
+    }
+    return err;
+}
+
+int CRW_handler_set_etag(CRW_Handler *handler, int enabled)
+{
+    int err = -1;
+    if (handler) {
+        handler->etag = (enabled) ?1 :0;
+        err = 0;
+    }
+    return err;
+}
+
+int CRW_handler_add_route(CRW_Handler *handler, const char *route)
+{
+    int err = -1;
+    if (handler && handler->inst && handler->inst->disp) {
+        err = CRW_dispatcher_register(handler->inst->disp, route, handler);
+    }
+    return err;
+}
+
+/*** http ****************************************************************/
+
+/* a minimal HTTP/1.x codec for the native server adapters.
+   The parser works in place: the request fields point into the buffer,
+   which must outlive the request. */
+
+enum {
+    CRW_HTTP_DEFAULT_REQUEST_SIZE = 16384, /* same as mongoose */
+    CRW_HTTP_STATUS_LINE_LEN = 64,
+    CRW_HTTP_EXTRA_HEADERS_LEN = 64,       /* Content-Length+Connection */
+    CRW_HTTP_CHUNK_HEAD_LEN = 24
+};
+
+typedef struct crwhttpinfo_ CRW_HTTPInfo;
+struct crwhttpinfo_ {
+    int version_minor;
+    int keep_alive;
+    int chunked;
+    long content_length;
+};
+
+static const char *CRW_http_reason(int status_code)
+{
+    const char *reason = "Unknown";
+    switch (status_code) {
+      case 200: reason = "OK"; break;
+      case 204: reason = "No Content"; break;
+      case 304: reason = "Not Modified"; break;
+      case 400: reason = "Bad Request"; break;
+      case 404: reason = "Not Found"; break;
+      case 411: reason = "Length Required"; break;
+      case 413: reason = "Request Entity Too Large"; break;
+      case 431: reason = "Request Header Fields Too Large"; break;
+      case 500: reason = "Internal Server Error"; break;
+      case 503: reason = "Service Unavailable"; break;
+      default:  reason = "Unknown"; break;
+    }
+    return reason;
+}
+
+/* in place, like mongoose does on the URI */
+static void CRW_http_url_decode(char *str)
+{
+    char *dst = str;
+    while (*str) {
+        int hi = -1, lo = -1;
+        if (str[0] == '%'
+         && (hi = CRW_http_hexval(str[1])) >= 0
+         && (lo = CRW_http_hexval(str[2])) >= 0) {
+            *dst++ = (char)((hi << 4) | lo);
+            str += 3;
+        } else {
+            *dst++ = *str++;
+        }
+    }
+    *dst = '\0';
+}
+
+/* returns the length of the line, terminator included, or 0 if
+   incomplete. The terminator ("\r\n" or "\n") is zeroed. */
+static size_t CRW_http_cut_line(char *buf, size_t len)
+{
+    size_t linelen = 0;
+    char *nl = memchr(buf, '\n', len);
+    if (nl) {
+        linelen = nl - buf + 1;
+        *nl = '\0';
+        if (nl > buf && nl[-1] == '\r') {
+            nl[-1] = '\0';
+        }
+    }
+    return linelen;
+}
+
+/* where the header block ends, or 0 if not yet complete */
+static size_t CRW_http_find_head_end(const char *buf, size_t len)
+{
+    size_t j = 0;
+    for (j = 0; j + 1 < len; j++) {
+        if (buf[j] == '\n') {
+            if (buf[j + 1] == '\n') {
+                return j + 2;
+            }
+            if (buf[j + 1] == '\r' && j + 2 < len && buf[j + 2] == '\n') {
+                return j + 3;
+            }
+        }
+    }
+    return 0;
+}
+
+/* the length of the head, the empty lines before the request line
+   included (RFC2616 4.1), or 0 if not all there */
+static size_t CRW_http_head_len(const char *buf, size_t len)
+{
+    size_t pos = 0, headlen = 0;
+    while (pos < len && (buf[pos] == '\r' || buf[pos] == '\n')) {
+        pos++;
+    }
+    headlen = CRW_http_find_head_end(buf + pos, len - pos);
+    return (headlen) ?pos + headlen :0;
+}
+
+static int CRW_http_parse_request_line(char *line, CRW_Request *req,
+                                       CRW_HTTPInfo *info)
+{
+    int err = -1;
+    char *URI = strchr(line, ' ');
+    char *version = NULL;
+    if (URI) {
+        *URI++ = '\0';
+        version = strchr(URI, ' ');
+    }
+    if (version) {
+        char *query = NULL;
+        *version++ = '\0';
+        if (!strncmp(version, "HTTP/1.", 7)
+         && version[7] >= '0' && version[7] <= '9' && !version[8]
+         && URI[0] == '/') {
+            info->version_minor = version[7] - '0';
+            query = strchr(URI, '?');
+            if (query) {
+                *query++ = '\0';
+            }
+            CRW_http_url_decode(URI);
+            req->method = CRW_request_method_from_str(line);
+            req->URI = URI;
+            req->query_string = query;
+            err = 0;
+        }
+    }
+    return err;
+}
+
+static int CRW_http_parse_header(char *line, CRW_Request *req,
+                                 CRW_HTTPInfo *info)
+{
+    int err = -1;
+    char *value = strchr(line, ':');
+    if (value && value > line) {
+        *value++ = '\0';
+        while (*value == ' ' || *value == '\t') {
+            value++;
+        }
+        switch (CRW_request_add_header(req, line, value)) {
+          case CRW_HDR_CONNECTION:
+            if (!strcasecmp(value, "close")) {
+                info->keep_alive = 0;
+            } else if (!strcasecmp(value, "keep-alive")) {
+                info->keep_alive = 1;
+            }
+            break;
+          case CRW_HDR_CONTENT_LENGTH: {
+            char *end = NULL;
+            info->content_length = strtol(value, &end, 10);
+            if (end == value || *end || info->content_length < 0) {
+                return -1;
+            }
+            break;
+          }
+          case CRW_HDR_TRANSFER_ENCODING:
+            info->chunked = (strcasecmp(value, "identity") != 0);
+            break;
+          default:
+            break;
+        }
+        err = 0;
+    }
+    return err;
+}
+
+/* returns the length of the request head (so the body, if any, starts
+   there), 0 if the head is still incomplete, <0 if malformed. */
+CRW_PRIVATE
+int CRW_http_parse_request(char *buf, size_t len,
+                           CRW_Request *req, CRW_HTTPInfo *info)
+{
+    size_t headlen = 0, pos = 0, linelen = 0;
+    int err = 0;
+    if (!buf || !req || !info) {
+        return -1;
+    }
+    headlen = CRW_http_head_len(buf, len);
+    if (!headlen) {
+        return 0;
+    }
+    /* tolerate the empty lines before the request line (RFC2616 4.1) */
+    while (buf[pos] == '\r' || buf[pos] == '\n') {
+        pos++;
+    }
+    memset(info, 0, sizeof(*info));
+    linelen = CRW_http_cut_line(buf + pos, headlen - pos);
+    err = CRW_http_parse_request_line(buf + pos, req, info);
+    /* HTTP/1.1 defaults to persistent connections, HTTP/1.0 doesn't */
+    info->keep_alive = (info->version_minor >= 1);
+    pos += linelen;
+    while (!err && pos < headlen) {
+        linelen = CRW_http_cut_line(buf + pos, headlen - pos);
+        if (buf[pos] != '\0') {
+            err = CRW_http_parse_header(buf + pos, req, info);
+        }
+        pos += linelen;
+    }
+    return (err) ?-1 :(int)headlen;
+}
+
+/* status line, user headers, Content-Length, Connection and the blank
+   line. A stream has no length: it goes in chunks, or (for the clients
+   which cannot take them) until the connection is closed.
+   The buffer lives in the arena of the response. */
+static char *CRW_http_format_head(CRW_Response *res, int keep_alive,
+                                  int chunked, size_t *headlen)
+{
+    size_t size = CRW_HTTP_STATUS_LINE_LEN + CRW_HTTP_EXTRA_HEADERS_LEN
+                + res->headers_len;
+    char *head = CRW_arena_alloc(res->arena, size);
+    if (head) {
+        const CRW_ResponseHeader *hdr = NULL;
+        size_t pos = 0;
+        pos += snprintf(head + pos, size - pos, "HTTP/1.1 %i %s\r\n",
+                        res->status_code,
+                        CRW_http_reason(res->status_code));
+        for (hdr = res->headers; hdr; hdr = hdr->next) {
+            memcpy(head + pos, hdr->line, hdr->len);
+            pos += hdr->len;
+        }
+        if (res->producer) {
+            if (chunked) {
+                pos += snprintf(head + pos, size - pos,
+                                "Transfer-Encoding: chunked\r\n");
+            }
+        } else if (res->status_code == 204 || res->status_code == 304) {
+            /* no body, by definition: no length to tell */
+        } else {
+            pos += snprintf(head + pos, size - pos,
+                            "Content-Length: %lu\r\n",
+                            (unsigned long)CRW_response_body_len(res));
+        }
+        pos += snprintf(head + pos, size - pos, "Connection: %s\r\n\r\n",
+                        (keep_alive) ?"keep-alive" :"close");
+        *headlen = pos;
+    }
+    return head;
+}
+
+#ifdef CRW_DEBUG
+
+CRW_PRIVATE
+CRW_HTTPInfo *CRW_http_info_new(void)
+{
+    return calloc(1, sizeof(CRW_HTTPInfo));
+}
+
+CRW_PRIVATE
+void CRW_http_info_del(CRW_HTTPInfo *info)
+{
+    free(info);
+}
+
+CRW_PRIVATE
+int CRW_http_info_keep_alive(const CRW_HTTPInfo *info)
+{
+    return info->keep_alive;
+}
+
+CRW_PRIVATE
+long CRW_http_info_content_length(const CRW_HTTPInfo *info)
+{
+    return info->content_length;
+}
+
+CRW_PRIVATE
+const char *CRW_request_get_URI(const CRW_Request *req)
+{
+    return req->URI;
+}
+
+#endif /* CRW_DEBUG */
+
+#if defined(CRW_NATIVE_SERVER) || defined(CRW_DEBUG)
+
+/* the native servers have no body streaming: the whole request must
+   fit the buffer. Returns the HTTP status to refuse it with, 0 if ok */
+CRW_PRIVATE
+int CRW_http_body_check(const CRW_HTTPInfo *info, int headlen,
+                        size_t max_len)
+{
+    int status = 0;
+    if (info->chunked) {
+        status = 411; /* no chunked request bodies (yet) */
+    } else if (info->content_length > (long)max_len - headlen) {
+        status = 413;
+    }
+    return status;
+}
+
+#endif /* CRW_NATIVE_SERVER || CRW_DEBUG */
+
+/* the next item of a comma separated header value, without the blanks
+   (and the line end) around it. Returns its length, 0 if the list is over. */
+static size_t CRW_http_list_next(const char **list, const char **item)
+{
+    const char *p = *list;
+    size_t len = 0;
+    while (*p == ' ' || *p == '\t' || *p == ',') {
+        p++;
+    }
+    *item = p;
+    while (p[len] && p[len] != ',') {
+        len++;
+    }
+    *list = p + len;
+    while (len && (p[len - 1] == ' ' || p[len - 1] == '\t'
+                || p[len - 1] == '\r' || p[len - 1] == '\n')) {
+        len--;
+    }
+    return len;
+}
+
+/* If-None-Match: does the client already have this entity tag
+   (etag_len bytes long)? Weak comparison, as RFC 7232 wants for it. */
+static int CRW_http_etag_match(const char *if_none_match,
+                               const char *etag, size_t etag_len)
+{
+    const char *item = NULL;
+    size_t len = 0;
+    if (!if_none_match || !etag) {
+        return 0;
+    }
+    if (etag_len > 2 && !strncmp(etag, "W/", 2)) {
+        etag += 2;
+        etag_len -= 2;
+    }
+    while ((len = CRW_http_list_next(&if_none_match, &item)) > 0) {
+        if (len == 1 && item[0] == '*') {
+            return 1;
+        }
+        if (len > 2 && !strncmp(item, "W/", 2)) {
+            item += 2;
+            len -= 2;
+        }
+        if (len == etag_len && !strncmp(item, etag, len)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Accept-Encoding: is the coding acceptable, with a non-zero q? */
+static int CRW_http_accepts_coding(const char *accept_encoding,
+                                   const char *coding)
+{
+    const char *item = NULL;
+    size_t len = 0, clen = strlen(coding);
+    if (!accept_encoding) {
+        return 0;
+    }
+    while ((len = CRW_http_list_next(&accept_encoding, &item)) > 0) {
+        size_t name = 0;
+        while (name < len && item[name] != ';'
+            && item[name] != ' ' && item[name] != '\t') {
+            name++;
+        }
+        if (name == clen && !strncasecmp(item, coding, clen)) {
+            const char *q = item + name;
+            while (q < item + len && *q != '=') {
+                q++;
+            }
+            /* q=0, q=0.0 and so on turn it down */
+            return q >= item + len || strtod(q + 1, NULL) > 0.0;
+        }
+    }
+    return 0;
+}
+
+/* for the adapters, when the application cannot say anything. */
+static CRW_Response *CRW_http_error_response(CRW_Instance *inst,
+                                             int status_code)
+{
+    CRW_Response *res = CRW_response_new(inst);
+    if (res) {
+        res->status_code = status_code;
+        CRW_response_add_header(res, "Content-Type", "text/plain");
+        CRW_response_add_body(res, CRW_http_reason(status_code));
+        CRW_response_add_body(res, "\n");
+    }
+    return res;
+}
+
+
+
+/*** http: compression ***************************************************/
+
+enum {
+    CRW_COMPRESS_DEFAULT_MIN_SIZE = 1024,
+    CRW_GZIP_LEVEL = 6,             /* zlib default: the sweet spot */
+    CRW_GZIP_WINDOW_BITS = 15 + 16, /* max window, gzip wrapper */
+    CRW_GZIP_MEM_LEVEL = 8,
+    CRW_GZIP_BUF_LEN = 4096         /* to start with, for the streams */
+};
+
+/* the floor from the configuration, 0 if compression is off */
+static size_t CRW_compress_min_size(const CRW_Config *cfg)
+{
+    size_t min_size = 0;
+#ifdef ENABLE_GZIP
+    if (cfg->compress) {
+        min_size = (cfg->compress_min_size) ?cfg->compress_min_size
+                                            :CRW_COMPRESS_DEFAULT_MIN_SIZE;
+    }
+#endif
+    return min_size;
+}
+
+#ifdef CRW_DEBUG
+
+CRW_PRIVATE
+void CRW_instance_set_compress_min_size(CRW_Instance *inst, size_t min_size)
+{
+    inst->compress_min_size = min_size;
+}
+
+#endif /* CRW_DEBUG */
+
+#ifdef ENABLE_GZIP
+
+/* text, and the structured syntaxes on top of it: the images, the
+   archives and so on are compressed already */
+static int CRW_http_type_compressible(const char *type)
+{
+    static const char *prefixes[] = {
+        "text/", "application/json", "application/javascript",
+        "application/xml", "application/xhtml+xml", "image/svg+xml", NULL
+    };
+    static const char *suffixes[] = { "+json", "+xml", NULL };
+    size_t len = 0;
+    int j = 0;
+    if (!type) {
+        return 0;
+    }
+    while (type[len] && type[len] != ';' && type[len] != ' '
+        && type[len] != '\r') {
+        len++;
+    }
+    for (j = 0; prefixes[j]; j++) {
+        size_t plen = strlen(prefixes[j]);
+        if (len >= plen && !strncasecmp(type, prefixes[j], plen)) {
+            return 1;
+        }
+    }
+    for (j = 0; suffixes[j]; j++) {
+        size_t slen = strlen(suffixes[j]);
+        if (len > slen && !strncasecmp(type + len - slen, suffixes[j], slen)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* worth a look: a body the handler did not encode on its own, nor put
+   in a file (that goes out with sendfile()), of a compressible type,
+   and large enough (a stream may always be). */
+static int CRW_response_compressible(const CRW_Response *res)
+{
+    return res->compress_min_size > 0
+        && res->status_code >= 200
+        && res->status_code != 204 && res->status_code != 304
+        && res->file_fd < 0
+        && (res->producer || res->body_len >= res->compress_min_size)
+        && !CRW_response_find_header(res, "Content-Encoding")
+        && CRW_http_type_compressible(CRW_response_find_header(res,
+                                                         "Content-Type"));
+}
+
+/* the body depends on Accept-Encoding now, the caches have to know */
+static int CRW_response_vary_coding(CRW_Response *res)
+{
+    const char *vary = CRW_response_find_header(res, "Vary");
+    const char *item = NULL;
+    size_t len = 0;
+    while (vary && (len = CRW_http_list_next(&vary, &item)) > 0) {
+        if ((len == 1 && item[0] == '*')
+         || (len == 15 && !strncasecmp(item, "Accept-Encoding", len))) {
+            return 0;
+        }
+    }
+    return CRW_response_add_header(res, "Vary", "Accept-Encoding");
+}
+
+/* from the deflater to the buffer, grown as needed, until the input is
+   over and the flush is done. One byte is left for the '\0' the bodies
+   end with. Returns 0 on success, <0 on error. */
+static int CRW_gzip_feed(z_stream *zs, const void *data, size_t len,
+                         int flush, char **buf, size_t *size, size_t *out)
+{
+    int ret = Z_OK;
+    zs->next_in = (Bytef *)data;
+    zs->avail_in = (uInt)len;
+    do {
+        if (*out + 1 >= *size) {
+            size_t newsize = (*size) ?*size * 2 :CRW_GZIP_BUF_LEN;
+            char *newbuf = realloc(*buf, newsize);
+            if (!newbuf) {
+                return -1;
+            }
+            *buf = newbuf;
+            *size = newsize;
+        }
+        zs->next_out = (Bytef *)(*buf + *out);
+        zs->avail_out = (uInt)(*size - *out - 1);
+        ret = deflate(zs, flush);
+        *out = *size - 1 - zs->avail_out;
+    } while (ret == Z_OK
+          && (zs->avail_in > 0 || zs->avail_out == 0 || flush == Z_FINISH));
+    /* Z_BUF_ERROR: nothing left to flush */
+    return (ret == Z_OK || ret == Z_STREAM_END || ret == Z_BUF_ERROR) ?0 :-1;
+}
+
+/* the whole body through the deflater */
+static int CRW_gzip_response_body(z_stream *zs, const CRW_Response *res,
+                                  int flush,
+                                  char **buf, size_t *size, size_t *out)
+{
+    size_t off = 0;
+    int num = 0, err = 0;
+    do {
+        CRW_BodyPiece piece;
+        num = CRW_response_body_pieces(res, off, &piece, 1);
+        if (num) {
+            err = CRW_gzip_feed(zs, piece.data, piece.len, Z_NO_FLUSH,
+                                buf, size, out);
+            off += piece.len;
+        }
+    } while (num && !err);
+    if (!err) {
+        err = CRW_gzip_feed(zs, NULL, 0, flush, buf, size, out);
+    }
+    return err;
+}
+
+/* the buffer becomes the body (its len first bytes); the old body
+   buffer goes back in exchange. */
+static void CRW_response_swap_body(CRW_Response *res,
+                                   char **buf, size_t *size, size_t len)
+{
+    char *body = res->body;
+    size_t body_size = res->body_size;
+    CRW_response_release_refs(res);
+    res->body = *buf;
+    res->body_size = *size;
+    res->body_pos = len;
+    res->body_len = len;
+    res->body[len] = '\0';
+    *buf = body;
+    *size = body_size;
+    return;
+}
+
+static int CRW_gzip_init(z_stream *zs)
+{
+    memset(zs, 0, sizeof(*zs));
+    return deflateInit2(zs, CRW_GZIP_LEVEL, Z_DEFLATED,
+                        CRW_GZIP_WINDOW_BITS, CRW_GZIP_MEM_LEVEL,
+                        Z_DEFAULT_STRATEGY);
+}
+
+/* all at once; the body stays as it is if it does not shrink,
+   or if anything goes wrong. */
+static void CRW_response_gzip(CRW_Response *res)
+{
+    z_stream zs;
+    char *buf = NULL;
+    size_t size = 0, out = 0;
+    if (CRW_gzip_init(&zs) != Z_OK) {
+        return;
+    }
+    size = deflateBound(&zs, res->body_len) + 1;
+    buf = malloc(size);
+    if (buf
+     && CRW_gzip_response_body(&zs, res, Z_FINISH, &buf, &size, &out) == 0
+     && out < res->body_len
+     && CRW_response_add_header(res, "Content-Encoding", "gzip") == 0) {
+        CRW_response_swap_body(res, &buf, &size, out);
+    }
+    deflateEnd(&zs);
+    free(buf);
+    return;
+}
+
+#endif /* ENABLE_GZIP */
+
+
+/*** http: deferred responses ********************************************/
+
+/* A deferred response comes back to the thread owning the connection:
+   an event loop through a queue of its own, woken up by a byte in a
+   pipe; the synchronous adapters just wait for it. */
+
+typedef struct crwpendingqueue_ CRW_PendingQueue;
+struct crwpendingqueue_ {
+    pthread_mutex_t mutex;
+    CRW_Pending *done;      /* completed, to be sent */
+    int wake_fd;            /* a byte there wakes the owner up */
+    int signaled;           /* the byte is on its way already */
+    int closing;            /* the owner is going (owner only) */
+};
+
+struct crwpending_ {
+    CRW_Pending *next;      /* in the queue of the owner */
+    pthread_mutex_t mutex;  /* for what follows */
+    pthread_cond_t landed;
+    CRW_Request *req;       /* detached: it goes with the token */
+    CRW_Response *res;      /* once completed */
+    int completed;
+    int abandoned;          /* the connection went away */
+    CRW_PendingQueue *queue;    /* of the owner, once attached */
+    void *conn;
+    /* the reply, as it would have been (native servers) */
+    int keep_alive;
+    int flags;
+};
+
+static void CRW_pending_del(CRW_Pending *P)
+{
+    /* the completer may be still on its way out */
+    pthread_mutex_lock(&P->mutex);
+    pthread_mutex_unlock(&P->mutex);
+    CRW_response_del(P->res);
+    CRW_request_del(P->req);
+    pthread_cond_destroy(&P->landed);
+    pthread_mutex_destroy(&P->mutex);
+    free(P);
+}
+
+CRW_Response *CRW_response_defer(CRW_Instance *inst, const CRW_Request *req,
+                                 CRW_Pending **pending)
+{
+    CRW_Response *res = NULL;
+    if (inst && req && pending) {
+        /* the accessors are const for the caller, not for the token */
+        CRW_Request *mreq = (CRW_Request *)req;
+        CRW_Pending *P = calloc(1, sizeof(CRW_Pending));
+        res = (P) ?CRW_response_new(inst) :NULL;
+        if (res && CRW_request_detach(mreq) == 0) {
+            pthread_mutex_init(&P->mutex, NULL);
+            pthread_cond_init(&P->landed, NULL);
+            P->req = mreq;
+            res->pending = P;
+            *pending = P;
+        } else {
+            CRW_log(inst, "hdl", CRW_LOG_ERROR,
+                    "cannot defer the response for URI=[%s]", req->URI);
+            CRW_response_del(res);
+            free(P);
+            res = NULL;
+        }
+    }
+    return res;
+}
+
+const CRW_Request *CRW_pending_get_request(const CRW_Pending *pending)
+{
+    const CRW_Request *req = NULL;
+    if (pending) {
+        req = pending->req;
+    }
+    return req;
+}
+
+const CRW_RouteArgs *CRW_pending_get_route_args(const CRW_Pending *pending)
+{
+    const CRW_RouteArgs *args = NULL;
+    if (pending) {
+        args = &pending->req->args;
+    }
+    return args;
+}
+
+#ifdef CRW_NATIVE_SERVER
+
+static void CRW_pending_queue_init(CRW_PendingQueue *Q)
+{
+    pthread_mutex_init(&Q->mutex, NULL);
+    Q->done = NULL;
+    Q->wake_fd = -1;
+    Q->signaled = 0;
+    Q->closing = 0;
+}
+
+/* under the lock of the token */
+static void CRW_pending_queue_push(CRW_PendingQueue *Q, CRW_Pending *P)
+{
+    pthread_mutex_lock(&Q->mutex);
+    P->next = Q->done;
+    Q->done = P;
+    if (!Q->signaled && Q->wake_fd >= 0) {
+        char byte = 1;
+        Q->signaled = (write(Q->wake_fd, &byte, 1) == 1);
+    }
+    pthread_mutex_unlock(&Q->mutex);
+    return;
+}
+
+/* for the owner, once woken up: what was completed so far */
+static CRW_Pending *CRW_pending_queue_take(CRW_PendingQueue *Q)
+{
+    CRW_Pending *done = NULL;
+    pthread_mutex_lock(&Q->mutex);
+    done = Q->done;
+    Q->done = NULL;
+    Q->signaled = 0;
+    pthread_mutex_unlock(&Q->mutex);
+    return done;
+}
+
+/* the owner is going: nobody will send them */
+static void CRW_pending_queue_flush(CRW_PendingQueue *Q)
+{
+    CRW_Pending *P = CRW_pending_queue_take(Q), *next = NULL;
+    for (; P; P = next) {
+        next = P->next;
+        CRW_pending_del(P);
+    }
+    return;
+}
+
+static void CRW_pending_queue_fini(CRW_PendingQueue *Q)
+{
+    CRW_pending_queue_flush(Q);
+    pthread_mutex_destroy(&Q->mutex);
+}
+
+/* the response may be there already, if the handler was quick */
+static void CRW_pending_attach(CRW_Pending *P, CRW_PendingQueue *Q,
+                               void *conn)
+{
+    pthread_mutex_lock(&P->mutex);
+    P->queue = Q;
+    P->conn = conn;
+    if (P->completed) {
+        CRW_pending_queue_push(Q, P);
+    }
+    pthread_mutex_unlock(&P->mutex);
+    return;
+}
+
+/* the connection is going: once completed, the token still goes back
+   to the owner, to be freed on its thread. Unless the owner is going
+   too: then the completer frees it. */
+static void CRW_pending_abandon(CRW_Pending *P)
+{
+    pthread_mutex_lock(&P->mutex);
+    P->abandoned = 1;
+    if (P->queue && P->queue->closing) {
+        P->queue = NULL;
+    }
+    pthread_mutex_unlock(&P->mutex);
+    return;
+}
+
+#endif /* CRW_NATIVE_SERVER */
+
+/* for the adapters: the placeholder back from the handler goes,
+   the token takes the request over */
+static CRW_Pending *CRW_pending_claim(CRW_Response *res)
+{
+    CRW_Pending *P = res->pending;
+    CRW_response_del(res);
+    return P;
+}
+
+/* for the synchronous adapters: a deferred response is waited for,
+   then the request is theirs again */
+static CRW_Response *CRW_pending_resolve(CRW_Instance *inst,
+                                         CRW_Response *res)
+{
+    if (res && res->pending) {
+        CRW_Pending *P = CRW_pending_claim(res);
+        pthread_mutex_lock(&P->mutex);
+        while (!P->completed) {
+            pthread_cond_wait(&P->landed, &P->mutex);
+        }
+        res = P->res;
+        P->res = NULL;
+        P->req = NULL;
+        pthread_mutex_unlock(&P->mutex);
+        CRW_pending_del(P);
+        if (!res) {
+            res = CRW_http_error_response(inst, 500);
+        }
+    }
+    return res;
+}
+
+int CRW_response_complete(CRW_Pending *pending, CRW_Response *res)
+{
+    int err = -1;
+    if (pending) {
+        CRW_Pending *P = pending;
+        int orphan = 0;
+        pthread_mutex_lock(&P->mutex);
+        P->res = res;
+        P->completed = 1;
+        orphan = P->abandoned;
+#ifdef CRW_NATIVE_SERVER
+        if (P->queue) {
+            CRW_pending_queue_push(P->queue, P);
+            orphan = 0; /* the owner frees it, if abandoned */
+        }
+#endif
+        pthread_cond_signal(&P->landed);
+        pthread_mutex_unlock(&P->mutex);
+        if (orphan) {
+            CRW_pending_del(P); /* nobody to send it to */
+        }
+        err = 0;
+    } else {
+        CRW_response_del(res);
+    }
+    return err;
+}
+
+
+/*** http: replies *******************************************************/
+
+/* what the server adapters have to send back for a request */
+typedef struct crwhttpreply_ CRW_HTTPReply;
+struct crwhttpreply_ {
+    CRW_Response *res;
+    char *head;         /* serialized status line + headers, in res;
+                           then the size line of each chunk */
+    size_t head_len;
+    int keep_alive;
+    int held;           /* the body waits for the head to be sent */
+    int ended;          /* the last chunk is in */
+    int raw;            /* a stream with no chunks: the close ends it */
+    char *chunk_head;   /* in res */
+#ifdef ENABLE_GZIP
+    z_stream *gzip;     /* for the chunks to come, in res: cannot move */
+    char *gzip_buf;     /* swapped with the body at each chunk */
+    size_t gzip_size;
+#endif
+};
+
+enum {
+    CRW_HTTP_REPLY_HEAD_ONLY = 1 << 0,  /* HEAD request */
+    CRW_HTTP_REPLY_NO_CHUNKED = 1 << 1, /* HTTP/1.0 client */
+    CRW_HTTP_REPLY_GZIP = 1 << 2        /* the client takes gzip */
+};
+
+#ifdef ENABLE_GZIP
+
+/* a body as the client prefers it: as a whole, or chunk by chunk
+   (see CRW_http_reply_gzip_chunk) for a stream. */
+static void CRW_http_reply_gzip_start(CRW_HTTPReply *reply,
+                                      CRW_Response *res, int flags)
+{
+    if (!CRW_response_compressible(res)
+     || CRW_response_vary_coding(res) != 0
+     || !(flags & CRW_HTTP_REPLY_GZIP)) {
+        return;
+    }
+    if (!res->producer) {
+        CRW_response_gzip(res);
+    } else if (flags & CRW_HTTP_REPLY_HEAD_ONLY) {
+        /* no chunks to come: just tell the truth */
+        CRW_response_add_header(res, "Content-Encoding", "gzip");
+    } else {
+        reply->gzip = CRW_arena_alloc(res->arena, sizeof(z_stream));
+        if (reply->gzip && CRW_gzip_init(reply->gzip) != Z_OK) {
+            reply->gzip = NULL;
+        }
+        if (reply->gzip
+         && CRW_response_add_header(res, "Content-Encoding", "gzip") != 0) {
+            deflateEnd(reply->gzip);
+            reply->gzip = NULL;
+        }
+    }
+    return;
+}
+
+/* the chunk in the body gets compressed, flushed so the client sees it
+   now; after the last one, the gzip trailer. */
+static int CRW_http_reply_gzip_chunk(CRW_HTTPReply *reply, int done)
+{
+    size_t out = 0;
+    int err = CRW_gzip_response_body(reply->gzip, reply->res,
+                                     (done) ?Z_FINISH :Z_SYNC_FLUSH,
+                                     &reply->gzip_buf, &reply->gzip_size,
+                                     &out);
+    if (!err) {
+        CRW_response_swap_body(reply->res, &reply->gzip_buf,
+                               &reply->gzip_size, out);
+    }
+    return err;
+}
+
+static void CRW_http_reply_gzip_end(CRW_HTTPReply *reply)
+{
+    if (reply->gzip) {
+        deflateEnd(reply->gzip);
+    }
+    free(reply->gzip_buf);
+    return;
+}
+
+#endif /* ENABLE_GZIP */
+
+static void CRW_http_reply_set(CRW_HTTPReply *reply, CRW_Response *res,
+                               int keep_alive, int flags)
+{
+    memset(reply, 0, sizeof(*reply));
+    if (res) {
+        if (res->producer && (flags & CRW_HTTP_REPLY_NO_CHUNKED)) {
+            reply->raw = 1;
+            keep_alive = 0;
+        }
+#ifdef ENABLE_GZIP
+        CRW_http_reply_gzip_start(reply, res, flags);
+#endif
+        if (res->producer) {
+            /* the head goes first, on its own; then nothing for HEAD */
+            reply->held = !(flags & CRW_HTTP_REPLY_HEAD_ONLY);
+            reply->ended = !reply->held;
+            reply->chunk_head = CRW_arena_alloc(res->arena,
+                                                CRW_HTTP_CHUNK_HEAD_LEN);
+        }
+        reply->head = CRW_http_format_head(res, keep_alive, !reply->raw,
+                                           &reply->head_len);
+        if (reply->head && (!res->producer || reply->chunk_head)) {
+            if (flags & CRW_HTTP_REPLY_HEAD_ONLY) {
+                /* Content-Length is already in, drop the body */
+                CRW_response_drop_body(res);
+            }
+            reply->res = res;
+            reply->keep_alive = keep_alive;
+        } else {
+#ifdef ENABLE_GZIP
+            CRW_http_reply_gzip_end(reply);
+#endif
+            CRW_response_del(res);
+            memset(reply, 0, sizeof(*reply));
+        }
+    }
+    return;
+}
+
+static int CRW_http_reply_flags(const CRW_Request *req, int version_minor)
+{
+    int flags = 0;
+    if (req && req->method == CRW_REQUEST_METHOD_HEAD) {
+        flags |= CRW_HTTP_REPLY_HEAD_ONLY;
+    }
+    if (req && CRW_http_accepts_coding(CRW_request_get_known_header(req,
+                                                CRW_HDR_ACCEPT_ENCODING),
+                                       "gzip")) {
+        flags |= CRW_HTTP_REPLY_GZIP;
+    }
+    if (version_minor < 1) {
+        flags |= CRW_HTTP_REPLY_NO_CHUNKED;
+    }
+    return flags;
+}
+
+/* the reply went out as a whole: for a streamed response, get the next
+   chunk in (to be sent from the offset 0).
+   Returns 1 if there is more to send, 0 if done, <0 on error. */
+static int CRW_http_reply_next(CRW_HTTPReply *reply)
+{
+    CRW_Response *res = reply->res;
+    size_t len = 0;
+    int done = 0, err = 0;
+    if (!res || !res->producer || (reply->ended && !reply->held)) {
+        return 0;
+    }
+    if (reply->held) {
+        reply->held = 0; /* what the handler added is the first chunk */
+    } else {
+        CRW_response_drop_body(res);
+    }
+    done = reply->ended;
+    while (!done && CRW_response_body_len(res) == 0) {
+        done = res->producer(res->stream_data, res);
+    }
+    if (done < 0) {
+        return -1;
+    }
+#ifdef ENABLE_GZIP
+    if (reply->gzip && CRW_http_reply_gzip_chunk(reply, done) != 0) {
+        return -1;
+    }
+#endif
+    reply->ended = done;
+    reply->head = reply->chunk_head;
+    reply->head_len = 0;
+    len = CRW_response_body_len(res);
+    if (reply->raw) {
+        /* as it is */
+    } else if (len > 0) {
+        reply->head_len = snprintf(reply->chunk_head, CRW_HTTP_CHUNK_HEAD_LEN,
+                                   "%lx\r\n", (unsigned long)len);
+        err = CRW_response_add_body_len(res, "\r\n", 2);
+    }
+    if (!err && done && !reply->raw) {
+        err = CRW_response_add_body_len(res, "0\r\n\r\n", 5);
+    }
+    return (err) ?-1 :1;
+}
+
+static void CRW_http_reply_cleanup(CRW_HTTPReply *reply)
+{
+#ifdef ENABLE_GZIP
+    CRW_http_reply_gzip_end(reply);
+#endif
+    CRW_response_del(reply->res); /* the head goes with it */
+    memset(reply, 0, sizeof(*reply));
+    return;
+}
+
+enum {
+    CRW_HTTP_MAX_PIECES = 16    /* per gather write */
+};
+
+static size_t CRW_http_reply_len(const CRW_HTTPReply *reply)
+{
+    return reply->head_len
+         + ((reply->held) ?0 :CRW_response_body_len(reply->res));
+}
+
+/* head and body from the offset on, ready for a gather write */
+static int CRW_http_reply_pieces(const CRW_HTTPReply *reply, size_t off,
+                                 CRW_BodyPiece *pieces, int max)
+{
+    int num = 0;
+    if (off < reply->head_len) {
+        pieces[num].data = reply->head + off;
+        pieces[num].len = reply->head_len - off;
+        num++;
+        off = 0;
+    } else {
+        off -= reply->head_len;
+    }
+    if (reply->held) {
+        return num;
+    }
+    return num + CRW_response_body_pieces(reply->res, off,
+                                          pieces + num, max - num);
+}
+
+/* when the pieces are over, the body may go on with a file: the bytes
+   to send from it (with sendfile() and friends), 0 if none. */
+static size_t CRW_http_reply_file(const CRW_HTTPReply *reply, size_t off,
+                                  int *fd, off_t *file_off)
+{
+    if (reply->held || off < reply->head_len) {
+        return 0;
+    }
+    return CRW_response_body_file(reply->res, off - reply->head_len,
+                                  fd, file_off);
+}
+
+#ifdef CRW_DEBUG
+
+/* the whole serving path, minus the transport: the reply is gathered
+   in out. Returns its length, <0 if it does not fit or on error. */
+CRW_PRIVATE
+int CRW_http_respond(CRW_Instance *inst, char *buf, size_t len,
+                     char *out, size_t size)
+{
+    CRW_Request *req = CRW_request_new(inst);
+    CRW_Response *res = NULL;
+    CRW_HTTPReply reply;
+    CRW_HTTPInfo info;
+    int ret = -1;
+    int headlen = 0;
+    if (req && (headlen = CRW_http_parse_request(buf, len, req, &info)) > 0) {
+        if (info.content_length <= (long)(len - headlen)) {
+            CRW_request_set_body_buffer(req, buf + headlen,
+                                        info.content_length);
+        }
+        res = CRW_pending_resolve(inst, CRW_dispatcher_handle(inst->disp,
+                                                              req));
+        if (!res) {
+            res = CRW_http_error_response(inst, 404);
+        }
+        CRW_http_reply_set(&reply, res, info.keep_alive,
+                           CRW_http_reply_flags(req, info.version_minor));
+        /* as the native servers do: the reply outlives the request */
+        CRW_request_del(req);
+        req = NULL;
+        if (reply.res) {
+            size_t len = 0;
+            int more = 1;
+            while (more > 0 && len + CRW_http_reply_len(&reply) <= size) {
+                CRW_BodyPiece pieces[CRW_HTTP_MAX_PIECES];
+                size_t off = 0, file_len = 0;
+                off_t file_off = 0;
+                int j = 0, num = 0, fd = -1;
+                do {
+                    num = CRW_http_reply_pieces(&reply, off, pieces,
+                                                CRW_HTTP_MAX_PIECES);
+                    for (j = 0; j < num; j++) {
+                        memcpy(out + len + off, pieces[j].data,
+                               pieces[j].len);
+                        off += pieces[j].len;
+                    }
+                } while (num > 0);
+                file_len = CRW_http_reply_file(&reply, off, &fd, &file_off);
+                if (file_len > 0
+                 && pread(fd, out + len + off, file_len, file_off)
+                    == (ssize_t)file_len) {
+                    off += file_len;
+                }
+                len += off;
+                more = CRW_http_reply_next(&reply);
+            }
+            ret = (more == 0) ?(int)len :-1;
+        }
+        CRW_http_reply_cleanup(&reply);
+    }
+    CRW_request_del(req);
+    return ret;
+}
+
+#endif /* CRW_DEBUG */
+
+/*** assets **************************************************************/
+
+#define CRW_ASSET_INDEX "index.html"
+
+static int CRW_asset_compare(const void *key, const void *elem)
+{
+    const CRW_Asset *asset = elem;
+    return strcmp(key, asset->path);
+}
+
+/* a directory stands for its index.html */
+static const CRW_Asset *CRW_assets_find(const CRW_Handler *handler,
+                                        const CRW_Request *req)
+{
+    const char *path = req->URI;
+    size_t len = (path) ?strlen(path) :0;
+    if (len && path[len - 1] == '/') {
+        char *index = CRW_request_alloc(req, len + sizeof(CRW_ASSET_INDEX));
+        if (!index) {
+            return NULL;
+        }
+        memcpy(index, path, len);
+        memcpy(index + len, CRW_ASSET_INDEX, sizeof(CRW_ASSET_INDEX));
+        path = index;
+    }
+    if (!len) {
+        return NULL;
+    }
+    return bsearch(path, handler->assets, handler->num_assets,
+                   sizeof(CRW_Asset), CRW_asset_compare);
+}
+
+static CRW_Response *CRW_assets_handle(CRW_Instance *inst,
+                                       const CRW_RouteArgs *args,
+                                       const CRW_Request *req,
+                                       void *userdata)
+{
+    const CRW_Asset *asset = CRW_assets_find(userdata, req);
+    CRW_Response *res = NULL;
+    if (!asset) {
+        return CRW_http_error_response(inst, 404);
+    }
+    res = CRW_response_new(inst);
+    if (res) {
+        const char *accept = CRW_request_get_known_header(req,
+                                                CRW_HDR_ACCEPT_ENCODING);
+        /* each representation has its own validator */
+        int negotiable = (asset->data_gzip && asset->etag_gzip);
+        int gzipped = negotiable && CRW_http_accepts_coding(accept, "gzip");
+        const char *etag = (gzipped) ?asset->etag_gzip :asset->etag;
+        CRW_response_add_header(res, "ETag", etag);
+        if (negotiable) {
+            CRW_response_add_header(res, "Vary", "Accept-Encoding");
+        }
+        if (CRW_http_etag_match(CRW_request_get_known_header(req,
+                                                CRW_HDR_IF_NONE_MATCH),
+                                etag, strlen(etag))) {
+            res->status_code = 304;
+        } else if (gzipped) {
+            CRW_response_add_header(res, "Content-Type", asset->mime_type);
+            CRW_response_add_header(res, "Content-Encoding", "gzip");
+            CRW_response_add_body_ref(res, asset->data_gzip,
+                                      asset->size_gzip, NULL, NULL);
+        } else {
+            CRW_response_add_header(res, "Content-Type", asset->mime_type);
+            CRW_response_add_body_ref(res, asset->data, asset->size,
+                                      NULL, NULL);
+        }
+    }
+    return res;
+}
+
+CRW_Handler *CRW_handler_new_assets(CRW_Instance *inst,
+                                    const char *route,
+                                    const CRW_Asset *assets)
+{
+    CRW_Handler *handler = NULL;
+    if (assets) {
+        handler = CRW_handler_new(inst, route, CRW_assets_handle, NULL);
+    }
+    if (handler) {
+        handler->userdata = handler;
+        handler->assets = assets;
+        while (assets[handler->num_assets].path) {
+            handler->num_assets++;
+        }
+    }
+    return handler;
+}
+
+/*** server adapters *****************************************************/
+
+enum {
+    CRW_PORT_STR_LEN = 8,
+    CRW_NUM_STR_LEN = 16
+};
+
+/* the dispatcher is read-only while serving, so we can use all the cores */
+static int CRW_server_default_workers(void)
+{
+    /* FIXME (portability) */
+    long num = sysconf(_SC_NPROCESSORS_ONLN);
+    return (num > 0) ?(int)num :1;
+}
+
+struct crwserveradapter_ {
+    CRW_Instance *inst;
+    CRW_LogHandler logger;
+    CRW_Dispatcher *disp;
+    CRW_ServerAdapterType server_type;
+    int running;
+
+    void *priv;
+
+    int (*destroy)(CRW_ServerAdapter *serv);
+    int (*run)(CRW_ServerAdapter *serv);
+    int (*stop)(CRW_ServerAdapter *serv);
+    /* optional: only for the adapters owning their event loops */
+    int (*count_shards)(CRW_ServerAdapter *serv);
+    int (*shard_stats)(CRW_ServerAdapter *serv, int shard,
+                       CRW_ShardStats *stats);
+};
+
+
+static int CRW_server_adapter_init_error(CRW_ServerAdapter *serv,
+                                         const CRW_Config *cfg)
+{
+    return -1;
+}
+
+/*** server adapters: native HTTP serving ********************************/
+#ifdef CRW_NATIVE_SERVER
+
+/* serves the first request in buf, if complete. Returns the bytes
+   consumed (the reply is filled), or 0 if more input is needed.
+   A reply without a response means: just close the connection.
+   A deferred response leaves the reply alone and gives the token
+   instead, to be attached to the connection. */
+static size_t CRW_http_serve(CRW_ServerAdapter *serv, CRW_Dispatcher *disp,
+                             char *buf, size_t len, size_t max_len,
+                             int keep_alive, CRW_HTTPReply *reply,
+                             CRW_Pending **pending)
+{
+    CRW_Request *req = CRW_request_new(serv->inst);
+    CRW_Response *res = NULL;
+    CRW_HTTPInfo info;
+    size_t used = 0;
+    int headlen = 0, flags = 0, reuse = 0, status = 0;
+    char *head = NULL;
+
+    *pending = NULL;
+
+    if (!req) {
+        CRW_log(serv->inst, "srv", CRW_LOG_CRITICAL,
+                "no memory for a new request");
+        CRW_http_reply_set(reply, CRW_http_error_response(serv->inst, 503),
+                           0, 0);
+        return len;
+    }
+    CRW_request_set_no_wait(req);
+    /* the parser works in place, but the body may still be on its way:
+       the buffer must stay as it is for the next try */
+    headlen = CRW_http_head_len(buf, len);
+    if (headlen > 0) {
+        head = CRW_arena_alloc(req->arena, headlen + 1);
+        if (head) {
+            memcpy(head, buf, headlen);
+            head[headlen] = '\0';
+        }
+        headlen = (head) ?CRW_http_parse_request(head, headlen, req, &info)
+                         :-1;
+    }
+    if (headlen < 0) {
+        res = CRW_http_error_response(serv->inst, 400);
+        used = len;
+    } else if (headlen == 0) {
+        if (len >= max_len) {
+            res = CRW_http_error_response(serv->inst, 431);
+            used = len;
+        }
+    } else if ((status = CRW_http_body_check(&info, headlen, max_len))) {
+        res = CRW_http_error_response(serv->inst, status);
+        used = len;
+    } else if (info.content_length <= (long)(len - headlen)) {
+        used = headlen + info.content_length;
+        /* after an error we cannot trust the rest of the stream */
+        reuse = (keep_alive && info.keep_alive);
+        flags = CRW_http_reply_flags(req, info.version_minor);
+        CRW_request_set_body_buffer(req, buf + headlen, info.content_length);
+        res = CRW_dispatcher_handle(disp, req);
+        if (!res) {
+            res = CRW_http_error_response(serv->inst, 404);
+        } else if (res->pending) {
+            *pending = CRW_pending_claim(res);
+            (*pending)->keep_alive = reuse;
+            (*pending)->flags = flags;
+            return used; /* the request goes with the token */
+        }
+    }
+    if (used) {
+        CRW_http_reply_set(reply, res, reuse, flags);
+    }
+    CRW_request_del(req);
+    return used;
+}
+
+/* a token of the connection was completed: the reply to send, and the
+   token goes with its request. Returns the connection, NULL if it went
+   away meanwhile (and the reply is left alone). */
+static void *CRW_http_serve_completed(CRW_ServerAdapter *serv,
+                                      CRW_Pending *P, CRW_HTTPReply *reply)
+{
+    void *conn = (P->abandoned) ?NULL :P->conn;
+    if (conn) {
+        CRW_Response *res = P->res;
+        P->res = NULL;
+        if (!res) {
+            res = CRW_http_error_response(serv->inst, 500);
+        }
+        CRW_http_reply_set(reply, res, P->keep_alive, P->flags);
+    }
+    CRW_pending_del(P);
+    return conn;
+}
+
+/* like mongoose: a client going away must not kill the application */
+static void CRW_server_ignore_sigpipe(void)
+{
+    signal(SIGPIPE, SIG_IGN);
+    return;
+}
+
+static int CRW_server_set_nonblocking(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    return (flags < 0) ?-1 :fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int CRW_server_address(CRW_ServerAdapter *serv, const CRW_Config *cfg,
+                              struct sockaddr_in *addr)
+{
+    int err = 0;
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(cfg->port);
+    if (inet_pton(AF_INET, cfg->host, &addr->sin_addr) != 1) {
+        CRW_log(serv->inst, "srv", CRW_LOG_CRITICAL,
+                "invalid IPv4 address (%s)", cfg->host);
+        err = -1;
+    }
+    return err;
+}
+
+/* returns the listening socket, <0 on error */
+static int CRW_server_listen(const struct sockaddr_in *addr, int backlog,
+                             int reuse_port)
+{
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0) {
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+#ifdef SO_REUSEPORT
+        /* if it fails, so will the bind() of the next socket */
+        if (reuse_port) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+        }
+#endif
+        if (bind(fd, (const struct sockaddr *)addr, sizeof(*addr)) != 0
+         || listen(fd, backlog) != 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    return fd;
+}
+
+/* binds the calling thread to the index-th online CPU.
+   Returns the CPU, or -1 if the thread was left alone. */
+static int CRW_server_pin_thread(int index)
+{
+    int cpu = -1;
+#ifdef __linux__
+    long num = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET((num > 0) ?index % num :0, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+        cpu = (num > 0) ?index % num :0;
+    }
+#endif
+    return cpu;
+}
+
+/* a loop is the only writer of its counters: no need for locked
+   instructions, just for stores the readers cannot see torn. */
+static void CRW_shard_stats_add(unsigned long *counter, long delta)
+{
+    __atomic_store_n(counter,
+                     __atomic_load_n(counter, __ATOMIC_RELAXED) + delta,
+                     __ATOMIC_RELAXED);
+    return;
+}
+
+static void CRW_shard_stats_read(const CRW_ShardStats *src,
+                                 CRW_ShardStats *dst)
+{
+    dst->cpu = src->cpu;
+    dst->accepted = __atomic_load_n(&src->accepted, __ATOMIC_RELAXED);
+    dst->requests = __atomic_load_n(&src->requests, __ATOMIC_RELAXED);
+    dst->active = __atomic_load_n(&src->active, __ATOMIC_RELAXED);
+    return;
+}
+
+#endif /* CRW_NATIVE_SERVER */
+
+/*** server adapters: specific: mongoose *********************************/
+#ifdef ENABLE_BUILTIN_MONGOOSE
+
+enum {
+    CRW_MONGOOSE_OPTION_NUM = 24
+};
+
+typedef struct crwserveradaptermongoose_ CRW_ServerAdapterMongoose;
+struct crwserveradaptermongoose_ {
+    struct mg_context *ctx;
+    const char *options[CRW_MONGOOSE_OPTION_NUM + 1]; /* ending NULL */
+    char *hostname;
+    char *docroot;
+    size_t hostlen;
+    int num_options;
+    int keep_alive;
+    char num_threads[CRW_NUM_STR_LEN];
+    char queue_size[CRW_NUM_STR_LEN];
+    char request_size[CRW_NUM_STR_LEN];
+    char static_cache_size[CRW_NUM_STR_LEN];
+};
+
+static int CRW_mongoose_read_body(void *source, char *buf, size_t len)
+{
+    return mg_read(source, buf, len);
+}
+
+static int CRW_server_adapter_mongoose_build(CRW_ServerAdapter *serv,
+                                             struct mg_connection *conn,
+                                             const struct mg_request_info *request_info,
+                                             CRW_Request *req)
+{
+    int err = 0;
+    if (serv && request_info && req) {
+        const char *cl = NULL;
+        int j = 0;
+        req->method = CRW_request_method_from_str(request_info->request_method);
+        req->URI = request_info->uri;
+        req->query_string = request_info->query_string;
+        for (j = 0; j < request_info->num_headers; j++) {
+            CRW_request_add_header(req, request_info->http_headers[j].name,
+                                   request_info->http_headers[j].value);
+        }
+        /* mongoose does the bookkeeping, and refused a bogus length */
+        cl = CRW_request_get_known_header(req, CRW_HDR_CONTENT_LENGTH);
+        CRW_request_set_body_source(req, (cl) ?strtol(cl, NULL, 10) :0,
+                                    CRW_mongoose_read_body, conn);
+    }
+    return err;
+}
+
+
+/* mirrors what mongoose will do with the connection afterwards */
+static int CRW_server_adapter_mongoose_keep_alive(CRW_ServerAdapter *serv,
+                                                  struct mg_connection *conn,
+                                                  const struct mg_request_info *request_info)
+{
+    CRW_ServerAdapterMongoose *MG = serv->priv;
+    const char *header = mg_get_header(conn, "Connection");
+    int keep_alive = 0;
+    if (header) {
+        keep_alive = !strcasecmp(header, "keep-alive");
+    } else {
+        keep_alive = (request_info->http_version
+                   && !strcmp(request_info->http_version, "1.1"));
+    }
+    return MG->keep_alive && keep_alive;
+}
+
+/* what the handler left unread of the body would be taken for the next
+   request: read it away, unless it is too much to be worth it. */
+static int CRW_server_adapter_mongoose_drain(CRW_Request *req)
+{
+    char buf[CRW_REQUEST_BODY_CHUNK];
+    if (!req) {
+        return -1;
+    }
+    if (req->body.length - req->body.consumed > CRW_REQUEST_BODY_DRAIN_MAX) {
+        return -1; /* mongoose will close the connection */
+    }
+    while (CRW_request_read_body(req, buf, sizeof(buf)) > 0) {
+        /* nothing */ ;
+    }
+    return (req->body.consumed < req->body.length) ?-1 :0;
+}
+
+/* no route: a GET or HEAD may still be for a static file */
+/* only when asked for: mongoose would serve its working directory */
+static int CRW_server_adapter_mongoose_static(CRW_ServerAdapter *serv,
+                                              const CRW_Request *req)
+{
+    CRW_ServerAdapterMongoose *MG = serv->priv;
+    CRW_RequestMethod meth = CRW_request_get_method(req);
+    return MG->docroot
+        && (meth == CRW_REQUEST_METHOD_GET || meth == CRW_REQUEST_METHOD_HEAD)
+        && !CRW_request_get_content_length(req);
+}
+
+/* head and body with gather writes, the body is not copied, a file
+   body goes with sendfile(). The writes block, so a streamed body is
+   produced at the client pace. */
+static int CRW_server_adapter_mongoose_send(CRW_ServerAdapter *serv,
+                                            struct mg_connection *conn,
+                                            CRW_HTTPReply *reply)
+{
+    int err = 0, more = 1;
+    if (!reply->res) {
+        return -1; /* nothing to send: out of memory */
+    }
+    while (!err && more > 0) {
+        size_t len = CRW_http_reply_len(reply), off = 0;
+        while (!err && off < len) {
+            CRW_BodyPiece pieces[MG_MAX_IOVEC];
+            struct mg_iovec iov[MG_MAX_IOVEC];
+            size_t chunk = 0;
+            int num = CRW_http_reply_pieces(reply, off, pieces, MG_MAX_IOVEC);
+            int j = 0;
+            if (num == 0) {
+                int fd = -1;
+                off_t file_off = 0;
+                chunk = CRW_http_reply_file(reply, off, &fd, &file_off);
+                if (!chunk || mg_sendfile(conn, fd, file_off, chunk)
+                                                    != (long long)chunk) {
+                    CRW_log(serv->inst, "mng", CRW_LOG_WARNING,
+                            "short file send to the client");
+                    err = -1;
+                }
+                off += chunk;
+                continue;
+            }
+            for (j = 0; j < num; j++) {
+                iov[j].buf = pieces[j].data;
+                iov[j].len = pieces[j].len;
+                chunk += pieces[j].len;
+            }
+            if (mg_writev(conn, iov, num) != (int)chunk) {
+                CRW_log(serv->inst, "mng", CRW_LOG_WARNING,
+                        "short write to the client");
+                err = -1;
+            }
+            off += chunk;
+        }
+        if (!err) {
+            more = CRW_http_reply_next(reply);
+            err = (more < 0) ?-1 :0;
+        }
+    }
+    if (err || !reply->keep_alive) {
+        /* the client cannot tell where we stopped, or waits for the close
+           to tell the end of the body */
+        mg_must_close(conn);
+    }
+    return err;
+}
+
+
+static void *CRW_mongoose_event_handler(enum mg_event event,
+                                        struct mg_connection *conn,
+                                        const struct mg_request_info *request_info)
+{
+    void *processed = "craneweb";
+    /* almost always. Mongoose should'nt do anything on its own,
+       but serving static files and the errors along the way */
+    CRW_ServerAdapter *serv = request_info->user_data;
+    if (event == MG_NEW_REQUEST) {
+        CRW_Request *req = CRW_request_new(serv->inst);
+        CRW_Response *res = NULL;
+        CRW_HTTPReply reply;
+        int keep_alive = 0, flags = 0;
+        if (req) {
+            CRW_server_adapter_mongoose_build(serv, conn, request_info, req);
+            /* a deferred response holds this thread: mongoose has
+               no loop to go back to */
+            res = CRW_pending_resolve(serv->inst,
+                                      CRW_dispatcher_handle(serv->disp,
+                                                            req));
+            if (!res && CRW_server_adapter_mongoose_static(serv, req)) {
+                CRW_request_del(req);
+                return NULL; /* from the document root, with sendfile() */
+            }
+            if (!res) {
+                res = CRW_http_error_response(serv->inst, 404);
+            }
+            flags = CRW_http_reply_flags(req,
+                                         (request_info->http_version
+                                       && !strcmp(request_info->http_version,
+                                                  "1.0")) ?0 :1);
+        } else {
+            CRW_log(serv->inst, "mng", CRW_LOG_CRITICAL,
+                    "no memory for a new request");
+            res = CRW_http_error_response(serv->inst, 503);
+        }
+        keep_alive = CRW_server_adapter_mongoose_keep_alive(serv, conn,
+                                                            request_info)
+                  && CRW_server_adapter_mongoose_drain(req) == 0;
+        CRW_http_reply_set(&reply, res, keep_alive, flags);
+        CRW_server_adapter_mongoose_send(serv, conn, &reply);
+        CRW_http_reply_cleanup(&reply);
+        CRW_request_del(req);
+    } else if (event == MG_HTTP_ERROR) {
+        processed = NULL; /* mongoose knows better what went wrong */
+    } /* else we're not interested in. */
+    return processed;
+}
+
+
+
+static int CRW_server_adapter_mongoose_destroy(CRW_ServerAdapter *serv)
+{
+    int err = -1;
+    if (serv) {
+        CRW_ServerAdapterMongoose *MG = serv->priv;
+        if (MG) {
+            free(MG->hostname);
+            free(MG->docroot);
+            free(MG);
+        }
+        err = 0;
+    }
+    return err;
+}
+
+
+static int CRW_server_adapter_mongoose_run(CRW_ServerAdapter *serv)
+{
+    int err = -1;
+    if (serv) {
+        CRW_ServerAdapterMongoose *MG = serv->priv;
+        MG->ctx = mg_start(CRW_mongoose_event_handler,
+                           serv, /* callback crazyness */
+                           MG->options);
+        if (MG->ctx) {
+            serv->running = 1;
+            err = 0;
+        } else {
+            CRW_log(serv->inst, "mng", CRW_LOG_CRITICAL,
+                    "server run mg_start() failed");
+        }
+    } else {
+        CRW_panic("mng", "missing server instance to run");
+    }
+    return err;
+}
+
+static int CRW_server_adapter_mongoose_stop(CRW_ServerAdapter *serv)
+{
+    int err = -1;
+    if (serv) {
+        CRW_ServerAdapterMongoose *MG = serv->priv;
+        mg_stop(MG->ctx);
+        serv->running = 0;
+    }
+    return err;
+}
+
+static void CRW_server_adapter_mongoose_option(CRW_ServerAdapter *serv,
+                                               const char *name,
+                                               const char *value)
+{
+    CRW_ServerAdapterMongoose *MG = serv->priv;
+    if (MG->num_options + 2 <= CRW_MONGOOSE_OPTION_NUM) {
+        MG->options[MG->num_options++] = name;
+        MG->options[MG->num_options++] = value;
+        MG->options[MG->num_options] = NULL;
+        CRW_log(serv->inst, "mng", CRW_LOG_DEBUG,
+                "option %s=(%s)", name, value);
+    } else {
+        CRW_log(serv->inst, "mng", CRW_LOG_ERROR,
+                "too many options, dropped %s=(%s)", name, value);
+    }
+}
+
+/* cfg was already validated by CRW_run */
+static void CRW_server_adapter_mongoose_tune(CRW_ServerAdapter *serv,
+                                             const CRW_Config *cfg)
+{
+    CRW_ServerAdapterMongoose *MG = serv->priv;
+    int workers = (cfg->workers) ?cfg->workers :CRW_server_default_workers();
+
+    snprintf(MG->num_threads, sizeof(MG->num_threads), "%i", workers);
+    CRW_server_adapter_mongoose_option(serv, "num_threads", MG->num_threads);
+    if (cfg->queue_depth) {
+        snprintf(MG->queue_size, sizeof(MG->queue_size),
+                 "%i", cfg->queue_depth);
+        CRW_server_adapter_mongoose_option(serv, "socket_queue_size",
+                                           MG->queue_size);
+    }
+    if (cfg->request_buffer_size) {
+        snprintf(MG->request_size, sizeof(MG->request_size),
+                 "%i", cfg->request_buffer_size);
+        CRW_server_adapter_mongoose_option(serv, "max_request_size",
+                                           MG->request_size);
+    }
+    MG->keep_alive = cfg->keep_alive;
+    CRW_server_adapter_mongoose_option(serv, "enable_keep_alive",
+                                       (cfg->keep_alive) ?"yes" :"no");
+    CRW_server_adapter_mongoose_option(serv, "cpu_affinity",
+                                       (cfg->pin_workers) ?"yes" :"no");
+    if (cfg->static_cache_size) {
+        snprintf(MG->static_cache_size, sizeof(MG->static_cache_size),
+                 "%i", cfg->static_cache_size);
+        CRW_server_adapter_mongoose_option(serv, "static_cache_size",
+                                           MG->static_cache_size);
+    }
+    /* the dynamic bodies are up to the reply; the static files have
+       to be compressed already */
+    CRW_server_adapter_mongoose_option(serv, "gzip_static",
+                                       (cfg->compress) ?"yes" :"no");
+    if (cfg->reuse_port) {
+        CRW_log(serv->inst, "mng", CRW_LOG_INFO,
+                "single listening socket, reuse_port ignored");
+    }
+}
+
+static int CRW_server_adapter_init_mongoose(CRW_ServerAdapter *serv,
+                                            const CRW_Config *cfg)
+{
+    int err = -1;
+    if (serv && cfg) {
+        CRW_ServerAdapterMongoose *MG = calloc(1, sizeof(CRW_ServerAdapterMongoose));
+        if (MG) {
+            serv->priv = MG;
+            MG->hostlen = strlen(cfg->host);
+            MG->hostlen += 1 + CRW_PORT_STR_LEN + 1;
+            MG->hostname = calloc(1, MG->hostlen);
+            if (MG->hostname) {
+                snprintf(MG->hostname, MG->hostlen,
+                         "%s:%i", cfg->host, cfg->port);
+            }
+            CRW_log(serv->inst, "mng", CRW_LOG_DEBUG,
+                    "will listen on (%s)", MG->hostname);
+            if (cfg->document_root) {
+                MG->docroot = strdup(cfg->document_root);
+                CRW_log(serv->inst, "mng", CRW_LOG_DEBUG,
+                        "will serve from (%s)", MG->docroot);
+            }
+            if (MG->hostname && (MG->docroot || !cfg->document_root)) {
+                if (MG->docroot) {
+                    CRW_server_adapter_mongoose_option(serv, "document_root",
+                                                       MG->docroot);
+                }
+                /* static files only: no listings, no scripts */
+                CRW_server_adapter_mongoose_option(serv,
+                                                   "enable_directory_listing",
+                                                   "no");
+                CRW_server_adapter_mongoose_option(serv, "cgi_extensions", "");
+                CRW_server_adapter_mongoose_option(serv, "ssi_extensions", "");
+                CRW_server_adapter_mongoose_option(serv, "listening_ports",
+                                                   MG->hostname);
+                CRW_server_adapter_mongoose_tune(serv, cfg);
+                serv->destroy  = CRW_server_adapter_mongoose_destroy;
+                serv->run      = CRW_server_adapter_mongoose_run;
+                serv->stop     = CRW_server_adapter_mongoose_stop;
+                err = 0;
+            } else {
+                CRW_log(serv->inst, "mng", CRW_LOG_CRITICAL,
+                        "no memory for server context parameters");
+                CRW_server_adapter_mongoose_destroy(serv);
+                serv->priv = NULL;
+                err = -1;
+            }
+        } else {
+            CRW_log(serv->inst, "mng", CRW_LOG_CRITICAL,
+                    "no memory for server context");
+        }
+    } else {
+        CRW_panic("mng", "missing server instance to intialize");
+    }
+    return err;
+}
+#else /* ENABLE_BUILTIN_MONGOOSE */
+
+static int CRW_server_adapter_init_mongoose(CRW_ServerAdapter *serv,
+                                            const CRW_Config *cfg)
+{
+    /* log it */
+    return -1;
+}
+
+#endif /* ENABLE_BUILTIN_MONGOOSE */
+
+
+/*** server adapters: specific: epoll ************************************/
+#ifdef ENABLE_EPOLL_SERVER
+
+/* Edge-triggered event loops, non blocking sockets, handlers called
+   inline. An idle connection costs just its CRW_EpollConn: the read
+   buffer is allocated only while a request is partially received,
+   otherwise the loop-wide scratch buffer is used.
+   By default there is just one loop. With reuse_port there is one per
+   worker, sharing nothing: each has its own listening socket (the
+   kernel spreads the connections among them), its own connections and
+   its own copy of the dispatcher.
+   A deferred response parks its connection: the loop goes on with the
+   others, and gets the response back through its queue. */
+
+enum {
+    CRW_EPOLL_MAX_EVENTS = 256,
+    CRW_EPOLL_MIN_CONNS = 64
+};
+
+enum {
+    CRW_EPOLL_CONN_CLOSE = 1 << 0, /* close when the output is flushed */
+    CRW_EPOLL_CONN_HUP = 1 << 1    /* the peer is gone, or going */
+};
+
+typedef struct crwepollconn_ CRW_EpollConn;
+struct crwepollconn_ {
+    int fd;
+    int flags;
+    char *in;               /* pending (partial) input, if any */
+    size_t in_len;
+    CRW_HTTPReply out;      /* being sent, if out.res */
+    size_t out_off;         /* bytes sent so far of head+body */
+    CRW_Pending *pending;   /* the response to wait for, if any */
+};
+
+typedef struct crwserveradapterepoll_ CRW_ServerAdapterEpoll;
+
+typedef struct crwepollloop_ CRW_EpollLoop;
+struct crwepollloop_ {
+    CRW_ServerAdapterEpoll *EP;
+    int index;
+    CRW_Dispatcher *disp;   /* a private copy, if sharded */
+    int listen_fd;
+    int epoll_fd;
+    volatile int stop;
+    int started;
+    pthread_t thread;
+    char *scratch;          /* read buffer for the idle connections */
+    CRW_EpollConn **conns;  /* indexed by fd */
+    int max_conns;
+    CRW_PendingQueue done;  /* the deferred responses completed */
+    int done_fds[2];        /* wakes the loop up for them */
+    CRW_ShardStats stats;
+};
+
+struct crwserveradapterepoll_ {
+    CRW_ServerAdapter *serv;
+    struct sockaddr_in addr;
+    int backlog;
+    int keep_alive;
+    int reuse_port;
+    int pin_loops;
+    size_t in_size;         /* max request head+body */
+    int wake_fds[2];        /* to stop all the loops */
+    CRW_EpollLoop *loops;
+    int num_loops;
+};
+
+static void CRW_epoll_conn_close(CRW_EpollLoop *EL, CRW_EpollConn *conn)
+{
+    if (conn->fd >= 0 && conn->fd < EL->max_conns) {
+        EL->conns[conn->fd] = NULL;
+    }
+    close(conn->fd); /* removes it from the epoll set as well */
+    free(conn->in);
+    CRW_http_reply_cleanup(&conn->out);
+    if (conn->pending) {
+        CRW_pending_abandon(conn->pending);
+    }
+    free(conn);
+    CRW_shard_stats_add(&EL->stats.active, -1);
+}
+
+static int CRW_epoll_conn_track(CRW_EpollLoop *EL, CRW_EpollConn *conn)
+{
+    int err = 0;
+    if (conn->fd >= EL->max_conns) {
+        int max_conns = (EL->max_conns) ?EL->max_conns :CRW_EPOLL_MIN_CONNS;
+        CRW_EpollConn **conns = NULL;
+        while (max_conns <= conn->fd) {
+            max_conns *= 2;
+        }
+        conns = realloc(EL->conns, max_conns * sizeof(CRW_EpollConn *));
+        if (conns) {
+            memset(conns + EL->max_conns, 0,
+                   (max_conns - EL->max_conns) * sizeof(CRW_EpollConn *));
+            EL->conns = conns;
+            EL->max_conns = max_conns;
+        } else {
+            err = -1;
+        }
+    }
+    if (!err) {
+        EL->conns[conn->fd] = conn;
+        CRW_shard_stats_add(&EL->stats.accepted, 1);
+        CRW_shard_stats_add(&EL->stats.active, 1);
+    }
+    return err;
+}
+
+/* 0: all sent, 1: still pending, -1: broken connection */
+static int CRW_epoll_conn_flush(CRW_EpollConn *conn)
+{
+    while (conn->out.res) {
+        CRW_BodyPiece pieces[CRW_HTTP_MAX_PIECES];
+        struct iovec iov[CRW_HTTP_MAX_PIECES];
+        int iovcnt = CRW_http_reply_pieces(&conn->out, conn->out_off,
+                                           pieces, CRW_HTTP_MAX_PIECES);
+        ssize_t sent = 0;
+        int j = 0;
+        for (j = 0; j < iovcnt; j++) {
+            iov[j].iov_base = (void *)pieces[j].data;
+            iov[j].iov_len = pieces[j].len;
+        }
+        if (iovcnt > 0) {
+            sent = writev(conn->fd, iov, iovcnt);
+        } else {
+            /* the file at the end of the body, straight from the kernel */
+            off_t file_off = 0;
+            int fd = -1;
+            size_t len = CRW_http_reply_file(&conn->out, conn->out_off,
+                                             &fd, &file_off);
+            sent = (len > 0) ?sendfile(conn->fd, fd, &file_off, len) :0;
+            if (sent == 0 && len > 0) {
+                return -1; /* the file shrunk under us */
+            }
+        }
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ?1 :-1;
+        }
+        conn->out_off += sent;
+        if (conn->out_off >= CRW_http_reply_len(&conn->out)) {
+            /* a streamed body is produced only when the socket drains */
+            int more = CRW_http_reply_next(&conn->out);
+            conn->out_off = 0;
+            if (more < 0) {
+                return -1;
+            } else if (more == 0) {
+                CRW_http_reply_cleanup(&conn->out);
+            }
+        }
+    }
+    return 0;
+}
+
+static void CRW_epoll_conn_serve(CRW_EpollLoop *EL, CRW_EpollConn *conn,
+                                 const CRW_HTTPReply *reply)
+{
+    conn->out = *reply;
+    conn->out_off = 0;
+    if (!reply->keep_alive) {
+        conn->flags |= CRW_EPOLL_CONN_CLOSE;
+    }
+    CRW_shard_stats_add(&EL->stats.requests, 1);
+    return;
+}
+
+static void CRW_epoll_conn_service(CRW_EpollLoop *EL, CRW_EpollConn *conn)
+{
+    CRW_ServerAdapterEpoll *EP = EL->EP;
+    char *buf = (conn->in) ?conn->in :EL->scratch;
+    size_t len = conn->in_len;
+    int ret = CRW_epoll_conn_flush(conn), done = 0;
+
+    while (!done && ret == 0 && !(conn->flags & CRW_EPOLL_CONN_CLOSE)) {
+        CRW_HTTPReply reply;
+        CRW_Pending *pending = NULL;
+        size_t used = 0;
+        ssize_t got = 0;
+        /* first serve the requests we already have... */
+        while (len && !conn->out.res && !conn->pending
+            && !(conn->flags & CRW_EPOLL_CONN_CLOSE)
+            && (used = CRW_http_serve(EP->serv, EL->disp, buf, len,
+                                      EP->in_size, EP->keep_alive,
+                                      &reply, &pending)) > 0) {
+            if (pending) {
+                /* the rest of the input waits for the response */
+                conn->pending = pending;
+                CRW_pending_attach(pending, &EL->done, conn);
+            } else {
+                CRW_epoll_conn_serve(EL, conn, &reply);
+            }
+            memmove(buf, buf + used, len - used);
+            len -= used;
+            ret = CRW_epoll_conn_flush(conn);
+        }
+        if (ret != 0 || conn->out.res || conn->pending
+         || (conn->flags & CRW_EPOLL_CONN_CLOSE)) {
+            break;
+        }
+        /* ...then read some more: edge triggered, so until EAGAIN */
+        got = read(conn->fd, buf + len, EP->in_size - len);
+        if (got > 0) {
+            len += got;
+        } else if (got < 0 && errno == EINTR) {
+            continue;
+        } else if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            done = 1;
+        } else {
+            ret = -1; /* EOF or error */
+        }
+    }
+
+    if (ret < 0 || (ret == 0 && (conn->flags & CRW_EPOLL_CONN_CLOSE))) {
+        CRW_epoll_conn_close(EL, conn);
+    } else if (conn->pending && (conn->flags & CRW_EPOLL_CONN_HUP)) {
+        /* no one left to wait for the response */
+        CRW_epoll_conn_close(EL, conn);
+    } else if (len > 0 && buf == EL->scratch) {
+        conn->in = malloc(EP->in_size);
+        if (conn->in) {
+            memcpy(conn->in, buf, len);
+            conn->in_len = len;
+        } else {
+            CRW_log(EP->serv->inst, "epl", CRW_LOG_CRITICAL,
+                    "no memory for the connection buffer");
+            CRW_epoll_conn_close(EL, conn);
+        }
+    } else if (len == 0 && conn->in) {
+        free(conn->in);
+        conn->in = NULL;
+        conn->in_len = 0;
+    } else {
+        conn->in_len = len;
+    }
+    return;
+}
+
+/* the deferred responses are back: out they go, then the connections
+   go on with their input */
+static void CRW_epoll_complete(CRW_EpollLoop *EL)
+{
+    CRW_Pending *P = NULL, *next = NULL;
+    char bytes[16];
+    while (read(EL->done_fds[0], bytes, sizeof(bytes)) > 0) {
+        /* just the wake up */ ;
+    }
+    for (P = CRW_pending_queue_take(&EL->done); P; P = next) {
+        CRW_HTTPReply reply;
+        CRW_EpollConn *conn = NULL;
+        next = P->next;
+        conn = CRW_http_serve_completed(EL->EP->serv, P, &reply);
+        if (conn) {
+            conn->pending = NULL;
+            CRW_epoll_conn_serve(EL, conn, &reply);
+            CRW_epoll_conn_service(EL, conn);
+        }
+    }
+    return;
+}
+
+static void CRW_epoll_accept(CRW_EpollLoop *EL)
+{
+    for (;;) {
+        struct epoll_event ev;
+        CRW_EpollConn *conn = NULL;
+        int one = 1;
+        int fd = accept(EL->listen_fd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                CRW_log(EL->EP->serv->inst, "epl", CRW_LOG_ERROR,
+                        "accept() failed errno=(%i)", errno);
+            }
+            break;
+        }
+        CRW_server_set_nonblocking(fd);
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        conn = calloc(1, sizeof(CRW_EpollConn));
+        if (!conn) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = fd;
+        if (CRW_epoll_conn_track(EL, conn) != 0) {
+            close(fd);
+            free(conn);
+        } else if (epoll_ctl(EL->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+            CRW_epoll_conn_close(EL, conn);
+        }
+    }
+    return;
+}
+
+static void *CRW_epoll_loop(void *data)
+{
+    CRW_EpollLoop *EL = data;
+    struct epoll_event events[CRW_EPOLL_MAX_EVENTS];
+    if (EL->EP->pin_loops) {
+        EL->stats.cpu = CRW_server_pin_thread(EL->index);
+    }
+    while (!EL->stop) {
+        int j = 0, num = epoll_wait(EL->epoll_fd, events,
+                                    CRW_EPOLL_MAX_EVENTS, -1);
+        for (j = 0; j < num; j++) {
+            int fd = events[j].data.fd;
+            if (fd == EL->listen_fd) {
+                CRW_epoll_accept(EL);
+            } else if (fd == EL->EP->wake_fds[0]) {
+                /* never read: all the loops must see it */
+                EL->stop = 1;
+            } else if (fd == EL->done_fds[0]) {
+                CRW_epoll_complete(EL);
+            } else if (fd < EL->max_conns && EL->conns[fd]) {
+                CRW_EpollConn *conn = EL->conns[fd];
+                if (events[j].events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+                    conn->flags |= CRW_EPOLL_CONN_HUP;
+                }
+                CRW_epoll_conn_service(EL, conn);
+            }
+        }
+        if (num < 0 && errno != EINTR) {
+            CRW_log(EL->EP->serv->inst, "epl", CRW_LOG_CRITICAL,
+                    "epoll_wait() failed errno=(%i)", errno);
+            break;
+        }
+    }
+    CRW_thread_cache_flush();
+    return NULL;
+}
+
+static int CRW_epoll_watch(CRW_EpollLoop *EL, int fd, uint32_t events)
+{
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.fd = fd;
+    return epoll_ctl(EL->epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+static int CRW_epoll_loop_setup(CRW_EpollLoop *EL)
+{
+    CRW_ServerAdapterEpoll *EP = EL->EP;
+    int err = -1;
+    EL->stop = 0;
+    EL->stats.cpu = -1;
+    EL->listen_fd = CRW_server_listen(&EP->addr, EP->backlog,
+                                      EP->reuse_port);
+    if (EL->listen_fd < 0
+     || CRW_server_set_nonblocking(EL->listen_fd) != 0) {
+        CRW_log(EP->serv->inst, "epl", CRW_LOG_CRITICAL,
+                "loop #%i cannot listen errno=(%i)", EL->index, errno);
+    } else if ((EL->epoll_fd = epoll_create(CRW_EPOLL_MAX_EVENTS)) < 0
+            || pipe(EL->done_fds) != 0
+            || CRW_server_set_nonblocking(EL->done_fds[0]) != 0
+            || CRW_server_set_nonblocking(EL->done_fds[1]) != 0
+            || CRW_epoll_watch(EL, EL->listen_fd, EPOLLIN | EPOLLET) != 0
+            || CRW_epoll_watch(EL, EP->wake_fds[0], EPOLLIN) != 0
+            || CRW_epoll_watch(EL, EL->done_fds[0], EPOLLIN) != 0) {
+        CRW_log(EP->serv->inst, "epl", CRW_LOG_CRITICAL,
+                "loop #%i cannot setup errno=(%i)", EL->index, errno);
+    } else {
+        EL->done.wake_fd = EL->done_fds[1];
+        if (pthread_create(&EL->thread, NULL, CRW_epoll_loop, EL) != 0) {
+            CRW_log(EP->serv->inst, "epl", CRW_LOG_CRITICAL,
+                    "cannot start the event loop thread #%i", EL->index);
+        } else {
+            EL->started = 1;
+            err = 0;
+        }
+    }
+    return err;
+}
+
+static void CRW_epoll_loop_release(CRW_EpollLoop *EL)
+{
+    int fd = 0;
+    EL->done.closing = 1;
+    for (fd = 0; fd < EL->max_conns; fd++) {
+        if (EL->conns[fd]) {
+            CRW_epoll_conn_close(EL, EL->conns[fd]);
+        }
+    }
+    CRW_pending_queue_flush(&EL->done);
+    free(EL->conns);
+    EL->conns = NULL;
+    EL->max_conns = 0;
+    if (EL->listen_fd >= 0) {
+        close(EL->listen_fd);
+    }
+    if (EL->epoll_fd >= 0) {
+        close(EL->epoll_fd);
+    }
+    if (EL->done_fds[0] >= 0) {
+        close(EL->done_fds[0]);
+        close(EL->done_fds[1]);
+    }
+    EL->listen_fd = EL->epoll_fd = -1;
+    EL->done_fds[0] = EL->done_fds[1] = EL->done.wake_fd = -1;
+    return;
+}
+
+/* wakes up and reaps all the loops started so far. they must be gone
+   before their resources: without the wake up pipe, each loop gets
+   stopped through its completion pipe */
+static int CRW_epoll_shutdown(CRW_ServerAdapterEpoll *EP)
+{
+    int err = 0, j = 0;
+    char byte = 0;
+    if (EP->wake_fds[1] >= 0) {
+        int ret = 0;
+        do {
+            ret = write(EP->wake_fds[1], &byte, 1);
+        } while (ret < 0 && errno == EINTR);
+        err = (ret == 1) ?0 :-1;
+    }
+    for (j = 0; j < EP->num_loops; j++) {
+        CRW_EpollLoop *EL = &EP->loops[j];
+        if (EL->started) {
+            if (err) {
+                EL->stop = 1;
+                if (write(EL->done_fds[1], &byte, 1) != 1) {
+                    /* full: it wakes the loop up all the same */ ;
+                }
+            }
+            pthread_join(EL->thread, NULL);
+        }
+        EL->started = 0;
+        CRW_epoll_loop_release(EL);
+    }
+    if (EP->wake_fds[0] >= 0) {
+        close(EP->wake_fds[0]);
+        close(EP->wake_fds[1]);
     }
+    EP->wake_fds[0] = EP->wake_fds[1] = -1;
     return err;
 }
 
-/* FIXME: found a way to unclutter */
-CRW_PRIVATE
-int CRW_dispatcher_register(CRW_Dispatcher *disp, const char *route,
-                            CRW_Handler *handler)
+static int CRW_server_adapter_epoll_run(CRW_ServerAdapter *serv)
 {
     int err = -1;
-    if (disp && route && handler) {
-        CRW_HandlerBinding *HB = calloc(1, sizeof(CRW_HandlerBinding));
-        if (HB) {
-            HB->handler = handler;
-            err = CRW_route_init(&HB->route, route);
-            if (!err) {
-                err = list_insert_next(&disp->handlers, NULL, HB);
-                if (!err) {
-                    CRW_log(disp->inst, "dsp", CRW_LOG_DEBUG,
-                            "bound handler %p for route [%s]",
-                            handler, route);
-                } else {
-                    CRW_log(disp->inst, "dsp", CRW_LOG_ERROR,
-                            "failed to bind handler %p for route [%s] error=(%i)",
-                            handler, route, err);
-                }
-            } else {
-                CRW_log(disp->inst, "dsp", CRW_LOG_ERROR,
-                        "failed intialization for route [%s]",
-                        route);
+    if (serv) {
+        CRW_ServerAdapterEpoll *EP = serv->priv;
+        int j = 0;
+        CRW_server_ignore_sigpipe();
+        if (pipe(EP->wake_fds) != 0) {
+            CRW_log(serv->inst, "epl", CRW_LOG_CRITICAL,
+                    "cannot setup the event loop errno=(%i)", errno);
+        } else {
+            for (err = 0, j = 0; !err && j < EP->num_loops; j++) {
+                err = CRW_epoll_loop_setup(&EP->loops[j]);
             }
+        }
+        if (!err) {
+            CRW_log(serv->inst, "epl", CRW_LOG_INFO,
+                    "serving with %i event loop(s)", EP->num_loops);
+            serv->running = 1;
         } else {
-            CRW_log(disp->inst, "dsp", CRW_LOG_ERROR,
-                    "cannot allocate an handler binding");
+            CRW_epoll_shutdown(EP);
         }
     } else {
-        CRW_panic("dsp",
-                  "invalid parameters for CRW_dispatcher_register");
+        CRW_panic("epl", "missing server instance to run");
     }
     return err;
 }
 
-CRW_PRIVATE
-CRW_Response *CRW_dispatcher_handle(CRW_Dispatcher *disp,
-                                    CRW_Request *request)
+static int CRW_server_adapter_epoll_stop(CRW_ServerAdapter *serv)
 {
-    CRW_Response *res = NULL;
-    int found = 0;
-    if (disp && request) {
-        list_element *elem = NULL;
-        CRW_log(disp->inst, "dsp", CRW_LOG_DEBUG,
-                "searching handler for URI=[%s]",
-                request->URI);
-        for (elem = list_head(&disp->handlers);
-             !found && elem;
-             elem = list_next(elem)) {
-            CRW_HandlerBinding *HB = list_data(elem);
-            if (CRW_route_match(&HB->route, request->URI)) {
-                int err = 0;
-                CRW_RouteArgs args;
-                found = 1;
-                CRW_log(disp->inst, "dsp", CRW_LOG_DEBUG,
-                        "handler %p found for URI=[%s] route=[%s]",
-                        HB->handler, request->URI, HB->route.regex_user);
-                err = CRW_route_fetch(&HB->route, request->URI, &args);
-                if (!err) {
-                    res = CRW_handler_call(HB->handler, &args, request);
-                } else {
-                    CRW_log(disp->inst, "dsp", CRW_LOG_ERROR,
-                            "route args fetch for URI=[%s] failed error=(%i)",
-                            request->URI, err);
+    int err = -1;
+    if (serv && serv->running) {
+        err = CRW_epoll_shutdown(serv->priv);
+        serv->running = 0;
+    }
+    return err;
+}
+
+static int CRW_server_adapter_epoll_count_shards(CRW_ServerAdapter *serv)
+{
+    CRW_ServerAdapterEpoll *EP = serv->priv;
+    return EP->num_loops;
+}
+
+static int CRW_server_adapter_epoll_shard_stats(CRW_ServerAdapter *serv,
+                                                int shard,
+                                                CRW_ShardStats *stats)
+{
+    CRW_ServerAdapterEpoll *EP = serv->priv;
+    int err = -1;
+    if (shard >= 0 && shard < EP->num_loops) {
+        CRW_shard_stats_read(&EP->loops[shard].stats, stats);
+        err = 0;
+    }
+    return err;
+}
+
+static int CRW_server_adapter_epoll_destroy(CRW_ServerAdapter *serv)
+{
+    int err = -1;
+    if (serv) {
+        CRW_ServerAdapterEpoll *EP = serv->priv;
+        if (EP) {
+            int j = 0;
+            if (serv->running) {
+                CRW_server_adapter_epoll_stop(serv);
+            }
+            for (j = 0; EP->loops && j < EP->num_loops; j++) {
+                if (EP->loops[j].disp != serv->disp) {
+                    CRW_dispatcher_del(EP->loops[j].disp);
                 }
+                free(EP->loops[j].scratch);
+                CRW_pending_queue_fini(&EP->loops[j].done);
+            }
+            free(EP->loops);
+            free(EP);
+        }
+        err = 0;
+    }
+    return err;
+}
+
+static int CRW_epoll_loops_init(CRW_ServerAdapterEpoll *EP,
+                                const CRW_Config *cfg)
+{
+    CRW_ServerAdapter *serv = EP->serv;
+    int err = 0, j = 0;
+
+    EP->num_loops = 1;
+    if (cfg->reuse_port) {
+#ifdef SO_REUSEPORT
+        EP->reuse_port = 1;
+        EP->num_loops = (cfg->workers) ?cfg->workers
+                                       :CRW_server_default_workers();
+#else
+        CRW_log(serv->inst, "epl", CRW_LOG_WARNING,
+                "SO_REUSEPORT not available, using a single event loop");
+#endif
+    } else if (cfg->workers > 1) {
+        CRW_log(serv->inst, "epl", CRW_LOG_INFO,
+                "single event loop, workers=[%i] ignored", cfg->workers);
+    }
+
+    EP->loops = calloc(EP->num_loops, sizeof(CRW_EpollLoop));
+    if (!EP->loops) {
+        CRW_log(serv->inst, "epl", CRW_LOG_CRITICAL,
+                "no memory for the event loops");
+        EP->num_loops = 0;
+        return -1;
+    }
+    for (j = 0; j < EP->num_loops; j++) {
+        EP->loops[j].done_fds[0] = EP->loops[j].done_fds[1] = -1;
+        CRW_pending_queue_init(&EP->loops[j].done);
+    }
+    for (j = 0; !err && j < EP->num_loops; j++) {
+        CRW_EpollLoop *EL = &EP->loops[j];
+        EL->EP = EP;
+        EL->index = j;
+        EL->listen_fd = EL->epoll_fd = -1;
+        EL->disp = (EP->reuse_port) ?CRW_dispatcher_clone(serv->disp)
+                                    :serv->disp;
+        EL->scratch = malloc(EP->in_size);
+        if (!EL->disp || !EL->scratch) {
+            CRW_log(serv->inst, "epl", CRW_LOG_CRITICAL,
+                    "no memory for the event loop #%i", j);
+            err = -1;
+        }
+    }
+    return err;
+}
+
+static int CRW_server_adapter_init_epoll(CRW_ServerAdapter *serv,
+                                         const CRW_Config *cfg)
+{
+    int err = -1;
+    if (serv && cfg) {
+        CRW_ServerAdapterEpoll *EP = calloc(1, sizeof(CRW_ServerAdapterEpoll));
+        if (EP) {
+            serv->priv = EP;
+            EP->serv = serv;
+            EP->wake_fds[0] = EP->wake_fds[1] = -1;
+            EP->backlog = (cfg->queue_depth) ?cfg->queue_depth :SOMAXCONN;
+            EP->keep_alive = cfg->keep_alive;
+            EP->pin_loops = cfg->pin_workers;
+            EP->in_size = (cfg->request_buffer_size)
+                            ?cfg->request_buffer_size
+                            :CRW_HTTP_DEFAULT_REQUEST_SIZE;
+            if (CRW_server_address(serv, cfg, &EP->addr) != 0) {
+                /* already logged */
+            } else if (CRW_epoll_loops_init(EP, cfg) != 0) {
+                /* already logged */
+            } else {
+                CRW_log(serv->inst, "epl", CRW_LOG_DEBUG,
+                        "will listen on (%s:%i)", cfg->host, cfg->port);
+                serv->destroy      = CRW_server_adapter_epoll_destroy;
+                serv->run          = CRW_server_adapter_epoll_run;
+                serv->stop         = CRW_server_adapter_epoll_stop;
+                serv->count_shards = CRW_server_adapter_epoll_count_shards;
+                serv->shard_stats  = CRW_server_adapter_epoll_shard_stats;
+                err = 0;
+            }
+            if (err) {
+                CRW_server_adapter_epoll_destroy(serv);
+                serv->priv = NULL;
             }
+        } else {
+            CRW_log(serv->inst, "epl", CRW_LOG_CRITICAL,
+                    "no memory for server context");
         }
     } else {
-        CRW_panic("dsp",
-                  "invalid parameters for CRW_dispatcher_handle");
+        CRW_panic("epl", "missing server instance to intialize");
     }
-    return res;
+    return err;
 }
 
+#else /* ENABLE_EPOLL_SERVER */
 
+static int CRW_server_adapter_init_epoll(CRW_ServerAdapter *serv,
+                                         const CRW_Config *cfg)
+{
+    CRW_log(serv->inst, "epl", CRW_LOG_CRITICAL,
+            "epoll server not available in this build");
+    return -1;
+}
 
+#endif /* ENABLE_EPOLL_SERVER */
 
-/*** handler *************************************************************/
 
-struct crwhandler_ {
-    CRW_Instance *inst;
-    const char *route;
-    CRW_HandlerCallback callback;
-    void *userdata;
+/*** server adapters: specific: io_uring *********************************/
+
+/* when io_uring is missing, the next best thing */
+static int CRW_server_adapter_init_fallback(CRW_ServerAdapter *serv,
+                                            const CRW_Config *cfg)
+{
+#ifdef ENABLE_EPOLL_SERVER
+    return CRW_server_adapter_init_epoll(serv, cfg);
+#else
+    return CRW_server_adapter_init_mongoose(serv, cfg);
+#endif
+}
+
+#ifdef ENABLE_IO_URING_SERVER
+
+/* Like the epoll adapter: one loop, handlers called inline. But the
+   socket I/O is batched through io_uring: a multishot accept, a multishot
+   recv per connection drawing from a provided buffer ring, and a writev
+   per reply. A whole loop iteration costs a single io_uring_enter().
+   The deferred responses come back through the wake pipe too: a byte
+   0 stops the loop, a byte 1 says that some are completed. */
+
+enum {
+    CRW_URING_ENTRIES = 256,        /* SQ size, the CQ is twice that */
+    CRW_URING_BUFFERS = 256,        /* provided buffers, power of two */
+    CRW_URING_BUFFER_SIZE = 4096,
+    CRW_URING_BGID = 0,
+    CRW_URING_MIN_CONNS = 64,
+    CRW_URING_SPLICE_CHUNK = 65536  /* the default pipe capacity */
+};
+
+/* user_data: the connection pointer, tagged in the low bits */
+enum {
+    CRW_URING_OP_RECV = 0,
+    CRW_URING_OP_SEND = 1,
+    CRW_URING_OP_SPLICE = 2,        /* file -> pipe, before the send */
+    CRW_URING_OP_MASK = 3,
+    /* no connection involved */
+    CRW_URING_TAG_ACCEPT = 1,
+    CRW_URING_TAG_WAKE = 2,
+    CRW_URING_TAG_PROBE = 3
+};
+
+enum {
+    CRW_URING_CONN_CLOSE = 1 << 0,  /* close when the reply is sent */
+    CRW_URING_CONN_RECV = 1 << 1,   /* multishot recv armed */
+    CRW_URING_CONN_SEND = 1 << 2,   /* writev in flight */
+    CRW_URING_CONN_DEAD = 1 << 3,   /* shut down, waiting for the CQEs */
+    CRW_URING_CONN_PAUSED = 1 << 4, /* too much pipelined input */
+    CRW_URING_CONN_PIPE = 1 << 5    /* has a pipe, for the files */
+};
+
+typedef struct crwuring_ CRW_URing;
+struct crwuring_ {
+    int fd;
+    unsigned sq_entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned sq_local_tail;
+    unsigned pending;               /* SQEs not yet submitted */
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *ring_ptr;
+    size_t ring_len;
+    size_t sqes_len;
+    struct io_uring_buf_ring *br;   /* provided buffers ring */
+    unsigned short br_tail;
+    char *bufs;
+};
+
+typedef struct crwuringconn_ CRW_URingConn;
+struct crwuringconn_ {
+    int fd;
+    int flags;
+    char *in;                       /* pending (partial) input, if any */
+    size_t in_len;
+    size_t in_cap;
+    CRW_HTTPReply out;
+    size_t out_off;
+    struct iovec iov[CRW_HTTP_MAX_PIECES];  /* of the send in flight */
+    int pipe_fds[2];                /* files go through it, if any */
+    size_t piped;                   /* bytes in the pipe, to be sent */
+    CRW_Pending *pending;           /* the response to wait for, if any */
+};
+
+typedef struct crwserveradapteruring_ CRW_ServerAdapterURing;
+struct crwserveradapteruring_ {
+    CRW_ServerAdapter *serv;
+    CRW_URing ring;
+    struct sockaddr_in addr;
+    int backlog;
+    int keep_alive;
+    size_t in_size;
+    int listen_fd;
+    int wake_fds[2];
+    char wake_byte;
+    CRW_PendingQueue done;          /* the deferred responses completed */
+    volatile int stop;
+    pthread_t loop;
+    CRW_URingConn **conns;          /* indexed by fd */
+    int max_conns;
+    int num_conns;
 };
 
-CRW_Handler *CRW_handler_new(CRW_Instance *inst,
-                             const char *route,
-                             CRW_HandlerCallback callback,
-                             void *userdata)
+static int CRW_uring_enter(CRW_URing *R, unsigned to_submit,
+                           unsigned min_complete, unsigned flags)
+{
+    int ret = syscall(__NR_io_uring_enter, R->fd, to_submit, min_complete,
+                      flags, NULL, 0);
+    if (ret > 0) {
+        R->pending -= ((unsigned)ret > R->pending) ?R->pending :ret;
+    }
+    return ret;
+}
+
+static void CRW_uring_publish(CRW_URing *R)
+{
+    __atomic_store_n(R->sq_tail, R->sq_local_tail, __ATOMIC_RELEASE);
+    return;
+}
+
+/* never fails: if the SQ is full, flushes it first */
+static struct io_uring_sqe *CRW_uring_get_sqe(CRW_URing *R, uint64_t data)
+{
+    struct io_uring_sqe *sqe = NULL;
+    while (R->sq_local_tail - __atomic_load_n(R->sq_head, __ATOMIC_ACQUIRE)
+           >= R->sq_entries) {
+        CRW_uring_publish(R);
+        CRW_uring_enter(R, R->pending, 0, 0);
+    }
+    sqe = &R->sqes[R->sq_local_tail & *R->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->user_data = data;
+    R->sq_local_tail++;
+    R->pending++;
+    return sqe;
+}
+
+static void CRW_uring_buf_recycle(CRW_URing *R, unsigned short bid)
+{
+    struct io_uring_buf *buf = &R->br->bufs[R->br_tail
+                                            & (CRW_URING_BUFFERS - 1)];
+    buf->addr = (uintptr_t)(R->bufs + (size_t)bid * CRW_URING_BUFFER_SIZE);
+    buf->len = CRW_URING_BUFFER_SIZE;
+    buf->bid = bid;
+    R->br_tail++;
+    __atomic_store_n(&R->br->tail, R->br_tail, __ATOMIC_RELEASE);
+    return;
+}
+
+static void CRW_uring_teardown(CRW_URing *R)
+{
+    if (R->fd >= 0) {
+        close(R->fd);
+    }
+    if (R->ring_ptr) {
+        munmap(R->ring_ptr, R->ring_len);
+    }
+    if (R->sqes) {
+        munmap(R->sqes, R->sqes_len);
+    }
+    free(R->br);
+    free(R->bufs);
+    memset(R, 0, sizeof(*R));
+    R->fd = -1;
+    return;
+}
+
+static int CRW_uring_setup(CRW_URing *R)
+{
+    struct io_uring_params params;
+    struct io_uring_buf_reg reg;
+    unsigned char *ptr = NULL;
+    long page = sysconf(_SC_PAGESIZE);
+    void *br = NULL;
+    int j = 0;
+
+    memset(&params, 0, sizeof(params));
+    R->fd = syscall(__NR_io_uring_setup, CRW_URING_ENTRIES, &params);
+    if (R->fd < 0) {
+        return -1;
+    }
+    /* keep it simple: no support for the older kernels */
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)
+     || !(params.features & IORING_FEAT_NODROP)) {
+        errno = ENOSYS;
+        return -1;
+    }
+    R->sq_entries = params.sq_entries;
+    R->ring_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    if (R->ring_len < params.cq_off.cqes
+                    + params.cq_entries * sizeof(struct io_uring_cqe)) {
+        R->ring_len = params.cq_off.cqes
+                    + params.cq_entries * sizeof(struct io_uring_cqe);
+    }
+    R->ring_ptr = mmap(NULL, R->ring_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED, R->fd, IORING_OFF_SQ_RING);
+    R->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    R->sqes = mmap(NULL, R->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED, R->fd, IORING_OFF_SQES);
+    if (R->ring_ptr == MAP_FAILED || R->sqes == MAP_FAILED) {
+        R->ring_ptr = (R->ring_ptr == MAP_FAILED) ?NULL :R->ring_ptr;
+        R->sqes = (R->sqes == MAP_FAILED) ?NULL :R->sqes;
+        return -1;
+    }
+    ptr = R->ring_ptr;
+    R->sq_head = (unsigned *)(ptr + params.sq_off.head);
+    R->sq_tail = (unsigned *)(ptr + params.sq_off.tail);
+    R->sq_mask = (unsigned *)(ptr + params.sq_off.ring_mask);
+    R->cq_head = (unsigned *)(ptr + params.cq_off.head);
+    R->cq_tail = (unsigned *)(ptr + params.cq_off.tail);
+    R->cq_mask = (unsigned *)(ptr + params.cq_off.ring_mask);
+    R->cqes = (struct io_uring_cqe *)(ptr + params.cq_off.cqes);
+    /* identity mapping, once and for all */
+    for (j = 0; j < (int)params.sq_entries; j++) {
+        ((unsigned *)(ptr + params.sq_off.array))[j] = j;
+    }
+    R->sq_local_tail = *R->sq_tail;
+
+    if (posix_memalign(&br, page,
+                       CRW_URING_BUFFERS * sizeof(struct io_uring_buf)) != 0
+     || !(R->bufs = malloc(CRW_URING_BUFFERS * CRW_URING_BUFFER_SIZE))) {
+        free(br);
+        errno = ENOMEM;
+        return -1;
+    }
+    R->br = br;
+    memset(R->br, 0, CRW_URING_BUFFERS * sizeof(struct io_uring_buf));
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)R->br;
+    reg.ring_entries = CRW_URING_BUFFERS;
+    reg.bgid = CRW_URING_BGID;
+    if (syscall(__NR_io_uring_register, R->fd,
+                IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+        return -1;
+    }
+    for (j = 0; j < CRW_URING_BUFFERS; j++) {
+        CRW_uring_buf_recycle(R, j);
+    }
+    return 0;
+}
+
+static void CRW_uring_prep_recv(CRW_URing *R, int fd, uint64_t data)
+{
+    struct io_uring_sqe *sqe = CRW_uring_get_sqe(R, data);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = CRW_URING_BGID;
+    return;
+}
+
+/* waits for a completion: only for the setup time probe */
+static int CRW_uring_wait_one(CRW_URing *R, struct io_uring_cqe *cqe)
+{
+    unsigned head = *R->cq_head;
+    CRW_uring_publish(R);
+    while (head == __atomic_load_n(R->cq_tail, __ATOMIC_ACQUIRE)) {
+        if (CRW_uring_enter(R, R->pending, 1, IORING_ENTER_GETEVENTS) < 0
+         && errno != EINTR) {
+            return -1;
+        }
+    }
+    *cqe = R->cqes[head & *R->cq_mask];
+    __atomic_store_n(R->cq_head, head + 1, __ATOMIC_RELEASE);
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        CRW_uring_buf_recycle(R, cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    return 0;
+}
+
+/* the provided buffer ring is there since 5.19, but the multishot recv
+   only since 6.0: try it for real on a socketpair. */
+static int CRW_uring_probe(CRW_URing *R)
+{
+    struct io_uring_cqe cqe;
+    int sv[2] = { -1, -1 }, err = -1;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) != 0) {
+        return -1;
+    }
+    CRW_uring_prep_recv(R, sv[0], CRW_URING_TAG_PROBE);
+    if (write(sv[1], "!", 1) == 1
+     && CRW_uring_wait_one(R, &cqe) == 0
+     && cqe.res == 1 && (cqe.flags & IORING_CQE_F_MORE)) {
+        err = 0;
+    }
+    /* let the recv terminate before going on */
+    shutdown(sv[0], SHUT_RDWR);
+    while ((cqe.flags & IORING_CQE_F_MORE)
+        && CRW_uring_wait_one(R, &cqe) == 0) {
+        /* drain */
+    }
+    if (err && cqe.res < 0) {
+        errno = -cqe.res;
+    }
+    close(sv[0]);
+    close(sv[1]);
+    return err;
+}
+
+static void CRW_uring_prep_accept(CRW_ServerAdapterURing *UR)
+{
+    struct io_uring_sqe *sqe = CRW_uring_get_sqe(&UR->ring,
+                                                 CRW_URING_TAG_ACCEPT);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = UR->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    return;
+}
+
+static void CRW_uring_prep_wake(CRW_ServerAdapterURing *UR)
+{
+    struct io_uring_sqe *sqe = CRW_uring_get_sqe(&UR->ring,
+                                                 CRW_URING_TAG_WAKE);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = UR->wake_fds[0];
+    sqe->addr = (uintptr_t)&UR->wake_byte;
+    sqe->len = 1;
+    return;
+}
+
+static void CRW_uring_conn_free(CRW_ServerAdapterURing *UR,
+                                CRW_URingConn *conn)
+{
+    if (conn->fd < UR->max_conns) {
+        UR->conns[conn->fd] = NULL;
+    }
+    close(conn->fd);
+    if (conn->flags & CRW_URING_CONN_PIPE) {
+        close(conn->pipe_fds[0]);
+        close(conn->pipe_fds[1]);
+    }
+    free(conn->in);
+    CRW_http_reply_cleanup(&conn->out);
+    if (conn->pending) {
+        CRW_pending_abandon(conn->pending);
+    }
+    free(conn);
+    UR->num_conns--;
+    return;
+}
+
+/* the in-flight operations still point to the connection: shut the
+   socket down, so they complete, and free it on the last one. */
+static int CRW_uring_conn_check(CRW_ServerAdapterURing *UR,
+                                CRW_URingConn *conn)
+{
+    int alive = 1;
+    if ((conn->flags & CRW_URING_CONN_CLOSE)
+     && !(conn->flags & CRW_URING_CONN_SEND)
+     && !(conn->flags & CRW_URING_CONN_DEAD) && !conn->pending) {
+        conn->flags |= CRW_URING_CONN_DEAD;
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    if ((conn->flags & CRW_URING_CONN_DEAD)
+     && !(conn->flags & (CRW_URING_CONN_RECV | CRW_URING_CONN_SEND))) {
+        CRW_uring_conn_free(UR, conn);
+        alive = 0;
+    }
+    return alive;
+}
+
+static void CRW_uring_conn_kill(CRW_ServerAdapterURing *UR,
+                                CRW_URingConn *conn)
+{
+    conn->flags |= CRW_URING_CONN_CLOSE;
+    if (!(conn->flags & CRW_URING_CONN_DEAD)) {
+        conn->flags |= CRW_URING_CONN_DEAD;
+        shutdown(conn->fd, SHUT_RDWR);
+    }
+    return;
+}
+
+static void CRW_uring_prep_splice(CRW_URing *R, uint64_t data,
+                                  int fd_in, int64_t off_in, int fd_out,
+                                  size_t len)
+{
+    struct io_uring_sqe *sqe = CRW_uring_get_sqe(R, data);
+    sqe->opcode = IORING_OP_SPLICE;
+    sqe->fd = fd_out;
+    sqe->off = (uint64_t)-1;
+    sqe->splice_fd_in = fd_in;
+    sqe->splice_off_in = (uint64_t)off_in;
+    sqe->len = len;
+    sqe->splice_flags = SPLICE_F_MOVE;
+    return;
+}
+
+/* no sendfile in io_uring: the file goes to the socket through a pipe,
+   with two splices. The data stays in the kernel all the way. */
+static void CRW_uring_conn_send_file(CRW_ServerAdapterURing *UR,
+                                     CRW_URingConn *conn)
+{
+    off_t file_off = 0;
+    int fd = -1;
+    size_t len = CRW_http_reply_file(&conn->out, conn->out_off,
+                                     &fd, &file_off);
+    if (conn->piped > 0) {
+        CRW_uring_prep_splice(&UR->ring, (uintptr_t)conn | CRW_URING_OP_SEND,
+                              conn->pipe_fds[0], -1, conn->fd, conn->piped);
+    } else if (len == 0) {
+        CRW_uring_conn_kill(UR, conn);
+        return;
+    } else {
+        if (!(conn->flags & CRW_URING_CONN_PIPE)) {
+            if (pipe(conn->pipe_fds) != 0) {
+                CRW_log(UR->serv->inst, "iou", CRW_LOG_ERROR,
+                        "cannot send a file errno=(%i)", errno);
+                CRW_uring_conn_kill(UR, conn);
+                return;
+            }
+            conn->flags |= CRW_URING_CONN_PIPE;
+        }
+        if (len > CRW_URING_SPLICE_CHUNK) {
+            len = CRW_URING_SPLICE_CHUNK;
+        }
+        CRW_uring_prep_splice(&UR->ring,
+                              (uintptr_t)conn | CRW_URING_OP_SPLICE,
+                              fd, file_off, conn->pipe_fds[1], len);
+    }
+    conn->flags |= CRW_URING_CONN_SEND;
+    return;
+}
+
+static void CRW_uring_conn_send(CRW_ServerAdapterURing *UR,
+                                CRW_URingConn *conn)
+{
+    struct io_uring_sqe *sqe = NULL;
+    CRW_BodyPiece pieces[CRW_HTTP_MAX_PIECES];
+    int iovcnt = CRW_http_reply_pieces(&conn->out, conn->out_off,
+                                       pieces, CRW_HTTP_MAX_PIECES);
+    int j = 0;
+    if (iovcnt == 0) {
+        CRW_uring_conn_send_file(UR, conn);
+        return;
+    }
+    for (j = 0; j < iovcnt; j++) {
+        conn->iov[j].iov_base = (void *)pieces[j].data;
+        conn->iov[j].iov_len = pieces[j].len;
+    }
+    sqe = CRW_uring_get_sqe(&UR->ring,
+                            (uintptr_t)conn | CRW_URING_OP_SEND);
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = conn->fd;
+    sqe->addr = (uintptr_t)conn->iov;
+    sqe->len = iovcnt;
+    conn->flags |= CRW_URING_CONN_SEND;
+    return;
+}
+
+/* the reply is in conn->out */
+static void CRW_uring_conn_reply(CRW_ServerAdapterURing *UR,
+                                 CRW_URingConn *conn)
+{
+    conn->out_off = 0;
+    if (!conn->out.keep_alive) {
+        conn->flags |= CRW_URING_CONN_CLOSE;
+    }
+    if (conn->out.res) {
+        CRW_uring_conn_send(UR, conn);
+    }
+    return;
+}
+
+/* serves what can be served; returns the bytes left in buf */
+static size_t CRW_uring_conn_serve(CRW_ServerAdapterURing *UR,
+                                   CRW_URingConn *conn,
+                                   char *buf, size_t len)
+{
+    CRW_Pending *pending = NULL;
+    size_t used = 0;
+    while (len && !conn->pending
+        && !(conn->flags & (CRW_URING_CONN_SEND | CRW_URING_CONN_CLOSE))
+        && (used = CRW_http_serve(UR->serv, UR->serv->disp,
+                                  buf, len, UR->in_size,
+                                  UR->keep_alive, &conn->out,
+                                  &pending)) > 0) {
+        memmove(buf, buf + used, len - used);
+        len -= used;
+        if (pending) {
+            /* the rest of the input waits for the response */
+            conn->pending = pending;
+            CRW_pending_attach(pending, &UR->done, conn);
+        } else {
+            CRW_uring_conn_reply(UR, conn);
+        }
+    }
+    return len;
+}
+
+/* the multishot recv cannot be told to slow down: pipelined input piles
+   up while a reply is in flight, until we cancel the recv. What was
+   already received when the cancel lands must still fit. */
+static int CRW_uring_conn_stash(CRW_ServerAdapterURing *UR,
+                                CRW_URingConn *conn,
+                                const char *data, size_t len)
 {
-    CRW_Handler *handler = NULL;
-    if (inst && inst->disp && route && callback) {
-        handler = calloc(1, sizeof(CRW_Handler));
-        if (handler) {
-            handler->inst = inst;
-            handler->route = route;
-            handler->callback = callback;
-            handler->userdata = userdata;
+    size_t need = conn->in_len + len;
+    if (need > conn->in_cap) {
+        size_t cap = (conn->in_cap) ?conn->in_cap * 2 :UR->in_size;
+        char *in = NULL;
+        while (cap < need) {
+            cap *= 2;
         }
+        if (cap > UR->in_size
+                  + CRW_URING_BUFFERS * CRW_URING_BUFFER_SIZE) {
+            return -1;
+        }
+        in = realloc(conn->in, cap);
+        if (!in) {
+            return -1;
+        }
+        conn->in = in;
+        conn->in_cap = cap;
     }
-    return handler;
+    memcpy(conn->in + conn->in_len, data, len);
+    conn->in_len += len;
+    if (conn->in_len >= UR->in_size
+     && (conn->flags & CRW_URING_CONN_RECV)
+     && !(conn->flags & CRW_URING_CONN_PAUSED)) {
+        struct io_uring_sqe *sqe = CRW_uring_get_sqe(&UR->ring, 0);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = (uintptr_t)conn | CRW_URING_OP_RECV;
+        conn->flags |= CRW_URING_CONN_PAUSED;
+    }
+    return 0;
 }
 
-void CRW_handler_del(CRW_Handler *handler)
+static void CRW_uring_conn_unstash(CRW_ServerAdapterURing *UR,
+                                   CRW_URingConn *conn)
 {
-    free(handler);
+    if (conn->in_len == 0) {
+        free(conn->in);
+        conn->in = NULL;
+        conn->in_cap = 0;
+    }
+    if ((conn->flags & CRW_URING_CONN_PAUSED) && conn->in_len < UR->in_size) {
+        conn->flags &= ~CRW_URING_CONN_PAUSED;
+        if (!(conn->flags & (CRW_URING_CONN_RECV | CRW_URING_CONN_CLOSE))) {
+            CRW_uring_prep_recv(&UR->ring, conn->fd,
+                                (uintptr_t)conn | CRW_URING_OP_RECV);
+            conn->flags |= CRW_URING_CONN_RECV;
+        }
+    }
+    return;
 }
 
-static CRW_Response *CRW_handler_call(CRW_Handler *handler,
-                                      const CRW_RouteArgs *args,
-                                      const CRW_Request *req)
+static void CRW_uring_conn_input(CRW_ServerAdapterURing *UR,
+                                 CRW_URingConn *conn,
+                                 char *data, size_t len)
 {
-    CRW_Response *res = NULL;
-    if (handler && args && req) {
-        res = handler->callback(handler->inst,
-                                args, req, handler->userdata);
+    if (conn->flags & CRW_URING_CONN_CLOSE) {
+        return; /* not interested anymore */
     }
-    return res;
+    if (conn->in_len == 0 && !(conn->flags & CRW_URING_CONN_SEND)) {
+        /* fast path: straight from the provided buffer */
+        len = CRW_uring_conn_serve(UR, conn, data, len);
+        if (len > 0 && !(conn->flags & CRW_URING_CONN_CLOSE)
+         && CRW_uring_conn_stash(UR, conn, data, len) != 0) {
+            CRW_uring_conn_kill(UR, conn);
+        }
+    } else if (CRW_uring_conn_stash(UR, conn, data, len) != 0) {
+        CRW_uring_conn_kill(UR, conn);
+    } else {
+        conn->in_len = CRW_uring_conn_serve(UR, conn,
+                                            conn->in, conn->in_len);
+        CRW_uring_conn_unstash(UR, conn);
+    }
+    return;
 }
 
-int CRW_handler_add_route(CRW_Handler *handler, const char *route)
+static void CRW_uring_on_recv(CRW_ServerAdapterURing *UR,
+                              CRW_URingConn *conn,
+                              const struct io_uring_cqe *cqe)
 {
-    int err = -1;
-    if (handler && handler->inst && handler->inst->disp) {
-        err = CRW_dispatcher_register(handler->inst->disp, route, handler);
+    CRW_URing *R = &UR->ring;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0) {
+            CRW_uring_conn_input(UR, conn,
+                                 R->bufs + (size_t)bid * CRW_URING_BUFFER_SIZE,
+                                 cqe->res);
+        }
+        CRW_uring_buf_recycle(R, bid);
     }
-    return err;
+    if (cqe->res == 0
+     || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)) {
+        /* EOF or error: nothing more to read, but maybe to send */
+        conn->flags |= CRW_URING_CONN_CLOSE;
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        conn->flags &= ~CRW_URING_CONN_RECV;
+        if (!(conn->flags & (CRW_URING_CONN_CLOSE | CRW_URING_CONN_DEAD
+                             | CRW_URING_CONN_PAUSED))) {
+            CRW_uring_prep_recv(R, conn->fd,
+                                (uintptr_t)conn | CRW_URING_OP_RECV);
+            conn->flags |= CRW_URING_CONN_RECV;
+        }
+    }
+    return;
 }
 
-/*** server adapters *****************************************************/
-
-enum {
-    CRW_PORT_STR_LEN = 8
-};
-
-struct crwserveradapter_ {
-    CRW_Instance *inst;
-    CRW_LogHandler logger;
-    CRW_Dispatcher *disp;
-    CRW_ServerAdapterType server_type;
-    int running;
-
-    void *priv;
-
-    int (*destroy)(CRW_ServerAdapter *serv);
-    int (*run)(CRW_ServerAdapter *serv);
-    int (*stop)(CRW_ServerAdapter *serv);
-};
-
-
-static int CRW_server_adapter_init_error(CRW_ServerAdapter *serv,
-                                         const CRW_Config *cfg)
+static void CRW_uring_on_send(CRW_ServerAdapterURing *UR,
+                              CRW_URingConn *conn,
+                              const struct io_uring_cqe *cqe)
 {
-    return -1;
+    int more = 0;
+    conn->flags &= ~CRW_URING_CONN_SEND;
+    if (cqe->res < 0) {
+        CRW_uring_conn_kill(UR, conn);
+        return;
+    }
+    if (conn->piped > 0) {
+        conn->piped -= cqe->res;
+    }
+    conn->out_off += cqe->res;
+    if (conn->out_off < CRW_http_reply_len(&conn->out)) {
+        CRW_uring_conn_send(UR, conn); /* short write */
+        return;
+    }
+    more = CRW_http_reply_next(&conn->out);
+    if (more != 0) {
+        conn->out_off = 0;
+        if (more > 0) {
+            CRW_uring_conn_send(UR, conn); /* the next chunk */
+        } else {
+            CRW_uring_conn_kill(UR, conn);
+        }
+        return;
+    }
+    CRW_http_reply_cleanup(&conn->out);
+    conn->out_off = 0;
+    if (conn->in_len > 0 && !(conn->flags & CRW_URING_CONN_CLOSE)) {
+        conn->in_len = CRW_uring_conn_serve(UR, conn,
+                                            conn->in, conn->in_len);
+    }
+    CRW_uring_conn_unstash(UR, conn);
+    return;
 }
 
-/*** server adapters: specific: mongoose *********************************/
-#ifdef ENABLE_BUILTIN_MONGOOSE
-
-enum {
-    CRW_MONGOOSE_OPTION_NUM = 6
-};
-
-typedef struct crwserveradaptermongoose_ CRW_ServerAdapterMongoose;
-struct crwserveradaptermongoose_ {
-    struct mg_context *ctx;
-    const char *options[CRW_MONGOOSE_OPTION_NUM + 1]; /* ending NULL */
-    char *hostname;
-    char *docroot;
-    size_t hostlen;
-};
-
-CRW_RequestMethod
-CRW_server_adapter_mongoose_method(const struct mg_request_info *request_info)
+/* the file chunk is in the pipe: on to the socket */
+static void CRW_uring_on_splice(CRW_ServerAdapterURing *UR,
+                                CRW_URingConn *conn,
+                                const struct io_uring_cqe *cqe)
 {
-    CRW_RequestMethod meth = CRW_REQUEST_METHOD_UNKNOWN;
-    /* FIXME what about a LUT? */
-    if (!strcmp(request_info->request_method, "GET")) {
-        meth = CRW_REQUEST_METHOD_GET;
-    } else if (!strcmp(request_info->request_method, "HEAD")) {
-        meth = CRW_REQUEST_METHOD_HEAD;
-    } else if (!strcmp(request_info->request_method, "POST")) {
-        meth = CRW_REQUEST_METHOD_POST;
-    } else if (!strcmp(request_info->request_method, "PUT")) {
-        meth = CRW_REQUEST_METHOD_PUT;
-    } else if (!strcmp(request_info->request_method, "DELETE")) {
-        meth = CRW_REQUEST_METHOD_DELETE;
-    } else {
-        meth = CRW_REQUEST_METHOD_UNKNOWN;
+    conn->flags &= ~CRW_URING_CONN_SEND;
+    if (cqe->res <= 0) {
+        CRW_uring_conn_kill(UR, conn); /* failed, or the file shrunk */
+        return;
     }
-    return meth;
+    conn->piped = cqe->res;
+    CRW_uring_conn_send_file(UR, conn);
+    return;
 }
 
-static int CRW_server_adapter_mongoose_build(CRW_ServerAdapter *serv,
-                                             const struct mg_request_info *request_info,
-                                             CRW_Request *req)
+static int CRW_uring_conn_track(CRW_ServerAdapterURing *UR,
+                                CRW_URingConn *conn)
 {
     int err = 0;
-    if (serv && request_info && req) {
-        int j = 0, num = request_info->num_headers;
-        if (num > CRW_MAX_REQUEST_HEADERS) {
-            num = CRW_MAX_REQUEST_HEADERS;
+    if (conn->fd >= UR->max_conns) {
+        int max_conns = (UR->max_conns) ?UR->max_conns :CRW_URING_MIN_CONNS;
+        CRW_URingConn **conns = NULL;
+        while (max_conns <= conn->fd) {
+            max_conns *= 2;
         }
-        req->method = CRW_server_adapter_mongoose_method(request_info);
-        req->URI = request_info->uri;
-        req->query_string = request_info->query_string;
-        for (j = 0; j < num; j++) {
-            req->headers[j].key = request_info->http_headers[j].name;
-            req->headers[j].value = request_info->http_headers[j].value;
-            if (!strcasecmp(req->headers[j].key,
-                            "X-Requested-With")) {
-                req->is_xhr = 1;
-            }
+        conns = realloc(UR->conns, max_conns * sizeof(CRW_URingConn *));
+        if (conns) {
+            memset(conns + UR->max_conns, 0,
+                   (max_conns - UR->max_conns) * sizeof(CRW_URingConn *));
+            UR->conns = conns;
+            UR->max_conns = max_conns;
+        } else {
+            err = -1;
         }
-        req->num_headers = num;
+    }
+    if (!err) {
+        UR->conns[conn->fd] = conn;
+        UR->num_conns++;
     }
     return err;
 }
 
-
-static int CRW_server_adapter_mongoose_send(CRW_ServerAdapter *serv,
-                                            struct mg_connection *conn,
-                                            CRW_Response *res)
+static void CRW_uring_on_accept(CRW_ServerAdapterURing *UR,
+                                const struct io_uring_cqe *cqe)
 {
-    /* FIXME*/
-    mg_write(conn, res->body->cstr, res->body->pos);
-    return 0;
+    if (cqe->res >= 0) {
+        CRW_URingConn *conn = calloc(1, sizeof(CRW_URingConn));
+        int one = 1;
+        if (!conn) {
+            close(cqe->res);
+        } else {
+            conn->fd = cqe->res;
+            if (CRW_uring_conn_track(UR, conn) != 0) {
+                close(conn->fd);
+                free(conn);
+            } else {
+                setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY,
+                           &one, sizeof(one));
+                CRW_uring_prep_recv(&UR->ring, conn->fd,
+                                    (uintptr_t)conn | CRW_URING_OP_RECV);
+                conn->flags |= CRW_URING_CONN_RECV;
+            }
+        }
+    } else if (!UR->stop) {
+        CRW_log(UR->serv->inst, "iou", CRW_LOG_ERROR,
+                "accept failed errno=(%i)", -cqe->res);
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE) && !UR->stop) {
+        CRW_uring_prep_accept(UR);
+    }
+    return;
 }
 
+/* the deferred responses are back: out they go (the stashed input
+   is served once they are sent) */
+static void CRW_uring_complete(CRW_ServerAdapterURing *UR)
+{
+    CRW_Pending *P = CRW_pending_queue_take(&UR->done), *next = NULL;
+    for (; P; P = next) {
+        CRW_HTTPReply reply;
+        CRW_URingConn *conn = NULL;
+        next = P->next;
+        conn = CRW_http_serve_completed(UR->serv, P, &reply);
+        if (conn) {
+            conn->pending = NULL;
+            conn->out = reply;
+            CRW_uring_conn_reply(UR, conn);
+            CRW_uring_conn_check(UR, conn);
+        }
+    }
+    return;
+}
 
-static void *CRW_mongoose_event_handler(enum mg_event event,
-                                        struct mg_connection *conn,
-                                        const struct mg_request_info *request_info)
+static void CRW_uring_dispatch(CRW_ServerAdapterURing *UR,
+                               const struct io_uring_cqe *cqe)
 {
-    void *processed = "craneweb";
-    /* always. Mongoose should'nt do anything on its own */
-    CRW_ServerAdapter *serv = request_info->user_data;
-    CRW_Request *req = CRW_request_new(serv->inst);
-    CRW_Response *res = NULL;/*CRW_response_new(serv->inst);*/
-    if (req /*&& res*/) {
-        int err = 0;
-        if (event == MG_NEW_REQUEST) {
-            err = CRW_server_adapter_mongoose_build(serv, request_info, req);
-            res = CRW_dispatcher_handle(serv->disp, req);
-            if (!err && res) {
-                err = CRW_server_adapter_mongoose_send(serv, conn, res);
-                /* if (err) log it */
-            } /* else what? FIXME */
-            CRW_response_del(res);
-            CRW_request_del(req);
-        } else if (event == MG_HTTP_ERROR) {
-            /* TODO */
-        } /* else we're not interested in. */
-    } /* else what? FIXME */
-    return processed;
+    uint64_t data = cqe->user_data;
+    CRW_URingConn *conn = (CRW_URingConn *)(uintptr_t)
+                            (data & ~(uint64_t)CRW_URING_OP_MASK);
+    if (!conn) {
+        if (data == CRW_URING_TAG_ACCEPT) {
+            CRW_uring_on_accept(UR, cqe);
+        } else if (data == CRW_URING_TAG_WAKE
+                && cqe->res == 1 && UR->wake_byte) {
+            CRW_uring_complete(UR);
+            CRW_uring_prep_wake(UR);
+        } else if (data == CRW_URING_TAG_WAKE) {
+            UR->stop = 1;
+        }
+    } else {
+        if ((data & CRW_URING_OP_MASK) == CRW_URING_OP_SEND) {
+            CRW_uring_on_send(UR, conn, cqe);
+        } else if ((data & CRW_URING_OP_MASK) == CRW_URING_OP_SPLICE) {
+            CRW_uring_on_splice(UR, conn, cqe);
+        } else {
+            CRW_uring_on_recv(UR, conn, cqe);
+        }
+        CRW_uring_conn_check(UR, conn);
+    }
+    return;
 }
 
+static void *CRW_uring_loop(void *data)
+{
+    CRW_ServerAdapterURing *UR = data;
+    CRW_URing *R = &UR->ring;
+    while (!UR->stop) {
+        unsigned head = *R->cq_head, tail = 0;
+        int ret = 0;
+        CRW_uring_publish(R);
+        ret = CRW_uring_enter(R, R->pending, 1, IORING_ENTER_GETEVENTS);
+        if (ret < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            CRW_log(UR->serv->inst, "iou", CRW_LOG_CRITICAL,
+                    "io_uring_enter() failed errno=(%i)", errno);
+            break;
+        }
+        tail = __atomic_load_n(R->cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe cqe = R->cqes[head & *R->cq_mask];
+            head++;
+            /* give back the slot first: dispatching may submit */
+            __atomic_store_n(R->cq_head, head, __ATOMIC_RELEASE);
+            CRW_uring_dispatch(UR, &cqe);
+        }
+    }
+    CRW_thread_cache_flush();
+    return NULL;
+}
 
+static void CRW_uring_release(CRW_ServerAdapterURing *UR)
+{
+    int fd = 0;
+    /* first the ring, which cancels everything still in flight */
+    CRW_uring_teardown(&UR->ring);
+    UR->done.closing = 1;
+    for (fd = 0; fd < UR->max_conns; fd++) {
+        if (UR->conns[fd]) {
+            CRW_uring_conn_free(UR, UR->conns[fd]);
+        }
+    }
+    CRW_pending_queue_flush(&UR->done);
+    UR->done.wake_fd = -1;
+    free(UR->conns);
+    UR->conns = NULL;
+    UR->max_conns = 0;
+    if (UR->listen_fd >= 0) {
+        close(UR->listen_fd);
+    }
+    if (UR->wake_fds[0] >= 0) {
+        close(UR->wake_fds[0]);
+        close(UR->wake_fds[1]);
+    }
+    UR->listen_fd = UR->wake_fds[0] = UR->wake_fds[1] = -1;
+    return;
+}
 
-static int CRW_server_adapter_mongoose_destroy(CRW_ServerAdapter *serv)
+static int CRW_server_adapter_uring_run(CRW_ServerAdapter *serv)
 {
     int err = -1;
     if (serv) {
-        CRW_ServerAdapterMongoose *MG = serv->priv;
-        free(MG->hostname);
-        free(MG->docroot);
-        free(MG);
-        err = 0;
+        CRW_ServerAdapterURing *UR = serv->priv;
+        UR->stop = 0;
+        CRW_server_ignore_sigpipe();
+        UR->listen_fd = CRW_server_listen(&UR->addr, UR->backlog, 0);
+        if (UR->listen_fd < 0) {
+            CRW_log(serv->inst, "iou", CRW_LOG_CRITICAL,
+                    "cannot listen errno=(%i)", errno);
+        } else if (pipe(UR->wake_fds) != 0) {
+            CRW_log(serv->inst, "iou", CRW_LOG_CRITICAL,
+                    "cannot setup the event loop errno=(%i)", errno);
+        } else {
+            UR->done.wake_fd = UR->wake_fds[1];
+            CRW_uring_prep_accept(UR);
+            CRW_uring_prep_wake(UR);
+            if (pthread_create(&UR->loop, NULL, CRW_uring_loop, UR) != 0) {
+                CRW_log(serv->inst, "iou", CRW_LOG_CRITICAL,
+                        "cannot start the event loop thread");
+            } else {
+                serv->running = 1;
+                err = 0;
+            }
+        }
+        if (err) {
+            CRW_uring_release(UR);
+        }
+    } else {
+        CRW_panic("iou", "missing server instance to run");
     }
     return err;
 }
 
-
-static int CRW_server_adapter_mongoose_run(CRW_ServerAdapter *serv)
+static int CRW_server_adapter_uring_stop(CRW_ServerAdapter *serv)
 {
     int err = -1;
-    if (serv) {
-        CRW_ServerAdapterMongoose *MG = serv->priv;
-        MG->ctx = mg_start(CRW_mongoose_event_handler,
-                           serv, /* callback crazyness */
-                           MG->options);
-        if (MG->ctx) {
-            serv->running = 1;
+    if (serv && serv->running) {
+        CRW_ServerAdapterURing *UR = serv->priv;
+        char byte = 0;
+        int ret = 0;
+        UR->stop = 1;
+        do {
+            ret = write(UR->wake_fds[1], &byte, 1);
+        } while (ret < 0 && errno == EINTR);
+        if (ret == 1) {
             err = 0;
         } else {
-            CRW_log(serv->inst, "mng", CRW_LOG_CRITICAL,
-                    "server run mg_start() failed");
+            /* the pending accept fails: the loop wakes up all the same */
+            shutdown(UR->listen_fd, SHUT_RDWR);
         }
-    } else {
-        CRW_panic("mng", "missing server instance to run");
+        /* the loop must be gone before the ring and the connections */
+        pthread_join(UR->loop, NULL);
+        CRW_uring_release(UR);
+        serv->running = 0;
     }
     return err;
 }
 
-static int CRW_server_adapter_mongoose_stop(CRW_ServerAdapter *serv)
+static int CRW_server_adapter_uring_destroy(CRW_ServerAdapter *serv)
 {
     int err = -1;
     if (serv) {
-        CRW_ServerAdapterMongoose *MG = serv->priv;
-        mg_stop(MG->ctx);
-        serv->running = 0;
+        CRW_ServerAdapterURing *UR = serv->priv;
+        if (UR) {
+            if (serv->running) {
+                CRW_server_adapter_uring_stop(serv);
+            }
+            CRW_uring_release(UR);
+            CRW_pending_queue_fini(&UR->done);
+            free(UR);
+        }
+        err = 0;
     }
     return err;
 }
 
-static int CRW_server_adapter_init_mongoose(CRW_ServerAdapter *serv,
-                                            const CRW_Config *cfg)
+static int CRW_server_adapter_init_uring(CRW_ServerAdapter *serv,
+                                         const CRW_Config *cfg)
 {
     int err = -1;
     if (serv && cfg) {
-        CRW_ServerAdapterMongoose *MG = calloc(1, sizeof(CRW_ServerAdapterMongoose));
-        if (MG) {
-            /* TODO: parameters validation */
-            MG->hostlen = strlen(cfg->host);
-            MG->hostlen += 1 + CRW_PORT_STR_LEN + 1;
-            MG->hostname = calloc(1, MG->hostlen);
-            snprintf(MG->hostname, MG->hostlen,
-                     "%s:%i", cfg->host, cfg->port);
-            CRW_log(serv->inst, "mng", CRW_LOG_DEBUG,
-                    "will listen on (%s)", MG->hostname);
-            MG->docroot = strdup(cfg->document_root);
-            CRW_log(serv->inst, "mng", CRW_LOG_DEBUG,
-                    "will serve from (%s)", MG->docroot);
-            if (MG->hostname && MG->docroot) {
-                MG->options[0] = "document_root";
-                MG->options[1] = MG->docroot;
-                MG->options[2] = "listening_ports";
-                MG->options[3] = MG->hostname;
-                MG->options[4] = "num_threads";
-                MG->options[5] = "1";
-                MG->options[6] = NULL;
-                serv->destroy  = CRW_server_adapter_mongoose_destroy;
-                serv->run      = CRW_server_adapter_mongoose_run;
-                serv->stop     = CRW_server_adapter_mongoose_stop;
-                serv->priv     = MG;
-                err = 0;
+        CRW_ServerAdapterURing *UR = calloc(1, sizeof(CRW_ServerAdapterURing));
+        if (UR) {
+            serv->priv = UR;
+            UR->serv = serv;
+            UR->ring.fd = UR->listen_fd = -1;
+            UR->wake_fds[0] = UR->wake_fds[1] = -1;
+            CRW_pending_queue_init(&UR->done);
+            UR->backlog = (cfg->queue_depth) ?cfg->queue_depth :SOMAXCONN;
+            UR->keep_alive = cfg->keep_alive;
+            UR->in_size = (cfg->request_buffer_size)
+                            ?cfg->request_buffer_size
+                            :CRW_HTTP_DEFAULT_REQUEST_SIZE;
+            if (CRW_server_address(serv, cfg, &UR->addr) != 0) {
+                CRW_server_adapter_uring_destroy(serv);
+                serv->priv = NULL;
+            } else if (CRW_uring_setup(&UR->ring) != 0
+                    || CRW_uring_probe(&UR->ring) != 0) {
+                CRW_log(serv->inst, "iou", CRW_LOG_WARNING,
+                        "io_uring not usable errno=(%i), falling back",
+                        errno);
+                CRW_server_adapter_uring_destroy(serv);
+                serv->priv = NULL;
+                err = CRW_server_adapter_init_fallback(serv, cfg);
             } else {
-                CRW_log(serv->inst, "mng", CRW_LOG_CRITICAL,
-                        "no memory for server context parameters");
-                CRW_server_adapter_mongoose_destroy(serv);
-                err = -1;
+                if (cfg->workers > 1) {
+                    CRW_log(serv->inst, "iou", CRW_LOG_INFO,
+                            "single event loop, workers=[%i] ignored",
+                            cfg->workers);
+                }
+                CRW_log(serv->inst, "iou", CRW_LOG_DEBUG,
+                        "will listen on (%s:%i)", cfg->host, cfg->port);
+                serv->destroy  = CRW_server_adapter_uring_destroy;
+                serv->run      = CRW_server_adapter_uring_run;
+                serv->stop     = CRW_server_adapter_uring_stop;
+                err = 0;
             }
         } else {
-            CRW_log(serv->inst, "mng", CRW_LOG_CRITICAL,
+            CRW_log(serv->inst, "iou", CRW_LOG_CRITICAL,
                     "no memory for server context");
         }
     } else {
-        CRW_panic("mng", "missing server instance to intialize");
+        CRW_panic("iou", "missing server instance to intialize");
     }
     return err;
 }
-#else /* ENABLE_BUILTIN_MONGOOSE */
 
-static int CRW_server_adapter_init_mongoose(CRW_ServerAdapter *serv,
-                                            const CRW_Config *cfg)
+#else /* ENABLE_IO_URING_SERVER */
+
+static int CRW_server_adapter_init_uring(CRW_ServerAdapter *serv,
+                                         const CRW_Config *cfg)
 {
-    /* log it */
-    return -1;
+    CRW_log(serv->inst, "iou", CRW_LOG_WARNING,
+            "io_uring server not available in this build, falling back");
+    return CRW_server_adapter_init_fallback(serv, cfg);
 }
 
-#endif /* ENABLE_BUILTIN_MONGOOSE */
+#endif /* ENABLE_IO_URING_SERVER */
 
 
 /*** server adapters: generics *******************************************/
@@ -1276,6 +7714,12 @@ static const char *CRW_server_type_to_str(CRW_ServerAdapterType server_type)
       case CRW_SERVER_ADAPTER_DEFAULT:
         str = "mongoose";
         break;
+      case CRW_SERVER_ADAPTER_EPOLL:
+        str = "epoll";
+        break;
+      case CRW_SERVER_ADAPTER_IO_URING:
+        str = "io_uring";
+        break;
       default:
         str = "unknown";
         break;
@@ -1292,6 +7736,8 @@ struct crwserveradapterdesc_ {
 static CRW_ServerAdapterDesc CRW_adapters[] = {
     { CRW_SERVER_ADAPTER_MONGOOSE, CRW_server_adapter_init_mongoose },
     { CRW_SERVER_ADAPTER_DEFAULT,  CRW_server_adapter_init_mongoose },
+    { CRW_SERVER_ADAPTER_EPOLL,    CRW_server_adapter_init_epoll    },
+    { CRW_SERVER_ADAPTER_IO_URING, CRW_server_adapter_init_uring    },
     { CRW_SERVER_ADAPTER_NONE,     CRW_server_adapter_init_error    }
 };
 
@@ -1429,8 +7875,83 @@ int CRW_instance_add_handler(CRW_Instance *inst, CRW_Handler *handler)
     return err;
 }
 
+int CRW_instance_count_shards(CRW_Instance *inst)
+{
+    int num = 0;
+    if (inst && inst->server && inst->server->count_shards) {
+        num = inst->server->count_shards(inst->server);
+    }
+    return num;
+}
+
+int CRW_instance_get_shard_stats(CRW_Instance *inst, int shard,
+                                 CRW_ShardStats *stats)
+{
+    int err = -1;
+    if (inst && inst->server && inst->server->shard_stats && stats) {
+        err = inst->server->shard_stats(inst->server, shard, stats);
+    }
+    return err;
+}
+
 /*** runtime(!) **********************************************************/
 
+int CRW_config_init(CRW_Config *cfg)
+{
+    int err = -1;
+    if (cfg) {
+        memset(cfg, 0, sizeof(*cfg));
+        cfg->host = "127.0.0.1";
+        cfg->port = 8080;
+        err = 0;
+    }
+    return err;
+}
+
+static int CRW_config_check_range(CRW_Instance *instance, const char *name,
+                                  int value, int min, int max)
+{
+    int err = 0;
+    /* zero is always fine: it means `default' */
+    if (value && (value < min || value > max)) {
+        CRW_log(instance, "cfg", CRW_LOG_ERROR,
+                "%s=[%i] out of range [%i, %i]", name, value, min, max);
+        err = -1;
+    }
+    return err;
+}
+
+CRW_PRIVATE
+int CRW_config_validate(CRW_Instance *instance, const CRW_Config *cfg)
+{
+    int err = 0;
+    if (!cfg->host) {
+        CRW_log(instance, "cfg", CRW_LOG_ERROR, "missing host");
+        err = -1;
+    }
+    /* not a tunable: there is no default to fall back to */
+    if (cfg->port < 1 || cfg->port > 65535) {
+        CRW_log(instance, "cfg", CRW_LOG_ERROR,
+                "port=[%i] out of range [1, 65535]", cfg->port);
+        err = -1;
+    }
+    err |= CRW_config_check_range(instance, "workers", cfg->workers,
+                                  1, CRW_MAX_WORKERS);
+    err |= CRW_config_check_range(instance, "queue_depth", cfg->queue_depth,
+                                  1, CRW_MAX_QUEUE_DEPTH);
+    err |= CRW_config_check_range(instance, "request_buffer_size",
+                                  cfg->request_buffer_size,
+                                  CRW_MIN_REQUEST_BUFFER_SIZE,
+                                  CRW_MAX_REQUEST_BUFFER_SIZE);
+    err |= CRW_config_check_range(instance, "static_cache_size",
+                                  cfg->static_cache_size,
+                                  1, CRW_MAX_STATIC_CACHE_SIZE);
+    err |= CRW_config_check_range(instance, "compress_min_size",
+                                  cfg->compress_min_size,
+                                  1, CRW_MAX_COMPRESS_MIN_SIZE);
+    return err;
+}
+
 static void CRW_wait(CRW_Instance *instance)
 {
     while (instance
@@ -1445,6 +7966,19 @@ int CRW_run(CRW_Instance *instance, const CRW_Config *cfg)
 {
     int err = -1;
     if (instance && cfg) {
+        err = CRW_config_validate(instance, cfg);
+        if (err) {
+            CRW_log(instance, "run", CRW_LOG_CRITICAL,
+                    "invalid configuration");
+            return err;
+        }
+        instance->compress_min_size = CRW_compress_min_size(cfg);
+        err = CRW_dispatcher_compile(instance->disp);
+        if (err) {
+            CRW_log(instance, "run", CRW_LOG_CRITICAL,
+                    "cannot compile the routes error = [%i]", err);
+            return err;
+        }
         instance->server = CRW_server_adapter_new(instance,
                                                   instance->server_type,
                                                   cfg,
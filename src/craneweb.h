@@ -14,6 +14,8 @@
 #include "config.h"
 
 #include <stdarg.h>
+#include <stddef.h>
+#include <sys/types.h>
 
 
 /*** implementation limits ***********************************************/
@@ -29,10 +31,14 @@
 enum {
     CRW_MAX_ROUTE_ARGS = 16,      /**< max number of :tags per route */
     CRW_MAX_HANDLER_ROUTES = 16,  /**< max number of aliases per handler */
-    CRW_MAX_REQUEST_HEADERS = 64  /**< max number of HTTP headers exported
+    CRW_MAX_REQUEST_HEADERS = 64, /**< max number of HTTP headers exported
                                        into a CRW_Request. The remainder
                                        is silently dropped.
                                    */
+    CRW_MAX_QUERY_PARAMS = 64     /**< max number of query string parameters
+                                       exported by a CRW_Request. The
+                                       remainder is silently dropped.
+                                   */
 };
 // TODO: doxygen anchor
 
@@ -96,7 +102,11 @@ int CRW_logger_console(void *userdata, CRW_LogLevel level, const char *tag,
 typedef enum crwserveradptertype_ {
     CRW_SERVER_ADAPTER_NONE = -1,   /**< none (you should'nt see this) */
     CRW_SERVER_ADAPTER_DEFAULT = 0, /**< implementation default */
-    CRW_SERVER_ADAPTER_MONGOOSE     /**< mongoose */
+    CRW_SERVER_ADAPTER_MONGOOSE,    /**< mongoose */
+    CRW_SERVER_ADAPTER_EPOLL,       /**< native epoll event loop (linux) */
+    CRW_SERVER_ADAPTER_IO_URING     /**< native io_uring event loop (linux),
+                                         falls back to epoll if the kernel
+                                         lacks the needed features */
 } CRW_ServerAdapterType;
 
 /** \var typedef CRW_Instance
@@ -201,6 +211,232 @@ int CRW_request_get_header_by_idx(const CRW_Request *req, int idx,
 */
 const char *CRW_request_get_header_value(const CRW_Request *req, const char *header);
 
+/** \enum CRW_KnownHeader
+    \brief the HTTP headers craneweb indexes while reading the request.
+*/
+typedef enum crwknownheader_ {
+    CRW_HDR_UNKNOWN = -1,           /**< not one of the following */
+    CRW_HDR_HOST = 0,               /**< Host */
+    CRW_HDR_CONNECTION,             /**< Connection */
+    CRW_HDR_CONTENT_LENGTH,         /**< Content-Length */
+    CRW_HDR_CONTENT_TYPE,           /**< Content-Type */
+    CRW_HDR_TRANSFER_ENCODING,      /**< Transfer-Encoding */
+    CRW_HDR_ACCEPT,                 /**< Accept */
+    CRW_HDR_ACCEPT_ENCODING,        /**< Accept-Encoding */
+    CRW_HDR_COOKIE,                 /**< Cookie */
+    CRW_HDR_IF_NONE_MATCH,          /**< If-None-Match */
+    CRW_HDR_IF_MODIFIED_SINCE,      /**< If-Modified-Since */
+    CRW_HDR_USER_AGENT,             /**< User-Agent */
+    CRW_HDR_AUTHORIZATION,          /**< Authorization */
+    CRW_HDR_RANGE,                  /**< Range */
+    CRW_HDR_X_REQUESTED_WITH,       /**< X-Requested-With */
+    CRW_HDR_COUNT                   /**< how many; not a header */
+} CRW_KnownHeader;
+
+/** \fn CRW_request_get_known_header
+    \brief access the value of a well-known header.
+
+    Like CRW_request_get_header_value, but the header is already
+    resolved when the request is read: no string compare is done.
+    If the header is repeated, the first one is returned.
+
+    \param req CRW_Request to be examined.
+    \param header the CRW_KnownHeader to fetch.
+    \return NULL if missing or on error, the value of the header on success.
+
+    \see CRW_request_get_header_value
+*/
+const char *CRW_request_get_known_header(const CRW_Request *req,
+                                         CRW_KnownHeader header);
+
+/** \fn CRW_request_get_query_string
+    \brief access the raw query string of the request.
+
+    \param req CRW_Request to be examined.
+    \return the query string, still urlencoded and without the
+            leading '?'; NULL if the request has none.
+*/
+const char *CRW_request_get_query_string(const CRW_Request *req);
+
+/** \fn CRW_request_count_query_params
+    \brief tell how many parameters are in the query string.
+
+    The query string is parsed on the first access to the parameters
+    (that is, on this call or on any of the CRW_request_get_query_param*
+    calls), and only once.
+
+    \param req CRW_Request to be examined.
+    \return <0 on error, the number of parameters on success.
+*/
+int CRW_request_count_query_params(const CRW_Request *req);
+
+/** \fn CRW_request_get_query_param_by_idx
+    \brief access the query parameters by index, as they are.
+
+    The parameters are indexed from 0 (zero) to N, [0,N) where N
+    is provided by CRW_request_count_query_params.
+    Name and value are views into the query string: they are NOT
+    NULL-terminated and are still urlencoded. Nothing is copied.
+
+    \param req CRW_Request to be examined.
+    \param idx index of the parameter requested.
+    \param[out] name set to the start of the idx-th parameter name.
+    \param[out] name_len set to the length of the name.
+    \param[out] value set to the start of the idx-th parameter value.
+    \param[out] value_len set to the length of the value (0 if missing).
+    \return 0 on success, >0 if idx is out of range, <0 on error.
+
+    \see CRW_request_count_query_params
+*/
+int CRW_request_get_query_param_by_idx(const CRW_Request *req, int idx,
+                                       const char **name, size_t *name_len,
+                                       const char **value, size_t *value_len);
+
+/** \fn CRW_request_get_query_param
+    \brief access a query parameter value given its name.
+
+    The search is case sensitive and done on the decoded name, through
+    an index built along with the parsing. Only the value found is
+    decoded, on its first access; the result lives as long as the
+    request (like the CRW_request_alloc memory).
+    If the parameter is repeated, the first one is returned.
+
+    \param req CRW_Request to be examined.
+    \param name the name of the parameter.
+    \return NULL if missing or on error, the decoded value on success
+            ("" for a parameter without value).
+
+    \see CRW_request_get_query_param_by_idx
+*/
+const char *CRW_request_get_query_param(const CRW_Request *req,
+                                        const char *name);
+
+/** \fn CRW_request_get_content_length
+    \brief tell how long is the request body.
+
+    \param req CRW_Request to be examined.
+    \return <0 on error, the body length (the Content-Length) on success.
+*/
+long CRW_request_get_content_length(const CRW_Request *req);
+
+/** \fn CRW_request_read_body
+    \brief read the next piece of the request body.
+
+    The body is NOT buffered by craneweb on the behalf of the handler:
+    it is read from the connection as the handler asks for it, so the
+    memory used stays flat regardless of the body size.
+    The native server adapters (epoll, io_uring) already have the whole
+    body in the request buffer, and read from there: so they take only
+    the requests fitting CRW_Config.request_buffer_size (1MB at most),
+    and no chunked bodies.
+    What the handler leaves unread is discarded.
+
+    \param req CRW_Request being handled.
+    \param buf where to store the data.
+    \param len the size of buf.
+    \return the bytes read, 0 at the end of the body, <0 on error.
+*/
+int CRW_request_read_body(const CRW_Request *req, void *buf, size_t len);
+
+/** \var typedef CRW_BodyChunkHandler
+    \brief gets the request body, chunk by chunk.
+
+    \param userdata the opaque data given to CRW_request_stream_body.
+    \param chunk the next chunk of the body. Valid only during the call.
+    \param len the length of the chunk.
+    \return 0 to get the next chunk, !0 to stop.
+*/
+typedef int (*CRW_BodyChunkHandler)(void *userdata,
+                                    const char *chunk, size_t len);
+
+/** \fn CRW_request_stream_body
+    \brief deliver the (rest of the) request body to a callback.
+
+    The chunks are handed over as they arrive from the connection, using
+    a bounded buffer; so, like CRW_request_read_body, the memory used
+    does not depend on the body size.
+
+    \param req CRW_Request being handled.
+    \param handler the callback which gets the chunks.
+    \param userdata opaque data for the callback.
+    \return <0 on error (e.g. the client went away), the bytes
+            delivered otherwise.
+*/
+long CRW_request_stream_body(const CRW_Request *req,
+                             CRW_BodyChunkHandler handler, void *userdata);
+
+/** \enum the multipart events, in the order they come for each part. */
+typedef enum {
+    CRW_MULTIPART_PART_BEGIN = 0, /**< the part headers are in */
+    CRW_MULTIPART_PART_DATA,      /**< the next piece of the part body */
+    CRW_MULTIPART_PART_END        /**< the part body is all there */
+} CRW_MultipartEvent;
+
+/** \enum the special spill sizes for CRW_request_read_multipart. */
+enum {
+    CRW_MULTIPART_STREAM = -1,              /**< don't keep the parts */
+    CRW_MULTIPART_SPILL_SIZE = 64 * 1024    /**< a sensible default */
+};
+
+/** \struct CRW_MultipartPart
+    \brief a part of a multipart/form-data request body.
+
+    The strings live as long as the request does.
+*/
+typedef struct crwmultipartpart_ CRW_MultipartPart;
+struct crwmultipartpart_ {
+    int index;                  /**< of the part, from 0 */
+    const char *name;           /**< the form field name, or NULL */
+    const char *filename;       /**< the uploaded file name, or NULL */
+    const char *content_type;   /**< as given by the client, or NULL */
+    long size;                  /**< the bytes of the body seen so far */
+    const char *data;           /**< at the end: the body, if kept in
+                                     memory (NUL-terminated) */
+    const char *path;           /**< the temporary file with the body,
+                                     if it was spilled on disk */
+};
+
+/** \var typedef CRW_MultipartHandler
+    \brief gets the multipart events.
+
+    \param userdata the opaque data given to CRW_request_read_multipart.
+    \param event what happened.
+    \param part the part the event is about.
+    \param data the part data on CRW_MULTIPART_PART_DATA, NULL otherwise.
+           Valid only during the call.
+    \param len the length of data.
+    \return 0 to go ahead, !0 to stop.
+*/
+typedef int (*CRW_MultipartHandler)(void *userdata,
+                                    CRW_MultipartEvent event,
+                                    const CRW_MultipartPart *part,
+                                    const char *data, size_t len);
+
+/** \fn CRW_request_read_multipart
+    \brief parse a multipart/form-data request body, as it comes.
+
+    The body is streamed through the parser (see CRW_request_stream_body),
+    never buffered as a whole.
+    With spill_size set to CRW_MULTIPART_STREAM, the part bodies are only
+    handed over, piece by piece, with CRW_MULTIPART_PART_DATA events.
+    Otherwise, the part bodies are collected and ready on
+    CRW_MULTIPART_PART_END (no CRW_MULTIPART_PART_DATA events): in memory
+    (part->data) up to spill_size bytes, in a temporary file (part->path)
+    beyond. The temporary files (in $TMPDIR or in /tmp) are removed with
+    the request: rename them to keep them.
+
+    \param req CRW_Request being handled.
+    \param spill_size the max part body kept in memory,
+           or CRW_MULTIPART_STREAM.
+    \param handler the callback which gets the events.
+    \param userdata opaque data for the callback.
+    \return <0 on error (not multipart, malformed or truncated body,
+            the client went away, can't write the temporary files),
+            the number of parts seen otherwise.
+*/
+int CRW_request_read_multipart(const CRW_Request *req, long spill_size,
+                               CRW_MultipartHandler handler, void *userdata);
+
 /** \fn CRW_request_is_xhr
     \brief checks if the request is made by the client using
            XmlHttpRequest.
@@ -215,6 +451,20 @@ const char *CRW_request_get_header_value(const CRW_Request *req, const char *hea
 */
 int CRW_request_is_xhr(const CRW_Request *req);
 
+/** \fn CRW_request_alloc
+    \brief allocates memory which lives as long as the request does.
+
+    The memory comes from the request arena, and goes away at once,
+    without any free(), when the request and its response are done
+    (that is, after the response is sent). Good for scratch buffers
+    and for the data attached with CRW_response_add_body_ref.
+
+    \param req CRW_Request being handled.
+    \param size bytes to allocate.
+    \return a pointer to the (uninitialized) memory, NULL on error.
+*/
+void *CRW_request_alloc(const CRW_Request *req, size_t size);
+
 /*** response ************************************************************/
 
 /** \var typedef CRW_Response
@@ -260,6 +510,9 @@ void CRW_response_del(CRW_Response *res);
 /** \fn CRW_response_add_header
     \brief adds an HTTP header to a CRW_Response.
 
+    The header goes out as `name: value'. Names with a colon or a line
+    break, and values with a line break, are refused.
+
     \param res the CRW_Response to be augmented.
     \param name name of the HTTP header to add.
     \value value value of the HTTP header to add.
@@ -279,6 +532,168 @@ int CRW_response_add_header(CRW_Response *res,
 */
 int CRW_response_add_body(CRW_Response *res, const char *chunk);
 
+/** \fn CRW_response_add_body_len
+    \brief add a chunk of binary data to the response body
+
+    like CRW_response_add_body, but the chunk may contain NULs.
+    The data is copied.
+
+    \param res the CRW_Response to be augmented.
+    \param data chunk of data to be added.
+    \param len length of the chunk, in bytes.
+    \return 0 on success, <0 on error.
+*/
+int CRW_response_add_body_len(CRW_Response *res,
+                              const void *data, size_t len);
+
+/** \var typedef CRW_BodyRelease
+    \brief releases a buffer attached to a response body.
+
+    called with the buffer and the opaque data given to
+    CRW_response_add_body_ref, once the response has been sent
+    (or discarded).
+*/
+typedef void (*CRW_BodyRelease)(const void *data, void *release_data);
+
+/** \fn CRW_response_add_body_ref
+    \brief attach a buffer to the response body, without copying it
+
+    the buffer goes in the body after what was added so far, and
+    must stay valid and unchanged until the release callback is called.
+    The release callback is called on error as well.
+
+    \param res the CRW_Response to be augmented.
+    \param data the buffer to attach.
+    \param len length of the buffer, in bytes.
+    \param release called when the buffer is not needed anymore.
+           Can be NULL (e.g. for static data).
+    \param release_data opaque data for the release callback.
+    \return 0 on success, <0 on error.
+*/
+int CRW_response_add_body_ref(CRW_Response *res,
+                              const void *data, size_t len,
+                              CRW_BodyRelease release, void *release_data);
+
+/** \fn CRW_response_send_file
+    \brief end the response body with (a part of) a file.
+
+    The file is not read by craneweb: the server adapter hands it
+    to the kernel (sendfile(2)) straight from the page cache.
+    The file is the last thing in the body: nothing can be added after
+    it. Not for streamed responses.
+
+    \param res the CRW_Response to be augmented.
+    \param path the file to send.
+    \param offset where to start from, in bytes.
+    \param len how many bytes to send, <0 for all the rest of the file;
+           never past the end of the file.
+    \return 0 on success, <0 on error (e.g. not a regular file).
+
+    \see CRW_response_send_fd
+*/
+int CRW_response_send_file(CRW_Response *res, const char *path,
+                           off_t offset, off_t len);
+
+/** \fn CRW_response_send_fd
+    \brief like CRW_response_send_file, for an already open file.
+
+    The response takes the file descriptor over, and closes it once
+    sent; on error as well.
+
+    \param res the CRW_Response to be augmented.
+    \param fd the file to send, open for reading.
+    \param offset where to start from, in bytes.
+    \param len how many bytes to send, <0 for all the rest of the file.
+    \return 0 on success, <0 on error (e.g. not a regular file).
+*/
+int CRW_response_send_fd(CRW_Response *res, int fd, off_t offset, off_t len);
+
+/** \var typedef CRW_ResponseProducer
+    \brief produces the body of a streamed response, piece by piece.
+
+    Called each time the previous piece went out on the connection,
+    so a slow client slows down the production as well.
+    The piece is added to the given response as usual
+    (CRW_response_add_body and friends), and must not be empty
+    unless the body is over. The request is gone by then:
+    what is needed from it must be in userdata.
+
+    \param userdata the opaque data given to CRW_response_set_stream.
+    \param res the CRW_Response to put the next piece in.
+    \return 0 if there is more to come, >0 if this was the last piece,
+            <0 to give up (the connection is closed).
+*/
+typedef int (*CRW_ResponseProducer)(void *userdata, CRW_Response *res);
+
+/** \var typedef CRW_StreamRelease
+    \brief called when a streamed response is over, in any way.
+*/
+typedef void (*CRW_StreamRelease)(void *userdata);
+
+/** \fn CRW_response_set_stream
+    \brief make the body of the response streamed.
+
+    The status line and the headers go out as soon as the handler
+    returns, with `Transfer-Encoding: chunked'; then the body follows,
+    as the producer makes it. What was added to the body before is sent
+    first. The body is never held as a whole in memory.
+    HTTP/1.0 clients cannot take chunks: for them, the body goes as it
+    is, with neither length nor chunks, and the connection is closed at
+    its end (a failed producer cannot be told from the end then).
+
+    \param res the CRW_Response to be streamed.
+    \param producer the callback which makes the body.
+    \param release called when the stream is over. Can be NULL.
+    \param userdata opaque data for the callbacks.
+    \return 0 on success, <0 on error (release is called anyway).
+*/
+int CRW_response_set_stream(CRW_Response *res,
+                            CRW_ResponseProducer producer,
+                            CRW_StreamRelease release, void *userdata);
+
+/** \fn CRW_response_set_cache_tag
+    \brief tag the response, to purge it later on from the cache.
+
+    Meaningful only for the handlers with a cache
+    (see CRW_handler_set_cache): all the responses with the same tag
+    can go at once, e.g. all the pages showing the same record.
+    A response has one tag at most: the last one set wins.
+
+    \param res the CRW_Response to be tagged.
+    \param tag the tag (copied).
+    \return 0 on success, <0 on error.
+
+    \see CRW_handler_cache_purge_tag
+*/
+int CRW_response_set_cache_tag(CRW_Response *res, const char *tag);
+
+/** \fn CRW_response_set_etag
+    \brief set the entity tag of the response, before to make its body.
+
+    If the request says (If-None-Match) that the client already has
+    it, the response becomes a 304 Not Modified: the handler can return
+    it right away, skipping the work to make the body.
+        res = CRW_response_new(inst);
+        if (CRW_response_set_etag(res, req, version) > 0) {
+            return res;
+        }
+        ... the body ...
+    With a cache or request coalescing, the responses shared get
+    their 304 too (see CRW_handler_set_cache).
+
+    \param res the CRW_Response to be tagged.
+    \param req the request being served.
+    \param etag the entity tag, e.g. a version (copied). Quoted if it
+           is not already (as in "v1" or W/"v1"). Without quotes inside.
+    \return 1 if the client has it: the response is a 304 already,
+            0 if the body is needed,
+            <0 on error.
+
+    \see CRW_handler_set_etag
+*/
+int CRW_response_set_etag(CRW_Response *res, const CRW_Request *req,
+                          const char *etag);
+
 
 /*** route ***************************************************************/
 
@@ -437,6 +852,249 @@ void CRW_handler_del(CRW_Handler *handler);
 */
 int CRW_handler_add_route(CRW_Handler *handler, const char *route);
 
+/** \fn CRW_handler_set_cache
+    \brief keep the responses of the handler, for the same requests to come.
+
+    For the handlers whose responses depend only on the URI (route args
+    and query string included) and, maybe, on a few request headers
+    (see CRW_handler_cache_vary). Only GET requests fill the cache;
+    HEAD requests get the same responses, without the body.
+    What is kept: the 200 responses with the body in memory (not
+    streamed, no file), without Set-Cookie, nor `Cache-Control: no-store'
+    or `private'.
+    A response is fresh for ttl milliseconds, and served as it is
+    without calling the handler. Then, for stale milliseconds more, it
+    is still served to all the requests but one, which calls the handler
+    to refresh it. Past that, it is thrown away.
+    The least recently used responses go to stay within max_size bytes.
+
+    CAUTION: set it up before to run the instance.
+
+    \param handler the handler to be cached.
+    \param ttl how long a response is fresh, in milliseconds. >0.
+    \param stale how long a response can be served after, while being
+           refreshed, in milliseconds. 0 for never.
+    \param max_size memory for the cache, in bytes.
+    \return 0 on success, <0 on error.
+
+    \see CRW_handler_cache_purge
+*/
+int CRW_handler_set_cache(CRW_Handler *handler,
+                          int ttl, int stale, size_t max_size);
+
+/** \fn CRW_handler_cache_vary
+    \brief make a request header part of the cache key.
+
+    Requests with different values of the header (e.g. Accept-Language)
+    get different responses from the cache. Up to 8 headers.
+
+    \param handler the handler with a cache.
+    \param header the header name (copied).
+    \return 0 on success, <0 on error (e.g. no cache).
+
+    \see CRW_handler_set_cache
+*/
+int CRW_handler_cache_vary(CRW_Handler *handler, const char *header);
+
+/** \fn CRW_handler_cache_purge
+    \brief throw away the cached responses for an URI.
+
+    \param handler the handler with a cache.
+    \param uri the URI path, as the requests have it: all its query
+           strings go as well. With a query string (e.g.
+           "/items/42?full=1"), just that one goes.
+    \return the number of responses thrown away (all the variants of
+            the URI, see CRW_handler_cache_vary), <0 on error.
+*/
+int CRW_handler_cache_purge(CRW_Handler *handler, const char *uri);
+
+/** \fn CRW_handler_cache_purge_tag
+    \brief throw away the cached responses with a tag.
+
+    \param handler the handler with a cache.
+    \param tag the tag, as given to CRW_response_set_cache_tag.
+    \return the number of responses thrown away, <0 on error.
+*/
+int CRW_handler_cache_purge_tag(CRW_Handler *handler, const char *tag);
+
+/** \fn CRW_handler_set_coalescing
+    \brief call the handler once for identical concurrent GET requests.
+
+    While the handler works on a GET request, the identical ones
+    arriving (same URI and query string; same varying headers, if
+    cached, see CRW_handler_cache_vary) wait for it, and get a copy of
+    its response instead of calling the handler again. With a cache,
+    this happens when a response is missing or expired.
+    The responses given to the waiters are the ones a cache would
+    share: the body in memory, without Set-Cookie nor
+    `Cache-Control: private'. For the others, each waiter calls
+    the handler by itself.
+    For the handlers whose responses depend only on the request URI,
+    like the cached ones. A waiter blocks its worker thread as long as
+    the handler runs: so the epoll and io_uring servers, which would
+    block a whole event loop, call the handler for each request.
+
+    CAUTION: set it up before to run the instance.
+
+    \param handler the handler to be coalesced.
+    \param enabled nonzero to enable, 0 to disable.
+    \return 0 on success, <0 on error.
+
+    \see CRW_handler_set_cache
+*/
+int CRW_handler_set_coalescing(CRW_Handler *handler, int enabled);
+
+/** \fn CRW_handler_set_etag
+    \brief give ETags to the responses of the handler, and answer 304
+    to the requests which already have them.
+
+    The body of the 200 responses is hashed (FNV-1a, not for security),
+    and the response gets a weak ETag from it, unless it has one already
+    (see CRW_response_set_etag). A GET or HEAD request with a matching
+    If-None-Match gets a 304 Not Modified, without the body. The handler
+    still makes the body: to skip that too, use CRW_response_set_etag.
+    Streamed and file responses are left as they are.
+    With a cache, the ETags are kept with the responses, and the cached
+    ones get their 304 as well.
+
+    CAUTION: set it up before to run the instance.
+
+    \param handler the handler.
+    \param enabled nonzero to enable, 0 to disable.
+    \return 0 on success, <0 on error.
+
+    \see CRW_response_set_etag
+*/
+int CRW_handler_set_etag(CRW_Handler *handler, int enabled);
+
+/** \var typedef CRW_Asset
+    \brief a file embedded in the program, for CRW_handler_new_assets.
+
+    Tables of CRW_Asset are made at build time from a directory by
+    tools/craneweb_embed.py (see the craneweb_embed_assets CMake
+    function in cmake/Modules/CranewebEmbed.cmake): everything is
+    read-only data, nothing is read from the filesystem at runtime.
+*/
+typedef struct crwasset_ CRW_Asset;
+struct crwasset_ {
+    const char *path;           /**< URI path, like "/ui/index.html" */
+    const char *mime_type;      /**< value of the Content-Type */
+    const char *etag;           /**< entity tag, with the quotes */
+    const unsigned char *data;  /**< the file contents */
+    size_t size;                /**< the file length, in bytes */
+    const unsigned char *data_gzip; /**< gzipped contents, NULL if none */
+    size_t size_gzip;           /**< gzipped length, in bytes */
+    const char *etag_gzip;      /**< entity tag of the gzipped contents,
+                                     with the quotes; without it, they
+                                     are not served */
+};
+
+/** \fn CRW_handler_new_assets
+    \brief build a new CRW_Handler serving a table of embedded files.
+
+    The file is looked up by the URI path; a path ending in '/' stands
+    for its index.html. The route decides which URIs get to the handler
+    (e.g. "/ui/.*"); an URI with no file gets a 404.
+    An If-None-Match with the entity tag of what would be sent gets a
+    304, and the gzipped contents, if any, go to the clients accepting
+    them, with their own entity tag.
+
+    \param inst the CRW_Instance on which the handler will operate.
+    \param route string representation of the route which this
+           handler will respond.
+    \param assets the table, sorted by path and ended by an entry
+           with a NULL path, as generated. Must outlive the handler.
+    \return a new CRW_Handler instance on success,
+            NULL on error.
+
+    \see CRW_Asset
+*/
+CRW_Handler *CRW_handler_new_assets(CRW_Instance *inst,
+                                    const char *route,
+                                    const CRW_Asset *assets);
+
+/** \var typedef CRW_Pending
+    \brief A CRW_Pending stands for a response to be sent later.
+
+    A handler waiting for something (a backend, another service) does
+    not need to hold a thread meanwhile: it defers the response
+    (CRW_response_defer) and hands the token over to whatever will
+    complete it (CRW_response_complete), from any thread.
+    The request goes with the token: it stays valid, even once the
+    connection buffer is reused, until the token is completed.
+*/
+typedef struct crwpending_ CRW_Pending;
+
+/** \fn CRW_response_defer
+    \brief defer the response to the request being served.
+
+    To be called from the handler, at most once per request; the
+    handler must return what it gives back, as it is.
+        CRW_Pending *pending = NULL;
+        res = CRW_response_defer(inst, req, &pending);
+        if (res) {
+            ... hand pending over to the backend ...
+        }
+        return res;
+    The body not read yet is read in memory now, then the request is
+    detached from the connection.
+    With the epoll and io_uring servers, the event loop goes on with
+    the other connections; this one waits for the completion (the
+    requests pipelined behind wait as well). With mongoose, the thread
+    of the connection waits for the completion.
+    A deferred response is not cached, nor shared by request coalescing,
+    and gets no automatic ETag.
+
+    \param inst the CRW_Instance on which the handler is operating.
+    \param req the request being served.
+    \param pending the token to complete the response with.
+    \return the placeholder to be returned by the handler,
+            NULL on error (then pending is not set).
+
+    \see CRW_response_complete
+*/
+CRW_Response *CRW_response_defer(CRW_Instance *inst, const CRW_Request *req,
+                                 CRW_Pending **pending);
+
+/** \fn CRW_pending_get_request
+    \brief access the request of a deferred response.
+
+    CAUTION: valid until the token is completed; to be used by one
+             thread at time.
+
+    \param pending the token.
+    \return the request, NULL on error.
+*/
+const CRW_Request *CRW_pending_get_request(const CRW_Pending *pending);
+
+/** \fn CRW_pending_get_route_args
+    \brief access the route arguments of a deferred response.
+
+    CAUTION: valid until the token is completed.
+
+    \param pending the token.
+    \return the route arguments, NULL on error.
+*/
+const CRW_RouteArgs *CRW_pending_get_route_args(const CRW_Pending *pending);
+
+/** \fn CRW_response_complete
+    \brief send a deferred response, from any thread.
+
+    The response is made as usual, with CRW_response_new; but outside
+    of a handler serving another request (it would share its memory).
+    The token is gone afterwards, whatever the outcome: it must be
+    completed exactly once. If the client went away meanwhile, the
+    response is just dropped. With the epoll server, a client shutting
+    down its side of the connection while waiting is gone as well.
+
+    \param pending the token given by CRW_response_defer.
+    \param res the response, taken over. NULL gets a 500.
+    \return 0 on success, <0 on error.
+
+    \see CRW_response_defer
+*/
+int CRW_response_complete(CRW_Pending *pending, CRW_Response *res);
+
 
 /*** instance (2) ********************************************************/
 
@@ -508,13 +1166,73 @@ int CRW_instance_add_handler(CRW_Instance *inst, CRW_Handler *handler);
 typedef struct crwconfig_ CRW_Config;
 struct crwconfig_ {
     const char *host;           /**< host IP to listen on */
-    int port;                   /**< listening port */
-    const char *document_root;  /**< document root (static files)*/
+    int port;                   /**< listening port, 1-65535 */
+    const char *document_root;  /**< static files for the requests no
+                                     handler takes. default: none, they
+                                     get a 404. mongoose server only */
+    /* tunables. 0 (zero) always means `use the default' */
+    int workers;                /**< worker threads.
+                                     default: one per online CPU */
+    int queue_depth;            /**< accepted connections waiting
+                                     for a free worker */
+    int keep_alive;             /**< !0 to keep the connections alive */
+    int request_buffer_size;    /**< max bytes of request line+headers.
+                                     The native servers (epoll, io_uring)
+                                     need the body in there too: bigger
+                                     requests get a 413, and the chunked
+                                     request bodies a 411.
+                                     default: 16384 bytes */
+    int pin_workers;            /**< !0 to bind each worker to a CPU */
+    int reuse_port;             /**< !0 to give each worker its own
+                                     listening socket (SO_REUSEPORT)
+                                     and event loop. epoll server only */
+    int static_cache_size;      /**< bytes of small static files kept
+                                     in memory, headers included.
+                                     default: none. mongoose server only */
+    int compress;               /**< !0 to gzip the responses for the
+                                     clients accepting it: the bodies of
+                                     the textual types, and the static
+                                     files with a precompressed `.gz'
+                                     sibling (mongoose server only) */
+    int compress_min_size;      /**< smallest body worth compressing.
+                                     default: 1024 bytes */
+};
+
+/** \enum the CRW_Config tunables limits.
+
+    Values out of those ranges are rejected by CRW_run.
+*/
+enum {
+    CRW_MAX_WORKERS = 1024,                   /**< max worker threads */
+    CRW_MAX_QUEUE_DEPTH = 65536,              /**< max queued connections */
+    CRW_MIN_REQUEST_BUFFER_SIZE = 1024,       /**< min request buffer */
+    CRW_MAX_REQUEST_BUFFER_SIZE = 1024 * 1024, /**< max request buffer */
+    CRW_MAX_STATIC_CACHE_SIZE = 1024 * 1024 * 1024, /**< max static cache */
+    CRW_MAX_COMPRESS_MIN_SIZE = 1024 * 1024   /**< max compression floor */
 };
 
+/** \fn CRW_config_init
+    \brief fills a CRW_Config with the default values.
+
+    Use this before to tune the fields you are interested in,
+    so the CRW_Config will not contain garbage.
+
+    \param cfg the CRW_Config to be initialized.
+    \return 0 on success, <0 on error.
+*/
+int CRW_config_init(CRW_Config *cfg);
+
 /**< \fn CRW_run
      \brief runs a CRW_Instance, allowing it to serve requests.
 
+     The routes of all the attached handlers are compiled here,
+     so handlers and routes must be registered before this call.
+     Routes made only of static segments and whole-segment :tags
+     (/like/:this) are looked up in a tree, the others are still
+     tried one by one, the most recent first. Either way a route
+     matches as its regex does: anywhere in the URI, with the :tags
+     taking any printable characters, '/' included.
+
      \param instance the CRW_Instance to be run.
      \param cfg CRW_Config describing how to run the given instance.
      \return 0 on success, <0 on error.
@@ -524,6 +1242,47 @@ struct crwconfig_ {
 */
 int CRW_run(CRW_Instance *instance, const CRW_Config *cfg);
 
+/** \struct CRW_ShardStats
+    \brief what an event loop of a running CRW_Instance did so far.
+
+    The counters are updated by the loop itself, without locking,
+    so a snapshot taken while serving is only approximate.
+*/
+typedef struct crwshardstats_ CRW_ShardStats;
+struct crwshardstats_ {
+    int cpu;                    /**< CPU the loop is bound to, -1 if none */
+    unsigned long accepted;     /**< connections accepted */
+    unsigned long requests;     /**< requests served */
+    unsigned long active;       /**< connections open right now */
+};
+
+/** \fn CRW_instance_count_shards
+    \brief tells how many event loops are serving a CRW_Instance.
+
+    Only the epoll server reports its loops: one per worker when
+    CRW_Config.reuse_port is set, just one otherwise.
+
+    \param inst the running CRW_Instance.
+    \return the number of the loops, 0 if unknown.
+*/
+int CRW_instance_count_shards(CRW_Instance *inst);
+
+/** \fn CRW_instance_get_shard_stats
+    \brief takes a snapshot of the counters of an event loop.
+
+    Useful to check that the kernel spreads the connections evenly
+    among the loops. Can be called from any thread, handlers included.
+
+    \param inst the running CRW_Instance.
+    \param shard the loop index, in [0, CRW_instance_count_shards()).
+    \param stats the CRW_ShardStats to be filled.
+    \return 0 on success, <0 on error.
+
+    \see CRW_instance_count_shards
+*/
+int CRW_instance_get_shard_stats(CRW_Instance *inst, int shard,
+                                 CRW_ShardStats *stats);
+
 /*** that's all folks! ***************************************************/
 
 #endif /* CRANEWEB_H */
@@ -0,0 +1,211 @@
+/**************************************************************************
+ * bench_epoll_idle: memory cost of idle keep-alive connections held by   *
+ * the epoll server adapter.                                              *
+ **************************************************************************/
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "craneweb.h" 
+
+
+/*************************************************************************/
+
+enum {
+    DEFAULT_CONNS = 50000,
+    DEFAULT_PORT = 8089,
+    FD_SLACK = 64,
+    CONNS_PER_SOURCE = 20000, /* stay well within the ephemeral ports */
+    RESP_LEN = 256
+};
+
+static const char Request[] = "GET /ping HTTP/1.1\r\nHost: bench\r\n\r\n";
+
+static CRW_Response *ping(CRW_Instance *inst,
+                          const CRW_RouteArgs *args,
+                          const CRW_Request *req,
+                          void *userdata)
+{
+    CRW_Response *res = CRW_response_new(inst);
+    CRW_response_add_body(res, "pong");
+    return res;
+}
+
+static int quiet(void *userdata, CRW_LogLevel level, const char *tag,
+                 const char *fmt, va_list args)
+{
+    return 0;
+}
+
+static int raise_fd_limit(int wanted)
+{
+    struct rlimit rl;
+    getrlimit(RLIMIT_NOFILE, &rl);
+    if (rl.rlim_max != RLIM_INFINITY && (int)rl.rlim_max < wanted) {
+        wanted = (int)rl.rlim_max;
+    }
+    rl.rlim_cur = wanted;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    return wanted;
+}
+
+static void serve(int port)
+{
+    CRW_Config cfg;
+    CRW_Instance *inst = CRW_instance_new(CRW_SERVER_ADAPTER_EPOLL);
+    CRW_Handler *handler = CRW_handler_new(inst, "/ping", ping, NULL);
+    CRW_instance_set_logger(inst, quiet);
+    CRW_instance_add_handler(inst, handler);
+    CRW_config_init(&cfg);
+    cfg.port = port;
+    cfg.keep_alive = 1;
+    exit(CRW_run(inst, &cfg));
+}
+
+static long rss_kb(pid_t pid)
+{
+    char path[64], line[256];
+    long rss = -1;
+    FILE *f = NULL;
+    snprintf(path, sizeof(path), "/proc/%i/status", (int)pid);
+    f = fopen(path, "r");
+    while (f && fgets(line, sizeof(line), f)) {
+        if (!strncmp(line, "VmRSS:", 6)) {
+            rss = strtol(line + 6, NULL, 10);
+        }
+    }
+    if (f) {
+        fclose(f);
+    }
+    return rss;
+}
+
+/* loopback is a /8: spread the clients on many source addresses */
+static int connect_one(int port, int idx)
+{
+    struct sockaddr_in src, dst;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    memset(&src, 0, sizeof(src));
+    src.sin_family = AF_INET;
+    src.sin_addr.s_addr = htonl(0x7F000002 + idx / CONNS_PER_SOURCE);
+    memset(&dst, 0, sizeof(dst));
+    dst.sin_family = AF_INET;
+    dst.sin_port = htons(port);
+    dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&src, sizeof(src)) != 0
+     || connect(fd, (struct sockaddr *)&dst, sizeof(dst)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+/* a full round trip, so the connection is surely idle and kept alive */
+static int ping_one(int fd)
+{
+    char resp[RESP_LEN];
+    ssize_t got = 0;
+    size_t len = 0;
+    if (write(fd, Request, sizeof(Request) - 1) != sizeof(Request) - 1) {
+        return -1;
+    }
+    while (len < sizeof(resp) - 1
+        && (got = read(fd, resp + len, sizeof(resp) - 1 - len)) > 0) {
+        len += got;
+        resp[len] = '\0';
+        if (strstr(resp, "pong")) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static int wait_server(int port)
+{
+    struct timespec nap = { 0, 50 * 1000 * 1000 };
+    int j = 0, fd = -1;
+    for (j = 0; j < 100 && fd < 0; j++) {
+        nanosleep(&nap, NULL);
+        fd = connect_one(port, 0);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return (fd >= 0) ?0 :-1;
+}
+
+int main(int argc, char *argv[])
+{
+    int conns = (argc > 1) ?atoi(argv[1]) :DEFAULT_CONNS;
+    int port = (argc > 2) ?atoi(argv[2]) :DEFAULT_PORT;
+    int limit = 0, j = 0, opened = 0, failed = 0;
+    int *fds = NULL;
+    long before = 0, after = 0;
+    pid_t server = 0;
+
+    limit = raise_fd_limit(conns + FD_SLACK);
+    if (limit < conns + FD_SLACK) {
+        fprintf(stderr, "fd limit is %i, using %i connections\n",
+                limit, limit - FD_SLACK);
+        conns = limit - FD_SLACK;
+    }
+    fds = calloc(conns, sizeof(int));
+    server = fork();
+    if (server == 0) {
+        serve(port);
+    }
+    if (server < 0 || !fds || wait_server(port) != 0) {
+        fprintf(stderr, "cannot start the server\n");
+        if (server > 0) {
+            kill(server, SIGKILL);
+        }
+        return EXIT_FAILURE;
+    }
+
+    before = rss_kb(server);
+    for (j = 0; j < conns; j++) {
+        fds[j] = connect_one(port, j);
+        if (fds[j] >= 0 && ping_one(fds[j]) == 0) {
+            opened++;
+        } else {
+            failed++;
+        }
+    }
+    sleep(1);
+    after = rss_kb(server);
+
+    printf("idle connections: %i (%i failed)\n", opened, failed);
+    printf("server RSS: %li kB -> %li kB\n", before, after);
+    if (opened) {
+        printf("memory per connection: %.1f bytes\n",
+               (after - before) * 1024.0 / opened);
+    }
+
+    for (j = 0; j < conns; j++) {
+        if (fds[j] >= 0) {
+            close(fds[j]);
+        }
+    }
+    free(fds);
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    return (failed) ?EXIT_FAILURE :EXIT_SUCCESS;
+}
+
+/*************************************************************************/
+
+/* vim: set ts=4 sw=4 et */
+/* EOF */
@@ -0,0 +1,109 @@
+/**************************************************************************
+ * bench_router: route lookup cost, regex scan vs compiled route tree.    *
+ **************************************************************************/
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "config.h"
+
+#include "craneweb.h" 
+#include "craneweb_private.h" 
+
+
+/*************************************************************************/
+
+enum {
+    ROUTE_LEN = 64,
+    LOOKUPS = 20000
+};
+
+static CRW_Response *dummy(CRW_Instance *inst,
+                           const CRW_RouteArgs *args,
+                           const CRW_Request *req,
+                           void *userdata)
+{
+    return NULL;
+}
+
+static int quiet(void *userdata, CRW_LogLevel level, const char *tag,
+                 const char *fmt, va_list args)
+{
+    return 0;
+}
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* the oldest route is the worst case for the regex scan */
+static double time_lookups(CRW_Dispatcher *disp, CRW_RouteArgs *args,
+                           const char *URI, int lookups)
+{
+    double begin = 0.0;
+    int j = 0, misses = 0;
+    begin = now_ns();
+    for (j = 0; j < lookups; j++) {
+        if (!CRW_dispatcher_route(disp, URI, args)) {
+            misses++;
+        }
+    }
+    if (misses) {
+        fprintf(stderr, "unexpected misses on [%s]: %i\n", URI, misses);
+    }
+    return (now_ns() - begin) / lookups;
+}
+
+static void bench(int num_routes)
+{
+    CRW_Instance *inst = CRW_instance_new(CRW_SERVER_ADAPTER_DEFAULT);
+    CRW_Dispatcher *disp = CRW_instance_get_dispatcher(inst);
+    CRW_RouteArgs *args = CRW_route_args_new();
+    char *routes = calloc(num_routes, ROUTE_LEN);
+    const char *URI = "/api/v1/res0/12345/items/678";
+    double scan = 0.0, tree = 0.0;
+    int j = 0, lookups = LOOKUPS;
+
+    CRW_instance_set_logger(inst, quiet);
+    for (j = 0; j < num_routes; j++) {
+        char *route = routes + j * ROUTE_LEN;
+        CRW_Handler *handler = NULL;
+        snprintf(route, ROUTE_LEN, "/api/v1/res%i/:id/items/:item", j);
+        handler = CRW_handler_new(inst, route, dummy, NULL);
+        CRW_instance_add_handler(inst, handler);
+    }
+
+    /* keep the slow path bearable */
+    if (num_routes > 100) {
+        lookups = LOOKUPS / (num_routes / 100);
+    }
+    scan = time_lookups(disp, args, URI, lookups);
+    CRW_dispatcher_compile(disp);
+    tree = time_lookups(disp, args, URI, LOOKUPS);
+
+    printf("routes=%6i  regex scan=%12.1f ns/lookup  tree=%8.1f ns/lookup\n",
+           num_routes, scan, tree);
+
+    CRW_route_args_del(args);
+    CRW_instance_del(inst);
+    free(routes);
+}
+
+/*************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    bench(10);
+    bench(1000);
+    bench(10000);
+    return EXIT_SUCCESS;
+}
+
+/*************************************************************************/
+
+/* vim: set ts=4 sw=4 et */
+/* EOF */
@@ -0,0 +1,311 @@
+/**************************************************************************
+ * bench_servers: requests per second through the server adapters.        *
+ * mongoose vs epoll vs io_uring, same handler, same client.              *
+ * epoll/rp is epoll with one SO_REUSEPORT listener and loop per core.    *
+ **************************************************************************/
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "craneweb.h" 
+
+
+/*************************************************************************/
+
+enum {
+    DEFAULT_CONNS = 32,
+    DEFAULT_REQUESTS = 20000,
+    DEFAULT_PORT = 8090,
+    RESP_LEN = 4096
+};
+
+typedef struct client_ Client;
+struct client_ {
+    int fd;
+    int keep_alive;
+    size_t len;
+    char resp[RESP_LEN];
+};
+
+static const char KeepAliveRequest[] =
+    "GET /ping HTTP/1.1\r\nHost: bench\r\n\r\n";
+static const char CloseRequest[] =
+    "GET /ping HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n";
+static const char StatsRequest[] =
+    "GET /stats HTTP/1.1\r\nHost: bench\r\nConnection: close\r\n\r\n";
+
+static CRW_Response *ping(CRW_Instance *inst,
+                          const CRW_RouteArgs *args,
+                          const CRW_Request *req,
+                          void *userdata)
+{
+    CRW_Response *res = CRW_response_new(inst);
+    CRW_response_add_body(res, "pong");
+    return res;
+}
+
+/* how the kernel spread the load among the event loops */
+static CRW_Response *stats(CRW_Instance *inst,
+                           const CRW_RouteArgs *args,
+                           const CRW_Request *req,
+                           void *userdata)
+{
+    CRW_Response *res = CRW_response_new(inst);
+    int j = 0, num = CRW_instance_count_shards(inst);
+    for (j = 0; j < num; j++) {
+        CRW_ShardStats st;
+        char line[128];
+        if (CRW_instance_get_shard_stats(inst, j, &st) == 0) {
+            snprintf(line, sizeof(line),
+                     "    loop %2i (cpu %2i): %8lu conns %8lu requests\n",
+                     j, st.cpu, st.accepted, st.requests);
+            CRW_response_add_body(res, line);
+        }
+    }
+    return res;
+}
+
+static int quiet(void *userdata, CRW_LogLevel level, const char *tag,
+                 const char *fmt, va_list args)
+{
+    return 0;
+}
+
+static void serve(CRW_ServerAdapterType type, int port, int conns,
+                  int keep_alive, int reuse_port)
+{
+    CRW_Config cfg;
+    CRW_Instance *inst = CRW_instance_new(type);
+    CRW_instance_set_logger(inst, quiet);
+    CRW_instance_add_handler(inst, CRW_handler_new(inst, "/ping",
+                                                   ping, NULL));
+    CRW_instance_add_handler(inst, CRW_handler_new(inst, "/stats",
+                                                   stats, NULL));
+    CRW_config_init(&cfg);
+    cfg.port = port;
+    cfg.keep_alive = keep_alive;
+    cfg.reuse_port = reuse_port;
+    cfg.pin_workers = reuse_port;
+    if (type == CRW_SERVER_ADAPTER_MONGOOSE && keep_alive) {
+        /* a worker is busy with its connection until the client closes */
+        cfg.workers = conns;
+    }
+    exit(CRW_run(inst, &cfg));
+}
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int connect_server(int port)
+{
+    struct sockaddr_in dst;
+    int one = 1, fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&dst, 0, sizeof(dst));
+    dst.sin_family = AF_INET;
+    dst.sin_port = htons(port);
+    dst.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&dst, sizeof(dst)) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (fd >= 0) {
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return fd;
+}
+
+static int wait_server(int port)
+{
+    struct timespec nap = { 0, 50 * 1000 * 1000 };
+    int j = 0, fd = -1;
+    for (j = 0; j < 100 && fd < 0; j++) {
+        nanosleep(&nap, NULL);
+        fd = connect_server(port);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return (fd >= 0) ?0 :-1;
+}
+
+static int client_send(Client *C, int port)
+{
+    const char *req = (C->keep_alive) ?KeepAliveRequest :CloseRequest;
+    size_t len = strlen(req);
+    if (C->fd < 0) {
+        C->fd = connect_server(port);
+    }
+    C->len = 0;
+    return (C->fd >= 0 && write(C->fd, req, len) == (ssize_t)len) ?0 :-1;
+}
+
+/* 1 when the whole response arrived, 0 if not yet, -1 on error */
+static int client_recv(Client *C)
+{
+    ssize_t got = read(C->fd, C->resp + C->len, RESP_LEN - 1 - C->len);
+    if (got > 0) {
+        const char *body = NULL, *clen = NULL;
+        C->len += got;
+        C->resp[C->len] = '\0';
+        body = strstr(C->resp, "\r\n\r\n");
+        clen = strstr(C->resp, "Content-Length: ");
+        if (C->keep_alive && body && clen) {
+            return (C->len >= (body + 4 - C->resp) + atol(clen + 16)) ?1 :0;
+        }
+        return 0;
+    }
+    if (got == 0 && !C->keep_alive && C->len > 0) {
+        close(C->fd);
+        C->fd = -1;
+        return 1; /* the server closed: that's the end of the response */
+    }
+    return -1;
+}
+
+static void print_stats(int port)
+{
+    char resp[RESP_LEN];
+    size_t len = 0;
+    ssize_t got = 0;
+    const char *body = NULL;
+    int fd = connect_server(port);
+    if (fd < 0 || write(fd, StatsRequest, strlen(StatsRequest)) < 0) {
+        return;
+    }
+    while ((got = read(fd, resp + len, RESP_LEN - 1 - len)) > 0) {
+        len += got;
+    }
+    close(fd);
+    resp[len] = '\0';
+    body = strstr(resp, "\r\n\r\n");
+    if (body) {
+        fputs(body + 4, stdout);
+    }
+    return;
+}
+
+/* closed loop: every connection sends the next request on a response */
+static double run_clients(int port, int conns, int requests, int keep_alive,
+                          int *errors)
+{
+    Client *clients = calloc(conns, sizeof(Client));
+    struct pollfd *pfds = calloc(conns, sizeof(struct pollfd));
+    int sent = 0, done = 0, j = 0;
+    double begin = now_s();
+
+    *errors = 0;
+    for (j = 0; j < conns; j++) {
+        clients[j].fd = -1;
+        clients[j].keep_alive = keep_alive;
+        if (sent < requests && client_send(&clients[j], port) == 0) {
+            sent++;
+        }
+    }
+    while (done < sent && !*errors) {
+        for (j = 0; j < conns; j++) {
+            pfds[j].fd = clients[j].fd;
+            pfds[j].events = POLLIN;
+        }
+        if (poll(pfds, conns, 5000) <= 0) {
+            (*errors)++;
+            break;
+        }
+        for (j = 0; j < conns; j++) {
+            int ret = 0;
+            if (!(pfds[j].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
+            }
+            ret = client_recv(&clients[j]);
+            if (ret < 0) {
+                (*errors)++;
+            } else if (ret > 0) {
+                done++;
+                if (sent < requests) {
+                    if (client_send(&clients[j], port) == 0) {
+                        sent++;
+                    } else {
+                        (*errors)++;
+                    }
+                }
+            }
+        }
+    }
+    begin = now_s() - begin;
+    for (j = 0; j < conns; j++) {
+        if (clients[j].fd >= 0) {
+            close(clients[j].fd);
+        }
+    }
+    free(pfds);
+    free(clients);
+    return (done) ?done / begin :0.0;
+}
+
+static void bench(const char *name, CRW_ServerAdapterType type,
+                  int port, int conns, int requests, int keep_alive,
+                  int reuse_port)
+{
+    int errors = 0;
+    double rps = 0.0;
+    pid_t server = fork();
+    if (server == 0) {
+        serve(type, port, conns, keep_alive, reuse_port);
+    }
+    if (server < 0 || wait_server(port) != 0) {
+        printf("%-10s %-10s cannot start the server\n", name,
+               (keep_alive) ?"keep-alive" :"close");
+    } else {
+        rps = run_clients(port, conns, requests, keep_alive, &errors);
+        printf("%-10s %-10s %10.0f req/s (%i errors)\n", name,
+               (keep_alive) ?"keep-alive" :"close", rps, errors);
+        print_stats(port);
+    }
+    if (server > 0) {
+        kill(server, SIGKILL);
+        waitpid(server, NULL, 0);
+    }
+    return;
+}
+
+int main(int argc, char *argv[])
+{
+    int conns = (argc > 1) ?atoi(argv[1]) :DEFAULT_CONNS;
+    int requests = (argc > 2) ?atoi(argv[2]) :DEFAULT_REQUESTS;
+    int port = (argc > 3) ?atoi(argv[3]) :DEFAULT_PORT;
+
+    signal(SIGPIPE, SIG_IGN);
+    printf("%i connections, %i requests\n", conns, requests);
+    bench("mongoose", CRW_SERVER_ADAPTER_MONGOOSE,
+          port++, conns, requests, 0, 0);
+    bench("epoll", CRW_SERVER_ADAPTER_EPOLL, port++, conns, requests, 0, 0);
+    bench("epoll/rp", CRW_SERVER_ADAPTER_EPOLL, port++, conns, requests, 0, 1);
+    bench("io_uring", CRW_SERVER_ADAPTER_IO_URING,
+          port++, conns, requests, 0, 0);
+    bench("mongoose", CRW_SERVER_ADAPTER_MONGOOSE,
+          port++, conns, requests, 1, 0);
+    bench("epoll", CRW_SERVER_ADAPTER_EPOLL, port++, conns, requests, 1, 0);
+    bench("epoll/rp", CRW_SERVER_ADAPTER_EPOLL, port++, conns, requests, 1, 1);
+    bench("io_uring", CRW_SERVER_ADAPTER_IO_URING,
+          port++, conns, requests, 1, 0);
+    return EXIT_SUCCESS;
+}
+
+/*************************************************************************/
+
+/* vim: set ts=4 sw=4 et */
+/* EOF */
@@ -0,0 +1,157 @@
+/**************************************************************************
+ * bench_socket_queue: mongoose socket queue under contention.            *
+ * the old mutex+condvars queue vs the lock-free ring, same workload:     *
+ * producers pushing sockets as fast as they can, workers popping them.   *
+ **************************************************************************/
+
+/* the queue is private to mongoose: take it all */
+#include "deps/mongoose/mongoose.c"
+
+#include <time.h>
+
+
+/*************************************************************************/
+
+enum {
+    DEFAULT_PRODUCERS = 1,      /* mongoose has one master thread */
+    DEFAULT_CONSUMERS = 8,
+    DEFAULT_ITEMS = 1000000,
+    MAX_THREADS = 256
+};
+
+typedef struct bench_ Bench;
+struct bench_ {
+    struct mg_context *ctx;
+    int items;                  /* per producer */
+    volatile long consumed;
+    volatile long checksum;
+};
+
+static double now_s(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *producer(void *data)
+{
+    Bench *B = data;
+    struct socket sock;
+    int j = 0;
+    memset(&sock, 0, sizeof(sock));
+    for (j = 0; j < B->items; j++) {
+        sock.sock = j;
+        produce_socket(B->ctx, &sock);
+    }
+    return NULL;
+}
+
+static void *consumer(void *data)
+{
+    Bench *B = data;
+    struct socket sock;
+    int spin = SQ_SPIN_MIN;
+    while (consume_socket(B->ctx, &sock, &spin)) {
+        __sync_fetch_and_add(&B->checksum, sock.sock);
+        __sync_fetch_and_add(&B->consumed, 1);
+    }
+    return NULL;
+}
+
+static struct mg_context *queue_new(const char *mode, const char *size)
+{
+    struct mg_context *ctx = calloc(1, sizeof(*ctx));
+    ctx->config[SOCKET_QUEUE] = mg_strdup(mode);
+    ctx->config[SOCKET_QUEUE_SIZE] = mg_strdup(size);
+    if (!init_socket_queue(ctx)) {
+        free_context(ctx);
+        return NULL;
+    }
+    pthread_mutex_init(&ctx->mutex, NULL);
+    pthread_cond_init(&ctx->sq_empty, NULL);
+    pthread_cond_init(&ctx->sq_full, NULL);
+    return ctx;
+}
+
+static void queue_del(struct mg_context *ctx)
+{
+    pthread_mutex_destroy(&ctx->mutex);
+    pthread_cond_destroy(&ctx->sq_empty);
+    pthread_cond_destroy(&ctx->sq_full);
+    free_context(ctx);
+}
+
+static void bench(const char *mode, int producers, int consumers,
+                  int items, const char *size)
+{
+    pthread_t threads[MAX_THREADS];
+    struct timespec nap = { 0, 100 * 1000 };
+    long total = (long)producers * items;
+    long expected = producers * ((long)items * (items - 1) / 2);
+    double elapsed = 0.0;
+    Bench B;
+    int j = 0;
+
+    memset(&B, 0, sizeof(B));
+    B.items = items;
+    B.ctx = queue_new(mode, size);
+    if (!B.ctx) {
+        printf("%-9s cannot setup the queue\n", mode);
+        return;
+    }
+
+    elapsed = now_s();
+    for (j = 0; j < consumers; j++) {
+        pthread_create(&threads[j], NULL, consumer, &B);
+    }
+    for (j = 0; j < producers; j++) {
+        pthread_create(&threads[consumers + j], NULL, producer, &B);
+    }
+    for (j = 0; j < producers; j++) {
+        pthread_join(threads[consumers + j], NULL);
+    }
+    while (B.consumed < total) {
+        nanosleep(&nap, NULL);
+    }
+    elapsed = now_s() - elapsed;
+
+    /* same as master_thread() on mg_stop() */
+    B.ctx->stop_flag = 1;
+    pthread_mutex_lock(&B.ctx->mutex);
+    pthread_cond_broadcast(&B.ctx->sq_full);
+    pthread_mutex_unlock(&B.ctx->mutex);
+    for (j = 0; j < consumers; j++) {
+        pthread_join(threads[j], NULL);
+    }
+
+    printf("%-9s %3i producers %3i consumers: %10.0f sockets/s%s\n",
+           mode, producers, consumers, total / elapsed,
+           (B.checksum == expected) ?"" :" (LOST SOCKETS!)");
+    queue_del(B.ctx);
+    return;
+}
+
+int main(int argc, char *argv[])
+{
+    int consumers = (argc > 1) ?atoi(argv[1]) :DEFAULT_CONSUMERS;
+    int items = (argc > 2) ?atoi(argv[2]) :DEFAULT_ITEMS;
+    const char *size = (argc > 3) ?argv[3] :"20";
+    int producers = (argc > 4) ?atoi(argv[4]) :DEFAULT_PRODUCERS;
+
+    if (consumers < 1 || producers < 1
+     || consumers + producers > MAX_THREADS) {
+        fprintf(stderr, "usage: %s [consumers [items [queue_size "
+                        "[producers]]]]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    printf("%i sockets per producer, queue size %s\n", items, size);
+    bench("mutex", producers, consumers, items, size);
+    bench("lockfree", producers, consumers, items, size);
+    return EXIT_SUCCESS;
+}
+
+/*************************************************************************/
+
+/* vim: set ts=4 sw=4 et */
+/* EOF */
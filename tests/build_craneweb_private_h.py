@@ -23,9 +23,12 @@ def write_header(protos, fdst):
                "",
                "/* autogenerated, do not edit */" 
                "\n",
+               "#include <sys/types.h>",
+               "#include \"regex.h\"\n",
                "typedef struct crwdispatcher_ CRW_Dispatcher;\n",
                "typedef struct crwroute_ CRW_Route;\n",
                "typedef struct crwroutescanner_ CRW_RouteScanner;\n",
+               "typedef struct crwhttpinfo_ CRW_HTTPInfo;\n",
                "\n",
                "" ]
     footer = [ "\n" ,
@@ -0,0 +1,201 @@
+/**************************************************************************
+ * check_config: craneweb configuration test suite.                       *
+ **************************************************************************/
+#include <strings.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <check.h>
+
+#include "config.h"
+
+#include "craneweb.h"
+#include "craneweb_private.h"
+
+#include "check_helpers.h"
+
+
+/*************************************************************************/
+
+static CRW_Config Cfg;
+
+static void setup(void)
+{
+    instance_setup();
+    CRW_config_init(&Cfg);
+}
+
+static void teardown(void)
+{
+    instance_teardown();
+}
+
+static int validate(void)
+{
+    return CRW_config_validate(Inst, &Cfg);
+}
+
+static CRW_Response *hello(CRW_Instance *inst,
+                           const CRW_RouteArgs *args,
+                           const CRW_Request *req,
+                           void *userdata)
+{
+    CRW_Response *res = CRW_response_new(inst);
+    CRW_response_add_body(res, "hello");
+    return res;
+}
+
+START_TEST(test_config_defaults)
+{
+    setup();
+    fail_unless(Cfg.port == 8080, "default port %i", Cfg.port);
+    fail_if(Cfg.host == NULL, "no default host");
+    fail_unless(Cfg.document_root == NULL, "default document root");
+    fail_if(validate(), "defaults rejected");
+    teardown();
+}
+END_TEST
+
+START_TEST(test_config_port)
+{
+    int bad[] = { 0, -1, 65536 };
+    int j = 0;
+    setup();
+    for (j = 0; j < 3; j++) {
+        Cfg.port = bad[j];
+        fail_unless(validate() != 0, "port %i accepted", bad[j]);
+    }
+    Cfg.port = 1;
+    fail_if(validate(), "port 1 rejected");
+    Cfg.port = 65535;
+    fail_if(validate(), "port 65535 rejected");
+    teardown();
+}
+END_TEST
+
+START_TEST(test_config_host)
+{
+    setup();
+    Cfg.host = NULL;
+    fail_unless(validate() != 0, "missing host accepted");
+    teardown();
+}
+END_TEST
+
+/* nothing gets served unless asked for */
+START_TEST(test_config_document_root)
+{
+    setup();
+    handler_add(CRW_handler_new(Inst, "/hello", hello, NULL));
+    instance_ready();
+    fail_unless(respond("GET /hello HTTP/1.1\r\n\r\n") > 0, "no reply");
+    fail_unless(strstr(Out, "HTTP/1.1 200") == Out, "routed: %s", Out);
+    fail_unless(respond("GET /index.html HTTP/1.1\r\n\r\n") > 0,
+                "no reply");
+    fail_unless(strstr(Out, "HTTP/1.1 404") == Out, "unrouted: %s", Out);
+    teardown();
+}
+END_TEST
+
+/* zero means `default' for all of them */
+START_TEST(test_config_tunables)
+{
+    setup();
+    Cfg.workers = 0;
+    Cfg.queue_depth = 0;
+    Cfg.request_buffer_size = 0;
+    Cfg.static_cache_size = 0;
+    Cfg.compress_min_size = 0;
+    fail_if(validate(), "defaults rejected");
+
+    Cfg.workers = CRW_MAX_WORKERS;
+    Cfg.queue_depth = CRW_MAX_QUEUE_DEPTH;
+    Cfg.request_buffer_size = CRW_MIN_REQUEST_BUFFER_SIZE;
+    Cfg.static_cache_size = 1;
+    Cfg.compress_min_size = CRW_MAX_COMPRESS_MIN_SIZE;
+    fail_if(validate(), "values in range rejected");
+    teardown();
+}
+END_TEST
+
+START_TEST(test_config_tunables_range)
+{
+    setup();
+    Cfg.workers = CRW_MAX_WORKERS + 1;
+    fail_unless(validate() != 0, "too many workers accepted");
+    Cfg.workers = -1;
+    fail_unless(validate() != 0, "negative workers accepted");
+    Cfg.workers = 0;
+
+    Cfg.queue_depth = CRW_MAX_QUEUE_DEPTH + 1;
+    fail_unless(validate() != 0, "queue too deep accepted");
+    Cfg.queue_depth = 0;
+
+    Cfg.request_buffer_size = CRW_MIN_REQUEST_BUFFER_SIZE - 1;
+    fail_unless(validate() != 0, "request buffer too small accepted");
+    Cfg.request_buffer_size = CRW_MAX_REQUEST_BUFFER_SIZE + 1;
+    fail_unless(validate() != 0, "request buffer too large accepted");
+    Cfg.request_buffer_size = 0;
+
+    Cfg.static_cache_size = -1;
+    fail_unless(validate() != 0, "negative static cache accepted");
+    Cfg.static_cache_size = 0;
+
+    Cfg.compress_min_size = CRW_MAX_COMPRESS_MIN_SIZE + 1;
+    fail_unless(validate() != 0, "compression floor too high accepted");
+    Cfg.compress_min_size = 0;
+
+    fail_if(validate(), "defaults rejected after all");
+    teardown();
+}
+END_TEST
+
+/* rejected before anything gets started */
+START_TEST(test_config_run)
+{
+    setup();
+    Cfg.port = 0;
+    fail_unless(CRW_run(Inst, &Cfg) != 0, "ran on port 0");
+    teardown();
+}
+END_TEST
+
+TCase *craneweb_testCaseConfig(void)
+{
+    TCase *tcConfig = tcase_create("craneweb.core.config");
+    tcase_add_test(tcConfig, test_config_defaults);
+    tcase_add_test(tcConfig, test_config_port);
+    tcase_add_test(tcConfig, test_config_host);
+    tcase_add_test(tcConfig, test_config_document_root);
+    tcase_add_test(tcConfig, test_config_tunables);
+    tcase_add_test(tcConfig, test_config_tunables_range);
+    tcase_add_test(tcConfig, test_config_run);
+    return tcConfig;
+}
+
+static Suite *craneweb_suiteConfig(void)
+{
+    TCase *tc = craneweb_testCaseConfig();
+    Suite *s = suite_create("craneweb.core.config");
+    suite_add_tcase(s, tc);
+    return s;
+}
+
+/*************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    int number_failed = 0;
+
+    Suite *s = craneweb_suiteConfig();
+    SRunner *sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_ENV);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et */
+/* EOF */
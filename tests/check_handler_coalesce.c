@@ -0,0 +1,300 @@
+/**************************************************************************
+ * check_handler_coalesce: craneweb request coalescing test suite.        *
+ **************************************************************************/
+#include <strings.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <pthread.h>
+
+#include <check.h>
+
+#include "config.h"
+
+#include "craneweb.h"
+#include "craneweb_private.h"
+
+#include "check_helpers.h"
+
+
+/*************************************************************************/
+
+enum {
+    MAX_CLIENTS = 8,
+    SLOW_MS = 200 /* long enough for all the clients to come */
+};
+
+typedef struct client_ Client;
+struct client_ {
+    pthread_t thread;
+    const char *raw;
+    char in[BUF_SIZE];
+    char out[BUF_SIZE];
+};
+
+static CRW_Handler *Slow = NULL;
+static Client Clients[MAX_CLIENTS];
+static pthread_barrier_t Start;
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static int Calls = 0;
+static char Nested[BUF_SIZE] = { '\0' };
+
+/* which call made it, so the shared ones are told apart */
+static CRW_Response *slow(CRW_Instance *inst,
+                          const CRW_RouteArgs *args,
+                          const CRW_Request *req,
+                          void *userdata)
+{
+    CRW_Response *res = CRW_response_new(inst);
+    const char *id = CRW_route_args_get_by_tag(args, "id");
+    char body[64];
+    int call = 0;
+    pthread_mutex_lock(&Lock);
+    call = ++Calls;
+    pthread_mutex_unlock(&Lock);
+    if (!strcmp(id, "nested") && call == 1) {
+        char in[BUF_SIZE];
+        respond_to("GET /slow/nested HTTP/1.1\r\n\r\n", in, Nested);
+    } else {
+        sleep_ms(SLOW_MS);
+    }
+    snprintf(body, sizeof(body), "%s #%i", id, call);
+    CRW_response_add_header(res, "Content-Type", "text/plain");
+    if (!strcmp(id, "session")) {
+        CRW_response_add_header(res, "Set-Cookie", "id=1");
+    }
+    CRW_response_add_body(res, body);
+    return res;
+}
+
+static void setup(void)
+{
+    instance_setup();
+    Slow = handler_add(CRW_handler_new(Inst, "/slow/:id", slow, NULL));
+    CRW_handler_set_coalescing(Slow, 1);
+    instance_ready();
+    Calls = 0;
+}
+
+static void teardown(void)
+{
+    instance_teardown();
+}
+
+static void *client(void *data)
+{
+    Client *C = data;
+    pthread_barrier_wait(&Start);
+    respond_to(C->raw, C->in, C->out);
+    return NULL;
+}
+
+/* all together, the first one as the (likely) leader */
+static void run_clients(const char **raws, int num)
+{
+    int j = 0;
+    pthread_barrier_init(&Start, NULL, num);
+    for (j = 0; j < num; j++) {
+        Clients[j].raw = raws[j];
+        pthread_create(&Clients[j].thread, NULL, client, &Clients[j]);
+    }
+    for (j = 0; j < num; j++) {
+        pthread_join(Clients[j].thread, NULL);
+    }
+    pthread_barrier_destroy(&Start);
+}
+
+static void run_same(const char *raw, int num)
+{
+    const char *raws[MAX_CLIENTS];
+    int j = 0;
+    for (j = 0; j < num; j++) {
+        raws[j] = raw;
+    }
+    run_clients(raws, num);
+}
+
+START_TEST(test_coalesce_identical)
+{
+    const char *first = NULL;
+    int j = 0;
+    setup();
+    run_same("GET /slow/1 HTTP/1.1\r\n\r\n", MAX_CLIENTS);
+    fail_unless(Calls == 1, "handler called %i times", Calls);
+    first = body(Clients[0].out);
+    fail_unless(!strcmp(first, "1 #1"), "bad body [%s]", Clients[0].out);
+    for (j = 1; j < MAX_CLIENTS; j++) {
+        fail_unless(!strcmp(Clients[j].out, Clients[0].out),
+                    "client #%i got [%s]", j, Clients[j].out);
+    }
+    /* landed: the next ones call the handler again */
+    run_same("GET /slow/1 HTTP/1.1\r\n\r\n", 2);
+    fail_unless(Calls == 2, "handler called %i times", Calls);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_coalesce_by_key)
+{
+    const char *raws[] = {
+        "GET /slow/1 HTTP/1.1\r\n\r\n",
+        "GET /slow/2 HTTP/1.1\r\n\r\n",
+        "GET /slow/1?full=1 HTTP/1.1\r\n\r\n",
+        "GET /slow/1 HTTP/1.1\r\n\r\n",
+        "GET /slow/2 HTTP/1.1\r\n\r\n",
+        "GET /slow/1?full=1 HTTP/1.1\r\n\r\n"
+    };
+    setup();
+    run_clients(raws, 6);
+    fail_unless(Calls == 3, "handler called %i times", Calls);
+    fail_unless(!strcmp(body(Clients[0].out), body(Clients[3].out))
+             && !strcmp(body(Clients[1].out), body(Clients[4].out))
+             && !strcmp(body(Clients[2].out), body(Clients[5].out)),
+                "responses mixed up");
+    fail_unless(strcmp(body(Clients[0].out), body(Clients[2].out)) != 0,
+                "query string ignored");
+    teardown();
+}
+END_TEST
+
+START_TEST(test_coalesce_not_get)
+{
+    setup();
+    run_same("POST /slow/1 HTTP/1.1\r\n"
+             "Content-Length: 0\r\n\r\n", 4);
+    fail_unless(Calls == 4, "POST coalesced: %i calls", Calls);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_coalesce_not_shared)
+{
+    int j = 0;
+    setup();
+    run_same("GET /slow/session HTTP/1.1\r\n\r\n", 4);
+    fail_unless(Calls == 4, "cookie shared: %i calls", Calls);
+    for (j = 0; j < 4; j++) {
+        fail_unless(strstr(Clients[j].out, "Set-Cookie: id=1") != NULL,
+                    "client #%i got [%s]", j, Clients[j].out);
+    }
+    teardown();
+}
+END_TEST
+
+START_TEST(test_coalesce_disabled)
+{
+    setup();
+    CRW_handler_set_coalescing(Slow, 0);
+    run_same("GET /slow/1 HTTP/1.1\r\n\r\n", 4);
+    fail_unless(Calls == 4, "still coalesced: %i calls", Calls);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_coalesce_nested)
+{
+    char in[BUF_SIZE], out[BUF_SIZE];
+    setup();
+    /* the handler asks for itself: it must not wait for itself */
+    respond_to("GET /slow/nested HTTP/1.1\r\n\r\n", in, out);
+    fail_unless(!strcmp(body(out), "nested #1"), "bad body [%s]", out);
+    fail_unless(!strcmp(body(Nested), "nested #2"), "bad nested [%s]",
+                Nested);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_coalesce_cached)
+{
+    setup();
+    CRW_handler_set_cache(Slow, 60000, 0, 1024 * 1024);
+    run_same("GET /slow/1 HTTP/1.1\r\n\r\n", MAX_CLIENTS);
+    fail_unless(Calls == 1, "handler called %i times", Calls);
+    run_same("GET /slow/1 HTTP/1.1\r\n\r\n", 2);
+    fail_unless(Calls == 1, "not cached: %i calls", Calls);
+    fail_unless(!strcmp(body(Clients[1].out), "1 #1"), "bad body [%s]",
+                Clients[1].out);
+    teardown();
+}
+END_TEST
+
+static void *leader(void *data)
+{
+    Client *C = data;
+    respond_to(C->raw, C->in, C->out);
+    return NULL;
+}
+
+/* as the event loops do: the follower calls the handler, not waits */
+START_TEST(test_coalesce_no_wait)
+{
+    CRW_HTTPInfo *info = CRW_http_info_new();
+    CRW_Request *req = NULL;
+    CRW_Response *res = NULL;
+    char in[BUF_SIZE], out[BUF_SIZE];
+    setup();
+    Clients[0].raw = "GET /slow/1 HTTP/1.1\r\n\r\n";
+    pthread_create(&Clients[0].thread, NULL, leader, &Clients[0]);
+    sleep_ms(SLOW_MS / 4);
+
+    req = CRW_request_new(Inst);
+    strcpy(in, Clients[0].raw);
+    fail_unless(CRW_http_parse_request(in, strlen(in), req, info) > 0,
+                "parse failed");
+    CRW_request_set_no_wait(req);
+    res = CRW_dispatcher_handle(CRW_instance_get_dispatcher(Inst), req);
+    fail_if(res == NULL, "no response");
+    out[CRW_response_get_body(res, out, sizeof(out) - 1)] = '\0';
+    fail_unless(!strcmp(out, "1 #2"), "waited for [%s]", out);
+    CRW_response_del(res);
+    CRW_request_del(req);
+
+    pthread_join(Clients[0].thread, NULL);
+    fail_unless(!strcmp(body(Clients[0].out), "1 #1"), "bad body [%s]",
+                Clients[0].out);
+    fail_unless(Calls == 2, "handler called %i times", Calls);
+    CRW_http_info_del(info);
+    teardown();
+}
+END_TEST
+
+TCase *craneweb_testCaseHandlerCoalesce(void)
+{
+    TCase *tcCoalesce = tcase_create("craneweb.core.handler.coalesce");
+    tcase_add_test(tcCoalesce, test_coalesce_identical);
+    tcase_add_test(tcCoalesce, test_coalesce_by_key);
+    tcase_add_test(tcCoalesce, test_coalesce_not_get);
+    tcase_add_test(tcCoalesce, test_coalesce_not_shared);
+    tcase_add_test(tcCoalesce, test_coalesce_disabled);
+    tcase_add_test(tcCoalesce, test_coalesce_nested);
+    tcase_add_test(tcCoalesce, test_coalesce_cached);
+    tcase_add_test(tcCoalesce, test_coalesce_no_wait);
+    return tcCoalesce;
+}
+
+static Suite *craneweb_suiteHandlerCoalesce(void)
+{
+    TCase *tc = craneweb_testCaseHandlerCoalesce();
+    Suite *s = suite_create("craneweb.core.handler.coalesce");
+    suite_add_tcase(s, tc);
+    return s;
+}
+
+/*************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    int number_failed = 0;
+
+    Suite *s = craneweb_suiteHandlerCoalesce();
+    SRunner *sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_ENV);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et */
+/* EOF */
@@ -0,0 +1,94 @@
+/**************************************************************************
+ * check_helpers: what the craneweb test suites share.                    *
+ **************************************************************************/
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "config.h"
+
+#include "craneweb.h"
+#include "craneweb_private.h"
+
+#include "check_helpers.h"
+
+
+/*************************************************************************/
+
+CRW_Instance *Inst = NULL;
+char In[BUF_SIZE] = { '\0' };
+char Out[BUF_SIZE] = { '\0' };
+
+static CRW_Handler *Handlers[MAX_HANDLERS];
+static int NumHandlers = 0;
+
+int quiet(void *userdata, CRW_LogLevel level, const char *tag,
+          const char *fmt, va_list args)
+{
+    return 0;
+}
+
+void sleep_ms(long ms)
+{
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+}
+
+void instance_setup(void)
+{
+    Inst = CRW_instance_new(CRW_SERVER_ADAPTER_DEFAULT);
+    CRW_instance_set_logger(Inst, quiet);
+    NumHandlers = 0;
+}
+
+CRW_Handler *handler_add(CRW_Handler *handler)
+{
+    if (handler && NumHandlers < MAX_HANDLERS) {
+        CRW_instance_add_handler(Inst, handler);
+        Handlers[NumHandlers++] = handler;
+    }
+    return handler;
+}
+
+void instance_ready(void)
+{
+    CRW_dispatcher_compile(CRW_instance_get_dispatcher(Inst));
+}
+
+void instance_teardown(void)
+{
+    int j = 0;
+    for (j = 0; j < NumHandlers; j++) {
+        CRW_handler_del(Handlers[j]);
+    }
+    NumHandlers = 0;
+    CRW_instance_del(Inst);
+    Inst = NULL;
+}
+
+/* the parser works in place, so we need a writable copy */
+int respond_to(const char *raw, char *in, char *out)
+{
+    size_t len = strlen(raw);
+    int ret = 0;
+    memcpy(in, raw, len + 1);
+    ret = CRW_http_respond(Inst, in, len, out, BUF_SIZE - 1);
+    out[(ret > 0) ?ret :0] = '\0';
+    return ret;
+}
+
+int respond(const char *raw)
+{
+    return respond_to(raw, In, Out);
+}
+
+const char *body(const char *out)
+{
+    const char *end = strstr(out, "\r\n\r\n");
+    return (end) ?end + 4 :"";
+}
+
+/* vim: set ts=4 sw=4 et */
+/* EOF */
@@ -0,0 +1,53 @@
+/**************************************************************************
+ * check_helpers: what the craneweb test suites share.                    *
+ **************************************************************************/
+#ifndef CHECK_HELPERS_H
+#define CHECK_HELPERS_H
+
+#include <stdarg.h>
+
+#include "craneweb.h"
+
+
+enum {
+    BUF_SIZE = 4096,
+    MAX_HANDLERS = 16
+};
+
+/* the instance under test, made by instance_setup() */
+extern CRW_Instance *Inst;
+/* the buffers used by respond() */
+extern char In[BUF_SIZE];
+extern char Out[BUF_SIZE];
+
+/* a logger that says nothing */
+int quiet(void *userdata, CRW_LogLevel level, const char *tag,
+          const char *fmt, va_list args);
+
+void sleep_ms(long ms);
+
+/* a fresh, quiet instance in Inst */
+void instance_setup(void);
+
+/* adds the handler to Inst; instance_teardown() deletes it */
+CRW_Handler *handler_add(CRW_Handler *handler);
+
+/* no more handlers: the routes get compiled */
+void instance_ready(void);
+
+void instance_teardown(void);
+
+/* serves the raw request from `in' into `out' (both BUF_SIZE long),
+   the reply is NUL-terminated; returns as CRW_http_respond() */
+int respond_to(const char *raw, char *in, char *out);
+
+/* the same, on In and Out */
+int respond(const char *raw);
+
+/* the body of the reply in `out' */
+const char *body(const char *out);
+
+#endif /* CHECK_HELPERS_H */
+
+/* vim: set ts=4 sw=4 et */
+/* EOF */
@@ -0,0 +1,562 @@
+/**************************************************************************
+ * check_http_parse: craneweb HTTP/1.x request parser test suite.         *
+ **************************************************************************/
+#include <strings.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include <check.h>
+
+#include "config.h"
+
+#include "craneweb.h" 
+#include "craneweb_private.h" 
+
+
+/*************************************************************************/
+
+enum {
+    BUF_SIZE = 1024
+};
+
+static CRW_Instance *Inst = NULL;
+static CRW_Request *Req = NULL;
+static CRW_HTTPInfo *Info = NULL;
+static char Buf[BUF_SIZE] = { '\0' };
+
+static void setup(void)
+{
+    Inst = CRW_instance_new(CRW_SERVER_ADAPTER_DEFAULT);
+    Req = CRW_request_new(Inst);
+    Info = CRW_http_info_new();
+}
+
+static void teardown(void)
+{
+    CRW_http_info_del(Info);
+    CRW_request_del(Req);
+    CRW_instance_del(Inst);
+}
+
+/* the parser works in place, so we need a writable copy */
+static int parse(const char *raw)
+{
+    size_t len = strlen(raw);
+    memcpy(Buf, raw, len + 1);
+    return CRW_http_parse_request(Buf, len, Req, Info);
+}
+
+static void check_header(const char *header, const char *expected)
+{
+    const char *value = CRW_request_get_header_value(Req, header);
+    fail_if(value == NULL, "missing header [%s]", header);
+    fail_if(strcmp(value, expected),
+            "header [%s] = [%s], expected [%s]", header, value, expected);
+}
+
+START_TEST(test_http_simple)
+{
+    const char *raw = "GET /hello/bob HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    int len = 0;
+    setup();
+    len = parse(raw);
+    fail_unless(len == (int)strlen(raw), "head length %i", len);
+    fail_unless(CRW_request_get_method(Req) == CRW_REQUEST_METHOD_GET,
+                "wrong method");
+    fail_if(strcmp(CRW_request_get_URI(Req), "/hello/bob"), "wrong URI");
+    fail_unless(CRW_request_get_query_string(Req) == NULL, "bogus query");
+    fail_unless(CRW_request_count_headers(Req) == 1, "wrong header count");
+    check_header("host", "localhost");
+    fail_unless(CRW_http_info_keep_alive(Info), "HTTP/1.1 is persistent");
+    teardown();
+}
+END_TEST
+
+START_TEST(test_http_incomplete)
+{
+    setup();
+    fail_unless(parse("GET /hello HTTP/1.1\r\nHost: loc") == 0,
+                "partial head accepted");
+    fail_unless(parse("GET /hello HTTP/1.1\r\n") == 0,
+                "unterminated head accepted");
+    teardown();
+}
+END_TEST
+
+START_TEST(test_http_malformed)
+{
+    setup();
+    fail_unless(parse("garbage\r\n\r\n") < 0, "garbage accepted");
+    fail_unless(parse("GET hello HTTP/1.1\r\n\r\n") < 0,
+                "relative URI accepted");
+    fail_unless(parse("GET / SPDY/3\r\n\r\n") < 0, "bad version accepted");
+    fail_unless(parse("GET / HTTP/1.1\r\nbroken\r\n\r\n") < 0,
+                "header without colon accepted");
+    fail_unless(parse("POST / HTTP/1.1\r\nContent-Length: x\r\n\r\n") < 0,
+                "bad Content-Length accepted");
+    teardown();
+}
+END_TEST
+
+START_TEST(test_http_query)
+{
+    setup();
+    fail_unless(parse("GET /a%20b?x=1&y=%20 HTTP/1.0\n\n") > 0,
+                "bare LF head refused");
+    fail_if(strcmp(CRW_request_get_URI(Req), "/a b"), "URI not decoded");
+    fail_if(strcmp(CRW_request_get_query_string(Req), "x=1&y=%20"),
+            "query string mangled");
+    fail_if(CRW_http_info_keep_alive(Info), "HTTP/1.0 is not persistent");
+    teardown();
+}
+END_TEST
+
+static void check_param(const char *name, const char *expected)
+{
+    const char *value = CRW_request_get_query_param(Req, name);
+    if (!expected) {
+        fail_unless(value == NULL, "phantom param [%s]", name);
+    } else {
+        fail_if(value == NULL, "missing param [%s]", name);
+        fail_if(strcmp(value, expected),
+                "param [%s] = [%s], expected [%s]", name, value, expected);
+    }
+}
+
+START_TEST(test_http_query_params)
+{
+    const char *name = NULL, *value = NULL;
+    size_t name_len = 0, value_len = 0;
+    setup();
+    fail_unless(parse("GET /s?a=1&b=hello+world&c=%41%42&&flag&a=2"
+                      "&na%6De=x&e=&p=50%25&t=%4 HTTP/1.1\r\n\r\n") > 0,
+                "valid request refused");
+    fail_unless(CRW_request_count_query_params(Req) == 9, "wrong count");
+    check_param("a", "1");
+    check_param("b", "hello world");
+    check_param("c", "AB");
+    check_param("flag", "");
+    check_param("name", "x");
+    check_param("e", "");
+    check_param("p", "50%");
+    check_param("t", "%4");
+    check_param("A", NULL);
+    check_param("missing", NULL);
+    /* decoded once, then the same */
+    fail_unless(CRW_request_get_query_param(Req, "b")
+                == CRW_request_get_query_param(Req, "b"), "decoded twice");
+    fail_if(CRW_request_get_query_param_by_idx(Req, 1, &name, &name_len,
+                                               &value, &value_len),
+            "by index failed");
+    fail_unless(name_len == 1 && !strncmp(name, "b", 1), "wrong name");
+    fail_unless(value_len == 11 && !strncmp(value, "hello+world", 11),
+                "the raw value must be left alone");
+    fail_unless(CRW_request_get_query_param_by_idx(Req, 9, &name, &name_len,
+                                                   &value, &value_len) > 0,
+                "out of range index accepted");
+    teardown();
+
+    setup();
+    fail_unless(parse("GET /s HTTP/1.1\r\n\r\n") > 0,
+                "valid request refused");
+    fail_unless(CRW_request_count_query_params(Req) == 0, "phantom params");
+    check_param("a", NULL);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_http_connection)
+{
+    const char *raw = "POST /form HTTP/1.0\r\n"
+                      "Connection: Keep-Alive\r\n"
+                      "X-Requested-With: XMLHttpRequest\r\n"
+                      "Content-Length: 5\r\n"
+                      "\r\n"
+                      "x=1&y";
+    int len = 0;
+    setup();
+    len = parse(raw);
+    fail_unless(len == (int)strlen(raw) - 5, "head length %i", len);
+    fail_unless(CRW_request_get_method(Req) == CRW_REQUEST_METHOD_POST,
+                "wrong method");
+    fail_unless(CRW_http_info_keep_alive(Info), "keep-alive ignored");
+    fail_unless(CRW_http_info_content_length(Info) == 5,
+                "wrong content length");
+    fail_unless(CRW_request_is_xhr(Req), "XHR not detected");
+    teardown();
+}
+END_TEST
+
+START_TEST(test_http_known_headers)
+{
+    const char *raw = "GET / HTTP/1.1\r\n"
+                      "host: example.com\r\n"
+                      "Cookie: a=1\r\n"
+                      "X-Custom: yes\r\n"
+                      "COOKIE: b=2\r\n"
+                      "Accept-Encoding: gzip\r\n"
+                      "\r\n";
+    setup();
+    fail_unless(parse(raw) > 0, "valid request refused");
+    fail_if(strcmp(CRW_request_get_known_header(Req, CRW_HDR_HOST),
+                   "example.com"), "wrong Host");
+    fail_if(strcmp(CRW_request_get_known_header(Req, CRW_HDR_COOKIE),
+                   "a=1"), "the first Cookie must win");
+    fail_if(strcmp(CRW_request_get_known_header(Req,
+                                                CRW_HDR_ACCEPT_ENCODING),
+                   "gzip"), "wrong Accept-Encoding");
+    fail_unless(CRW_request_get_known_header(Req, CRW_HDR_IF_NONE_MATCH)
+                == NULL, "phantom If-None-Match");
+    fail_unless(CRW_request_get_known_header(Req, CRW_HDR_COUNT) == NULL,
+                "out of range header");
+    fail_unless(CRW_request_get_known_header(Req, CRW_HDR_UNKNOWN) == NULL,
+                "out of range header");
+    check_header("HOST", "example.com");
+    check_header("cookie", "a=1");
+    check_header("x-custom", "yes");
+    fail_unless(CRW_request_get_header_value(Req, "X-Missing") == NULL,
+                "phantom header");
+    fail_unless(CRW_request_count_headers(Req) == 5, "wrong count");
+    fail_if(CRW_request_is_xhr(Req), "phantom XHR");
+    teardown();
+}
+END_TEST
+
+/* the index must cope with a full table, and with the leftovers */
+START_TEST(test_http_many_headers)
+{
+    char raw[BUF_SIZE] = "GET / HTTP/1.1\r\n";
+    char name[32], value[32];
+    int j = 0;
+    for (j = 0; j < CRW_MAX_REQUEST_HEADERS + 4; j++) {
+        snprintf(raw + strlen(raw), sizeof(raw) - strlen(raw),
+                 "X-H%i: %i\r\n", j, j);
+    }
+    strcat(raw, "\r\n");
+    setup();
+    fail_unless(parse(raw) > 0, "valid request refused");
+    fail_unless(CRW_request_count_headers(Req) == CRW_MAX_REQUEST_HEADERS,
+                "wrong count");
+    for (j = 0; j < CRW_MAX_REQUEST_HEADERS; j++) {
+        snprintf(name, sizeof(name), "x-h%i", j);
+        snprintf(value, sizeof(value), "%i", j);
+        check_header(name, value);
+    }
+    fail_unless(CRW_request_get_header_value(Req, "X-H64") == NULL,
+                "dropped header found");
+    teardown();
+}
+END_TEST
+
+static int count_chunk(void *userdata, const char *chunk, size_t len)
+{
+    long *total = userdata;
+    *total += len;
+    return (*total >= 20000); /* enough */
+}
+
+START_TEST(test_http_body_read)
+{
+    static char body[40000];
+    char buf[16];
+    long total = 0, seen = 0;
+    int len = 0;
+    memset(body, 'x', sizeof(body));
+    memcpy(body, "0123456789", 10);
+    setup();
+    fail_unless(CRW_request_get_content_length(Req) == 0, "phantom body");
+    fail_unless(CRW_request_read_body(Req, buf, sizeof(buf)) == 0,
+                "phantom body");
+    CRW_request_set_body_buffer(Req, body, sizeof(body));
+    fail_unless(CRW_request_get_content_length(Req) == sizeof(body),
+                "wrong length");
+    len = CRW_request_read_body(Req, buf, 4);
+    fail_unless(len == 4 && !memcmp(buf, "0123", 4), "bad first read");
+    len = CRW_request_read_body(Req, buf, 6);
+    fail_unless(len == 6 && !memcmp(buf, "456789", 6), "bad second read");
+    /* the stream picks up from there, and can stop early */
+    total = CRW_request_stream_body(Req, count_chunk, &seen);
+    fail_unless(total == seen, "delivered %li, seen %li", total, seen);
+    fail_unless(total >= 20000 && total < sizeof(body) - 10,
+                "stream did not stop (%li)", total);
+    total += 10;
+    while ((len = CRW_request_read_body(Req, buf, sizeof(buf))) > 0) {
+        total += len;
+    }
+    fail_unless(len == 0, "read error");
+    fail_unless(total == sizeof(body), "body lost (%li)", total);
+    teardown();
+}
+END_TEST
+
+/* the file part ends across two stream chunks, and has in it
+   something which looks like the start of the delimiter */
+static const char MultipartHead[] =
+    "POST /upload HTTP/1.1\r\n"
+    "Content-Type: multipart/form-data; boundary=\"XyZ\"\r\n"
+    "\r\n";
+static const char MultipartPre[] =
+    "preamble\r\n"
+    "--XyZ\r\n"
+    "Content-Disposition: form-data; name=\"field\"\r\n"
+    "\r\n"
+    "value\r\n"
+    "--XyZ  \r\n"
+    "Content-Disposition: form-data; name=\"file\"; "
+    "filename=\"a \\\"b\\\".bin\"\r\n"
+    "Content-Type: application/octet-stream\r\n"
+    "\r\n";
+static const char MultipartPost[] = "\r\n--XyZ--\r\nepilogue";
+
+static char MultipartBody[20000];
+
+static long multipart_body(void)
+{
+    size_t pre = sizeof(MultipartPre) - 1, post = sizeof(MultipartPost) - 1;
+    size_t data = 16384 - 2 - pre, j = 0;
+    memcpy(MultipartBody, MultipartPre, pre);
+    for (j = 0; j < data; j++) {
+        MultipartBody[pre + j] = 'a' + j % 26;
+    }
+    memcpy(MultipartBody + pre + 100, "\r\n--Xy\r\n-", 10);
+    memcpy(MultipartBody + pre + data, MultipartPost, post);
+    parse(MultipartHead);
+    CRW_request_set_body_buffer(Req, MultipartBody, pre + data + post);
+    return data;
+}
+
+typedef struct {
+    int begins, ends;
+    long sizes[4];
+    char path[256];
+} MultipartSeen;
+
+static int on_part(void *userdata, CRW_MultipartEvent event,
+                   const CRW_MultipartPart *part, const char *data,
+                   size_t len)
+{
+    MultipartSeen *seen = userdata;
+    if (event == CRW_MULTIPART_PART_BEGIN) {
+        seen->begins++;
+        if (part->index == 0) {
+            fail_if(strcmp(part->name, "field"), "wrong name");
+            fail_unless(part->filename == NULL, "phantom filename");
+        } else {
+            fail_if(strcmp(part->name, "file"), "wrong name");
+            fail_if(strcmp(part->filename, "a \"b\".bin"), "wrong filename");
+            fail_if(strcmp(part->content_type, "application/octet-stream"),
+                    "wrong content type");
+        }
+    } else if (event == CRW_MULTIPART_PART_DATA) {
+        fail_unless(seen->begins == part->index + 1, "data out of a part");
+        if (part->index == 0) {
+            fail_unless(len == 5 && !memcmp(data, "value", 5), "bad field");
+        }
+        seen->sizes[part->index] += len;
+    } else {
+        seen->ends++;
+        if (part->data) {
+            fail_if(strcmp(part->data, "value"), "bad field");
+            seen->sizes[part->index] = part->size;
+        } else if (part->path) {
+            FILE *f = fopen(part->path, "rb");
+            fail_unless(f != NULL, "spilled file missing");
+            seen->sizes[part->index] = fread(MultipartBody, 1,
+                                             sizeof(MultipartBody), f);
+            fclose(f);
+            strcpy(seen->path, part->path);
+        }
+    }
+    return 0;
+}
+
+START_TEST(test_http_multipart)
+{
+    MultipartSeen seen;
+    long data = 0;
+    int parts = 0;
+    setup();
+    /* streamed */
+    memset(&seen, 0, sizeof(seen));
+    data = multipart_body();
+    parts = CRW_request_read_multipart(Req, CRW_MULTIPART_STREAM,
+                                       on_part, &seen);
+    fail_unless(parts == 2, "got %i parts", parts);
+    fail_unless(seen.begins == 2 && seen.ends == 2, "events lost");
+    fail_unless(seen.sizes[0] == 5, "field size %li", seen.sizes[0]);
+    fail_unless(seen.sizes[1] == data, "file size %li", seen.sizes[1]);
+    /* collected: the file goes on disk */
+    memset(&seen, 0, sizeof(seen));
+    data = multipart_body();
+    parts = CRW_request_read_multipart(Req, 100, on_part, &seen);
+    fail_unless(parts == 2, "got %i parts", parts);
+    fail_unless(seen.sizes[0] == 5, "field size %li", seen.sizes[0]);
+    fail_unless(seen.sizes[1] == data, "file size %li", seen.sizes[1]);
+    fail_unless(!memcmp(MultipartBody, "abc", 3)
+             && !memcmp(MultipartBody + 100, "\r\n--Xy\r\n-", 10),
+                "file content mangled");
+    fail_unless(seen.path[0] && access(seen.path, F_OK) == 0,
+                "file not spilled");
+    teardown();
+    fail_unless(access(seen.path, F_OK) != 0, "spilled file left behind");
+}
+END_TEST
+
+START_TEST(test_http_multipart_malformed)
+{
+    MultipartSeen seen;
+    long data = 0;
+    memset(&seen, 0, sizeof(seen));
+    setup();
+    data = multipart_body();
+    /* truncated */
+    CRW_request_set_body_buffer(Req, MultipartBody, data);
+    fail_unless(CRW_request_read_multipart(Req, CRW_MULTIPART_STREAM,
+                                           on_part, &seen) < 0,
+                "truncated body accepted");
+    teardown();
+    setup();
+    parse("POST / HTTP/1.1\r\nContent-Type: text/plain\r\n\r\n");
+    fail_unless(CRW_request_read_multipart(Req, CRW_MULTIPART_STREAM,
+                                           on_part, &seen) < 0,
+                "not multipart accepted");
+    teardown();
+}
+END_TEST
+
+static int Released = 0;
+
+static void release_ref(const void *data, void *release_data)
+{
+    Released += *(int *)release_data;
+}
+
+START_TEST(test_http_body_binary)
+{
+    static const char bin[] = { 'a', '\0', 'b', '\0' };
+    CRW_Response *res = NULL;
+    size_t len = 0;
+    setup();
+    res = CRW_response_new(Inst);
+    fail_if(CRW_response_add_body(res, "x"), "text refused");
+    fail_if(CRW_response_add_body_len(res, bin, sizeof(bin)),
+            "binary refused");
+    fail_if(CRW_response_add_body_len(res, NULL, 0), "empty refused");
+    len = CRW_response_get_body(res, Buf, sizeof(Buf));
+    fail_unless(len == 1 + sizeof(bin), "body length %lu",
+                (unsigned long)len);
+    fail_if(memcmp(Buf, "xa\0b\0", len), "body mangled");
+    CRW_response_del(res);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_http_body_ref)
+{
+    static const char big[] = "0123456789";
+    int one = 1, ten = 10;
+    CRW_Response *res = NULL;
+    size_t len = 0;
+    setup();
+    Released = 0;
+    res = CRW_response_new(Inst);
+    fail_if(CRW_response_add_body_ref(res, big, 10, release_ref, &one),
+            "ref refused");
+    fail_if(CRW_response_add_body(res, "-"), "text refused");
+    fail_if(CRW_response_add_body_ref(res, big + 5, 5, release_ref, &ten),
+            "ref refused");
+    fail_if(CRW_response_add_body_ref(res, "!", 1, NULL, NULL),
+            "static ref refused");
+    fail_if(CRW_response_add_body(res, "?"), "text refused");
+    len = CRW_response_get_body(res, Buf, sizeof(Buf));
+    fail_unless(len == 18, "body length %lu", (unsigned long)len);
+    fail_if(memcmp(Buf, "0123456789-56789!?", len), "body out of order");
+    fail_unless(Released == 0, "released too early");
+    CRW_response_del(res);
+    fail_unless(Released == 11, "not released (%i)", Released);
+    teardown();
+}
+END_TEST
+
+/* what the native servers (epoll, io_uring) refuse */
+START_TEST(test_http_body_limits)
+{
+    const char *raw = "POST /upload HTTP/1.1\r\nContent-Length: 100\r\n\r\n";
+    int len = 0;
+    setup();
+    len = parse(raw);
+    fail_unless(len > 0, "head rejected");
+    fail_unless(CRW_http_body_check(Info, len, len + 100) == 0,
+                "fitting body refused");
+    fail_unless(CRW_http_body_check(Info, len, len + 99) == 413,
+                "oversized body accepted");
+    teardown();
+
+    /* as large as strtol() goes: no overflow on the way */
+    setup();
+    len = parse("POST /upload HTTP/1.1\r\n"
+                "Content-Length: 9223372036854775807\r\n\r\n");
+    fail_unless(len > 0, "head rejected");
+    fail_unless(CRW_http_body_check(Info, len, BUF_SIZE) == 413,
+                "huge body accepted");
+    teardown();
+
+    setup();
+    len = parse("POST /upload HTTP/1.1\r\n"
+                "Transfer-Encoding: chunked\r\n\r\n");
+    fail_unless(len > 0, "head rejected");
+    fail_unless(CRW_http_body_check(Info, len, BUF_SIZE) == 411,
+                "chunked body accepted");
+    teardown();
+}
+END_TEST
+
+TCase *craneweb_testCaseHTTPParse(void)
+{
+    TCase *tcHTTP = tcase_create("craneweb.core.http.parse");
+    tcase_add_test(tcHTTP, test_http_simple);
+    tcase_add_test(tcHTTP, test_http_incomplete);
+    tcase_add_test(tcHTTP, test_http_malformed);
+    tcase_add_test(tcHTTP, test_http_query);
+    tcase_add_test(tcHTTP, test_http_query_params);
+    tcase_add_test(tcHTTP, test_http_connection);
+    tcase_add_test(tcHTTP, test_http_known_headers);
+    tcase_add_test(tcHTTP, test_http_many_headers);
+    tcase_add_test(tcHTTP, test_http_body_read);
+    tcase_add_test(tcHTTP, test_http_multipart);
+    tcase_add_test(tcHTTP, test_http_multipart_malformed);
+    tcase_add_test(tcHTTP, test_http_body_binary);
+    tcase_add_test(tcHTTP, test_http_body_ref);
+    tcase_add_test(tcHTTP, test_http_body_limits);
+    return tcHTTP;
+}
+
+static Suite *craneweb_suiteHTTPParse(void)
+{
+    TCase *tc = craneweb_testCaseHTTPParse();
+    Suite *s = suite_create("craneweb.core.http.parse");
+    suite_add_tcase(s, tc);
+    return s;
+}
+
+/*************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    int number_failed = 0;
+
+    Suite *s = craneweb_suiteHTTPParse();
+    SRunner *sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_ENV);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*************************************************************************/
+
+/* vim: set ts=4 sw=4 et */
+/* EOF */
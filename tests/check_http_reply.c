@@ -0,0 +1,531 @@
+/**************************************************************************
+ * check_http_reply: craneweb HTTP/1.x reply test suite.                  *
+ **************************************************************************/
+#include <strings.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include <check.h>
+
+#include "config.h"
+
+#ifdef ENABLE_GZIP
+#include <zlib.h>
+#endif
+
+#include "craneweb.h" 
+#include "craneweb_private.h"
+
+#include "check_helpers.h"
+
+
+/*************************************************************************/
+
+static int Released = 0;
+static char File[] = "/tmp/check_http_reply.XXXXXX";
+
+typedef struct {
+    int lines;
+    int made;
+} Counter;
+
+static int count_lines(void *userdata, CRW_Response *res)
+{
+    Counter *C = userdata;
+    char line[32];
+    if (C->lines < 0) {
+        return -1; /* something went wrong halfway */
+    }
+    snprintf(line, sizeof(line), "line %i\n", C->made);
+    CRW_response_add_body(res, line);
+    return (++C->made >= C->lines);
+}
+
+static void count_done(void *userdata)
+{
+    Released++;
+}
+
+/* the request goes away before the stream: the counter goes in the arena */
+static CRW_Response *count(CRW_Instance *inst,
+                           const CRW_RouteArgs *args,
+                           const CRW_Request *req,
+                           void *userdata)
+{
+    CRW_Response *res = CRW_response_new(inst);
+    Counter *C = CRW_request_alloc(req, sizeof(Counter));
+    C->lines = atoi(CRW_route_args_get_by_tag(args, "lines"));
+    C->made = 0;
+    CRW_response_add_body(res, "> ");
+    CRW_response_set_stream(res, count_lines, count_done, C);
+    return res;
+}
+
+/* same as count, but as text: compressible */
+static CRW_Response *count_text(CRW_Instance *inst,
+                                const CRW_RouteArgs *args,
+                                const CRW_Request *req,
+                                void *userdata)
+{
+    CRW_Response *res = count(inst, args, req, userdata);
+    CRW_response_add_header(res, "Content-Type", "text/plain");
+    return res;
+}
+
+/* a JSON array of as many items as asked */
+static CRW_Response *json(CRW_Instance *inst,
+                          const CRW_RouteArgs *args,
+                          const CRW_Request *req,
+                          void *userdata)
+{
+    CRW_Response *res = CRW_response_new(inst);
+    int j = 0, items = atoi(CRW_route_args_get_by_tag(args, "items"));
+    CRW_response_add_header(res, "Content-Type",
+                            "application/json; charset=utf-8");
+    CRW_response_add_body(res, "[");
+    for (j = 0; j < items; j++) {
+        CRW_response_add_body(res, (j) ?",{\"k\":\"v\"}" :"{\"k\":\"v\"}");
+    }
+    CRW_response_add_body(res, "]");
+    return res;
+}
+
+/* from the file made by setup(), a slice of it */
+static CRW_Response *slice(CRW_Instance *inst,
+                           const CRW_RouteArgs *args,
+                           const CRW_Request *req,
+                           void *userdata)
+{
+    CRW_Response *res = CRW_response_new(inst);
+    CRW_response_add_body(res, "> ");
+    if (CRW_response_send_file(res, File,
+                               atoi(CRW_route_args_get_by_tag(args, "off")),
+                               atoi(CRW_route_args_get_by_tag(args, "len")))) {
+        CRW_response_del(res);
+        return NULL;
+    }
+    return res;
+}
+
+/* as tools/craneweb_embed.py makes them: sorted, NULL-terminated */
+static const unsigned char Index[] = "<p>hi</p>";
+static const unsigned char IndexGz[] = "GZ";
+static const unsigned char Style[] = "p{}";
+static const CRW_Asset Assets[] = {
+    { "/ui/css/s.css", "text/css", "\"e1\"", Style, 3, NULL, 0, NULL },
+    { "/ui/index.html", "text/html", "\"e2\"", Index, 9, IndexGz, 2,
+      "\"e2z\"" },
+    { NULL, NULL, NULL, NULL, 0, NULL, 0, NULL }
+};
+
+static void setup(void)
+{
+    int fd = -1;
+    instance_setup();
+    handler_add(CRW_handler_new(Inst, "/count/:lines", count, NULL));
+    handler_add(CRW_handler_new(Inst, "/slice/:off/:len", slice, NULL));
+    handler_add(CRW_handler_new(Inst, "/text/:lines", count_text, NULL));
+    handler_add(CRW_handler_new(Inst, "/json/:items", json, NULL));
+    handler_add(CRW_handler_new_assets(Inst, "/ui/.*", Assets));
+    instance_ready();
+    Released = 0;
+    strcpy(File + strlen(File) - 6, "XXXXXX");
+    fd = mkstemp(File);
+    write(fd, "0123456789", 10);
+    close(fd);
+}
+
+static void teardown(void)
+{
+    instance_teardown();
+    unlink(File);
+}
+
+START_TEST(test_reply_stream)
+{
+    const char *expected = "HTTP/1.1 200 OK\r\n"
+                           "Transfer-Encoding: chunked\r\n"
+                           "Connection: keep-alive\r\n"
+                           "\r\n"
+                           "2\r\n> \r\n"
+                           "7\r\nline 0\n\r\n"
+                           "7\r\nline 1\n\r\n"
+                           "0\r\n\r\n";
+    setup();
+    fail_unless(respond("GET /count/2 HTTP/1.1\r\n\r\n") > 0, "no reply");
+    fail_if(strcmp(Out, expected), "bad reply [%s]", Out);
+    fail_unless(Released == 1, "stream released %i times", Released);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_reply_stream_http10)
+{
+    const char *expected = "HTTP/1.1 200 OK\r\n"
+                           "Connection: close\r\n"
+                           "\r\n"
+                           "> line 0\nline 1\n";
+    setup();
+    fail_unless(respond("GET /count/2 HTTP/1.0\r\n\r\n") > 0, "no reply");
+    fail_if(strcmp(Out, expected), "bad reply [%s]", Out);
+    fail_unless(Released == 1, "stream released %i times", Released);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_reply_stream_head)
+{
+    const char *expected = "HTTP/1.1 200 OK\r\n"
+                           "Transfer-Encoding: chunked\r\n"
+                           "Connection: keep-alive\r\n"
+                           "\r\n";
+    setup();
+    fail_unless(respond("HEAD /count/2 HTTP/1.1\r\n\r\n") > 0, "no reply");
+    fail_if(strcmp(Out, expected), "bad reply [%s]", Out);
+    fail_unless(Released == 1, "stream released %i times", Released);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_reply_stream_abort)
+{
+    setup();
+    fail_unless(respond("GET /count/-1 HTTP/1.1\r\n\r\n") < 0,
+                "aborted stream completed");
+    fail_unless(Released == 1, "stream released %i times", Released);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_reply_file)
+{
+    const char *expected = "HTTP/1.1 200 OK\r\n"
+                           "Content-Length: 6\r\n"
+                           "Connection: keep-alive\r\n"
+                           "\r\n"
+                           "> 2345";
+    setup();
+    fail_unless(respond("GET /slice/2/4 HTTP/1.1\r\n\r\n") > 0, "no reply");
+    fail_if(strcmp(Out, expected), "bad reply [%s]", Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_reply_file_rest)
+{
+    const char *expected = "HTTP/1.1 200 OK\r\n"
+                           "Content-Length: 5\r\n"
+                           "Connection: keep-alive\r\n"
+                           "\r\n"
+                           "> 789";
+    setup();
+    fail_unless(respond("GET /slice/7/-1 HTTP/1.1\r\n\r\n") > 0, "no reply");
+    fail_if(strcmp(Out, expected), "bad reply [%s]", Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_reply_file_head)
+{
+    const char *expected = "HTTP/1.1 200 OK\r\n"
+                           "Content-Length: 6\r\n"
+                           "Connection: keep-alive\r\n"
+                           "\r\n";
+    setup();
+    fail_unless(respond("HEAD /slice/2/4 HTTP/1.1\r\n\r\n") > 0, "no reply");
+    fail_if(strcmp(Out, expected), "bad reply [%s]", Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_reply_file_bad)
+{
+    CRW_Response *res = NULL;
+    int fds[2] = { -1, -1 };
+    setup();
+    res = CRW_response_new(Inst);
+    fail_unless(CRW_response_send_file(res, File, 20, 1) != 0,
+                "offset past the end accepted");
+    fail_unless(pipe(fds) == 0, "no pipe");
+    close(fds[1]);
+    fail_unless(CRW_response_send_fd(res, fds[0], 0, -1) != 0,
+                "pipe accepted");
+    fail_unless(close(fds[0]) != 0, "pipe left open on error");
+    CRW_response_del(res);
+    teardown();
+}
+END_TEST
+
+/* no way to split the response from a header */
+START_TEST(test_reply_header_bad)
+{
+    CRW_Response *res = NULL;
+    setup();
+    res = CRW_response_new(Inst);
+    fail_unless(CRW_response_add_header(res, "X-A", "b") == 0,
+                "header refused");
+    fail_unless(CRW_response_add_header(res, "X-A", "b\r\nX-B: c") < 0,
+                "CRLF in the value accepted");
+    fail_unless(CRW_response_add_header(res, "X-A", "b\nc") < 0,
+                "LF in the value accepted");
+    fail_unless(CRW_response_add_header(res, "X-A\r\nX-B", "c") < 0,
+                "CRLF in the name accepted");
+    fail_unless(CRW_response_add_header(res, "X-A: b", "c") < 0,
+                "colon in the name accepted");
+    fail_unless(CRW_response_add_header(res, "", "c") < 0,
+                "empty name accepted");
+    CRW_response_del(res);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_reply_asset)
+{
+    const char *expected = "HTTP/1.1 200 OK\r\n"
+                           "ETag: \"e1\"\r\n"
+                           "Content-Type: text/css\r\n"
+                           "Content-Length: 3\r\n"
+                           "Connection: keep-alive\r\n"
+                           "\r\n"
+                           "p{}";
+    setup();
+    fail_unless(respond("GET /ui/css/s.css HTTP/1.1\r\n\r\n") > 0,
+                "no reply");
+    fail_if(strcmp(Out, expected), "bad reply [%s]", Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_reply_asset_index_gzip)
+{
+    const char *expected = "HTTP/1.1 200 OK\r\n"
+                           "ETag: \"e2z\"\r\n"
+                           "Vary: Accept-Encoding\r\n"
+                           "Content-Type: text/html\r\n"
+                           "Content-Encoding: gzip\r\n"
+                           "Content-Length: 2\r\n"
+                           "Connection: keep-alive\r\n"
+                           "\r\n"
+                           "GZ";
+    setup();
+    fail_unless(respond("GET /ui/ HTTP/1.1\r\n"
+                        "Accept-Encoding: deflate, gzip;q=0.5\r\n"
+                        "\r\n") > 0, "no reply");
+    fail_if(strcmp(Out, expected), "bad reply [%s]", Out);
+    fail_unless(respond("GET /ui/ HTTP/1.1\r\n"
+                        "Accept-Encoding: gzip;q=0\r\n"
+                        "\r\n") > 0, "no reply");
+    fail_unless(strstr(Out, "<p>hi</p>") != NULL, "gzip not refused [%s]", Out);
+    fail_unless(strstr(Out, "ETag: \"e2\"\r\n") != NULL,
+                "gzip tag on the identity body [%s]", Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_reply_asset_not_modified)
+{
+    const char *expected = "HTTP/1.1 304 Not Modified\r\n"
+                           "ETag: \"e1\"\r\n"
+                           "Connection: keep-alive\r\n"
+                           "\r\n";
+    setup();
+    fail_unless(respond("GET /ui/css/s.css HTTP/1.1\r\n"
+                        "If-None-Match: \"e0\", W/\"e1\"\r\n"
+                        "\r\n") > 0, "no reply");
+    fail_if(strcmp(Out, expected), "bad reply [%s]", Out);
+    fail_unless(respond("GET /ui/nope.css HTTP/1.1\r\n\r\n") > 0,
+                "no reply");
+    fail_unless(!strncmp(Out, "HTTP/1.1 404", 12), "bad reply [%s]", Out);
+
+    /* the tag is the one of the representation to be sent */
+    fail_unless(respond("GET /ui/ HTTP/1.1\r\n"
+                        "Accept-Encoding: gzip\r\n"
+                        "If-None-Match: \"e2z\"\r\n"
+                        "\r\n") > 0, "no reply");
+    fail_unless(!strncmp(Out, "HTTP/1.1 304", 12), "bad reply [%s]", Out);
+    fail_unless(respond("GET /ui/ HTTP/1.1\r\n"
+                        "If-None-Match: \"e2z\"\r\n"
+                        "\r\n") > 0, "no reply");
+    fail_unless(!strncmp(Out, "HTTP/1.1 200", 12), "bad reply [%s]", Out);
+    teardown();
+}
+END_TEST
+
+#ifdef ENABLE_GZIP
+
+/* the body of the reply in Out, after the head */
+/* the chunks of the body in Out, joined in place. Returns their length. */
+static size_t unchunk(void)
+{
+    char *in = (char *)body(Out), *out = in;
+    size_t len = 0;
+    while ((len = strtoul(in, &in, 16)) > 0) {
+        in += 2;
+        memmove(out, in, len);
+        out += len;
+        in += len + 2;
+    }
+    return out - body(Out);
+}
+
+/* the gzipped bytes back, as a string in plain */
+static int gunzip(const char *data, size_t len, char *plain, size_t size)
+{
+    z_stream zs;
+    int ret = 0;
+    memset(&zs, 0, sizeof(zs));
+    inflateInit2(&zs, 15 + 16);
+    zs.next_in = (Bytef *)data;
+    zs.avail_in = len;
+    zs.next_out = (Bytef *)plain;
+    zs.avail_out = size - 1;
+    ret = inflate(&zs, Z_FINISH);
+    plain[size - 1 - zs.avail_out] = '\0';
+    inflateEnd(&zs);
+    return (ret == Z_STREAM_END) ?0 :-1;
+}
+
+START_TEST(test_reply_gzip)
+{
+    char plain[BUF_SIZE];
+    char expected[BUF_SIZE];
+    char length[32];
+    int j = 0, len = 0;
+    strcpy(expected, "[");
+    for (j = 0; j < 100; j++) {
+        strcat(expected, (j) ?",{\"k\":\"v\"}" :"{\"k\":\"v\"}");
+    }
+    strcat(expected, "]");
+    setup();
+    CRW_instance_set_compress_min_size(Inst, 64);
+    len = respond("GET /json/100 HTTP/1.1\r\n"
+                  "Accept-Encoding: gzip, deflate\r\n"
+                  "\r\n");
+    fail_unless(len > 0, "no reply");
+    fail_unless(strstr(Out, "Content-Encoding: gzip\r\n") != NULL,
+                "not compressed [%s]", Out);
+    fail_unless(strstr(Out, "Vary: Accept-Encoding\r\n") != NULL,
+                "no Vary [%s]", Out);
+    len -= body(Out) - Out;
+    snprintf(length, sizeof(length), "Content-Length: %i\r\n", len);
+    fail_unless(strstr(Out, length) != NULL, "bad length [%s]", Out);
+    fail_unless(len < (int)strlen(expected) / 4, "poorly compressed");
+    fail_unless(gunzip(body(Out), len, plain, sizeof(plain)) == 0,
+                "bad gzip stream");
+    fail_if(strcmp(plain, expected), "bad body [%s]", plain);
+    /* the same, for who cannot take it */
+    fail_unless(respond("GET /json/100 HTTP/1.1\r\n\r\n") > 0, "no reply");
+    fail_unless(strstr(Out, "Content-Encoding") == NULL,
+                "compressed anyway [%s]", Out);
+    fail_unless(strstr(Out, "Vary: Accept-Encoding\r\n") != NULL,
+                "no Vary [%s]", Out);
+    fail_if(strcmp(body(Out), expected), "bad body [%s]", body(Out));
+    teardown();
+}
+END_TEST
+
+START_TEST(test_reply_gzip_skip)
+{
+    setup();
+    /* off by default */
+    fail_unless(respond("GET /json/100 HTTP/1.1\r\n"
+                        "Accept-Encoding: gzip\r\n"
+                        "\r\n") > 0, "no reply");
+    fail_unless(strstr(Out, "Content-Encoding") == NULL,
+                "compressed while off [%s]", Out);
+    CRW_instance_set_compress_min_size(Inst, 64);
+    /* too small */
+    fail_unless(respond("GET /json/2 HTTP/1.1\r\n"
+                        "Accept-Encoding: gzip\r\n"
+                        "\r\n") > 0, "no reply");
+    fail_unless(strstr(Out, "Content-Encoding") == NULL
+             && strstr(Out, "Vary") == NULL, "small one compressed [%s]", Out);
+    /* no type, no compression; and what the handler encoded is left */
+    fail_unless(respond("GET /slice/0/-1 HTTP/1.1\r\n"
+                        "Accept-Encoding: gzip\r\n"
+                        "\r\n") > 0, "no reply");
+    fail_unless(strstr(Out, "Content-Encoding") == NULL,
+                "file compressed [%s]", Out);
+    fail_unless(respond("GET /ui/index.html HTTP/1.1\r\n"
+                        "Accept-Encoding: gzip\r\n"
+                        "\r\n") > 0, "no reply");
+    fail_unless(strcmp(body(Out), "GZ") == 0, "compressed twice [%s]", Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_reply_gzip_stream)
+{
+    char plain[BUF_SIZE];
+    size_t len = 0;
+    setup();
+    CRW_instance_set_compress_min_size(Inst, 64);
+    fail_unless(respond("GET /text/3 HTTP/1.1\r\n"
+                        "Accept-Encoding: gzip\r\n"
+                        "\r\n") > 0, "no reply");
+    fail_unless(strstr(Out, "Transfer-Encoding: chunked\r\n") != NULL
+             && strstr(Out, "Content-Encoding: gzip\r\n") != NULL
+             && strstr(Out, "Vary: Accept-Encoding\r\n") != NULL,
+                "bad head [%s]", Out);
+    len = unchunk();
+    fail_unless(gunzip(body(Out), len, plain, sizeof(plain)) == 0,
+                "bad gzip stream");
+    fail_if(strcmp(plain, "> line 0\nline 1\nline 2\n"),
+            "bad body [%s]", plain);
+    fail_unless(Released == 1, "stream released %i times", Released);
+    teardown();
+}
+END_TEST
+
+#endif /* ENABLE_GZIP */
+
+TCase *craneweb_testCaseHTTPReply(void)
+{
+    TCase *tcReply = tcase_create("craneweb.core.http.reply");
+    tcase_add_test(tcReply, test_reply_stream);
+    tcase_add_test(tcReply, test_reply_stream_http10);
+    tcase_add_test(tcReply, test_reply_stream_head);
+    tcase_add_test(tcReply, test_reply_stream_abort);
+    tcase_add_test(tcReply, test_reply_file);
+    tcase_add_test(tcReply, test_reply_file_rest);
+    tcase_add_test(tcReply, test_reply_file_head);
+    tcase_add_test(tcReply, test_reply_file_bad);
+    tcase_add_test(tcReply, test_reply_header_bad);
+    tcase_add_test(tcReply, test_reply_asset);
+    tcase_add_test(tcReply, test_reply_asset_index_gzip);
+    tcase_add_test(tcReply, test_reply_asset_not_modified);
+#ifdef ENABLE_GZIP
+    tcase_add_test(tcReply, test_reply_gzip);
+    tcase_add_test(tcReply, test_reply_gzip_skip);
+    tcase_add_test(tcReply, test_reply_gzip_stream);
+#endif
+    return tcReply;
+}
+
+static Suite *craneweb_suiteHTTPReply(void)
+{
+    TCase *tc = craneweb_testCaseHTTPReply();
+    Suite *s = suite_create("craneweb.core.http.reply");
+    suite_add_tcase(s, tc);
+    return s;
+}
+
+/*************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    int number_failed = 0;
+
+    Suite *s = craneweb_suiteHTTPReply();
+    SRunner *sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_ENV);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et */
+/* EOF */
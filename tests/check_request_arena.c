@@ -0,0 +1,258 @@
+/**************************************************************************
+ * check_request_arena: craneweb per-request memory test suite.           *
+ **************************************************************************/
+#include <strings.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include <pthread.h>
+
+#include <check.h>
+
+#include "config.h"
+
+#include "craneweb.h" 
+#include "craneweb_private.h"
+
+#include "check_helpers.h"
+
+
+/*************************************************************************/
+
+/* counts the allocations made while serving: on glibc we can take
+   malloc() over, and still get the real thing. */
+#ifdef __GLIBC__
+#define HAVE_MALLOC_COUNT 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static volatile int Counting = 0;
+static volatile int Allocs = 0;
+static volatile int Frees = 0;
+
+void *malloc(size_t size)
+{
+    Allocs += Counting;
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    Allocs += Counting;
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    Allocs += Counting;
+    return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+    Frees += (Counting && ptr);
+    __libc_free(ptr);
+}
+#endif
+
+enum {
+    WARMUP_ROUNDS = 4,
+    ROUNDS = 100
+};
+
+/* all the usual stuff: args, scratch memory, headers, zero-copy body */
+static CRW_Response *hello(CRW_Instance *inst,
+                           const CRW_RouteArgs *args,
+                           const CRW_Request *req,
+                           void *userdata)
+{
+    const char *name = CRW_route_args_get_by_tag(args, "name");
+    CRW_Response *res = CRW_response_new(inst);
+    char *greet = CRW_request_alloc(req, BUF_SIZE);
+    int len = snprintf(greet, BUF_SIZE, "hello, %s!\n", name);
+    CRW_response_add_header(res, "Content-Type", "text/plain");
+    CRW_response_add_header(res, "X-Server", "craneweb");
+    CRW_response_add_body(res, "> ");
+    CRW_response_add_body_ref(res, greet, len, NULL, NULL);
+    return res;
+}
+
+static void setup(void)
+{
+    instance_setup();
+    handler_add(CRW_handler_new(Inst, "/hello/:name", hello, NULL));
+    instance_ready();
+}
+
+static void teardown(void)
+{
+    instance_teardown();
+}
+
+static const char *Request = "GET /hello/bob HTTP/1.1\r\n"
+                             "Host: localhost\r\n"
+                             "\r\n";
+
+static const char *Reply = "HTTP/1.1 200 OK\r\n"
+                           "Content-Type: text/plain\r\n"
+                           "X-Server: craneweb\r\n"
+                           "Content-Length: 14\r\n"
+                           "Connection: keep-alive\r\n"
+                           "\r\n"
+                           "> hello, bob!\n";
+
+START_TEST(test_arena_reply)
+{
+    setup();
+    fail_unless(respond(Request) > 0, "no reply");
+    fail_if(strcmp(Out, Reply), "bad reply [%s]", Out);
+    fail_unless(respond("GET /nowhere HTTP/1.1\r\n\r\n") > 0, "no reply");
+    fail_if(strncmp(Out, "HTTP/1.1 404 ", 13), "bad reply [%s]", Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_arena_no_malloc)
+{
+#ifdef HAVE_MALLOC_COUNT
+    int j = 0;
+    setup();
+    for (j = 0; j < WARMUP_ROUNDS; j++) {
+        respond(Request);
+    }
+    Allocs = 0;
+    Counting = 1;
+    for (j = 0; j < ROUNDS; j++) {
+        respond(Request);
+    }
+    Counting = 0;
+    fail_unless(Allocs == 0, "%i allocations in %i requests",
+                Allocs, ROUNDS);
+    fail_if(strcmp(Out, Reply), "bad reply [%s]", Out);
+    teardown();
+#endif
+}
+END_TEST
+
+static void *serve_and_exit(void *unused)
+{
+    static char in[BUF_SIZE], out[BUF_SIZE];
+    int j = 0;
+    Counting = 1; /* not before: pthread_create() allocates too */
+    for (j = 0; j < WARMUP_ROUNDS; j++) {
+        respond_to(Request, in, out);
+    }
+    return NULL;
+}
+
+/* a thread we do not own leaves nothing cached behind */
+START_TEST(test_arena_thread_exit)
+{
+#ifdef HAVE_MALLOC_COUNT
+    pthread_t tid;
+    setup();
+    Allocs = 0;
+    Frees = 0;
+    fail_if(pthread_create(&tid, NULL, serve_and_exit, NULL),
+            "no thread");
+    pthread_join(tid, NULL);
+    Counting = 0;
+    fail_unless(Allocs > 0, "nothing allocated");
+    fail_unless(Frees == Allocs, "%i allocations, %i freed",
+                Allocs, Frees);
+    teardown();
+#endif
+}
+END_TEST
+
+START_TEST(test_arena_alloc)
+{
+    CRW_Request *req = NULL;
+    char *small = NULL, *big = NULL;
+    setup();
+    req = CRW_request_new(Inst);
+    small = CRW_request_alloc(req, 3);
+    big = CRW_request_alloc(req, 16 * BUF_SIZE);
+    fail_if(small == NULL || big == NULL, "allocation failed");
+    fail_if((uintptr_t)small % sizeof(void *), "misaligned memory");
+    fail_if((uintptr_t)big % sizeof(void *), "misaligned memory");
+    memset(big, 'x', 16 * BUF_SIZE);
+    memcpy(small, "ok", 3);
+    fail_if(strcmp(small, "ok"), "memory overlap");
+    CRW_request_del(req);
+    teardown();
+}
+END_TEST
+
+/* the objects are recycled: nothing of the previous use must show */
+START_TEST(test_arena_recycle)
+{
+    CRW_HTTPInfo *info = CRW_http_info_new();
+    CRW_Request *req = NULL;
+    CRW_Response *res = NULL;
+    int j = 0;
+    setup();
+    for (j = 0; j < 2; j++) {
+        req = CRW_request_new(Inst);
+        fail_unless(CRW_request_count_headers(req) == 0, "stale headers");
+        fail_unless(CRW_request_get_URI(req) == NULL, "stale URI");
+        strcpy(In, Request);
+        fail_unless(CRW_http_parse_request(In, strlen(In), req, info) > 0,
+                    "parse failed");
+        CRW_request_del(req);
+
+        res = CRW_response_new(Inst);
+        fail_unless(CRW_response_get_body(res, Out, sizeof(Out)) == 0,
+                    "stale body");
+        CRW_response_add_body(res, "stale");
+        CRW_response_del(res);
+    }
+    fail_unless(respond(Request) > 0, "no reply");
+    fail_if(strcmp(Out, Reply), "bad reply [%s]", Out);
+    CRW_http_info_del(info);
+    teardown();
+}
+END_TEST
+
+TCase *craneweb_testCaseRequestArena(void)
+{
+    TCase *tcArena = tcase_create("craneweb.core.request.arena");
+    tcase_add_test(tcArena, test_arena_reply);
+    tcase_add_test(tcArena, test_arena_no_malloc);
+    tcase_add_test(tcArena, test_arena_thread_exit);
+    tcase_add_test(tcArena, test_arena_alloc);
+    tcase_add_test(tcArena, test_arena_recycle);
+    return tcArena;
+}
+
+static Suite *craneweb_suiteRequestArena(void)
+{
+    TCase *tc = craneweb_testCaseRequestArena();
+    Suite *s = suite_create("craneweb.core.request.arena");
+    suite_add_tcase(s, tc);
+    return s;
+}
+
+/*************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    int number_failed = 0;
+
+    Suite *s = craneweb_suiteRequestArena();
+    SRunner *sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_ENV);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et */
+/* EOF */
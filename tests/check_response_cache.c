@@ -0,0 +1,286 @@
+/**************************************************************************
+ * check_response_cache: craneweb handler response cache test suite.      *
+ **************************************************************************/
+#include <strings.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <check.h>
+
+#include "config.h"
+
+#include "craneweb.h"
+#include "craneweb_private.h"
+
+#include "check_helpers.h"
+
+
+/*************************************************************************/
+
+static CRW_Handler *Item = NULL;
+static char Nested[BUF_SIZE] = { '\0' };
+static int Calls = 0;
+
+/* the same request, from within the handler: as if another worker
+   got it meanwhile */
+static void respond_nested(const char *URI)
+{
+    char buf[BUF_SIZE];
+    int ret = 0;
+    snprintf(buf, sizeof(buf), "GET %s HTTP/1.1\r\n\r\n", URI);
+    ret = CRW_http_respond(Inst, buf, strlen(buf),
+                           Nested, sizeof(Nested) - 1);
+    Nested[(ret > 0) ?ret :0] = '\0';
+}
+
+/* which call made it, so the cached ones are told apart */
+static CRW_Response *item(CRW_Instance *inst,
+                          const CRW_RouteArgs *args,
+                          const CRW_Request *req,
+                          void *userdata)
+{
+    CRW_Response *res = CRW_response_new(inst);
+    const char *id = CRW_route_args_get_by_tag(args, "id");
+    const char *lang = CRW_request_get_header_value(req, "Accept-Language");
+    char tag[32], body[64];
+    int call = ++Calls;
+    if (!strcmp(id, "nested") && call > 1) {
+        respond_nested("/item/nested");
+    }
+    snprintf(tag, sizeof(tag), "item:%s", id);
+    snprintf(body, sizeof(body), "%s %s #%i", id, (lang) ?lang :"-", call);
+    CRW_response_add_header(res, "Content-Type", "text/plain");
+    if (!strcmp(id, "private")) {
+        CRW_response_add_header(res, "Cache-Control", "max-age=0, private");
+    } else if (!strcmp(id, "session")) {
+        CRW_response_add_header(res, "Set-Cookie", "id=1");
+    }
+    CRW_response_set_cache_tag(res, tag);
+    CRW_response_add_body(res, body);
+    return res;
+}
+
+static void setup_cache(int ttl, int stale, size_t max_size)
+{
+    instance_setup();
+    Item = handler_add(CRW_handler_new(Inst, "/item/:id", item, NULL));
+    CRW_handler_set_cache(Item, ttl, stale, max_size);
+    instance_ready();
+    Calls = 0;
+}
+
+static void setup(void)
+{
+    setup_cache(60000, 0, 1024 * 1024);
+}
+
+static void teardown(void)
+{
+    instance_teardown();
+}
+
+static void get(const char *URI)
+{
+    char raw[256];
+    snprintf(raw, sizeof(raw), "GET %s HTTP/1.1\r\n\r\n", URI);
+    fail_unless(respond(raw) > 0, "no reply for %s", URI);
+}
+
+START_TEST(test_cache_hit)
+{
+    const char *expected = "HTTP/1.1 200 OK\r\n"
+                           "Content-Type: text/plain\r\n"
+                           "Content-Length: 7\r\n"
+                           "Connection: keep-alive\r\n"
+                           "\r\n"
+                           "42 - #1";
+    setup();
+    get("/item/42");
+    get("/item/42");
+    fail_if(strncmp(Out, expected, strlen(expected)), "bad hit [%s]", Out);
+    fail_unless(Calls == 1, "handler called %i times", Calls);
+    fail_unless(respond("HEAD /item/42 HTTP/1.1\r\n\r\n") > 0, "no reply");
+    fail_unless(Calls == 1 && !strcmp(body(Out), ""), "bad HEAD [%s]", Out);
+    get("/item/42?full=1");
+    fail_unless(!strcmp(body(Out), "42 - #2"), "query not in the key [%s]",
+                Out);
+    fail_unless(respond("POST /item/42 HTTP/1.1\r\n"
+                        "Content-Length: 0\r\n\r\n") > 0, "no reply");
+    fail_unless(!strcmp(body(Out), "42 - #3"), "POST cached [%s]", Out);
+    get("/item/42");
+    fail_unless(!strcmp(body(Out), "42 - #1"), "POST in the cache [%s]", Out);
+    teardown();
+}
+END_TEST
+
+/* a HEAD uses the responses of the GETs, but makes none */
+START_TEST(test_cache_head)
+{
+    setup();
+    fail_unless(respond("HEAD /item/5 HTTP/1.1\r\n\r\n") > 0, "no reply");
+    fail_unless(Calls == 1 && !strcmp(body(Out), ""), "bad HEAD [%s]", Out);
+    fail_unless(strstr(Out, "Content-Length: 6\r\n") != NULL,
+                "bad HEAD length [%s]", Out);
+    get("/item/5");
+    fail_unless(!strcmp(body(Out), "5 - #2"), "HEAD in the cache [%s]", Out);
+    fail_unless(respond("HEAD /item/5 HTTP/1.1\r\n\r\n") > 0, "no reply");
+    fail_unless(Calls == 2 && !strcmp(body(Out), ""), "bad HEAD [%s]", Out);
+    fail_unless(respond("DELETE /item/5 HTTP/1.1\r\n\r\n") > 0,
+                "no reply");
+    fail_unless(!strcmp(body(Out), "5 - #3"), "DELETE cached [%s]", Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_cache_vary)
+{
+    setup();
+    CRW_handler_cache_vary(Item, "Accept-Language");
+    fail_unless(respond("GET /item/1 HTTP/1.1\r\n"
+                        "Accept-Language: it\r\n\r\n") > 0, "no reply");
+    fail_unless(respond("GET /item/1 HTTP/1.1\r\n"
+                        "Accept-Language: en\r\n\r\n") > 0, "no reply");
+    fail_unless(!strcmp(body(Out), "1 en #2"), "bad variant [%s]", Out);
+    fail_unless(respond("GET /item/1 HTTP/1.1\r\n"
+                        "Accept-Language: it\r\n\r\n") > 0, "no reply");
+    fail_unless(!strcmp(body(Out), "1 it #1"), "bad variant [%s]", Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_cache_not_stored)
+{
+    setup();
+    get("/item/private");
+    get("/item/private");
+    fail_unless(Calls == 2, "private response cached");
+    get("/item/session");
+    get("/item/session");
+    fail_unless(Calls == 4, "cookie cached");
+    teardown();
+}
+END_TEST
+
+START_TEST(test_cache_expire)
+{
+    setup_cache(20, 0, 1024 * 1024);
+    get("/item/7");
+    get("/item/7");
+    fail_unless(Calls == 1, "handler called %i times", Calls);
+    sleep_ms(40);
+    get("/item/7");
+    fail_unless(!strcmp(body(Out), "7 - #2"), "expired served [%s]", Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_cache_stale)
+{
+    setup_cache(20, 60000, 1024 * 1024);
+    get("/item/nested");
+    sleep_ms(40);
+    /* this one refreshes; meanwhile, the nested one gets the stale copy */
+    get("/item/nested");
+    fail_unless(!strcmp(body(Out), "nested - #2"), "not refreshed [%s]", Out);
+    fail_unless(strstr(Nested, "nested - #1") != NULL,
+                "stale not served [%s]", Nested);
+    get("/item/nested");
+    fail_unless(!strcmp(body(Out), "nested - #2"), "refresh lost [%s]", Out);
+    fail_unless(Calls == 2, "handler called %i times", Calls);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_cache_lru)
+{
+    /* room for a couple of entries only */
+    setup_cache(60000, 0, 400);
+    get("/item/a");
+    get("/item/b");
+    get("/item/a");
+    get("/item/c");
+    fail_unless(Calls == 3, "handler called %i times", Calls);
+    get("/item/a");
+    fail_unless(!strcmp(body(Out), "a - #1"), "recently used evicted [%s]",
+                Out);
+    get("/item/b");
+    fail_unless(!strcmp(body(Out), "b - #4"), "least recently used kept [%s]",
+                Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_cache_purge)
+{
+    setup();
+    CRW_handler_cache_vary(Item, "Accept-Language");
+    get("/item/1");
+    fail_unless(respond("GET /item/1 HTTP/1.1\r\n"
+                        "Accept-Language: it\r\n\r\n") > 0, "no reply");
+    get("/item/2");
+    get("/item/2?full=1");
+    get("/item/1?full=1");
+    get("/item/10");
+    fail_unless(CRW_handler_cache_purge(Item, "/item/1") == 3,
+                "not all the variants purged");
+    fail_unless(CRW_handler_cache_purge(Item, "/item/1") == 0,
+                "purged twice");
+    get("/item/10");
+    fail_unless(!strcmp(body(Out), "10 - #6"), "prefix purged [%s]", Out);
+    get("/item/1");
+    fail_unless(!strcmp(body(Out), "1 - #7"), "purged served [%s]", Out);
+    fail_unless(CRW_handler_cache_purge(Item, "/item/2?full=1") == 1,
+                "not just the query purged");
+    get("/item/2");
+    fail_unless(!strcmp(body(Out), "2 - #3"), "bare purged [%s]", Out);
+    get("/item/2?full=1");
+    fail_unless(CRW_handler_cache_purge_tag(Item, "item:2") == 2,
+                "not all the tagged purged");
+    get("/item/2");
+    fail_unless(!strcmp(body(Out), "2 - #9"), "purged served [%s]", Out);
+    fail_unless(CRW_handler_cache_purge(NULL, "/item/1") < 0,
+                "purged from nothing");
+    teardown();
+}
+END_TEST
+
+TCase *craneweb_testCaseResponseCache(void)
+{
+    TCase *tcCache = tcase_create("craneweb.core.response.cache");
+    tcase_add_test(tcCache, test_cache_hit);
+    tcase_add_test(tcCache, test_cache_head);
+    tcase_add_test(tcCache, test_cache_vary);
+    tcase_add_test(tcCache, test_cache_not_stored);
+    tcase_add_test(tcCache, test_cache_expire);
+    tcase_add_test(tcCache, test_cache_stale);
+    tcase_add_test(tcCache, test_cache_lru);
+    tcase_add_test(tcCache, test_cache_purge);
+    return tcCache;
+}
+
+static Suite *craneweb_suiteResponseCache(void)
+{
+    TCase *tc = craneweb_testCaseResponseCache();
+    Suite *s = suite_create("craneweb.core.response.cache");
+    suite_add_tcase(s, tc);
+    return s;
+}
+
+/*************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    int number_failed = 0;
+
+    Suite *s = craneweb_suiteResponseCache();
+    SRunner *sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_ENV);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et */
+/* EOF */
@@ -0,0 +1,255 @@
+/**************************************************************************
+ * check_response_defer: craneweb deferred responses test suite.          *
+ **************************************************************************/
+#include <strings.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <pthread.h>
+
+#include <check.h>
+
+#include "config.h"
+
+#include "craneweb.h"
+#include "craneweb_private.h"
+
+#include "check_helpers.h"
+
+
+/*************************************************************************/
+
+enum {
+    MAX_BACKENDS = 32,
+    MAX_CLIENTS = 8,
+    SLOW_MS = 50
+};
+
+typedef struct client_ Client;
+struct client_ {
+    pthread_t thread;
+    char raw[256];
+    char in[BUF_SIZE];
+    char out[BUF_SIZE];
+};
+
+static CRW_Handler *Later = NULL;
+static pthread_t Backends[MAX_BACKENDS];
+static Client Clients[MAX_CLIENTS];
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static int NumBackends = 0;
+static int Calls = 0;
+
+/* what the request says, as the backend sees it */
+static CRW_Response *answer(CRW_Pending *pending)
+{
+    const CRW_Request *req = CRW_pending_get_request(pending);
+    const CRW_RouteArgs *args = CRW_pending_get_route_args(pending);
+    const char *from = CRW_request_get_header_value(req, "X-From");
+    CRW_Response *res = CRW_response_new(Inst);
+    char body[BUF_SIZE];
+    int len = 0;
+    len = snprintf(body, sizeof(body), "%s from %s: ",
+                   CRW_route_args_get_by_tag(args, "id"),
+                   (from) ?from :"nobody");
+    len += CRW_request_read_body(req, body + len, sizeof(body) - len - 1);
+    body[len] = '\0';
+    CRW_response_add_header(res, "Content-Type", "text/plain");
+    CRW_response_add_body(res, body);
+    return res;
+}
+
+static void *backend(void *data)
+{
+    CRW_Pending *pending = data;
+    sleep_ms(SLOW_MS);
+    CRW_response_complete(pending, answer(pending));
+    return NULL;
+}
+
+static CRW_Response *later(CRW_Instance *inst,
+                           const CRW_RouteArgs *args,
+                           const CRW_Request *req,
+                           void *userdata)
+{
+    const char *id = CRW_route_args_get_by_tag(args, "id");
+    CRW_Pending *pending = NULL;
+    CRW_Response *res = CRW_response_defer(inst, req, &pending);
+    pthread_mutex_lock(&Lock);
+    Calls++;
+    pthread_mutex_unlock(&Lock);
+    if (!res) {
+        return NULL;
+    }
+    if (!strcmp(id, "now")) {
+        /* before the handler returns, from the same thread */
+        CRW_response_complete(pending, answer(pending));
+    } else if (!strcmp(id, "fail")) {
+        CRW_response_complete(pending, NULL);
+    } else {
+        pthread_mutex_lock(&Lock);
+        pthread_create(&Backends[NumBackends++], NULL, backend, pending);
+        pthread_mutex_unlock(&Lock);
+    }
+    return res;
+}
+
+static void setup(void)
+{
+    instance_setup();
+    Later = handler_add(CRW_handler_new(Inst, "/later/:id", later, NULL));
+    instance_ready();
+    NumBackends = 0;
+    Calls = 0;
+}
+
+static void teardown(void)
+{
+    int j = 0;
+    for (j = 0; j < NumBackends; j++) {
+        pthread_join(Backends[j], NULL);
+    }
+    instance_teardown();
+}
+
+START_TEST(test_defer_later)
+{
+    setup();
+    fail_unless(respond("GET /later/1 HTTP/1.1\r\n"
+                        "X-From: test\r\n\r\n") > 0, "no reply");
+    fail_unless(!strncmp(Out, "HTTP/1.1 200 OK\r\n", 17), "not 200 [%s]",
+                Out);
+    fail_unless(!strcmp(body(Out), "1 from test: "), "bad body [%s]", Out);
+    fail_unless(strstr(Out, "Content-Length: 13") != NULL,
+                "bad length [%s]", Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_defer_body)
+{
+    setup();
+    fail_unless(respond("POST /later/2 HTTP/1.1\r\n"
+                        "Content-Length: 5\r\n\r\n"
+                        "hello") > 0, "no reply");
+    fail_unless(!strcmp(body(Out), "2 from nobody: hello"), "bad body [%s]",
+                Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_defer_now)
+{
+    setup();
+    fail_unless(respond("GET /later/now HTTP/1.1\r\n\r\n") > 0,
+                "no reply");
+    fail_unless(!strcmp(body(Out), "now from nobody: "), "bad body [%s]",
+                Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_defer_fail)
+{
+    setup();
+    fail_unless(respond("GET /later/fail HTTP/1.1\r\n\r\n") > 0,
+                "no reply");
+    fail_unless(strstr(Out, " 500 ") != NULL, "not 500 [%s]", Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_defer_head)
+{
+    setup();
+    fail_unless(respond("HEAD /later/3 HTTP/1.1\r\n\r\n") > 0,
+                "no reply");
+    fail_unless(!strncmp(Out, "HTTP/1.1 200 OK\r\n", 17), "not 200 [%s]",
+                Out);
+    fail_unless(!strcmp(body(Out), ""), "HEAD with a body [%s]", Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_defer_not_cached)
+{
+    setup();
+    CRW_handler_set_cache(Later, 60000, 0, 1024 * 1024);
+    CRW_handler_set_etag(Later, 1);
+    fail_unless(respond("GET /later/4 HTTP/1.1\r\n\r\n") > 0,
+                "no reply");
+    fail_unless(respond("GET /later/4 HTTP/1.1\r\n\r\n") > 0,
+                "no reply");
+    fail_unless(!strcmp(body(Out), "4 from nobody: "), "bad body [%s]", Out);
+    fail_unless(Calls == 2, "placeholder cached: %i calls", Calls);
+    fail_unless(strstr(Out, "ETag") == NULL, "placeholder ETag [%s]", Out);
+    teardown();
+}
+END_TEST
+
+static void *client(void *data)
+{
+    Client *C = data;
+    respond_to(C->raw, C->in, C->out);
+    return NULL;
+}
+
+START_TEST(test_defer_many)
+{
+    int j = 0;
+    setup();
+    for (j = 0; j < MAX_CLIENTS; j++) {
+        snprintf(Clients[j].raw, sizeof(Clients[j].raw),
+                 "GET /later/%i HTTP/1.1\r\nX-From: #%i\r\n\r\n", j, j);
+        pthread_create(&Clients[j].thread, NULL, client, &Clients[j]);
+    }
+    for (j = 0; j < MAX_CLIENTS; j++) {
+        char expected[64];
+        pthread_join(Clients[j].thread, NULL);
+        snprintf(expected, sizeof(expected), "%i from #%i: ", j, j);
+        fail_unless(!strcmp(body(Clients[j].out), expected),
+                    "client #%i got [%s]", j, Clients[j].out);
+    }
+    teardown();
+}
+END_TEST
+
+TCase *craneweb_testCaseResponseDefer(void)
+{
+    TCase *tcDefer = tcase_create("craneweb.core.response.defer");
+    tcase_add_test(tcDefer, test_defer_later);
+    tcase_add_test(tcDefer, test_defer_body);
+    tcase_add_test(tcDefer, test_defer_now);
+    tcase_add_test(tcDefer, test_defer_fail);
+    tcase_add_test(tcDefer, test_defer_head);
+    tcase_add_test(tcDefer, test_defer_not_cached);
+    tcase_add_test(tcDefer, test_defer_many);
+    return tcDefer;
+}
+
+static Suite *craneweb_suiteResponseDefer(void)
+{
+    TCase *tc = craneweb_testCaseResponseDefer();
+    Suite *s = suite_create("craneweb.core.response.defer");
+    suite_add_tcase(s, tc);
+    return s;
+}
+
+/*************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    int number_failed = 0;
+
+    Suite *s = craneweb_suiteResponseDefer();
+    SRunner *sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_ENV);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et */
+/* EOF */
@@ -0,0 +1,258 @@
+/**************************************************************************
+ * check_response_etag: craneweb ETag and conditional GET test suite.     *
+ **************************************************************************/
+#include <strings.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include <check.h>
+
+#include "config.h"
+
+#include "craneweb.h"
+#include "craneweb_private.h"
+
+#include "check_helpers.h"
+
+
+/*************************************************************************/
+
+static CRW_Handler *Doc = NULL;
+static CRW_Handler *Version = NULL;
+static char ETag[256] = { '\0' };
+static int Calls = 0;
+static int Bodies = 0;
+
+/* the body is the id: same id, same ETag */
+static CRW_Response *doc(CRW_Instance *inst,
+                         const CRW_RouteArgs *args,
+                         const CRW_Request *req,
+                         void *userdata)
+{
+    CRW_Response *res = CRW_response_new(inst);
+    const char *id = CRW_route_args_get_by_tag(args, "id");
+    Calls++;
+    CRW_response_add_header(res, "Content-Type", "text/plain");
+    if (!strcmp(id, "own")) {
+        CRW_response_add_header(res, "ETag", "\"mine\"");
+    }
+    CRW_response_add_body(res, "document ");
+    CRW_response_add_body(res, id);
+    return res;
+}
+
+/* the expensive body is made only if the client lacks it */
+static CRW_Response *version(CRW_Instance *inst,
+                             const CRW_RouteArgs *args,
+                             const CRW_Request *req,
+                             void *userdata)
+{
+    CRW_Response *res = CRW_response_new(inst);
+    Calls++;
+    if (CRW_response_set_etag(res, req,
+                              CRW_route_args_get_by_tag(args, "v")) > 0) {
+        return res;
+    }
+    Bodies++;
+    CRW_response_add_header(res, "Content-Type", "text/plain");
+    CRW_response_add_body(res, "expensive");
+    return res;
+}
+
+static void setup(void)
+{
+    instance_setup();
+    Doc = handler_add(CRW_handler_new(Inst, "/doc/:id", doc, NULL));
+    CRW_handler_set_etag(Doc, 1);
+    Version = handler_add(CRW_handler_new(Inst, "/version/:v",
+                                          version, NULL));
+    instance_ready();
+    Calls = 0;
+    Bodies = 0;
+}
+
+static void teardown(void)
+{
+    instance_teardown();
+}
+
+/* the ETag of the last response, in ETag; NULL if none */
+static const char *etag(void)
+{
+    const char *value = strstr(Out, "ETag: ");
+    size_t len = 0;
+    if (!value) {
+        return NULL;
+    }
+    value += 6;
+    len = strcspn(value, "\r");
+    memcpy(ETag, value, len);
+    ETag[len] = '\0';
+    return ETag;
+}
+
+/* a request with If-None-Match */
+static void get_if(const char *method, const char *URI, const char *tag)
+{
+    char raw[512];
+    snprintf(raw, sizeof(raw), "%s %s HTTP/1.1\r\n"
+                               "If-None-Match: %s\r\n\r\n", method, URI, tag);
+    fail_unless(respond(raw) > 0, "no reply for %s", URI);
+}
+
+START_TEST(test_etag_auto)
+{
+    char first[256];
+    setup();
+    fail_unless(respond("GET /doc/1 HTTP/1.1\r\n\r\n") > 0, "no reply");
+    fail_unless(etag() != NULL && !strncmp(ETag, "W/\"", 3),
+                "no weak ETag [%s]", Out);
+    strcpy(first, ETag);
+    fail_unless(respond("GET /doc/1 HTTP/1.1\r\n\r\n") > 0, "no reply");
+    fail_unless(etag() && !strcmp(first, ETag), "ETag not stable [%s]", Out);
+    fail_unless(respond("GET /doc/2 HTTP/1.1\r\n\r\n") > 0, "no reply");
+    fail_unless(etag() && strcmp(first, ETag) != 0, "ETag clash [%s]", Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_etag_not_modified)
+{
+    const char *expected = "HTTP/1.1 304 Not Modified\r\n";
+    char tag[256];
+    setup();
+    fail_unless(respond("GET /doc/1 HTTP/1.1\r\n\r\n") > 0, "no reply");
+    strcpy(tag, etag());
+    get_if("GET", "/doc/1", tag);
+    fail_if(strncmp(Out, expected, strlen(expected)), "not 304 [%s]", Out);
+    fail_unless(!strcmp(body(Out), ""), "304 with a body [%s]", Out);
+    fail_unless(strstr(Out, "Content-Length") == NULL,
+                "304 with Content-Length [%s]", Out);
+    fail_unless(etag() && !strcmp(ETag, tag), "304 without ETag [%s]", Out);
+    get_if("HEAD", "/doc/1", tag);
+    fail_if(strncmp(Out, expected, strlen(expected)), "HEAD not 304 [%s]",
+            Out);
+    get_if("GET", "/doc/1", "\"other\", *");
+    fail_if(strncmp(Out, expected, strlen(expected)), "* not 304 [%s]", Out);
+    get_if("GET", "/doc/1", "\"other\"");
+    fail_unless(!strcmp(body(Out), "document 1"), "not 200 [%s]", Out);
+    get_if("GET", "/doc/2", tag);
+    fail_unless(!strcmp(body(Out), "document 2"), "not 200 [%s]", Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_etag_own)
+{
+    setup();
+    get_if("GET", "/doc/own", "\"other\"");
+    fail_unless(etag() && !strcmp(ETag, "\"mine\""), "ETag replaced [%s]",
+                Out);
+    get_if("GET", "/doc/own", "W/\"mine\"");
+    fail_unless(strstr(Out, " 304 ") != NULL, "not 304 [%s]", Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_etag_not_get)
+{
+    char raw[512];
+    setup();
+    fail_unless(respond("GET /doc/1 HTTP/1.1\r\n\r\n") > 0, "no reply");
+    snprintf(raw, sizeof(raw), "POST /doc/1 HTTP/1.1\r\n"
+                               "If-None-Match: %s\r\n"
+                               "Content-Length: 0\r\n\r\n", etag());
+    fail_unless(respond(raw) > 0, "no reply");
+    fail_unless(!strcmp(body(Out), "document 1"), "POST not 200 [%s]", Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_etag_disabled)
+{
+    setup();
+    CRW_handler_set_etag(Doc, 0);
+    fail_unless(respond("GET /doc/1 HTTP/1.1\r\n\r\n") > 0, "no reply");
+    fail_unless(etag() == NULL, "ETag anyway [%s]", Out);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_etag_validator)
+{
+    setup();
+    fail_unless(respond("GET /version/7 HTTP/1.1\r\n\r\n") > 0, "no reply");
+    fail_unless(etag() && !strcmp(ETag, "\"7\""), "bad ETag [%s]", Out);
+    fail_unless(!strcmp(body(Out), "expensive"), "bad body [%s]", Out);
+    get_if("GET", "/version/7", "\"7\"");
+    fail_unless(strstr(Out, " 304 ") != NULL, "not 304 [%s]", Out);
+    fail_unless(Calls == 2 && Bodies == 1, "body made anyway");
+    get_if("GET", "/version/8", "\"7\"");
+    fail_unless(!strcmp(body(Out), "expensive"), "not 200 [%s]", Out);
+    fail_unless(Bodies == 2, "body not made");
+    teardown();
+}
+END_TEST
+
+START_TEST(test_etag_cached)
+{
+    char tag[256];
+    setup();
+    CRW_handler_set_cache(Doc, 60000, 0, 1024 * 1024);
+    CRW_handler_set_cache(Version, 60000, 0, 1024 * 1024);
+    fail_unless(respond("GET /doc/1 HTTP/1.1\r\n\r\n") > 0, "no reply");
+    strcpy(tag, etag());
+    get_if("GET", "/doc/1", tag);
+    fail_unless(strstr(Out, " 304 ") != NULL, "not 304 [%s]", Out);
+    fail_unless(respond("GET /doc/1 HTTP/1.1\r\n\r\n") > 0, "no reply");
+    fail_unless(!strcmp(body(Out), "document 1"), "304 cached [%s]", Out);
+    fail_unless(etag() && !strcmp(ETag, tag), "ETag lost [%s]", Out);
+    fail_unless(Calls == 1, "handler called %i times", Calls);
+    /* the validator ones: the cache knows them too */
+    fail_unless(respond("GET /version/7 HTTP/1.1\r\n\r\n") > 0, "no reply");
+    get_if("GET", "/version/7", "\"7\"");
+    fail_unless(strstr(Out, " 304 ") != NULL, "not 304 [%s]", Out);
+    fail_unless(Calls == 2, "handler called %i times", Calls);
+    teardown();
+}
+END_TEST
+
+TCase *craneweb_testCaseResponseETag(void)
+{
+    TCase *tcETag = tcase_create("craneweb.core.response.etag");
+    tcase_add_test(tcETag, test_etag_auto);
+    tcase_add_test(tcETag, test_etag_not_modified);
+    tcase_add_test(tcETag, test_etag_own);
+    tcase_add_test(tcETag, test_etag_not_get);
+    tcase_add_test(tcETag, test_etag_disabled);
+    tcase_add_test(tcETag, test_etag_validator);
+    tcase_add_test(tcETag, test_etag_cached);
+    return tcETag;
+}
+
+static Suite *craneweb_suiteResponseETag(void)
+{
+    TCase *tc = craneweb_testCaseResponseETag();
+    Suite *s = suite_create("craneweb.core.response.etag");
+    suite_add_tcase(s, tc);
+    return s;
+}
+
+/*************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    int number_failed = 0;
+
+    Suite *s = craneweb_suiteResponseETag();
+    SRunner *sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_ENV);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et */
+/* EOF */
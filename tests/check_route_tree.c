@@ -0,0 +1,382 @@
+/**************************************************************************
+ * check_route_tree: craneweb compiled routes (dispatcher) test suite.    *
+ **************************************************************************/
+#include <strings.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <stdio.h>
+
+#include <check.h>
+
+#include "config.h"
+
+#include "craneweb.h" 
+#include "craneweb_private.h" 
+
+
+/*************************************************************************/
+
+static CRW_Response *dummy(CRW_Instance *inst,
+                           const CRW_RouteArgs *args,
+                           const CRW_Request *req,
+                           void *userdata)
+{
+    return NULL;
+}
+
+static int quiet(void *userdata, CRW_LogLevel level, const char *tag,
+                 const char *fmt, va_list args)
+{
+    return 0;
+}
+
+static CRW_Instance *Inst = NULL;
+static CRW_Dispatcher *Disp = NULL;
+static CRW_RouteArgs *Args = NULL;
+
+static CRW_Handler *bind(const char *route)
+{
+    CRW_Handler *handler = CRW_handler_new(Inst, route, dummy, NULL);
+    int err = CRW_instance_add_handler(Inst, handler);
+    fail_if(err, "failed to bind route [%s]", route);
+    return handler;
+}
+
+static void setup(void)
+{
+    Inst = CRW_instance_new(CRW_SERVER_ADAPTER_DEFAULT);
+    CRW_instance_set_logger(Inst, quiet);
+    Disp = CRW_instance_get_dispatcher(Inst);
+    Args = CRW_route_args_new();
+}
+
+static void teardown(void)
+{
+    CRW_route_args_del(Args);
+    CRW_instance_del(Inst);
+}
+
+static void check_route(const char *URI, CRW_Handler *expected)
+{
+    CRW_Handler *handler = CRW_dispatcher_route(Disp, URI, Args);
+    fail_unless(handler == expected,
+                "URI [%s] routed to %p, expected %p",
+                URI, handler, expected);
+}
+
+static void check_arg(const char *tag, const char *expected)
+{
+    const char *value = CRW_route_args_get_by_tag(Args, tag);
+    fail_if(value == NULL, "missing tag [%s]", tag);
+    fail_if(strcmp(value, expected),
+            "tag [%s] = [%s], expected [%s]", tag, value, expected);
+}
+
+START_TEST(test_tree_static)
+{
+    CRW_Handler *root, *hello, *world;
+    setup();
+    root = bind("/");
+    hello = bind("/hello");
+    world = bind("/hello/world");
+    fail_if(CRW_dispatcher_compile(Disp), "compile failed");
+    check_route("/", root);
+    check_route("/hello", hello);
+    check_route("/hello/world", world);
+    /* as with the regexes, the routes are not anchored */
+    check_route("/hello/", hello);
+    check_route("/hello/world/again", world);
+    check_route("/hello/worldwide", world);
+    check_route("/nowhere", root);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_tree_tags)
+{
+    CRW_Handler *hello, *full;
+    setup();
+    hello = bind("/hello/:name");
+    full = bind("/hello/:name/:surname/aka/:nickname");
+    fail_if(CRW_dispatcher_compile(Disp), "compile failed");
+    check_route("/hello/bob", hello);
+    check_arg("name", "bob");
+    check_route("/hello/bob/smith/aka/bobby", full);
+    fail_unless(CRW_route_args_count(Args) == 3, "wrong args count");
+    check_arg("name", "bob");
+    check_arg("surname", "smith");
+    check_arg("nickname", "bobby");
+    /* a tag is [[:print:]]*, so it can span more segments */
+    check_route("/hello/bob/smith", hello);
+    check_arg("name", "bob/smith");
+    check_route("/hello", NULL);
+    teardown();
+}
+END_TEST
+
+/* as many tags as a route can take */
+START_TEST(test_tree_max_tags)
+{
+    CRW_Handler *many;
+    char route[256] = { '\0' }, URI[256] = { '\0' };
+    int j = 0;
+    setup();
+    for (j = 1; j < CRW_MAX_ROUTE_ARGS; j++) {
+        char tag[16];
+        snprintf(tag, sizeof(tag), "/:t%i", j);
+        strcat(route, tag);
+        snprintf(tag, sizeof(tag), "/%i", j);
+        strcat(URI, tag);
+    }
+    many = bind(route);
+    fail_if(CRW_dispatcher_compile(Disp), "compile failed");
+    check_route(URI, many);
+    fail_unless(CRW_route_args_count(Args) == CRW_MAX_ROUTE_ARGS - 1,
+                "wrong args count %i", CRW_route_args_count(Args));
+    for (j = 1; j < CRW_MAX_ROUTE_ARGS; j++) {
+        char tag[16], value[16];
+        snprintf(tag, sizeof(tag), "t%i", j);
+        snprintf(value, sizeof(value), "%i", j);
+        check_arg(tag, value);
+    }
+    teardown();
+}
+END_TEST
+
+START_TEST(test_tree_order)
+{
+    CRW_Handler *tagged, *fixed, *again;
+    setup();
+    tagged = bind("/user/:id");
+    fixed = bind("/user/me");
+    fail_if(CRW_dispatcher_compile(Disp), "compile failed");
+    /* the most recent binding wins, as with the regex scan */
+    check_route("/user/me", fixed);
+    check_route("/user/42", tagged);
+    teardown();
+
+    setup();
+    fixed = bind("/user/me");
+    tagged = bind("/user/:id");
+    again = bind("/user/:uid");
+    fail_if(CRW_dispatcher_compile(Disp), "compile failed");
+    check_route("/user/me", again);
+    check_arg("uid", "me");
+    teardown();
+}
+END_TEST
+
+START_TEST(test_tree_fallback)
+{
+    CRW_Handler *tagged, *regex, *older;
+    setup();
+    older = bind("/files/[a-z]+\\.txt");
+    tagged = bind("/files/:name");
+    regex = bind("/docs/[0-9]+");
+    fail_if(CRW_dispatcher_compile(Disp), "compile failed");
+    /* tree hit registered later than the regex route */
+    check_route("/files/readme.txt", tagged);
+    check_arg("name", "readme.txt");
+    check_route("/docs/123", regex);
+    fail_if(older == NULL, "unexpected binding failure");
+    teardown();
+
+    setup();
+    tagged = bind("/files/:name");
+    regex = bind("/files/[a-z]+\\.txt");
+    fail_if(CRW_dispatcher_compile(Disp), "compile failed");
+    /* regex route registered later than the tree hit */
+    check_route("/files/readme.txt", regex);
+    check_route("/files/README", tagged);
+    teardown();
+}
+END_TEST
+
+/* every route the tree holds, in both orders, and some regex ones too */
+static const char *SameRoutes[] = {
+    "/",
+    "/hello",
+    "/hello/:name",
+    "/files/:path",
+    "/files/:path/raw",
+    "/a/:x/b/:y",
+    "/user/me",
+    "/user/:id/",
+    "/:any/end",
+    "//empty",
+    "/static/logo.png",
+    "/docs/[0-9]+",
+    NULL
+};
+
+static const char *SameTags[] = {
+    "name", "path", "x", "y", "id", "any", NULL
+};
+
+static const char *SameURIs[] = {
+    "", "/", "//", "/hello", "/hello/", "/helloworld", "/hello/bob",
+    "/x/hello/bob/smith", "/files/a/b", "/files/a/b/raw", "/files/raw",
+    "/files//raw", "/a/1/b/2", "/a/1/2/b/3/4", "/a/b/c", "/user/me",
+    "/user/meh", "/user/42", "/user/42/", "/user/42/x", "/q/end",
+    "/q/r/end", "/q/ending", "//empty", "/x//emptyish", "/nowhere",
+    "/static/logo.png", "/static/logoXpng", "/docs/12", "/files/\001/raw",
+    "no/slash/first", NULL
+};
+
+static int route_index(CRW_Handler **handlers, int num, CRW_Handler *handler)
+{
+    int j = 0;
+    for (j = 0; j < num; j++) {
+        if (handlers[j] == handler) {
+            return j;
+        }
+    }
+    return -1;
+}
+
+static void check_same_as_scan(int reverse)
+{
+    CRW_Instance *scan = CRW_instance_new(CRW_SERVER_ADAPTER_DEFAULT);
+    CRW_Dispatcher *scan_disp = CRW_instance_get_dispatcher(scan);
+    CRW_RouteArgs *scan_args = CRW_route_args_new();
+    CRW_Handler *tree_handlers[16], *scan_handlers[16];
+    int j = 0, k = 0, num = 0;
+
+    CRW_instance_set_logger(scan, quiet);
+    while (SameRoutes[num]) {
+        num++;
+    }
+    for (j = 0; j < num; j++) {
+        const char *route = SameRoutes[(reverse) ?num - 1 - j :j];
+        tree_handlers[j] = bind(route);
+        scan_handlers[j] = CRW_handler_new(scan, route, dummy, NULL);
+        CRW_instance_add_handler(scan, scan_handlers[j]);
+    }
+    /* only the first one gets the tree */
+    fail_if(CRW_dispatcher_compile(Disp), "compile failed");
+
+    for (j = 0; SameURIs[j]; j++) {
+        const char *URI = SameURIs[j];
+        int tree = route_index(tree_handlers, num,
+                               CRW_dispatcher_route(Disp, URI, Args));
+        int regex = route_index(scan_handlers, num,
+                                CRW_dispatcher_route(scan_disp, URI,
+                                                     scan_args));
+        fail_unless(tree == regex,
+                    "URI [%s] routed to #%i by the tree, #%i by the scan",
+                    URI, tree, regex);
+        if (tree < 0) {
+            continue;
+        }
+        fail_unless(CRW_route_args_count(Args)
+                        == CRW_route_args_count(scan_args),
+                    "URI [%s]: %i args from the tree, %i from the scan",
+                    URI, CRW_route_args_count(Args),
+                    CRW_route_args_count(scan_args));
+        for (k = 0; SameTags[k]; k++) {
+            const char *a = CRW_route_args_get_by_tag(Args, SameTags[k]);
+            const char *b = CRW_route_args_get_by_tag(scan_args,
+                                                      SameTags[k]);
+            fail_unless((!a && !b) || (a && b && !strcmp(a, b)),
+                        "URI [%s]: tag [%s] is [%s], not [%s]",
+                        URI, SameTags[k], (a) ?a :"(none)",
+                        (b) ?b :"(none)");
+        }
+    }
+    CRW_route_args_del(scan_args);
+    CRW_instance_del(scan);
+}
+
+START_TEST(test_tree_same_as_scan)
+{
+    setup();
+    check_same_as_scan(0);
+    teardown();
+
+    setup();
+    check_same_as_scan(1);
+    teardown();
+}
+END_TEST
+
+START_TEST(test_tree_sealed)
+{
+    setup();
+    bind("/before");
+    fail_if(CRW_dispatcher_compile(Disp), "compile failed");
+    fail_unless(CRW_dispatcher_register(Disp, "/after", NULL) != 0,
+                "registration after compilation succeeded");
+    teardown();
+}
+END_TEST
+
+START_TEST(test_tree_clone)
+{
+    CRW_Handler *user, *regex;
+    CRW_Dispatcher *orig = NULL;
+    setup();
+    fail_unless(CRW_dispatcher_clone(Disp) == NULL,
+                "copied a dispatcher not yet compiled");
+    bind("/user");
+    user = bind("/user/:id");
+    regex = bind("/files/[a-z]+");
+    fail_if(CRW_dispatcher_compile(Disp), "compile failed");
+    orig = Disp;
+    Disp = CRW_dispatcher_clone(orig);
+    fail_if(Disp == NULL, "clone failed");
+    fail_if(Disp == orig, "clone returned the original");
+    check_route("/user/42", user);
+    check_arg("id", "42");
+    check_route("/files/abc", regex);
+    check_route("/nowhere", NULL);
+    /* the copy goes away, the original still works */
+    CRW_dispatcher_destroy(Disp);
+    Disp = orig;
+    check_route("/user/7", user);
+    check_arg("id", "7");
+    teardown();
+}
+END_TEST
+
+TCase *craneweb_testCaseRouteTree(void)
+{
+    TCase *tcRoute = tcase_create("craneweb.core.route.tree");
+    tcase_add_test(tcRoute, test_tree_static);
+    tcase_add_test(tcRoute, test_tree_tags);
+    tcase_add_test(tcRoute, test_tree_max_tags);
+    tcase_add_test(tcRoute, test_tree_order);
+    tcase_add_test(tcRoute, test_tree_fallback);
+    tcase_add_test(tcRoute, test_tree_same_as_scan);
+    tcase_add_test(tcRoute, test_tree_sealed);
+    tcase_add_test(tcRoute, test_tree_clone);
+    return tcRoute;
+}
+
+static Suite *craneweb_suiteRouteTree(void)
+{
+    TCase *tc = craneweb_testCaseRouteTree();
+    Suite *s = suite_create("craneweb.core.route.tree");
+    suite_add_tcase(s, tc);
+    return s;
+}
+
+/*************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    int number_failed = 0;
+
+    Suite *s = craneweb_suiteRouteTree();
+    SRunner *sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_ENV);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/*************************************************************************/
+
+/* vim: set ts=4 sw=4 et */
+/* EOF */
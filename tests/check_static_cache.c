@@ -0,0 +1,301 @@
+/**************************************************************************
+ * check_static_cache: mongoose static file and open file caches.         *
+ **************************************************************************/
+
+/* the caches are private to mongoose: take it all */
+#include "deps/mongoose/mongoose.c"
+
+#include <utime.h>
+
+#include <check.h>
+
+
+/*************************************************************************/
+
+enum {
+    REPLY_SIZE = 4096,
+    FIRST_PORT = 18300,
+    NUM_PORTS = 100
+};
+
+/* small.txt goes in memory, big.txt is too large for that */
+static const char *Small = "small file, cached";
+static const char *Big =
+    "big file, over the static_cache_file_size of 64 bytes, "
+    "so it is sent from the cached descriptor instead";
+
+static struct mg_context *Ctx = NULL;
+static char Root[] = "/tmp/check_static_cache.XXXXXX";
+static char Port[16];
+static char Reply[REPLY_SIZE];
+
+static void file_path(char *buf, size_t len, const char *name)
+{
+    snprintf(buf, len, "%s/%s", Root, name);
+}
+
+/* the new content comes with a new inode: an open descriptor
+   still reads the old one. mtime is set explicitly */
+static void file_write(const char *name, const char *data, time_t mtime)
+{
+    char path[PATH_MAX], tmp[PATH_MAX + 8];
+    struct utimbuf times;
+    FILE *f = NULL;
+    file_path(path, sizeof(path), name);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    f = fopen(tmp, "w");
+    fail_if(f == NULL, "cannot write %s", tmp);
+    fputs(data, f);
+    fclose(f);
+    times.actime = times.modtime = mtime;
+    utime(tmp, &times);
+    rename(tmp, path);
+}
+
+static void setup(void)
+{
+    const char *options[] = {
+        "document_root", Root,
+        "listening_ports", Port,
+        "num_threads", "1",
+        "static_cache_size", "65536",
+        "static_cache_file_size", "64",
+        "fd_cache_size", "4",
+        NULL
+    };
+    int j = 0;
+    fail_if(mkdtemp(Root) == NULL, "cannot make the document root");
+    file_write("small.txt", Small, 1000000);
+    file_write("big.txt", Big, 1000000);
+    for (j = 0; j < NUM_PORTS && Ctx == NULL; j++) {
+        snprintf(Port, sizeof(Port), "127.0.0.1:%i", FIRST_PORT + j);
+        Ctx = mg_start(NULL, NULL, options);
+    }
+    fail_if(Ctx == NULL, "cannot start the server");
+}
+
+static void teardown(void)
+{
+    char path[PATH_MAX];
+    mg_stop(Ctx);
+    Ctx = NULL;
+    file_path(path, sizeof(path), "small.txt");
+    unlink(path);
+    file_path(path, sizeof(path), "big.txt");
+    unlink(path);
+    rmdir(Root);
+    strcpy(Root + strlen(Root) - 6, "XXXXXX");
+}
+
+/* the whole reply, NUL-terminated, in Reply */
+static const char *get(const char *uri, const char *range)
+{
+    struct sockaddr_in sa;
+    char req[256];
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    int len = 0, n = 0;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(atoi(strchr(Port, ':') + 1));
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fail_if(connect(sock, (struct sockaddr *)&sa, sizeof(sa)) != 0,
+            "cannot connect");
+    len = snprintf(req, sizeof(req),
+                   "GET %s HTTP/1.1\r\n%s%s%sConnection: close\r\n\r\n",
+                   uri, (range) ?"Range: " :"", (range) ?range :"",
+                   (range) ?"\r\n" :"");
+    fail_unless(send(sock, req, len, 0) == len, "cannot send");
+    len = 0;
+    while (len < REPLY_SIZE - 1
+        && (n = recv(sock, Reply + len, REPLY_SIZE - 1 - len, 0)) > 0) {
+        len += n;
+    }
+    close(sock);
+    Reply[len] = '\0';
+    return Reply;
+}
+
+static const char *reply_body(void)
+{
+    const char *end = strstr(Reply, "\r\n\r\n");
+    return (end) ?end + 4 :"";
+}
+
+static struct fd_cache_entry *fd_cached(const char *name)
+{
+    char path[PATH_MAX];
+    int j = 0;
+    file_path(path, sizeof(path), name);
+    for (j = 0; j < Ctx->fd_cache_size; j++) {
+        if (Ctx->fd_cache[j] && !strcmp(Ctx->fd_cache[j]->path, path)) {
+            return Ctx->fd_cache[j];
+        }
+    }
+    return NULL;
+}
+
+START_TEST(test_static_cache_hit)
+{
+    setup();
+    get("/small.txt", NULL);
+    fail_unless(strstr(Reply, "HTTP/1.1 200") == Reply, "reply: %s", Reply);
+    fail_unless(!strcmp(reply_body(), Small), "body: %s", reply_body());
+    fail_if(Ctx->sc_newest == NULL, "not cached");
+
+    /* same size and mtime: the copy in memory is served */
+    file_write("small.txt", "SMALL FILE, CACHED", 1000000);
+    get("/small.txt", NULL);
+    fail_unless(strstr(Reply, "HTTP/1.1 200") == Reply, "reply: %s", Reply);
+    fail_unless(!strcmp(reply_body(), Small), "missed: %s", reply_body());
+    teardown();
+}
+END_TEST
+
+/* a changed file is noticed within a second */
+START_TEST(test_static_cache_changed)
+{
+    setup();
+    get("/small.txt", NULL);
+    fail_unless(!strcmp(reply_body(), Small), "body: %s", reply_body());
+
+    file_write("small.txt", "changed", 1000000);
+    usleep(1100 * 1000);
+    get("/small.txt", NULL);
+    fail_unless(strstr(Reply, "Content-Length: 7\r\n") != NULL,
+                "reply: %s", Reply);
+    fail_unless(!strcmp(reply_body(), "changed"), "stale: %s", reply_body());
+
+    file_write("small.txt", "CHANGED", 2000000);
+    usleep(1100 * 1000);
+    get("/small.txt", NULL);
+    fail_unless(!strcmp(reply_body(), "CHANGED"), "stale: %s", reply_body());
+    teardown();
+}
+END_TEST
+
+START_TEST(test_fd_cache_hit)
+{
+    char big[128];
+    setup();
+    get("/big.txt", NULL);
+    fail_unless(strstr(Reply, "HTTP/1.1 200") == Reply, "reply: %s", Reply);
+    fail_unless(!strcmp(reply_body(), Big), "body: %s", reply_body());
+    fail_if(fd_cached("big.txt") == NULL, "not cached");
+    fail_unless(Ctx->sc_newest == NULL, "too big, but in memory");
+
+    /* same size and mtime: the open descriptor is used */
+    strcpy(big, Big);
+    big[0] = 'B';
+    file_write("big.txt", big, 1000000);
+    get("/big.txt", NULL);
+    fail_unless(!strcmp(reply_body(), Big), "missed: %s", reply_body());
+    teardown();
+}
+END_TEST
+
+/* the file is checked on every request */
+START_TEST(test_fd_cache_changed)
+{
+    char big[128];
+    setup();
+    get("/big.txt", NULL);
+    fail_unless(!strcmp(reply_body(), Big), "body: %s", reply_body());
+
+    snprintf(big, sizeof(big), "%s!", Big);
+    file_write("big.txt", big, 1000000);
+    get("/big.txt", NULL);
+    fail_unless(!strcmp(reply_body(), big), "stale: %s", reply_body());
+
+    big[0] = 'B';
+    file_write("big.txt", big, 2000000);
+    get("/big.txt", NULL);
+    fail_unless(!strcmp(reply_body(), big), "stale: %s", reply_body());
+    fail_unless(fd_cached("big.txt")->mtime == 2000000, "old entry kept");
+    teardown();
+}
+END_TEST
+
+/* partial replies for both, also once the file is cached */
+START_TEST(test_static_cache_range)
+{
+    char expected[64];
+    int j = 0;
+    setup();
+    for (j = 0; j < 2; j++) {
+        get("/small.txt", "bytes=0-4");
+        fail_unless(strstr(Reply, "HTTP/1.1 206") == Reply,
+                    "reply: %s", Reply);
+        snprintf(expected, sizeof(expected),
+                 "Content-Range: bytes 0-4/%i\r\n", (int)strlen(Small));
+        fail_unless(strstr(Reply, expected) != NULL, "reply: %s", Reply);
+        fail_unless(!strcmp(reply_body(), "small"), "body: %s", reply_body());
+
+        get("/big.txt", "bytes=-7");
+        fail_unless(strstr(Reply, "HTTP/1.1 206") == Reply,
+                    "reply: %s", Reply);
+        fail_unless(!strcmp(reply_body(), "instead"),
+                    "body: %s", reply_body());
+
+        get("/big.txt", "bytes=4-");
+        fail_unless(!strcmp(reply_body(), Big + 4), "body: %s", reply_body());
+
+        get("/small.txt", "bytes=100-");
+        fail_unless(strstr(Reply, "HTTP/1.1 416") == Reply,
+                    "reply: %s", Reply);
+
+        /* the last zero bytes: nothing to send */
+        get("/small.txt", "bytes=-0");
+        fail_unless(strstr(Reply, "HTTP/1.1 416") == Reply,
+                    "reply: %s", Reply);
+        snprintf(expected, sizeof(expected),
+                 "Content-Range: bytes */%i\r\n", (int)strlen(Small));
+        fail_unless(strstr(Reply, expected) != NULL, "reply: %s", Reply);
+        get("/big.txt", "bytes=-0");
+        fail_unless(strstr(Reply, "HTTP/1.1 416") == Reply,
+                    "reply: %s", Reply);
+
+        /* the full files, for the next round */
+        get("/small.txt", NULL);
+        get("/big.txt", NULL);
+    }
+    teardown();
+}
+END_TEST
+
+TCase *craneweb_testCaseStaticCache(void)
+{
+    TCase *tcStaticCache = tcase_create("craneweb.mongoose.static_cache");
+    tcase_add_test(tcStaticCache, test_static_cache_hit);
+    tcase_add_test(tcStaticCache, test_static_cache_changed);
+    tcase_add_test(tcStaticCache, test_fd_cache_hit);
+    tcase_add_test(tcStaticCache, test_fd_cache_changed);
+    tcase_add_test(tcStaticCache, test_static_cache_range);
+    return tcStaticCache;
+}
+
+static Suite *craneweb_suiteStaticCache(void)
+{
+    TCase *tc = craneweb_testCaseStaticCache();
+    Suite *s = suite_create("craneweb.mongoose.static_cache");
+    suite_add_tcase(s, tc);
+    return s;
+}
+
+/*************************************************************************/
+
+int main(int argc, char *argv[])
+{
+    int number_failed = 0;
+
+    Suite *s = craneweb_suiteStaticCache();
+    SRunner *sr = srunner_create(s);
+
+    srunner_run_all(sr, CK_ENV);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* vim: set ts=4 sw=4 et */
+/* EOF */
@@ -15,6 +15,10 @@
 
 #undef ENABLE_BUILTIN_MONGOOSE
 
+#undef ENABLE_EPOLL_SERVER
+
+#undef ENABLE_IO_URING_SERVER
+
 
 #endif /* CRANEWEB_CONFIG_H */
 
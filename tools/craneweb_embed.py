@@ -0,0 +1,154 @@
+#!/usr/bin/env python
+#
+# craneweb_embed.py -- packs a directory into a CRW_Asset table.
+# usage: craneweb_embed.py [--prefix /uri] [--gzip] name srcdir out.c out.h
+#
+# Every regular file below srcdir becomes an entry, with its URI path
+# (prefix + the path relative to srcdir), MIME type, entity tag (from the
+# contents, so stable across builds) and, with --gzip, a precompressed
+# copy when it saves something, with its own entity tag. The table is sorted by path, as
+# CRW_handler_new_assets wants it.
+
+import gzip
+import hashlib
+import io
+import mimetypes
+import os
+import sys
+
+
+MIME_TYPES = {
+    ".html": "text/html", ".htm": "text/html",
+    ".css": "text/css", ".js": "application/javascript",
+    ".mjs": "application/javascript", ".json": "application/json",
+    ".map": "application/json", ".txt": "text/plain",
+    ".xml": "text/xml", ".svg": "image/svg+xml",
+    ".png": "image/png", ".jpg": "image/jpeg", ".jpeg": "image/jpeg",
+    ".gif": "image/gif", ".ico": "image/x-icon", ".webp": "image/webp",
+    ".woff": "font/woff", ".woff2": "font/woff2", ".ttf": "font/ttf",
+    ".wasm": "application/wasm",
+}
+
+# gzip must save at least this much to be worth the negotiation
+GZIP_MIN_SAVING = 0.1
+BYTES_PER_LINE = 16
+
+
+def mime_type(path):
+    ext = os.path.splitext(path)[1].lower()
+    if ext in MIME_TYPES:
+        return MIME_TYPES[ext]
+    return mimetypes.guess_type(path)[0] or "application/octet-stream"
+
+
+def gzipped(data):
+    buf = io.BytesIO()
+    # mtime=0: the same input gives the same output
+    with gzip.GzipFile(fileobj=buf, mode="wb", compresslevel=9, mtime=0) as gz:
+        gz.write(data)
+    return buf.getvalue()
+
+
+def c_string(s):
+    out = []
+    for c in bytearray(s.encode("utf-8")):
+        if c in (0x22, 0x5c):
+            out.append("\\" + chr(c))
+        elif 0x20 <= c < 0x7f and c != 0x3f:  # no '?': no trigraphs
+            out.append(chr(c))
+        else:
+            out.append("\\%03o" % c)
+    return '"' + "".join(out) + '"'
+
+
+def c_array(name, data):
+    data = bytearray(data)
+    lines = [ "static const unsigned char %s[%i] = {" % (name, len(data) or 1) ]
+    for i in range(0, len(data), BYTES_PER_LINE):
+        chunk = data[i:i + BYTES_PER_LINE]
+        lines.append("    " + ", ".join("0x%02x" % b for b in chunk) + ",")
+    if not data:
+        lines.append("    0x00")
+    lines.append("};")
+    return "\n".join(lines)
+
+
+def collect(srcdir, prefix):
+    assets = []
+    for root, dirs, files in os.walk(srcdir):
+        dirs.sort()
+        for fname in sorted(files):
+            fpath = os.path.join(root, fname)
+            if not os.path.isfile(fpath):
+                continue
+            rel = os.path.relpath(fpath, srcdir).replace(os.sep, "/")
+            assets.append((prefix.rstrip("/") + "/" + rel, fpath))
+    # strcmp() order, for bsearch()
+    assets.sort(key=lambda a: a[0].encode("utf-8"))
+    return assets
+
+
+def write_source(name, assets, use_gzip, fdst):
+    entries = []
+    fdst.write("/* autogenerated by craneweb_embed.py, do not edit */\n\n")
+    fdst.write("#include <stddef.h>\n\n")
+    fdst.write("#include \"craneweb.h\"\n\n")
+    for i, (path, fpath) in enumerate(assets):
+        with open(fpath, "rb") as f:
+            data = f.read()
+        etag = '"%s"' % hashlib.sha1(data).hexdigest()[:20]
+        array = "%s_%i" % (name, i)
+        fdst.write("/* %s */\n" % path.replace("*/", "*\\/"))
+        fdst.write(c_array(array, data) + "\n\n")
+        gz, gz_size, gz_etag = "NULL", 0, "NULL"
+        if use_gzip and data:
+            packed = gzipped(data)
+            if len(packed) <= len(data) * (1.0 - GZIP_MIN_SAVING):
+                gz, gz_size = array + "_gz", len(packed)
+                # another representation, another strong validator
+                gz_etag = c_string('"%s"' %
+                                   hashlib.sha1(packed).hexdigest()[:20])
+                fdst.write(c_array(gz, packed) + "\n\n")
+        entries.append("    { %s, %s, %s, %s, %i, %s, %i, %s }," % (
+                       c_string(path), c_string(mime_type(path)),
+                       c_string(etag), array, len(data), gz, gz_size,
+                       gz_etag))
+    fdst.write("const CRW_Asset %s[] = {\n" % name)
+    fdst.write("\n".join(entries) + "\n")
+    fdst.write("    { NULL, NULL, NULL, NULL, 0, NULL, 0, NULL }\n};\n")
+
+
+def write_header(name, fdst):
+    guard = name.upper() + "_H"
+    fdst.write("/* autogenerated by craneweb_embed.py, do not edit */\n\n")
+    fdst.write("#ifndef %s\n#define %s\n\n" % (guard, guard))
+    fdst.write("#include \"craneweb.h\"\n\n")
+    fdst.write("extern const CRW_Asset %s[];\n\n" % name)
+    fdst.write("#endif /* %s */\n" % guard)
+
+
+def main(args):
+    prefix, use_gzip = "", False
+    while args and args[0].startswith("--"):
+        opt = args.pop(0)
+        if opt == "--prefix" and args:
+            prefix = args.pop(0)
+        elif opt == "--gzip":
+            use_gzip = True
+        else:
+            args = []
+    if len(args) != 4:
+        sys.stderr.write("usage: %s [--prefix /uri] [--gzip] "
+                         "name srcdir out.c out.h\n" % sys.argv[0])
+        return 1
+    name, srcdir, out_c, out_h = args
+    assets = collect(srcdir, prefix)
+    with open(out_c, "w") as fdst:
+        write_source(name, assets, use_gzip, fdst)
+    with open(out_h, "w") as fdst:
+        write_header(name, fdst)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main(sys.argv[1:]))